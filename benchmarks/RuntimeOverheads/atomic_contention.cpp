@@ -0,0 +1,108 @@
+// RUN: %hc %s -lmcwamp_atomic -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <kalmar_cpu_pool.h>
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#define ITEM_COUNT (1 << 22)
+#define PART_COUNT (1024)
+
+#define TEST_DEBUG (0)
+
+// Measures histogram-style kernels on the CPU path, where every work-item
+// does an atomic add into one of a few bins. The atomics from libmcwamp_atomic
+// used by CPU kernels are run from 1 up to hardware_concurrency() workers,
+// with few bins (heavy contention) and many bins (light contention), and
+// compared with the global mutex the CPU path used to serialize them on.
+
+// the CPU path implementations, as declared by hc.hpp for CPU kernels
+namespace hc {
+unsigned int atomic_add_unsigned(unsigned int *p, unsigned int val);
+float atomic_add_float(float *p, float val);
+}
+
+struct Histogram {
+  unsigned int* bins;
+  float* weights;
+  unsigned int bin_count;
+};
+
+static std::mutex baseline_lock;
+
+static inline unsigned int bin_of(size_t i, unsigned int bin_count) {
+  return static_cast<unsigned int>((i * 2654435761u) >> 7) % bin_count;
+}
+
+static void histogram_atomic(void* arg, size_t part) {
+  Histogram* h = static_cast<Histogram*>(arg);
+  for (size_t i = part * (ITEM_COUNT / PART_COUNT); i < (part + 1) * (ITEM_COUNT / PART_COUNT); ++i) {
+    unsigned int b = bin_of(i, h->bin_count);
+    hc::atomic_add_unsigned(&h->bins[b], 1);
+    hc::atomic_add_float(&h->weights[b], 1.0f);
+  }
+}
+
+static void histogram_mutex(void* arg, size_t part) {
+  Histogram* h = static_cast<Histogram*>(arg);
+  for (size_t i = part * (ITEM_COUNT / PART_COUNT); i < (part + 1) * (ITEM_COUNT / PART_COUNT); ++i) {
+    unsigned int b = bin_of(i, h->bin_count);
+    std::lock_guard<std::mutex> l(baseline_lock);
+    h->bins[b] += 1;
+    h->weights[b] += 1.0f;
+  }
+}
+
+static long elapsed_ns(const struct timespec& begin, const struct timespec& end) {
+  return ((end.tv_sec - begin.tv_sec) * 1000 * 1000 * 1000) + (end.tv_nsec - begin.tv_nsec);
+}
+
+bool test(const char* name, Kalmar::CPUThreadPool::task_fn fn, unsigned int nworkers, unsigned int bin_count) {
+  std::vector<unsigned int> bins(bin_count, 0);
+  std::vector<float> weights(bin_count, 0.0f);
+  Histogram h { bins.data(), weights.data(), bin_count };
+
+  Kalmar::CPUThreadPool pool(nworkers);
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &begin);
+  pool.run(fn, &h, PART_COUNT);
+  clock_gettime(CLOCK_REALTIME, &end);
+
+  std::cout << name << " " << nworkers << " workers, " << bin_count << " bins: "
+            << ((double)elapsed_ns(begin, end) / ITEM_COUNT) << "ns per item\n";
+
+  // every item counted exactly once; the float sums stay exact below 2^24
+  bool ret = true;
+  unsigned long total = 0;
+  for (unsigned int b = 0; b < bin_count; ++b) {
+    total += bins[b];
+    ret &= (weights[b] == (float)bins[b]);
+  }
+  ret &= (total == ITEM_COUNT);
+#if TEST_DEBUG
+  std::cout << "total: " << total << "\n";
+#endif
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  unsigned int ncores = std::max(1u, std::thread::hardware_concurrency());
+  const unsigned int bin_counts[] = { 16, 4096 };
+  for (unsigned int bin_count : bin_counts) {
+    for (unsigned int n = 1; n <= ncores; n *= 2)
+      ret &= test("lock-free", histogram_atomic, n, bin_count);
+    ret &= test("mutex    ", histogram_mutex, ncores, bin_count);
+  }
+
+  return !(ret == true);
+}
@@ -0,0 +1,155 @@
+// RUN: %hc %s -lhc_am -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+// tracked ranges, as a HIP application with many buffers would have
+#define RANGE_COUNT (4096)
+#define RANGE_SIZE (4096)
+
+// lookups made by each thread
+#define LOOKUP_COUNT (1 << 20)
+
+// ranges removed and added again by the churn case, at each number of tracked ranges
+#define CHURN_COUNT (1 << 16)
+#define CHURN_RANGE_SIZE (64)
+
+#define TEST_DEBUG (0)
+
+// Measures am_memtracker_getinfo, which is called for every copy_ext and by
+// HIP for every memcpy, from 1 up to hardware_concurrency() threads looking up
+// pointers at the same time. The ranges are host addresses added with
+// am_memtracker_add, so no device memory is involved. Each thread count is
+// run twice: with lookups only, and with one more thread adding and removing
+// a range all the time, as allocations and frees made while copies go on do.
+// The churn case times am_memtracker_remove and am_memtracker_add alone, as
+// every am_free and am_alloc calls them, with more and more ranges tracked.
+
+static long elapsed_ns(const struct timespec& begin, const struct timespec& end) {
+  return ((end.tv_sec - begin.tv_sec) * 1000 * 1000 * 1000) + (end.tv_nsec - begin.tv_nsec);
+}
+
+// look up pointers inside the ranges, count those found with the right base
+static void lookups(char* base, unsigned int seed, long* found) {
+  hc::AmPointerInfo info;
+  long count = 0;
+  for (unsigned int i = 0; i < LOOKUP_COUNT; ++i) {
+    size_t range = ((i + seed) * 2654435761u >> 7) % RANGE_COUNT;
+    char* p = base + range * RANGE_SIZE + (i % RANGE_SIZE);
+    if (hc::am_memtracker_getinfo(&info, p) == AM_SUCCESS &&
+        info._hostPointer == base + range * RANGE_SIZE) {
+      ++count;
+    }
+  }
+  *found = count;
+}
+
+bool test(hc::accelerator& acc, char* base, char* spare, unsigned int nthreads, bool with_writer) {
+  std::atomic<bool> done(false);
+  std::thread writer;
+  if (with_writer) {
+    writer = std::thread([&]() {
+      while (!done.load()) {
+        hc::AmPointerInfo info(spare, spare, spare, RANGE_SIZE, acc, false, false);
+        hc::am_memtracker_add(spare, info);
+        hc::am_memtracker_remove(spare);
+      }
+    });
+  }
+
+  std::vector<std::thread> threads;
+  std::vector<long> found(nthreads, 0);
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &begin);
+  for (unsigned int t = 0; t < nthreads; ++t)
+    threads.emplace_back(lookups, base, t * 7919, &found[t]);
+  for (auto& t : threads)
+    t.join();
+  clock_gettime(CLOCK_REALTIME, &end);
+
+  done.store(true);
+  if (with_writer)
+    writer.join();
+
+  double seconds = (double)elapsed_ns(begin, end) / (1000.0 * 1000.0 * 1000.0);
+  std::cout << (with_writer ? "lookups + writer " : "lookups          ") << nthreads << " threads: "
+            << ((double)nthreads * LOOKUP_COUNT / seconds / (1000.0 * 1000.0)) << " M lookups/s\n";
+
+  // every pointer looked up is in a tracked range
+  bool ret = true;
+  for (long f : found)
+    ret &= (f == LOOKUP_COUNT);
+#if TEST_DEBUG
+  std::cout << "found: " << found[0] << "\n";
+#endif
+  return ret;
+}
+
+// remove and add back ranges spread over nranges tracked ones
+bool churn(hc::accelerator& acc, size_t nranges) {
+  bool ret = true;
+  std::vector<char> memory(nranges * CHURN_RANGE_SIZE);
+  char* base = memory.data();
+  for (size_t r = 0; r < nranges; ++r) {
+    char* p = base + r * CHURN_RANGE_SIZE;
+    hc::AmPointerInfo info(p, p, p, CHURN_RANGE_SIZE, acc, false, false);
+    ret &= (hc::am_memtracker_add(p, info) == AM_SUCCESS);
+  }
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &begin);
+  for (unsigned int i = 0; i < CHURN_COUNT; ++i) {
+    char* p = base + ((i * 2654435761u >> 7) % nranges) * CHURN_RANGE_SIZE;
+    hc::AmPointerInfo info(p, p, p, CHURN_RANGE_SIZE, acc, false, false);
+    ret &= (hc::am_memtracker_remove(p) == AM_SUCCESS);
+    ret &= (hc::am_memtracker_add(p, info) == AM_SUCCESS);
+  }
+  clock_gettime(CLOCK_REALTIME, &end);
+
+  double seconds = (double)elapsed_ns(begin, end) / (1000.0 * 1000.0 * 1000.0);
+  std::cout << "remove + add     " << nranges << " ranges: "
+            << ((double)CHURN_COUNT / seconds / (1000.0 * 1000.0)) << " M pairs/s\n";
+
+  for (size_t r = 0; r < nranges; ++r)
+    ret &= (hc::am_memtracker_remove(base + r * CHURN_RANGE_SIZE) == AM_SUCCESS);
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  std::vector<char> memory((RANGE_COUNT + 1) * RANGE_SIZE);
+  char* base = memory.data();
+  char* spare = base + RANGE_COUNT * RANGE_SIZE;
+  for (int r = 0; r < RANGE_COUNT; ++r) {
+    char* p = base + r * RANGE_SIZE;
+    hc::AmPointerInfo info(p, p, p, RANGE_SIZE, acc, false, false);
+    ret &= (hc::am_memtracker_add(p, info) == AM_SUCCESS);
+  }
+
+  unsigned int ncores = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int n = 1; n <= ncores; n *= 2) {
+    ret &= test(acc, base, spare, n, false);
+    ret &= test(acc, base, spare, n, true);
+  }
+
+  for (int r = 0; r < RANGE_COUNT; ++r)
+    ret &= (hc::am_memtracker_remove(base + r * RANGE_SIZE) == AM_SUCCESS);
+
+  for (size_t n = RANGE_COUNT; n <= 64 * RANGE_COUNT; n *= 4)
+    ret &= churn(acc, n);
+
+  return !(ret == true);
+}
@@ -0,0 +1,102 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <kalmar_cpu_pool.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+// the size of a staging buffer chunk, as copied by the unpinned copy engine
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+// large enough not to fit in the last level cache
+#define COPY_SIZE (256 * 1024 * 1024)
+
+#define TEST_DEBUG (0)
+
+// Measures the CPU side of staging copies: a large pageable buffer copied
+// chunk by chunk into a staging buffer, which is what the unpinned copy
+// engine does for host-to-device copies. The bandwidth is reported for plain
+// memcpy, for non-temporal stores, and for the chunks split over 2 up to
+// hardware_concurrency() threads with and without non-temporal stores.
+
+enum Mode { MODE_MEMCPY, MODE_STREAM, MODE_PARALLEL, MODE_PARALLEL_STREAM };
+
+static const char* mode_names[] = {
+  "memcpy                ",
+  "non-temporal          ",
+  "parallel              ",
+  "parallel, non-temporal"
+};
+
+static long elapsed_ns(const struct timespec& begin, const struct timespec& end) {
+  return ((end.tv_sec - begin.tv_sec) * 1000 * 1000 * 1000) + (end.tv_nsec - begin.tv_nsec);
+}
+
+bool test(Mode mode, unsigned int nthreads, const std::vector<char>& src, std::vector<char>& staging) {
+  Kalmar::CPUThreadPool pool(std::max(1u, nthreads - 1));
+
+  // touch both buffers first so that page faults are not measured
+  std::memset(staging.data(), 0, staging.size());
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &begin);
+  bool ret = true;
+  for (size_t offset = 0; offset < src.size(); offset += CHUNK_SIZE) {
+    // the staging buffer is reused by every chunk
+    switch (mode) {
+      case MODE_MEMCPY:
+        std::memcpy(staging.data(), src.data() + offset, CHUNK_SIZE);
+        break;
+      case MODE_STREAM:
+        Kalmar::stream_memcpy(staging.data(), src.data() + offset, CHUNK_SIZE);
+        break;
+      case MODE_PARALLEL:
+        Kalmar::parallel_memcpy(pool, staging.data(), src.data() + offset, CHUNK_SIZE, false);
+        break;
+      case MODE_PARALLEL_STREAM:
+        Kalmar::parallel_memcpy(pool, staging.data(), src.data() + offset, CHUNK_SIZE, true);
+        break;
+    }
+    // spot check of every chunk
+    ret &= (staging[CHUNK_SIZE / 3] == src[offset + CHUNK_SIZE / 3]);
+  }
+  clock_gettime(CLOCK_REALTIME, &end);
+
+  double seconds = (double)elapsed_ns(begin, end) / (1000.0 * 1000.0 * 1000.0);
+  std::cout << mode_names[mode] << " " << nthreads << " threads: "
+            << ((double)src.size() / seconds / (1024.0 * 1024.0 * 1024.0)) << " GB/s\n";
+
+  // the last chunk in full
+  ret &= (std::memcmp(staging.data(), src.data() + src.size() - CHUNK_SIZE, CHUNK_SIZE) == 0);
+#if TEST_DEBUG
+  std::cout << "verified: " << ret << "\n";
+#endif
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  std::vector<char> src(COPY_SIZE);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<char>(i * 2654435761u >> 13);
+  std::vector<char> staging(CHUNK_SIZE);
+
+  ret &= test(MODE_MEMCPY, 1, src, staging);
+  ret &= test(MODE_STREAM, 1, src, staging);
+
+  unsigned int ncores = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int n = 2; n <= ncores; n *= 2) {
+    ret &= test(MODE_PARALLEL, n, src, staging);
+    ret &= test(MODE_PARALLEL_STREAM, n, src, staging);
+  }
+
+  return !(ret == true);
+}
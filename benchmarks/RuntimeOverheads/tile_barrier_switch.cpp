@@ -0,0 +1,114 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <kalmar_cpu_fiber.h>
+
+#include <iostream>
+#include <memory>
+
+#include <time.h>
+#include <ucontext.h>
+
+#define TILE_SIZE (256)
+#define BARRIER_COUNT (1000)
+#define STACK_SIZE (1024 * 16)
+
+#define TEST_DEBUG (0)
+
+// Measures the cost of one tile_barrier::wait() on the CPU path: a tile of
+// TILE_SIZE work-items is run as fibers on one thread, and every barrier
+// switches through all of them once. The user space switch used by hc.hpp
+// is compared with the ucontext based implementation it replaced.
+
+static int idx;
+static long work_done;
+
+static Kalmar::CPUFiber fibers[TILE_SIZE + 1];
+static ucontext_t contexts[TILE_SIZE + 1];
+
+static void fiber_wait() {
+  --idx;
+  Kalmar::fiber_switch(&fibers[idx + 1], &fibers[idx]);
+}
+
+static void fiber_item(void* arg) {
+  long x = reinterpret_cast<long>(arg);
+  for (int i = 0; i < BARRIER_COUNT; ++i) {
+    ++work_done;
+    fiber_wait();
+  }
+  Kalmar::fiber_switch(&fibers[x], &fibers[x - 1]);
+}
+
+static void ucontext_wait() {
+  --idx;
+  swapcontext(&contexts[idx + 1], &contexts[idx]);
+}
+
+static void ucontext_item() {
+  for (int i = 0; i < BARRIER_COUNT; ++i) {
+    ++work_done;
+    ucontext_wait();
+  }
+}
+
+static long elapsed_ns(const struct timespec& begin, const struct timespec& end) {
+  return ((end.tv_sec - begin.tv_sec) * 1000 * 1000 * 1000) + (end.tv_nsec - begin.tv_nsec);
+}
+
+bool test_fiber(char* stacks) {
+  work_done = 0;
+  for (long x = 1; x <= TILE_SIZE; ++x) {
+    Kalmar::fiber_make(&fibers[x], stacks + (x - 1) * STACK_SIZE, STACK_SIZE,
+                       fiber_item, reinterpret_cast<void*>(x));
+  }
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &begin);
+  idx = 0;
+  while (idx == 0) {
+    idx = TILE_SIZE;
+    Kalmar::fiber_switch(&fibers[0], &fibers[TILE_SIZE]);
+  }
+  clock_gettime(CLOCK_REALTIME, &end);
+
+  std::cout << "user space switch: " << ((double)elapsed_ns(begin, end) / BARRIER_COUNT)
+            << "ns per " << TILE_SIZE << "-wide barrier\n";
+  return work_done == (long)TILE_SIZE * BARRIER_COUNT;
+}
+
+bool test_ucontext(char* stacks) {
+  work_done = 0;
+  for (int x = 1; x <= TILE_SIZE; ++x) {
+    getcontext(&contexts[x]);
+    contexts[x].uc_stack.ss_sp = stacks + (x - 1) * STACK_SIZE;
+    contexts[x].uc_stack.ss_size = STACK_SIZE;
+    contexts[x].uc_link = &contexts[x - 1];
+    makecontext(&contexts[x], ucontext_item, 0);
+  }
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &begin);
+  idx = 0;
+  while (idx == 0) {
+    idx = TILE_SIZE;
+    swapcontext(&contexts[0], &contexts[TILE_SIZE]);
+  }
+  clock_gettime(CLOCK_REALTIME, &end);
+
+  std::cout << "ucontext switch:   " << ((double)elapsed_ns(begin, end) / BARRIER_COUNT)
+            << "ns per " << TILE_SIZE << "-wide barrier\n";
+  return work_done == (long)TILE_SIZE * BARRIER_COUNT;
+}
+
+int main() {
+  bool ret = true;
+
+  std::unique_ptr<char[]> stacks(new char[TILE_SIZE * STACK_SIZE]);
+  ret &= test_fiber(stacks.get());
+  ret &= test_ucontext(stacks.get());
+
+  return !(ret == true);
+}
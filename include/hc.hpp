@@ -55,6 +55,7 @@ using namespace Kalmar::CLAMP;
 class accelerator;
 class accelerator_view;
 class completion_future;
+class command_graph;
 template <int N> class extent;
 template <int N> class tiled_extent;
 template <typename T, int N> class array_view;
@@ -206,11 +207,14 @@ public:
      * accelerator view prior to calling wait().
      *
      * @param waitMode[in] An optional parameter to specify the wait mode. By
-     *                     default it would be hcWaitModeBlocked.
+     *                     default it would be hcWaitModeHybrid, which spins
+     *                     for a budget learnt from the recent waits on the
+     *                     accelerator_view before it blocks.
      *                     hcWaitModeActive would be used to reduce latency with
-     *                     the expense of using one CPU core for active waiting.
+     *                     the expense of using one CPU core for active waiting,
+     *                     hcWaitModeBlocked to never spin.
      */
-    void wait(hcWaitMode waitMode = hcWaitModeBlocked) { 
+    void wait(hcWaitMode waitMode = hcWaitModeHybrid) { 
       pQueue->wait(waitMode); 
       Kalmar::getContext()->flushPrintfBuffer();
     }
@@ -338,6 +342,35 @@ public:
     template<typename InputIterator>
     completion_future create_blocking_marker(InputIterator first, InputIterator last, memory_scope scope) const;
 
+    /**
+     * Starts recording the commands enqueued into this accelerator_view into
+     * a command_graph, instead of executing them.
+     *
+     * Until end_capture() is called, parallel_for_each, copy_async,
+     * copy_async_ext, create_marker and create_blocking_marker on this
+     * accelerator_view are recorded, and the completion_futures they return
+     * are ready right away.  Dependencies on commands of other
+     * accelerator_views cannot be recorded.  Synchronous commands and wait()
+     * throw a runtime_exception while capturing.
+     *
+     * Kernels are recorded with the arguments they were launched with.  The
+     * contents of array_views used by the kernels are not synchronized again
+     * when the graph is replayed, kernels of graphs should use device memory
+     * allocated with am_alloc or hc::array.
+     *
+     * Only execute_in_order accelerator_views of HSA accelerators can record
+     * commands, others throw a runtime_exception.
+     */
+    void begin_capture();
+
+    /**
+     * Stops recording commands into this accelerator_view.
+     *
+     * @return The command_graph holding the commands recorded since
+     *         begin_capture().
+     */
+    command_graph end_capture();
+
     /**
      * Copies size_bytes bytes from src to dst.  
      * Src and dst must not overlap.  
@@ -492,6 +525,15 @@ public:
         return pQueue->isEmpty();
     }
 
+    /**
+     * Returns how many of the hcWaitModeHybrid waits on this accelerator_view
+     * completed while spinning and how many had to block, along with the
+     * current spin budget.
+     */
+    hcWaitStats get_wait_stats() {
+        return pQueue->getWaitStats();
+    }
+
     /**
      * Returns an opaque handle which points to the underlying HSA queue.
      *
@@ -639,6 +681,11 @@ public:
      * The setting is permanent until the queue is destroyed or CU affinity is
      * set again. This setting is "atomic", it won't affect the dispatch in flight. 
      *
+     * On a CPU accelerator every CU is one of the cores the process may run
+     * on, and kernels of the view run on worker threads bound to the selected
+     * cores. Kernels of views with disjoint masks do not compete for cores,
+     * and run side by side unless they access the same array or array_view.
+     *
      * @param cu_mask a bool vector to indicate what CUs you want to use. True
      *        represents using the cu. The first 32 elements represents the first
      *        32 CUs, and so on. If its size is greater than physical CU number,
@@ -649,11 +696,8 @@ public:
      *
      */
      bool set_cu_mask(const std::vector<bool>& cu_mask) {
-        // If it is HSA based accelerator view, set cu mask, otherwise, return;
-        if(is_hsa_accelerator()) {
-            return pQueue->set_cu_mask(cu_mask);
-        }
-        return false;
+        // queues of accelerators without CU masking return false
+        return pQueue->set_cu_mask(cu_mask);
      }
 
 private:
@@ -1168,7 +1212,7 @@ public:
      * object which does not refer to any asynchronous operation. Default
      * constructed completion_future objects have valid() == false
      */
-    completion_future() : __amp_future(), __thread_then(nullptr), __asyncOp(nullptr) {};
+    completion_future() : __amp_future(), __then_registered(false), __asyncOp(nullptr) {};
 
     /**
      * Copy constructor. Constructs a new completion_future object that referes
@@ -1178,7 +1222,7 @@ public:
      *                  initialize this.
      */
     completion_future(const completion_future& other)
-        : __amp_future(other.__amp_future), __thread_then(other.__thread_then), __asyncOp(other.__asyncOp) {}
+        : __amp_future(other.__amp_future), __then_registered(other.__then_registered), __asyncOp(other.__asyncOp) {}
 
     /**
      * Move constructor. Move constructs a new completion_future object that
@@ -1190,7 +1234,7 @@ public:
      *                  completion_future
      */
     completion_future(completion_future&& other)
-        : __amp_future(std::move(other.__amp_future)), __thread_then(other.__thread_then), __asyncOp(other.__asyncOp) {}
+        : __amp_future(std::move(other.__amp_future)), __then_registered(other.__then_registered), __asyncOp(other.__asyncOp) {}
 
     /**
      * Copy assignment. Copy assigns the contents of other to this. This method
@@ -1203,7 +1247,7 @@ public:
     completion_future& operator=(const completion_future& _Other) {
         if (this != &_Other) {
            __amp_future = _Other.__amp_future;
-           __thread_then = _Other.__thread_then;
+           __then_registered = _Other.__then_registered;
            __asyncOp = _Other.__asyncOp;
         }
         return (*this);
@@ -1221,7 +1265,7 @@ public:
     completion_future& operator=(completion_future&& _Other) {
         if (this != &_Other) {
             __amp_future = std::move(_Other.__amp_future);
-            __thread_then = _Other.__thread_then;
+            __then_registered = _Other.__then_registered;
            __asyncOp = _Other.__asyncOp;
         }
         return (*this);
@@ -1261,11 +1305,14 @@ public:
      * std::shared_future<void> member methods with same names.
      *
      * @param waitMode[in] An optional parameter to specify the wait mode. By
-     *                     default it would be hcWaitModeBlocked.
+     *                     default it would be hcWaitModeHybrid, which spins
+     *                     for a budget learnt from the recent waits on the
+     *                     accelerator_view before it blocks.
      *                     hcWaitModeActive would be used to reduce latency with
-     *                     the expense of using one CPU core for active waiting.
+     *                     the expense of using one CPU core for active waiting,
+     *                     hcWaitModeBlocked to never spin.
      */
-    void wait(hcWaitMode mode = hcWaitModeBlocked) const {
+    void wait(hcWaitMode mode = hcWaitModeHybrid) const {
         if (this->valid()) {
             if (__asyncOp != nullptr) {
                 __asyncOp->setWaitMode(mode);
@@ -1303,6 +1350,10 @@ public:
      * executed upon completion of the asynchronous operation associated with
      * this completion_future object. The completion callback func should have
      * an operator() that is valid when invoked with non arguments, i.e., "func()".
+     *
+     * func is copied and runs on one of the few threads of the runtime which
+     * execute the completion callbacks of all asynchronous operations; it
+     * should not block waiting for another completion callback.
      */
     // FIXME: notice we removed const from the signature here
     //        the original signature in the specification should be
@@ -1312,13 +1363,21 @@ public:
     void then(const functor & func) {
 #if __KALMAR_ACCELERATOR__ != 1
       // could only assign once
-      if (__thread_then == nullptr) {
-        // spawn a new thread to wait on the future and then execute the callback functor
-        __thread_then = new std::thread([&]() __CPU__ {
-          this->wait();
-          if(this->valid())
-            func();
-        });
+      if (!__then_registered && this->valid()) {
+        __then_registered = true;
+        // the callback keeps the asynchronous operation alive until it has run
+        std::shared_future<void> future = __amp_future;
+        std::shared_ptr<Kalmar::KalmarAsyncOp> op = __asyncOp;
+        Kalmar::CompletionService::callback_fn callback = [future, op, func]() __CPU__ {
+          future.wait();
+          Kalmar::getContext()->flushPrintfBuffer();
+          func();
+        };
+        if (op != nullptr) {
+          op->notifyCompletion(std::move(callback));
+        } else {
+          Kalmar::CompletionService::watch(future, std::move(callback));
+        }
       }
 #endif
     }
@@ -1396,12 +1455,6 @@ public:
     }
 
     ~completion_future() {
-      if (__thread_then != nullptr) {
-        __thread_then->join();
-      }
-      delete __thread_then;
-      __thread_then = nullptr;
-      
       if (__asyncOp != nullptr) {
         __asyncOp = nullptr;
       }
@@ -1415,15 +1468,16 @@ public:
 
 private:
     std::shared_future<void> __amp_future;
-    std::thread* __thread_then = nullptr;
+    bool __then_registered = false;
     std::shared_ptr<Kalmar::KalmarAsyncOp> __asyncOp;
 
     completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp> event) : __amp_future(*(event->getFuture())), __asyncOp(event) {}
 
     completion_future(const std::shared_future<void> &__future)
-        : __amp_future(__future), __thread_then(nullptr), __asyncOp(nullptr) {}
+        : __amp_future(__future), __then_registered(false), __asyncOp(nullptr) {}
 
     friend class Kalmar::HSAQueue;
+    friend class command_graph;
     
     // non-tiled parallel_for_each
     // generic version
@@ -1486,6 +1540,80 @@ private:
     friend class accelerator_view;
 };
 
+// ------------------------------------------------------------------------
+// command_graph
+// ------------------------------------------------------------------------
+
+/**
+ * Represents a sequence of commands recorded from an accelerator_view, see
+ * accelerator_view::begin_capture().  The graph can be replayed into the
+ * accelerator_view it was recorded from any number of times.
+ *
+ * A replay writes the recorded kernels and markers into the queue as AQL
+ * packets built at capture time, and rings the doorbell once for every run of
+ * them between copies.  Its host overhead hardly depends on the number of
+ * kernels recorded.
+ */
+class command_graph {
+public:
+    /**
+     * Default constructor. Constructs an empty command_graph, which can only
+     * be assigned to.
+     */
+    command_graph() {}
+
+    /**
+     * Returns the number of commands recorded.
+     */
+    size_t get_command_count() const { return pGraph->getCommandCount(); }
+
+    /**
+     * Returns the kind of the command recorded at position index, in the
+     * order the commands were enqueued.
+     */
+    hcCommandKind get_command_kind(size_t index) const { return pGraph->getCommandKind(index); }
+
+    /**
+     * Enqueues the recorded commands into the accelerator_view they were
+     * recorded from.  They are ordered after the commands enqueued before.
+     *
+     * @return A completion_future which is ready once all the recorded
+     *         commands have completed.
+     */
+    completion_future replay() { return completion_future(pGraph->replay()); }
+
+    /**
+     * Replaces the arguments of the kernel recorded at position index with
+     * the captures of f, which must be of the type of the functor the kernel
+     * was launched with.  The new arguments are used by the next replays.
+     *
+     * Waits for the last replay of the graph to complete before changing the
+     * arguments.  Throws a runtime_exception if the command at position index
+     * is not a kernel launched with a functor of the type of f.
+     */
+    template <typename Kernel>
+    void set_kernel_args(size_t index, const Kernel& f);
+
+private:
+    command_graph(std::shared_ptr<Kalmar::KalmarQueue> pQueue, std::shared_ptr<Kalmar::KalmarGraph> pGraph)
+        : pQueue(pQueue), pGraph(pGraph) {}
+
+    // the graph refers to the queue it was recorded from, keep it alive
+    std::shared_ptr<Kalmar::KalmarQueue> pQueue;
+    std::shared_ptr<Kalmar::KalmarGraph> pGraph;
+
+    friend class accelerator_view;
+};
+
+template <typename Kernel>
+inline void command_graph::set_kernel_args(size_t index, const Kernel& f) {
+#if __KALMAR_ACCELERATOR__ != 1
+    void* kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(pQueue, f);
+    Kalmar::append_kernel(pQueue, f, kernel);
+    pGraph->setKernelArgs(index, kernel);
+#endif
+}
+
 // ------------------------------------------------------------------------
 // member function implementations
 // ------------------------------------------------------------------------
@@ -1585,6 +1713,22 @@ inline void accelerator_view::copy2d_ext(const void *src, void *dst, size_t widt
     pQueue->copy2d_ext(src, dst, width, height, srcPitch, dstPitch, copyDir, srcInfo, dstInfo, copyAcc ? copyAcc->pDev : nullptr, forceUnpinnedCopy);
 };
 
+inline void
+accelerator_view::begin_capture() {
+    if (!pQueue->beginCapture()) {
+        throw runtime_exception("accelerator_view does not support capturing commands", E_FAIL);
+    }
+}
+
+inline command_graph
+accelerator_view::end_capture() {
+    std::shared_ptr<Kalmar::KalmarGraph> pGraph = pQueue->endCapture();
+    if (!pGraph) {
+        throw runtime_exception("accelerator_view is not capturing commands", E_FAIL);
+    }
+    return command_graph(pQueue, pGraph);
+}
+
 inline completion_future
 accelerator_view::copy_async(const void *src, void *dst, size_t size_bytes) {
     return completion_future(pQueue->EnqueueAsyncCopy(src, dst, size_bytes));
@@ -3334,30 +3478,70 @@ extern "C" void* get_dynamic_group_segment_base_pointer() __HC__;
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
 template <typename Ker, typename Ti>
-void bar_wrapper(Ker *f, Ti *t)
+void bar_wrapper(void *f, void *t)
 {
-    (*f)(*t);
+    (*static_cast<Ker*>(f))(*static_cast<Ti*>(t));
 }
 
+/// Work-items of a tile are run as fibers on a single thread, ctx[0] is the
+/// thread driving the tile. wait() switches to the next lower work-item and
+/// the last one switches back to ctx[0], which restarts the round from the
+/// highest one. All switches are done in user space (see kalmar_cpu_fiber.h).
 struct barrier_t {
-    std::unique_ptr<ucontext_t[]> ctx;
+    struct item_t {
+        barrier_t *bar;
+        int x;
+        void (*fn)(void*, void*);
+        void *f;
+        void *tidx;
+    };
+    std::unique_ptr<Kalmar::CPUFiber[]> ctx;
+    std::unique_ptr<item_t[]> items;
     int idx;
+    /// idx while the work-items of a tile run as a plain loop, none of them
+    /// on a fiber
+    static constexpr int loop_idx = -1;
     barrier_t (int a) :
-        ctx(new ucontext_t[a + 1]) {}
+        ctx(new Kalmar::CPUFiber[a + 1]), items(new item_t[a + 1]) {}
     template <typename Ti, typename Ker>
-    void setctx(int x, char *stack, Ker& f, Ti* tidx, int S) {
-        getcontext(&ctx[x]);
-        ctx[x].uc_stack.ss_sp = stack;
-        ctx[x].uc_stack.ss_size = S;
-        ctx[x].uc_link = &ctx[x - 1];
-        makecontext(&ctx[x], (void (*)(void))bar_wrapper<Ker, Ti>, 2, &f, tidx);
+    void setctx(int x, char *stack, Ker& f, Ti* tidx, size_t S) {
+        items[x] = { this, x, bar_wrapper<Ker, Ti>, const_cast<void*>(static_cast<const void*>(&f)), tidx };
+        Kalmar::fiber_make(&ctx[x], stack, S, entry, &items[x]);
+    }
+    static void entry(void *p) {
+        item_t *item = static_cast<item_t*>(p);
+        item->fn(item->f, item->tidx);
+        // a finished work-item resumes the previous context, the same way
+        // uc_link would
+        item->bar->swap(item->x, item->x - 1);
     }
     void swap(int a, int b) {
-        swapcontext(&ctx[a], &ctx[b]);
+        Kalmar::fiber_switch(&ctx[a], &ctx[b]);
+    }
+    /// Run work-item n, set up last with setctx(n), on its own. The calling
+    /// context is parked in ctx[n - 1] so that both a wait() and the end of
+    /// the work-item come back here. Returns true if the work-item finished
+    /// without reaching a barrier.
+    bool probe(int n) {
+        idx = n;
+        swap(n - 1, n);
+        return idx == n;
+    }
+    /// After a failed probe(n), run work-items n - 1 down to 1 to the first
+    /// barrier, then cycle through all n of them until they have finished.
+    void resume(int n) {
+        if (idx != 0)
+            swap(0, idx);
+        while (idx == 0) {
+            idx = n;
+            swap(0, n);
+        }
     }
     void wait() __HC__ {
+        if (idx == loop_idx)
+            Kalmar::fiber_barrier_divergence();
         --idx;
-        swapcontext(&ctx[idx + 1], &ctx[idx]);
+        Kalmar::fiber_switch(&ctx[idx + 1], &ctx[idx]);
     }
 };
 #endif
@@ -3611,7 +3795,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K> friend
-        void partitioned_task_tile_3D(K const&, tiled_extent<3> const&, int);
+        void partitioned_task_tile_3D(K const&, tiled_extent<3> const&, size_t, size_t);
 #endif
 };
 
@@ -3710,7 +3894,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K> friend
-        void partitioned_task_tile_1D(K const&, tiled_extent<1> const&, int);
+        void partitioned_task_tile_1D(K const&, tiled_extent<1> const&, size_t, size_t);
 #endif
 };
 
@@ -3809,197 +3993,176 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K> friend
-        void partitioned_task_tile_2D(K const&, tiled_extent<2> const&, int);
+        void partitioned_task_tile_2D(K const&, tiled_extent<2> const&, size_t, size_t);
 #endif
 };
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
-#define SSIZE 1024 * 10
-template <int N, typename Kernel,  int K>
+template <typename Kernel, int N>
 struct cpu_helper
 {
-    static inline void call(const Kernel& k, index<K>& idx, const extent<K>& ext) __CPU__ __HC__ {
-        int i;
-        for (i = 0; i < ext[N]; ++i) {
-            idx[N] = i;
-            cpu_helper<N + 1, Kernel, K>::call(k, idx, ext);
-        }
-    }
-};
-template <typename Kernel, int K>
-struct cpu_helper<K, Kernel, K>
-{
-    static inline void call(const Kernel& k, const index<K>& idx, const extent<K>& ext) __CPU__ __HC__ {
+    static inline void call(const Kernel& k, const index<N>& idx) __CPU__ __HC__ {
         (const_cast<Kernel&>(k))(idx);
     }
 };
 
+// The CPU path treats the compute domain as a flat, row-major range of
+// work-items (or of tiles, for tiled launches) and each partitioned_task
+// call handles the chunk [begin, end) of it.
+
 template <typename Kernel, int N>
-void partitioned_task(const Kernel& ker, const extent<N>& ext, int part) {
+void partitioned_task(const Kernel& ker, const extent<N>& ext, size_t begin, size_t end) {
     index<N> idx;
-    int start = ext[0] * part / Kalmar::NTHREAD;
-    int end = ext[0] * (part + 1) / Kalmar::NTHREAD;
-    for (int i = start; i < end; i++) {
-        idx[0] = i;
-        cpu_helper<1, Kernel, N>::call(ker, idx, ext);
+    size_t rem = begin;
+    for (int d = N - 1; d >= 0; d--) {
+        idx[d] = static_cast<int>(rem % ext[d]);
+        rem /= ext[d];
+    }
+    for (size_t i = begin; i < end; i++) {
+        cpu_helper<Kernel, N>::call(ker, idx);
+        for (int d = N - 1; ++idx[d] == ext[d] && d > 0; d--)
+            idx[d] = 0;
+    }
+}
+
+// Run one tile of n work-items whose tiled_index objects are in tidx. The
+// last work-item is run on a fiber of its own first: if it completes without
+// reaching a barrier, the tile does not use tile_barrier and the remaining
+// work-items run as a plain loop, in which a wait() aborts: all work-items
+// of a tile have to reach a barrier, and the one which did not has already
+// finished. Otherwise it is left suspended in its first wait() and every
+// other work-item gets a fiber as well. The tiled_index objects are
+// destroyed afterwards.
+template <typename Kernel, typename Ti>
+void run_tile(Kernel const& f, barrier_t& bar, Ti *tidx, int n, Kalmar::CPUStackArena& arena) {
+    const size_t S = Kalmar::CPUStackArena::stack_size();
+    bar.setctx(n, arena.stack(n - 1), f, &tidx[n - 1], S);
+    if (bar.probe(n)) {
+        bar.idx = barrier_t::loop_idx;
+        for (int i = 0; i < n - 1; i++)
+            f(tidx[i]);
+    } else {
+        for (int i = 1; i < n; i++)
+            bar.setctx(i, arena.stack(i - 1), f, &tidx[i - 1], S);
+        bar.resume(n);
     }
+    for (int i = 0; i < n; i++)
+        tidx[i].~Ti();
 }
 
 template <typename Kernel>
-void partitioned_task_tile_1D(Kernel const& f, tiled_extent<1> const& ext, int part) {
+void partitioned_task_tile_1D(Kernel const& f, tiled_extent<1> const& ext, size_t begin, size_t end) {
     int D0 = ext.tile_dim[0];
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
-        return;
-    char *stk = new char[D0 * SSIZE];
-    tiled_index<1> *tidx = new tiled_index<1>[D0];
+    Kalmar::CPUStackArena& arena = Kalmar::CPUStackArena::get();
+    arena.reserve(D0);
+    tiled_index<1> *tidx = static_cast<tiled_index<1>*>(arena.scratch(D0 * sizeof(tiled_index<1>)));
     tile_barrier::pb_t hc_bar = std::make_shared<barrier_t>(D0);
     tile_barrier tbar(hc_bar);
-    for (int tx = start; tx < end; tx++) {
-        int id = 0;
-        char *sp = stk;
+    for (size_t t = begin; t < end; t++) {
+        int tx = static_cast<int>(t);
         tiled_index<1> *tip = tidx;
         for (int x = 0; x < D0; x++) {
             new (tip) tiled_index<1>(tx * D0 + x, x, tx, tbar, D0);
-            hc_bar->setctx(++id, sp, f, tip, SSIZE);
-            sp += SSIZE;
             ++tip;
         }
-        hc_bar->idx = 0;
-        while (hc_bar->idx == 0) {
-            hc_bar->idx = id;
-            hc_bar->swap(0, id);
-        }
+        run_tile(f, *hc_bar, tidx, D0, arena);
     }
-    delete [] stk;
-    delete [] tidx;
 }
 
 template <typename Kernel>
-void partitioned_task_tile_2D(Kernel const& f, tiled_extent<2> const& ext, int part) {
+void partitioned_task_tile_2D(Kernel const& f, tiled_extent<2> const& ext, size_t begin, size_t end) {
     int D0 = ext.tile_dim[0];
     int D1 = ext.tile_dim[1];
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
-        return;
-    char *stk = new char[D1 * D0 * SSIZE];
-    tiled_index<2> *tidx = new tiled_index<2>[D0 * D1];
+    size_t T1 = ext[1] / D1;
+    Kalmar::CPUStackArena& arena = Kalmar::CPUStackArena::get();
+    arena.reserve(D0 * D1);
+    tiled_index<2> *tidx = static_cast<tiled_index<2>*>(arena.scratch(D0 * D1 * sizeof(tiled_index<2>)));
     tile_barrier::pb_t hc_bar = std::make_shared<barrier_t>(D0 * D1);
     tile_barrier tbar(hc_bar);
 
-    for (int tx = 0; tx < ext[1] / D1; tx++)
-        for (int ty = start; ty < end; ty++) {
-            int id = 0;
-            char *sp = stk;
-            tiled_index<2> *tip = tidx;
-            for (int x = 0; x < D1; x++)
-                for (int y = 0; y < D0; y++) {
-                    new (tip) tiled_index<2>(D1 * tx + x, D0 * ty + y, x, y, tx, ty, tbar, D0, D1);
-                    hc_bar->setctx(++id, sp, f, tip, SSIZE);
-                    ++tip;
-                    sp += SSIZE;
-                }
-            hc_bar->idx = 0;
-            while (hc_bar->idx == 0) {
-                hc_bar->idx = id;
-                hc_bar->swap(0, id);
+    for (size_t t = begin; t < end; t++) {
+        int ty = static_cast<int>(t / T1);
+        int tx = static_cast<int>(t % T1);
+        tiled_index<2> *tip = tidx;
+        for (int x = 0; x < D1; x++)
+            for (int y = 0; y < D0; y++) {
+                new (tip) tiled_index<2>(D1 * tx + x, D0 * ty + y, x, y, tx, ty, tbar, D0, D1);
+                ++tip;
             }
-        }
-    delete [] stk;
-    delete [] tidx;
+        run_tile(f, *hc_bar, tidx, D0 * D1, arena);
+    }
 }
 
 template <typename Kernel>
-void partitioned_task_tile_3D(Kernel const& f, tiled_extent<3> const& ext, int part) {
+void partitioned_task_tile_3D(Kernel const& f, tiled_extent<3> const& ext, size_t begin, size_t end) {
     int D0 = ext.tile_dim[0];
     int D1 = ext.tile_dim[1];
     int D2 = ext.tile_dim[2];
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
-        return;
-    char *stk = new char[D2 * D1 * D0 * SSIZE];
-    tiled_index<3> *tidx = new tiled_index<3>[D0 * D1 * D2];
+    size_t T1 = ext[1] / D1;
+    size_t T2 = ext[2] / D2;
+    Kalmar::CPUStackArena& arena = Kalmar::CPUStackArena::get();
+    arena.reserve(D0 * D1 * D2);
+    tiled_index<3> *tidx = static_cast<tiled_index<3>*>(arena.scratch(D0 * D1 * D2 * sizeof(tiled_index<3>)));
     tile_barrier::pb_t hc_bar = std::make_shared<barrier_t>(D0 * D1 * D2);
     tile_barrier tbar(hc_bar);
 
-    for (int i = 0; i < ext[2] / D2; i++)
-        for (int j = 0; j < ext[1] / D1; j++)
-            for(int k = start; k < end; k++) {
-                int id = 0;
-                char *sp = stk;
-                tiled_index<3> *tip = tidx;
-                for (int x = 0; x < D2; x++)
-                    for (int y = 0; y < D1; y++)
-                        for (int z = 0; z < D0; z++) {
-                            new (tip) tiled_index<3>(D2 * i + x,
-                                                              D1 * j + y,
-                                                              D0 * k + z,
-                                                              x, y, z, i, j, k, tbar, D0, D1, D2);
-                            hc_bar->setctx(++id, sp, f, tip, SSIZE);
-                            ++tip;
-                            sp += SSIZE;
-                        }
-                hc_bar->idx = 0;
-                while (hc_bar->idx == 0) {
-                    hc_bar->idx = id;
-                    hc_bar->swap(0, id);
+    for (size_t t = begin; t < end; t++) {
+        int k = static_cast<int>(t / (T1 * T2));
+        int j = static_cast<int>((t / T2) % T1);
+        int i = static_cast<int>(t % T2);
+        tiled_index<3> *tip = tidx;
+        for (int x = 0; x < D2; x++)
+            for (int y = 0; y < D1; y++)
+                for (int z = 0; z < D0; z++) {
+                    new (tip) tiled_index<3>(D2 * i + x,
+                                             D1 * j + y,
+                                             D0 * k + z,
+                                             x, y, z, i, j, k, tbar, D0, D1, D2);
+                    ++tip;
                 }
-            }
-    delete [] stk;
-    delete [] tidx;
+        run_tile(f, *hc_bar, tidx, D0 * D1 * D2, arena);
+    }
 }
 
 template <typename Kernel, int N>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      extent<N> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task<Kernel, N>, std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t count = 1;
+    for (int i = 0; i < N; ++i)
+        count *= compute_domain[i];
+    return completion_future(Kalmar::CPUKernelLaunch<Kernel, extent<N>>::launch(
+        pQueue, f, compute_domain, partitioned_task<Kernel, N>, count, Kalmar::CPU_MIN_CHUNK));
 }
 
 template <typename Kernel>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<1> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile_1D<Kernel>,
-                             std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t tiles = compute_domain[0] / compute_domain.tile_dim[0];
+    return completion_future(Kalmar::CPUKernelLaunch<Kernel, tiled_extent<1>>::launch(
+        pQueue, f, compute_domain, partitioned_task_tile_1D<Kernel>, tiles, 1));
 }
 
 template <typename Kernel>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<2> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile_2D<Kernel>,
-                             std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t tiles = static_cast<size_t>(compute_domain[0] / compute_domain.tile_dim[0]) *
+                   (compute_domain[1] / compute_domain.tile_dim[1]);
+    return completion_future(Kalmar::CPUKernelLaunch<Kernel, tiled_extent<2>>::launch(
+        pQueue, f, compute_domain, partitioned_task_tile_2D<Kernel>, tiles, 1));
 }
 
 template <typename Kernel>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<3> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile_3D<Kernel>,
-                             std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t tiles = static_cast<size_t>(compute_domain[0] / compute_domain.tile_dim[0]) *
+                   (compute_domain[1] / compute_domain.tile_dim[1]) *
+                   (compute_domain[2] / compute_domain.tile_dim[2]);
+    return completion_future(Kalmar::CPUKernelLaunch<Kernel, tiled_extent<3>>::launch(
+        pQueue, f, compute_domain, partitioned_task_tile_3D<Kernel>, tiles, 1));
 }
 
 #endif
@@ -7193,16 +7356,22 @@ extern "C" int atomic_compare_exchange_int(int *dest, int expected_val, int val)
 extern "C" uint64_t atomic_compare_exchange_uint64(uint64_t *dest, uint64_t expected_val, uint64_t val) __HC__;
 
 static inline bool atomic_compare_exchange(unsigned int *dest, unsigned int *expected_val, unsigned int val) __CPU__ __HC__ {
-  *expected_val = atomic_compare_exchange_unsigned(dest, *expected_val, val);
-  return (*dest == val);
+  unsigned int old = atomic_compare_exchange_unsigned(dest, *expected_val, val);
+  bool exchanged = (old == *expected_val);
+  *expected_val = old;
+  return exchanged;
 }
 static inline bool atomic_compare_exchange(int *dest, int *expected_val, int val) __CPU__ __HC__ {
-  *expected_val = atomic_compare_exchange_int(dest, *expected_val, val);
-  return (*dest == val);
+  int old = atomic_compare_exchange_int(dest, *expected_val, val);
+  bool exchanged = (old == *expected_val);
+  *expected_val = old;
+  return exchanged;
 }
 static inline bool atomic_compare_exchange(uint64_t *dest, uint64_t *expected_val, uint64_t val) __CPU__ __HC__ {
-  *expected_val = atomic_compare_exchange_uint64(dest, *expected_val, val);
-  return (*dest == val);
+  uint64_t old = atomic_compare_exchange_uint64(dest, *expected_val, val);
+  bool exchanged = (old == *expected_val);
+  *expected_val = old;
+  return exchanged;
 }
 #elif __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
 unsigned int atomic_compare_exchange_unsigned(unsigned int *dest, unsigned int expected_val, unsigned int val);
@@ -7210,16 +7379,22 @@ int atomic_compare_exchange_int(int *dest, int expected_val, int val);
 uint64_t atomic_compare_exchange_uint64(uint64_t *dest, uint64_t expected_val, uint64_t val);
 
 static inline bool atomic_compare_exchange(unsigned int *dest, unsigned int *expected_val, unsigned int val) __CPU__ __HC__ {
-  *expected_val = atomic_compare_exchange_unsigned(dest, *expected_val, val);
-  return (*dest == val);
+  unsigned int old = atomic_compare_exchange_unsigned(dest, *expected_val, val);
+  bool exchanged = (old == *expected_val);
+  *expected_val = old;
+  return exchanged;
 }
 static inline bool atomic_compare_exchange(int *dest, int *expected_val, int val) __CPU__ __HC__ {
-  *expected_val = atomic_compare_exchange_int(dest, *expected_val, val);
-  return (*dest == val);
+  int old = atomic_compare_exchange_int(dest, *expected_val, val);
+  bool exchanged = (old == *expected_val);
+  *expected_val = old;
+  return exchanged;
 }
 static inline bool atomic_compare_exchange(uint64_t *dest, uint64_t *expected_val, uint64_t val) __CPU__ __HC__ {
-  *expected_val = atomic_compare_exchange_uint64(dest, *expected_val, val);
-  return (*dest == val);
+  uint64_t old = atomic_compare_exchange_uint64(dest, *expected_val, val);
+  bool exchanged = (old == *expected_val);
+  *expected_val = old;
+  return exchanged;
 }
 #else
 extern bool atomic_compare_exchange(unsigned int *dest, unsigned int *expected_val, unsigned int val) __CPU__ __HC__;
@@ -7683,7 +7858,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
         return launch_cpu_task_async(av.pQueue, f, compute_domain);
     }
 #endif
-    if (av.get_accelerator().get_device_path() == L"cpu") {
+    if (Kalmar::is_cpu_queue(av.pQueue)) {
       throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
     }
     const pfe_wrapper<N, Kernel> _pf(compute_domain, f);
@@ -7721,7 +7896,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
     }
 #endif
   size_t ext = compute_domain[0];
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   return completion_future(Kalmar::mcw_cxxamp_launch_kernel_async<Kernel, 1>(av.pQueue, &ext, NULL, f));
@@ -7759,7 +7934,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
 #endif
   size_t ext[2] = {static_cast<size_t>(compute_domain[1]),
                    static_cast<size_t>(compute_domain[0])};
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   return completion_future(Kalmar::mcw_cxxamp_launch_kernel_async<Kernel, 2>(av.pQueue, ext, NULL, f));
@@ -7800,7 +7975,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
   size_t ext[3] = {static_cast<size_t>(compute_domain[2]),
                    static_cast<size_t>(compute_domain[1]),
                    static_cast<size_t>(compute_domain[0])};
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   return completion_future(Kalmar::mcw_cxxamp_launch_kernel_async<Kernel, 3>(av.pQueue, ext, NULL, f));
@@ -7836,7 +8011,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
       return launch_cpu_task_async(av.pQueue, f, compute_domain);
   } else
 #endif
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   void *kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(av.pQueue, f);
@@ -7878,7 +8053,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
       return launch_cpu_task_async(av.pQueue, f, compute_domain);
   } else
 #endif
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   void *kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(av.pQueue, f);
@@ -7924,7 +8099,7 @@ __attribute__((noinline,used)) completion_future parallel_for_each(
       return launch_cpu_task_async(av.pQueue, f, compute_domain);
   } else
 #endif
-  if (av.get_accelerator().get_device_path() == L"cpu") {
+  if (Kalmar::is_cpu_queue(av.pQueue)) {
     throw runtime_exception(Kalmar::__errorMsg_UnsupportedAccelerator, E_FAIL);
   }
   void *kernel = Kalmar::mcw_cxxamp_get_kernel<Kernel>(av.pQueue, f);
@@ -138,6 +138,9 @@ am_status_t am_copy(void*  dst, const void*  src, std::size_t size) __attribute_
  * The tracker tracks the base pointer as well as the size of the allocation, and will
  * find the information for a pointer anywhere in the tracked range.
  *
+ * Lookups take no lock, so threads can call this at the same time without waiting on each
+ * other or on pointers being added or removed.
+ *
  * @returns AM_ERROR_MISC if pointer is not currently being tracked.  In this case, @p info
  * is not modified.
 
@@ -206,6 +209,26 @@ void am_memtracker_print(void * targetAddress=nullptr);
  **/
 void am_memtracker_sizeinfo(const hc::accelerator &acc, std::size_t *deviceMemSize, std::size_t *hostMemSize, std::size_t *userMemSize);
 
+/**
+ * Return total sizes of device, host, and user memory allocated by the application, and of the
+ * device and host memory the caching allocator holds without it being allocated by the application.
+ *
+ * The caching allocator is enabled with HCC_AM_CACHE_SIZE=<MB>, the most free memory it keeps
+ * for each accelerator, memory pool and allocation flags.
+ * @see am_alloc_cache_trim
+ **/
+void am_memtracker_sizeinfo(const hc::accelerator &acc, std::size_t *deviceMemSize, std::size_t *hostMemSize, std::size_t *userMemSize,
+                            std::size_t *cachedDeviceMemSize, std::size_t *cachedHostMemSize);
+
+/**
+ * Return memory of @p acc held by the caching allocator to the HSA runtime, until at most
+ * @p keepBytes are left for each memory pool and allocation flags.
+ *
+ * @returns Number of bytes returned.
+ * @see am_memtracker_sizeinfo
+ **/
+std::size_t am_alloc_cache_trim(const hc::accelerator &acc, std::size_t keepBytes = 0);
+
 
 void am_memtracker_update_peers(const hc::accelerator &acc, int peerCnt, hsa_agent_s *agents);
 
@@ -220,6 +243,13 @@ void am_memtracker_update_peers(const hc::accelerator &acc, int peerCnt, hsa_age
  * @return AM_ERROR_MISC if @p ptr is not am managed.
  * @return AM_ERROR_MISC if @p ptr is not found in the pointer tracker.
  * @return AM_ERROR_MISC if @p peers incudes a non peer accelerator.
+ * @return AM_ERROR_MISC if @p ptr is device memory the caching allocator
+ *         sub-allocated from a slab shared with other allocations (requests of
+ *         up to 64KB with HCC_AM_CACHE_SIZE set): peers are given access to
+ *         whole pool allocations, which would expose the other blocks. Larger
+ *         cached blocks are pool allocations of their own and are mapped; they
+ *         are freed rather than cached again once released. Cached host memory
+ *         is mapped to all peers when allocated, like any other host memory.
  */
 am_status_t am_map_to_peers(void* ptr, std::size_t num_peer, const hc::accelerator* peers); 
 
@@ -238,6 +268,11 @@ am_status_t am_memory_host_lock(hc::accelerator &ac, void *hostPtr, std::size_t
 
 /*
  * Unlock page locked host memory
+ *
+ * Also unlocks the host memory kept locked after pin-in-place copies from or
+ * to @p hostPtr when HCC_PINNED_CACHE_SIZE is set (the cache is off by
+ * default). With the cache on, call it before freeing or unmapping such
+ * memory.
  * 
  * @p ac current device accelerator
  * @p hostPtr host pointer 
@@ -2,15 +2,20 @@
 
 // C++ headers
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <future>
 #include <initializer_list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -20,7 +25,7 @@
 
 // CPU execution path
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
-#include <ucontext.h>
+#include "kalmar_cpu_fiber.h"
 #endif
 
 namespace hc {
@@ -0,0 +1,119 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+
+// Use the hand-written register save/restore on architectures libmcwamp has
+// it for, and fall back to ucontext everywhere else. glibc's swapcontext
+// saves and restores the signal mask, which costs a syscall per switch.
+#if defined(__x86_64__) || defined(__aarch64__)
+#define KALMAR_FIBER_ASM (1)
+#else
+#define KALMAR_FIBER_ASM (0)
+#include <ucontext.h>
+#endif
+
+/** \cond HIDDEN_SYMBOLS */
+#if KALMAR_FIBER_ASM
+/// save the callee-saved registers on the current stack, store the stack
+/// pointer to *from_sp and resume the context saved at to_sp
+extern "C" void __hcc_fiber_switch(void** from_sp, void* to_sp);
+
+/// set up stack [stack, stack + size) so that switching to the returned
+/// stack pointer calls fn(arg)
+extern "C" void* __hcc_fiber_make(char* stack, size_t size, void (*fn)(void*), void* arg);
+#endif
+
+namespace Kalmar {
+
+/// CPUFiber
+///
+/// Execution context of one work-item on the CPU path. Switching between
+/// fibers is done entirely in user space.
+struct CPUFiber {
+#if KALMAR_FIBER_ASM
+    void* sp;
+#else
+    ucontext_t ctx;
+#endif
+};
+
+/// prepare fiber to run fn(arg) on the given stack
+/// fn must never return, it has to switch away to another fiber when done
+static inline void fiber_make(CPUFiber* fiber, char* stack, size_t size, void (*fn)(void*), void* arg) {
+#if KALMAR_FIBER_ASM
+    fiber->sp = __hcc_fiber_make(stack, size, fn, arg);
+#else
+    getcontext(&fiber->ctx);
+    fiber->ctx.uc_stack.ss_sp = stack;
+    fiber->ctx.uc_stack.ss_size = size;
+    fiber->ctx.uc_link = nullptr;
+    makecontext(&fiber->ctx, (void (*)(void))fn, 1, arg);
+#endif
+}
+
+/// save the running context into from and resume to
+static inline void fiber_switch(CPUFiber* from, CPUFiber* to) {
+#if KALMAR_FIBER_ASM
+    __hcc_fiber_switch(&from->sp, to->sp);
+#else
+    swapcontext(&from->ctx, &to->ctx);
+#endif
+}
+
+/// report a tile_barrier::wait() from a work-item which runs without a fiber
+/// of its own and abort. A tile runs as a plain loop when its last work-item
+/// does not reach a barrier, so this is a barrier reached by some work-items
+/// of a tile but not by all of them.
+[[noreturn]] void fiber_barrier_divergence();
+
+/// CPUStackArena
+///
+/// Per-thread memory for the work-item fibers of tiled kernels, reused
+/// across launches. The stacks are carved out of one anonymous mapping with
+/// an inaccessible guard page below each of them, so that a work-item
+/// overflowing its stack faults instead of corrupting its neighbour. Pages
+/// are only committed once they are touched.
+class CPUStackArena
+{
+public:
+    CPUStackArena();
+    ~CPUStackArena();
+
+    CPUStackArena(const CPUStackArena&) = delete;
+    CPUStackArena& operator=(const CPUStackArena&) = delete;
+
+    /// arena of the calling thread
+    static CPUStackArena& get();
+
+    /// usable size of one stack: HCC_CPU_STACK_SIZE bytes rounded up to
+    /// whole pages, 64 KiB by default
+    static size_t stack_size();
+
+    /// make sure stacks [0, n) are available
+    void reserve(size_t n);
+
+    /// lowest address of stack i, which is stack_size() bytes long
+    char* stack(size_t i) const { return base + i * stride + guard; }
+
+    /// scratch memory of at least bytes bytes for the bookkeeping of a tile,
+    /// valid until the next call on this thread
+    void* scratch(size_t bytes);
+
+private:
+    char* base;
+    size_t stride;
+    size_t guard;
+    size_t count;
+    void* scratch_mem;
+    size_t scratch_size;
+};
+
+} // namespace Kalmar
+/** \endcond */
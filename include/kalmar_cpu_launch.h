@@ -15,32 +15,115 @@ namespace Kalmar {
 template <int D0, int D1=0, int D2=0> class tiled_extent;
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
-static const unsigned int NTHREAD = std::thread::hardware_concurrency();
+/// smallest number of work-items handed to a pool worker at a time by a
+/// non-tiled CPU launch; tiled launches are handed out one tile at a time
+static const size_t CPU_MIN_CHUNK = 256;
 
-template <typename Kernel>
-class CPUKernelRAII
+/// CPUKernelLaunch
+///
+/// One asynchronous kernel launch on the CPU path. The launch owns copies of
+/// the functor and the compute domain, so that it can outlive the
+/// parallel_for_each call which created it. It is started by the command
+/// stream of its queue and deletes itself once the last chunk has been
+/// executed.
+///
+/// The iteration space of a launch is handed out to the pool workers in
+/// chunks from a shared cursor. Chunks follow guided scheduling: each one
+/// takes a share of what is left, so they shrink towards the end and skewed
+/// per-item costs even out across the workers.
+template <typename Kernel, typename Domain>
+class CPUKernelLaunch
 {
-    const std::shared_ptr<Kalmar::KalmarQueue> pQueue;
-    const Kernel& f;
-    std::vector<std::thread> th;
 public:
-    CPUKernelRAII(const std::shared_ptr<Kalmar::KalmarQueue> pQueue, const Kernel& f)
-        : pQueue(pQueue), f(f), th(NTHREAD) {
+    typedef void (*body_fn)(const Kernel&, const Domain&, size_t, size_t);
+
+    /// enqueue a launch running body(f, ext, begin, end) over chunks covering
+    /// [0, total) on the CPU thread pool and return the operation tracking it
+    static std::shared_ptr<KalmarAsyncOp> launch(const std::shared_ptr<KalmarQueue>& pQueue,
+                                                 const Kernel& f, const Domain& ext, body_fn body,
+                                                 size_t total, size_t min_chunk) {
+        // all queues of the CPU path are command stream queues
+        CPUStreamQueue* queue = static_cast<CPUStreamQueue*>(pQueue.get());
+        CPUKernelLaunch* l = new CPUKernelLaunch(pQueue, f, ext, body, total, min_chunk);
+        // the buffers are only looked at, they are synced once the launch starts
+        CPUBufferCollector bufs;
+        Serialize s(&bufs);
+        f.__cxxamp_serialize(s);
+        return CLAMP::push_cpu_kernel(queue, bufs.get(),
+            [l](const std::shared_ptr<CPUAsyncOp>& op) { l->start(op); });
+    }
+
+private:
+    CPUKernelLaunch(const std::shared_ptr<KalmarQueue>& pQueue, const Kernel& f, const Domain& ext,
+                    body_fn body, size_t total, size_t min_chunk)
+        : pQueue(pQueue), f(f), ext(ext), body(body), total(total), min_chunk(min_chunk),
+          nworkers(0), next(0), op(), error_lock(), error(nullptr) {}
+
+    /// called by the command stream of the queue once the launch may start
+    void start(const std::shared_ptr<CPUAsyncOp>& op) {
+        std::unique_ptr<CPUKernelLaunch> l(this);
+
         CPUVisitor vis(pQueue);
         Serialize s(&vis);
         f.__cxxamp_serialize(s);
+
+        // the pool is looked up only now, so that a change of the core set of
+        // the queue applies from the next command on
+        CPUThreadPool& pool = static_cast<CPUStreamQueue*>(pQueue.get())->get_pool();
+        nworkers = pool.size();
+
+        this->op = op;
+        op->start();
+        pool.submit(&CPUKernelLaunch::run, l.release(), nworkers, &CPUKernelLaunch::finish);
+    }
+
+    static void run(void* self, size_t) {
+        CPUKernelLaunch* l = static_cast<CPUKernelLaunch*>(self);
         CLAMP::enter_kernel();
+        size_t begin = l->next.load(std::memory_order_relaxed);
+        for (;;) {
+            size_t n;
+            do {
+                if (begin >= l->total) {
+                    CLAMP::leave_kernel();
+                    return;
+                }
+                n = std::max(l->min_chunk, (l->total - begin) / (2 * l->nworkers));
+            } while (!l->next.compare_exchange_weak(begin, begin + n, std::memory_order_relaxed));
+            try {
+                l->body(l->f, l->ext, begin, std::min(begin + n, l->total));
+            } catch (...) {
+                // keep the first exception and skip the rest of the launch
+                std::lock_guard<std::mutex> g(l->error_lock);
+                if (!l->error)
+                    l->error = std::current_exception();
+                l->next.store(l->total, std::memory_order_relaxed);
+            }
+            begin = l->next.load(std::memory_order_relaxed);
+        }
     }
-    std::thread& operator[](int i) { return th[i]; }
-    ~CPUKernelRAII() {
-        for (auto& t : th)
-            if (t.joinable())
-                t.join();
-        CPUVisitor vis(pQueue);
-        Serialize ss(&vis);
-        f.__cxxamp_serialize(ss);
+
+    static void finish(void* self) {
+        std::unique_ptr<CPUKernelLaunch> l(static_cast<CPUKernelLaunch*>(self));
+        CLAMP::enter_kernel();
+        CPUVisitor vis(l->pQueue);
+        Serialize s(&vis);
+        l->f.__cxxamp_serialize(s);
         CLAMP::leave_kernel();
+        l->op->complete(l->error);
     }
+
+    const std::shared_ptr<KalmarQueue> pQueue;
+    const Kernel f;
+    const Domain ext;
+    body_fn body;
+    size_t total;
+    size_t min_chunk;
+    size_t nworkers;
+    std::atomic<size_t> next;
+    std::shared_ptr<CPUAsyncOp> op;
+    std::mutex error_lock;
+    std::exception_ptr error;
 };
 
 #endif
@@ -0,0 +1,136 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** \cond HIDDEN_SYMBOLS */
+namespace Kalmar {
+
+/// CPUThreadPool
+///
+/// A persistent pool of worker threads used to execute kernels on the CPU
+/// path. Every worker owns a deque of tasks; a worker pops work from the back
+/// of its own deque and, once that is empty, steals from the front of the
+/// deques of the other workers.
+///
+/// A launch is split into a number of partitions. The partitions are spread
+/// over the worker deques as ranges which are split in half every time a
+/// worker picks one up, so that an idle worker always has a large piece of
+/// work to steal.
+class CPUThreadPool
+{
+public:
+    /// body of a task, invoked once for every partition of a launch
+    typedef void (*task_fn)(void* arg, size_t part);
+
+    /// completion callback of an asynchronous launch
+    typedef void (*done_fn)(void* arg);
+
+    explicit CPUThreadPool(unsigned int nworkers);
+
+    /// workers bound to the set of cpus in cpus, one per cpu unless the CPU
+    /// quota of the process allows for fewer
+    explicit CPUThreadPool(const std::vector<int>& cpus);
+
+    ~CPUThreadPool();
+
+    CPUThreadPool(const CPUThreadPool&) = delete;
+    CPUThreadPool& operator=(const CPUThreadPool&) = delete;
+
+    /// number of worker threads in the pool
+    unsigned int size() const { return static_cast<unsigned int>(workers.size()); }
+
+    /// execute fn(arg, part) for every part in [0, nparts) on the pool and
+    /// return once all of them have completed. The calling thread takes part
+    /// in the execution while it waits.
+    void run(task_fn fn, void* arg, size_t nparts);
+
+    /// start executing fn(arg, part) for every part in [0, nparts) on the
+    /// pool and return immediately. done(arg) is called on the thread which
+    /// completes the last part; the pool does not touch arg afterwards.
+    void submit(task_fn fn, void* arg, size_t nparts, done_fn done);
+
+    /// process-wide pool shared by all CPU path launches, created on first use
+    static CPUThreadPool& get_default();
+
+    /// delete pool. A pool may be released by a callback running on one of
+    /// its own workers, which cannot join itself; the pool is then deleted
+    /// from another thread once the callback has returned.
+    static void destroy(CPUThreadPool* pool);
+
+private:
+    struct Job;
+
+    /// a contiguous range of partitions of one job
+    struct Task {
+        Job* job;
+        size_t begin;
+        size_t end;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    void worker_loop(unsigned int id);
+    bool pop(unsigned int id, Task& task);
+    bool steal(unsigned int thief, Task& task, unsigned int& victim);
+    void execute(unsigned int id, Task task);
+    void push(unsigned int id, const Task& task);
+    void wake();
+    void seed(Job* job, size_t nparts);
+    void start(unsigned int nworkers);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    /// cpus the workers are bound to, empty if they are not bound
+    std::vector<int> cpus;
+
+    /// number of tasks sitting in the deques, used to park idle workers
+    std::atomic<size_t> queued;
+    std::atomic<unsigned int> sleepers;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    bool stopping;
+};
+
+/// parse a cpu list in the format used by sysfs and cgroups, e.g. "0-3,8"
+std::vector<int> parse_cpu_list(const std::string& list);
+
+/// cpus the process is allowed to run on, in ascending order
+std::vector<int> usable_cpus();
+
+/// number of cpus worth of time the cgroup of the process may use, rounded
+/// up; 0 if there is no CPU quota
+unsigned int cpu_quota();
+
+/// number of workers to keep ncpus cpus busy without exceeding the quota
+unsigned int cpu_worker_count(size_t ncpus);
+
+/// copy count bytes from src to dst with non-temporal stores, which do not
+/// pull dst into the caches. A plain memcpy where they are not available.
+void stream_memcpy(void* dst, const void* src, size_t count);
+
+/// copy count bytes from src to dst, split into parts copied by the workers
+/// of pool and the calling thread. Copies too small to be worth splitting
+/// are done by the calling thread alone.
+void parallel_memcpy(CPUThreadPool& pool, void* dst, const void* src, size_t count, bool nontemporal);
+
+} // namespace Kalmar
+/** \endcond */
@@ -11,6 +11,8 @@
 #include "kalmar_runtime.h"
 #include "kalmar_serialize.h"
 
+#include <atomic>
+
 /** \cond HIDDEN_SYMBOLS */
 namespace Kalmar {
 
@@ -22,6 +24,35 @@ static void append_kernel(const std::shared_ptr<KalmarQueue>& pQueue, const Kern
   f.__cxxamp_serialize(s);
 }
 
+// number of devices, by seqnum, kernels are cached for in create_kernel
+#define KALMAR_KERNEL_CACHE_DEVICES (16)
+
+/// create a dispatch of the kernel of functor type Kernel
+///
+/// The kernel is resolved by name once per device and functor type, later
+/// launches go straight to creating the dispatch.
+template <typename Kernel>
+static inline void* create_kernel(const std::shared_ptr<KalmarQueue>& pQueue, const Kernel& f)
+{
+  static std::atomic<void*> kernels[KALMAR_KERNEL_CACHE_DEVICES];
+
+  KalmarDevice* pDev = pQueue->getDev();
+  unsigned int seqnum = pDev->get_seqnum();
+  if (seqnum < KALMAR_KERNEL_CACHE_DEVICES) {
+    // all threads resolve the same kernel, whoever stores it last wins
+    void* kernel = kernels[seqnum].load(std::memory_order_acquire);
+    if (!kernel) {
+      kernel = pDev->GetKernel(f.__cxxamp_trampoline_name(), pQueue.get());
+      kernels[seqnum].store(kernel, std::memory_order_release);
+    }
+    if (kernel)
+      return pDev->CreateDispatch(kernel, pQueue.get());
+  }
+
+  std::string kernel_name(f.__cxxamp_trampoline_name());
+  return CLAMP::CreateKernel(kernel_name, pQueue.get());
+}
+
 template <typename Kernel>
 static inline std::shared_ptr<KalmarQueue> get_availabe_que(const Kernel& f)
 {
@@ -46,11 +77,7 @@ mcw_cxxamp_launch_kernel_async(const std::shared_ptr<KalmarQueue>& pQueue, size_
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  {
-      std::string kernel_name(f.__cxxamp_trampoline_name());
-      kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  }
+  void *kernel = create_kernel(pQueue, f);
   append_kernel(pQueue, f, kernel);
   return pQueue->LaunchKernelAsync(kernel, dim_ext, ext, local_size);
 #endif
@@ -69,11 +96,7 @@ void mcw_cxxamp_launch_kernel(const std::shared_ptr<KalmarQueue>& pQueue, size_t
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  {
-      std::string kernel_name(f.__cxxamp_trampoline_name());
-      kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  }
+  void *kernel = create_kernel(pQueue, f);
   append_kernel(pQueue, f, kernel);
   pQueue->LaunchKernel(kernel, dim_ext, ext, local_size);
 #endif // __KALMAR_ACCELERATOR__
@@ -90,9 +113,7 @@ inline void* mcw_cxxamp_get_kernel(const std::shared_ptr<KalmarQueue>& pQueue, c
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  std::string kernel_name (f.__cxxamp_trampoline_name());
-  kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
+  void *kernel = create_kernel(pQueue, f);
   return kernel;
 #else
   return NULL;
@@ -2,6 +2,7 @@
 
 #include "hc_defines.h"
 #include "kalmar_aligned_alloc.h"
+#include "kalmar_cpu_pool.h"
 
 namespace hc {
 class AmPointerInfo;
@@ -103,7 +104,17 @@ static inline bool isComputeQueueCommand(hcCommandKind k) {
 
 enum hcWaitMode {
     hcWaitModeBlocked = 0,
-    hcWaitModeActive = 1
+    hcWaitModeActive = 1,
+    // spin for a while, then block. The spin budget adapts to how long the
+    // recent waits on the queue took
+    hcWaitModeHybrid = 2
+};
+
+/// how the hcWaitModeHybrid waits on a queue went
+struct hcWaitStats {
+    uint64_t spinCount;     // waits which completed while spinning
+    uint64_t blockCount;    // waits which ran out of spin budget and blocked
+    uint64_t spinBudgetNs;  // spin budget of the next wait, in nanoseconds
 };
 
 enum hcAgentProfile {
@@ -126,6 +137,30 @@ class KalmarDevice;
 class KalmarQueue;
 struct rw_info;
 
+/// CompletionService
+///
+/// Runs the continuations registered with completion_future::then. They are
+/// executed by a small pool of executor threads shared by the whole process,
+/// HCC_COMPLETION_THREADS of them (2 by default), started on first use.
+/// Operations which learn about their own completion post their
+/// continuations once they complete; the other futures are watched by a
+/// single waiter thread.
+///
+/// A continuation must not block on another continuation: with every
+/// executor thread blocked none of them would ever run.
+class CompletionService
+{
+public:
+  typedef std::function<void()> callback_fn;
+
+  /// run callback on an executor thread
+  static void post(callback_fn callback);
+
+  /// run callback on an executor thread once future is ready. Deferred
+  /// futures are waited for on the executor thread.
+  static void watch(const std::shared_future<void>& future, callback_fn callback);
+};
+
 /// KalmarAsyncOp
 ///
 /// This is an abstraction of all asynchronous operations within Kalmar
@@ -172,6 +207,20 @@ public:
    */
   virtual void setWaitMode(hcWaitMode mode) {}
 
+  /**
+   * Run callback on the CompletionService once the async operation has
+   * completed. The caller keeps the operation alive until callback has run.
+   *
+   * @param callback[in] continuation of the operation.
+   */
+  virtual void notifyCompletion(CompletionService::callback_fn callback) {
+    std::shared_future<void>* future = getFuture();
+    if (future != nullptr && future->valid())
+      CompletionService::watch(*future, std::move(callback));
+    else
+      CompletionService::post(std::move(callback));
+  }
+
   void setSeqNumFromQueue();
   uint64_t getSeqNum () const { return seqNum;};
 
@@ -192,6 +241,31 @@ private:
 
 };
 
+/// KalmarGraph
+/// This is the implementation of command_graph
+/// A sequence of commands recorded from a KalmarQueue between beginCapture and
+/// endCapture, which can be replayed into that queue
+class KalmarGraph
+{
+public:
+  virtual ~KalmarGraph() {}
+
+  /// number of commands recorded
+  virtual size_t getCommandCount() const = 0;
+
+  /// kind of the i-th command recorded
+  virtual hcCommandKind getCommandKind(size_t i) const = 0;
+
+  /// replace the arguments of the i-th command, a kernel, with the arguments
+  /// pushed to kernel, a kernel created for the same function.
+  /// kernel is consumed.
+  virtual void setKernelArgs(size_t i, void* kernel) = 0;
+
+  /// enqueue the recorded commands into the queue, returns the op completing
+  /// after the last of them
+  virtual std::shared_ptr<KalmarAsyncOp> replay() = 0;
+};
+
 /// KalmarQueue
 /// This is the implementation of accelerator_view
 /// KalamrQueue is responsible for data operations and launch kernel
@@ -205,7 +279,7 @@ public:
   virtual ~KalmarQueue() {}
 
   virtual void flush() {}
-  virtual void wait(hcWaitMode mode = hcWaitModeBlocked) {}
+  virtual void wait(hcWaitMode mode = hcWaitModeHybrid) {}
 
   // sync kernel launch with dynamic group memory
   virtual void LaunchKernelWithDynamicGroupMemory(void *kernel, size_t dim_ext, size_t *ext, size_t *local_size, size_t dynamic_group_size) {}
@@ -255,6 +329,9 @@ public:
   /// Is the queue empty?  Same as getPendingAsyncOps but may be faster.
   virtual bool isEmpty() { return 0; }
 
+  /// get statistics of the hcWaitModeHybrid waits on the queue
+  virtual hcWaitStats getWaitStats() { return hcWaitStats(); }
+
   /// get underlying native queue handle
   virtual void* getHSAQueue() { return nullptr; }
 
@@ -274,6 +351,13 @@ public:
   /// check if the queue is an HSA queue
   virtual bool hasHSAInterOp() { return false; }
 
+  /// record the commands enqueued from now on into a graph instead of
+  /// executing them. Returns false if the queue cannot record commands.
+  virtual bool beginCapture() { return false; }
+
+  /// stop recording commands, returns the graph holding them
+  virtual std::shared_ptr<KalmarGraph> endCapture() { return nullptr; }
+
   /// enqueue marker
   virtual std::shared_ptr<KalmarAsyncOp> EnqueueMarker(memory_scope) { return nullptr; }
 
@@ -392,6 +476,14 @@ public:
     /// create kernel
     virtual void* CreateKernel(const char* fun, KalmarQueue *queue) { return nullptr; }
 
+    /// look up the kernel named fun, the result stays valid for the lifetime
+    /// of the device and can be passed to CreateDispatch any number of times.
+    /// Returns nullptr if the device has no such kernels.
+    virtual void* GetKernel(const char* fun, KalmarQueue *queue) { return nullptr; }
+
+    /// create kernel dispatch of a kernel returned by GetKernel, as CreateKernel
+    virtual void* CreateDispatch(void* kernel, KalmarQueue *queue) { return nullptr; }
+
     /// check if a given kernel is compatible with the device
     virtual bool IsCompatibleKernel(void* size, void* source) { return true; }
 
@@ -450,11 +542,131 @@ public:
 
 };
 
-class CPUQueue final : public KalmarQueue
+/// CPUAsyncOp
+/// An operation executed asynchronously on the CPU path. Timestamps are taken
+/// from the host steady clock in nanoseconds.
+class CPUAsyncOp : public KalmarAsyncOp
 {
 public:
+  CPUAsyncOp(KalmarQueue* queue, hcCommandKind commandKind)
+      : KalmarAsyncOp(queue, commandKind), promise(), future(promise.get_future().share()),
+        begin(0), end(0) {}
+
+  std::shared_future<void>* getFuture() override { return &future; }
+
+  uint64_t getBeginTimestamp() override { return begin.load(); }
+
+  uint64_t getEndTimestamp() override { return end.load(); }
+
+  uint64_t getTimestampFrequency() override { return 1000000000L; }
+
+  bool isReady() override {
+      return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+
+  /// mark the operation as started
+  void start() { begin.store(now()); }
+
+  /// mark the operation as completed, with error if it threw an exception
+  void complete(std::exception_ptr error = nullptr) {
+      end.store(now());
+      if (error)
+          promise.set_exception(error);
+      else
+          promise.set_value();
+
+      std::vector<CompletionService::callback_fn> ready;
+      {
+          std::lock_guard<std::mutex> l(callback_lock);
+          completed = true;
+          ready.swap(callbacks);
+      }
+      for (auto& callback : ready)
+          CompletionService::post(std::move(callback));
+  }
+
+  void notifyCompletion(CompletionService::callback_fn callback) override {
+      {
+          std::lock_guard<std::mutex> l(callback_lock);
+          if (!completed) {
+              callbacks.push_back(std::move(callback));
+              return;
+          }
+      }
+      CompletionService::post(std::move(callback));
+  }
+
+private:
+  static uint64_t now() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  std::promise<void> promise;
+  std::shared_future<void> future;
+  std::atomic<uint64_t> begin;
+  std::atomic<uint64_t> end;
+
+  /// continuations posted once the operation completes
+  std::mutex callback_lock;
+  std::vector<CompletionService::callback_fn> callbacks;
+  bool completed = false;
+};
+
+/// CPUCommandStream
+/// Executes the commands of a CPU queue on a worker thread of its own, which
+/// is started when the first command is enqueued. On an execute_in_order
+/// queue a command starts once the previous one has completed; on an
+/// execute_any_order queue only markers wait for the commands before them.
+class CPUCommandStream
+{
+public:
+  /// start a command. op has to be completed, possibly later on another
+  /// thread; if the function throws, op is completed with the exception.
+  typedef std::function<void(const std::shared_ptr<CPUAsyncOp>& op)> command_fn;
+
+  CPUCommandStream(KalmarQueue* queue, execute_order order);
+  ~CPUCommandStream();
+
+  CPUCommandStream(const CPUCommandStream&) = delete;
+  CPUCommandStream& operator=(const CPUCommandStream&) = delete;
 
-  CPUQueue(KalmarDevice* pDev) : KalmarQueue(pDev) {}
+  /// enqueue a command which starts after all of deps have completed
+  std::shared_ptr<CPUAsyncOp> enqueue(hcCommandKind kind, command_fn fn,
+                                      std::vector<std::shared_ptr<KalmarAsyncOp>> deps =
+                                          std::vector<std::shared_ptr<KalmarAsyncOp>>());
+
+  /// wait for all commands enqueued so far
+  void wait();
+
+  /// number of enqueued commands which have not completed yet
+  int pending();
+
+private:
+  struct Command;
+
+  /// state shared with the worker thread, which may outlive the stream when
+  /// the last reference to the queue is dropped by a command on the worker
+  struct State;
+
+  static void worker_loop(std::shared_ptr<State> state);
+
+  std::shared_ptr<State> state;
+};
+
+/// CPUStreamQueue
+/// Queue of the CPU devices. Data movement of arrays is done with memmove on
+/// the calling thread, once rw_info has waited for the kernels accessing the
+/// array. Kernels,
+/// markers and asynchronous copies go through a CPUCommandStream.
+class CPUStreamQueue : public KalmarQueue
+{
+public:
+
+  CPUStreamQueue(KalmarDevice* pDev, execute_order order)
+      : KalmarQueue(pDev, queuing_mode_automatic, order), stream(this, order) {}
+
+  void wait(hcWaitMode mode) override { stream.wait(); }
 
   void read(void* device, void* dst, size_t count, size_t offset) override {
       if (dst != device)
@@ -478,6 +690,95 @@ public:
   void unmap(void* device, void* addr, size_t count, size_t offset, bool modify) override {}
 
   void Push(void *kernel, int idx, void* device, bool modify) override {}
+
+  int getPendingAsyncOps() override { return stream.pending(); }
+
+  bool isEmpty() override { return stream.pending() == 0; }
+
+  std::shared_ptr<KalmarAsyncOp> EnqueueMarker(memory_scope scope) override {
+      return stream.enqueue(hcCommandMarker, complete_marker);
+  }
+
+  std::shared_ptr<KalmarAsyncOp> EnqueueMarkerWithDependency(int count, std::shared_ptr<KalmarAsyncOp> *depOps, memory_scope scope) override {
+      return stream.enqueue(hcCommandMarker, complete_marker,
+                            std::vector<std::shared_ptr<KalmarAsyncOp>>(depOps, depOps + count));
+  }
+
+  std::shared_ptr<KalmarAsyncOp> EnqueueAsyncCopy(const void* src, void* dst, size_t size_bytes) override {
+      return stream.enqueue(hcMemcpyHostToHost, [=](const std::shared_ptr<CPUAsyncOp>& op) {
+          op->start();
+          memmove(dst, src, size_bytes);
+          op->complete();
+      });
+  }
+
+  std::shared_ptr<KalmarAsyncOp> EnqueueAsyncCopyExt(const void* src, void* dst, size_t size_bytes,
+                                                     hcCommandKind copyDir, const hc::AmPointerInfo &srcInfo, const hc::AmPointerInfo &dstInfo,
+                                                     const Kalmar::KalmarDevice *copyDevice) override {
+      return EnqueueAsyncCopy(src, dst, size_bytes);
+  }
+
+  void copy(const void *src, void *dst, size_t size_bytes) override {
+      stream.wait();
+      memmove(dst, src, size_bytes);
+  }
+
+  /// select the cpus, by their index in get_device_cpus(), the kernels
+  /// launched after this call run on. Commands already enqueued complete on
+  /// the previous set first.
+  bool set_cu_mask(const std::vector<bool>& cu_mask) override;
+
+  /// thread pool running the kernels launched on this queue
+  CPUThreadPool& get_pool() { return cu_pool ? *cu_pool : get_device_pool(); }
+
+  /// thread pool of the device of this queue
+  virtual CPUThreadPool& get_device_pool() { return CPUThreadPool::get_default(); }
+
+  /// cpus the compute units of the device of this queue stand for
+  virtual std::vector<int> get_device_cpus() { return usable_cpus(); }
+
+  /// enqueue a command on the stream of this queue, which starts after all
+  /// of deps have completed
+  std::shared_ptr<CPUAsyncOp> enqueue(hcCommandKind kind, CPUCommandStream::command_fn fn,
+                                      std::vector<std::shared_ptr<KalmarAsyncOp>> deps =
+                                          std::vector<std::shared_ptr<KalmarAsyncOp>>()) {
+      return stream.enqueue(kind, std::move(fn), std::move(deps));
+  }
+
+private:
+  static void complete_marker(const std::shared_ptr<CPUAsyncOp>& op) {
+      op->start();
+      op->complete();
+  }
+
+  CPUCommandStream stream;
+
+  /// pool bound to the cpus selected with set_cu_mask, only accessed by the
+  /// worker of the stream
+  std::shared_ptr<CPUThreadPool> cu_pool;
+};
+
+namespace CLAMP {
+/// enqueue a kernel accessing the buffers in bufs on queue. The kernel starts
+/// once the kernels enqueued before it on any CPU queue which access one of
+/// the buffers have completed, since the buffer pointers of a launch are
+/// swapped in and out around it.
+extern std::shared_ptr<CPUAsyncOp> push_cpu_kernel(CPUStreamQueue* queue,
+                                                   const std::vector<struct rw_info*>& bufs,
+                                                   CPUCommandStream::command_fn fn);
+
+/// wait until the kernels enqueued on the CPU queues which access buf have
+/// completed
+/// returns immediately when called from inside a CPU path kernel or from a
+/// command stream worker
+extern void wait_cpu_kernels(const struct rw_info* buf);
+} // namespace CLAMP
+
+class CPUQueue final : public CPUStreamQueue
+{
+public:
+
+  CPUQueue(KalmarDevice* pDev, execute_order order = execute_in_order) : CPUStreamQueue(pDev, order) {}
 };
 
 /// cpu accelerator
@@ -493,9 +794,12 @@ public:
     bool is_emulated() const override { return true; }
     uint32_t get_version() const override { return 0; }
 
-    std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order, queue_priority priority = priority_normal) override { return std::shared_ptr<KalmarQueue>(new CPUQueue(this)); }
+    std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order, queue_priority priority = priority_normal) override { return std::shared_ptr<KalmarQueue>(new CPUQueue(this, order)); }
     void* create(size_t count, struct rw_info* /* not used */ ) override { return kalmar_aligned_alloc(0x1000, count); }
-    void release(void* ptr, struct rw_info* /* nout used */) override { kalmar_aligned_free(ptr); }
+    void release(void* ptr, struct rw_info* rw) override {
+        CLAMP::wait_cpu_kernels(rw);
+        kalmar_aligned_free(ptr);
+    }
     void* CreateKernel(const char* fun, KalmarQueue *queue) { return nullptr; }
 };
 
@@ -602,7 +906,9 @@ static inline const std::shared_ptr<KalmarQueue> get_cpu_queue() {
 }
 
 static inline bool is_cpu_queue(const std::shared_ptr<KalmarQueue>& Queue) {
-    return Queue->getDev()->get_path() == L"cpu";
+    // compare the device rather than its path, which is built on every call
+    static const KalmarDevice* cpu_device = getContext()->getDevice(L"cpu");
+    return Queue->getDev() == cpu_device;
 }
 
 static inline void copy_helper(std::shared_ptr<KalmarQueue>& srcQueue, void* src,
@@ -766,6 +1072,14 @@ struct rw_info
              stage = curr;
     }
 
+    /// wait for the CPU path kernels accessing this buffer, before its data
+    /// is moved on the calling thread
+    void wait_cpu_kernels() const {
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+        CLAMP::wait_cpu_kernels(this);
+#endif
+    }
+
     void* get_device_pointer() {
         return devs[curr->getDev()].data;
     }
@@ -806,6 +1120,7 @@ struct rw_info
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
         if (CLAMP::in_cpu_kernel())
             return;
+        CLAMP::wait_cpu_kernels(this);
 #endif
         if (!curr) {
             /// This can only happen if array_view is constructed with size and
@@ -866,6 +1181,7 @@ struct rw_info
     void* map(size_t cnt, size_t offset, bool modify) {
         if (cnt == 0)
             cnt = count;
+        wait_cpu_kernels();
         /// This can only happen if this rw_info is constructed only with size
         /// and not accessed on any device
         if (!curr) {
@@ -896,6 +1212,7 @@ struct rw_info
     /// Write data from host source pointer to device
     /// Change state to modified, because the device has exclusive copy of data
     void write(const void* src, int cnt, int offset, bool blocking) {
+        wait_cpu_kernels();
         curr->write(devs[curr->getDev()].data, src, cnt, offset, blocking);
         dev_info& dev = devs[curr->getDev()];
         if (dev.state != modified) {
@@ -906,6 +1223,7 @@ struct rw_info
 
     /// Read data to host pointer from device
     void read(void* dst, int cnt, int offset) {
+        wait_cpu_kernels();
         curr->read(devs[curr->getDev()].data, dst, cnt, offset);
     }
 
@@ -913,6 +1231,8 @@ struct rw_info
     void copy(rw_info* other, int src_offset, int dst_offset, int cnt) {
         if (cnt == 0)
             cnt = count;
+        wait_cpu_kernels();
+        other->wait_cpu_kernels();
         if (!curr) {
             if (!other->curr)
                 return;
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <set>
+#include <vector>
 #include "kalmar_runtime.h"
 #include "kalmar_exception.h"
 
@@ -56,6 +58,18 @@ public:
     }
 };
 
+/// Collect the buffers a kernel accesses, without touching them
+class CPUBufferCollector : public FunctorBufferWalker
+{
+    std::vector<struct rw_info*> bufs;
+public:
+    void visit_buffer(struct rw_info* rw, bool modify, bool isArray) override {
+        if (std::find(std::begin(bufs), std::end(bufs), rw) == std::end(bufs))
+            bufs.push_back(rw);
+    }
+    const std::vector<struct rw_info*>& get() const { return bufs; }
+};
+
 /// Append kernel argument to kernel
 class BufferArgumentsAppender : public FunctorBufferWalker
 {
@@ -5,12 +5,20 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
 #include <cstdlib>
 #include <cassert>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <kalmar_runtime.h>
 #include <kalmar_aligned_alloc.h>
 
@@ -18,43 +26,84 @@ extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v) {}
 
 namespace Kalmar {
 
-class CPUFallbackQueue final : public KalmarQueue
-{
-public:
-
-  CPUFallbackQueue(KalmarDevice* pDev) : KalmarQueue(pDev) {}
+// memory policy mode of mbind(2), spelled out to not depend on libnuma
+#define CPU_MPOL_PREFERRED (1)
 
-  void read(void* device, void* dst, size_t count, size_t offset) override {
-      if (dst != device)
-          memmove(dst, (char*)device + offset, count);
-  }
+/// NUMA node with the cpus it contains
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
 
-  void write(void* device, const void* src, size_t count, size_t offset, bool blocking) override {
-      if (src != device)
-          memmove((char*)device + offset, src, count);
-  }
+/// read the NUMA nodes which have cpus from sysfs, empty if the system does
+/// not expose NUMA information
+static std::vector<NumaNode> read_numa_nodes() {
+    std::vector<NumaNode> nodes;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (!std::getline(online, list))
+        return nodes;
+    // only the cpus the process may run on count
+    std::vector<int> usable = usable_cpus();
+    for (int id : parse_cpu_list(list)) {
+        std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        std::string line;
+        if (!std::getline(cpulist, line))
+            continue;
+        std::vector<int> cpus;
+        for (int cpu : parse_cpu_list(line))
+            if (std::binary_search(usable.begin(), usable.end(), cpu))
+                cpus.push_back(cpu);
+        if (!cpus.empty())
+            nodes.push_back(NumaNode{id, cpus});
+    }
+    return nodes;
+}
 
-  void copy(void* src, void* dst, size_t count, size_t src_offset, size_t dst_offset, bool blocking) override {
-      if (src != dst)
-          memmove((char*)dst + dst_offset, (char*)src + src_offset, count);
-  }
+class CPUFallbackQueue final : public CPUStreamQueue
+{
+public:
 
-  void* map(void* device, size_t count, size_t offset, bool modify) override {
-      return (char*)device + offset;
-  }
+  CPUFallbackQueue(KalmarDevice* pDev, execute_order order) : CPUStreamQueue(pDev, order) {}
 
-  void unmap(void* device, void* addr, size_t count, size_t offset, bool modify) override {}
+  CPUThreadPool& get_device_pool() override;
 
-  void Push(void *kernel, int idx, void* device, bool isConst) override {}
+  std::vector<int> get_device_cpus() override;
 };
 
+/// A CPU device. On a NUMA system there is one device per node: its kernels
+/// run on workers bound to the cpus of the node, and its memory is placed on
+/// the node when it is first touched. The buffers of a node device are
+/// mappings of their own, so that the policy covers no other allocation.
 class CPUFallbackDevice final : public KalmarDevice
 {
-public:
-    CPUFallbackDevice() : KalmarDevice() {}
+    /// NUMA node of the device, -1 if the device spans the whole system
+    int node;
+    std::vector<int> cpus;
+    std::wstring path;
+
+    std::unique_ptr<CPUThreadPool> pool;
+    std::once_flag pool_flag;
+
+    /// length of the mappings of the buffers of a node device
+    std::mutex mapped_lock;
+    std::map<void*, size_t> mapped;
 
-    std::wstring get_path() const override { return L"fallback"; }
-    std::wstring get_description() const override { return L"CPU Fallback"; }
+public:
+    CPUFallbackDevice()
+        : KalmarDevice(), node(-1), cpus(usable_cpus()), path(L"fallback"), pool(), pool_flag(),
+          mapped_lock(), mapped() {}
+
+    CPUFallbackDevice(const NumaNode& numa, const std::wstring& path)
+        : KalmarDevice(), node(numa.id), cpus(numa.cpus), path(path), pool(), pool_flag(),
+          mapped_lock(), mapped() {}
+
+    std::wstring get_path() const override { return path; }
+    std::wstring get_description() const override {
+        if (node < 0)
+            return L"CPU Fallback";
+        return L"CPU Fallback (NUMA node " + std::to_wstring(node) + L")";
+    }
     size_t get_mem() const override { return 0; }
     bool is_double() const override { return true; }
     bool is_lim_double() const override { return true; }
@@ -62,23 +111,92 @@ public:
     bool is_emulated() const override { return true; }
     uint32_t get_version() const override { return 0; }
 
+    unsigned int get_compute_unit_count() override { return cpus.size(); }
+
+    /// cpus of the device, one per compute unit
+    const std::vector<int>& get_cpus() const { return cpus; }
+
     void* create(size_t count, struct rw_info* /* not used */) override {
-        return kalmar_aligned_alloc(0x1000, count);
+        if (node < 0)
+            return kalmar_aligned_alloc(0x1000, count);
+
+        // whole pages nobody has touched yet, so that all of them are placed
+        // by the policy
+        const size_t page = sysconf(_SC_PAGESIZE);
+        size_t length = std::max<size_t>((count + page - 1) / page * page, page);
+        void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            return nullptr;
+
+        // prefer the node of the device; the policy is a hint, the
+        // allocation stands if it cannot be set
+        const size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(node / bits + 1, 0);
+        mask[node / bits] = 1UL << (node % bits);
+        syscall(SYS_mbind, ptr, length, CPU_MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, 0);
+
+        std::lock_guard<std::mutex> l(mapped_lock);
+        mapped[ptr] = length;
+        return ptr;
     }
-    void release(void *device, struct rw_info* /* not used */ ) override { 
-        kalmar_aligned_free(device);
+    void release(void *device, struct rw_info* rw) override {
+        CLAMP::wait_cpu_kernels(rw);
+        if (node < 0) {
+            kalmar_aligned_free(device);
+            return;
+        }
+        size_t length = 0;
+        {
+            std::lock_guard<std::mutex> l(mapped_lock);
+            auto it = mapped.find(device);
+            if (it == mapped.end())
+                return;
+            length = it->second;
+            mapped.erase(it);
+        }
+        munmap(device, length);
     }
     std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order, queue_priority priority = priority_normal) override {
-        return std::shared_ptr<KalmarQueue>(new CPUFallbackQueue(this));
+        return std::shared_ptr<KalmarQueue>(new CPUFallbackQueue(this, order));
+    }
+
+    /// thread pool of the device, created on first use
+    CPUThreadPool& get_pool() {
+        if (node < 0)
+            return CPUThreadPool::get_default();
+        std::call_once(pool_flag, [this] { pool.reset(new CPUThreadPool(cpus)); });
+        return *pool;
     }
 };
 
+CPUThreadPool& CPUFallbackQueue::get_device_pool() {
+    return static_cast<CPUFallbackDevice*>(getDev())->get_pool();
+}
+
+std::vector<int> CPUFallbackQueue::get_device_cpus() {
+    return static_cast<CPUFallbackDevice*>(getDev())->get_cpus();
+}
+
 template <typename T> inline void deleter(T* ptr) { delete ptr; }
 
 class CPUContext final : public KalmarContext
 {
 public:
-    CPUContext() { Devices.push_back(new CPUFallbackDevice); }
+    CPUContext() {
+        std::vector<NumaNode> nodes = read_numa_nodes();
+        if (nodes.size() <= 1) {
+            Devices.push_back(new CPUFallbackDevice);
+            return;
+        }
+        // the device of the first node keeps the path of the single device
+        // of a non-NUMA system, so that it is also the default one
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            std::wstring path = L"fallback";
+            if (i != 0)
+                path += std::to_wstring(nodes[i].id);
+            Devices.push_back(new CPUFallbackDevice(nodes[i], path));
+        }
+    }
     ~CPUContext() { std::for_each(std::begin(Devices), std::end(Devices), deleter<KalmarDevice>); }
 };
 
@@ -0,0 +1,270 @@
+/*
+Copyright (c) 2015-2016 Advanced Micro Devices, Inc. All rights reserved.
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANNTY OF ANY KIND, EXPRESS OR
+IMPLIED, INNCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANNY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER INN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR INN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <tuple>
+
+#include "copy_tuner.h"
+#include "hc_rt_debug.h"
+
+// samples of every algorithm taken in a bucket before the best one is used
+#define TUNER_MIN_SAMPLES (3)
+
+// a bucket tries another algorithm again once every TUNER_REPROBE_INTERVAL copies
+#define TUNER_REPROBE_INTERVAL (64)
+
+// weight of older samples in the bandwidth average: avg = (avg*(W-1) + sample) / W
+#define TUNER_AVG_WEIGHT (4)
+
+static const char *modeNames[] = { "choosebest", "pininplace", "staging", "memcpy" };
+static const char *directionNames[] = { "h2d", "d2h" };
+
+
+// Averages of the profile and of the tuners destroyed so far, by device, direction and bucket.
+// Tuners start from these, and write theirs back when destroyed.
+namespace {
+typedef std::tuple<std::string, int, int> ProfileKey;
+
+struct ProfileEntry {
+    double  _bytesPerNs[4];
+};
+
+std::mutex &profileLock()
+{
+    static std::mutex *lock = new std::mutex();
+    return *lock;
+}
+
+std::map<ProfileKey, ProfileEntry> &profile()
+{
+    static std::map<ProfileKey, ProfileEntry> *entries = new std::map<ProfileKey, ProfileEntry>();
+    return *entries;
+}
+
+std::set<CopyTuner*> &liveTuners()
+{
+    static std::set<CopyTuner*> *tuners = new std::set<CopyTuner*>();
+    return *tuners;
+}
+} // namespace
+
+
+//---
+CopyTuner::CopyTuner(const std::string &device) :
+    _device(device)
+{
+    memset(_buckets, 0, sizeof(_buckets));
+
+    std::lock_guard<std::mutex> l(profileLock());
+    for (auto &p : profile()) {
+        if (std::get<0>(p.first) != _device) {
+            continue;
+        }
+        Bucket &b = _buckets[std::get<1>(p.first)][std::get<2>(p.first)];
+        for (int m = 1; m < _numModes; m++) {
+            b._bytesPerNs[m] = p.second._bytesPerNs[m];
+            // measured before, no need to try it again right away
+            b._samples[m] = (b._bytesPerNs[m] > 0) ? TUNER_MIN_SAMPLES : 0;
+        }
+    }
+    liveTuners().insert(this);
+}
+
+
+//---
+CopyTuner::~CopyTuner()
+{
+    std::lock_guard<std::mutex> l(profileLock());
+    liveTuners().erase(this);
+    for (int dir = 0; dir < 2; dir++) {
+        for (int i = 0; i < _numBuckets; i++) {
+            const Bucket &b = _buckets[dir][i];
+            ProfileEntry e;
+            bool measured = false;
+            for (int m = 0; m < _numModes; m++) {
+                e._bytesPerNs[m] = b._bytesPerNs[m];
+                measured |= (b._bytesPerNs[m] > 0);
+            }
+            if (measured) {
+                profile()[ProfileKey(_device, dir, i)] = e;
+            }
+        }
+    }
+}
+
+
+//---
+int CopyTuner::BucketIndex(size_t sizeBytes)
+{
+    int log2 = 0;
+    while ((sizeBytes >> 1) != 0 && log2 < _maxLog2) {
+        sizeBytes >>= 1;
+        log2++;
+    }
+    return (log2 < _minLog2 ? _minLog2 : log2) - _minLog2;
+}
+
+
+//---
+UnpinnedCopyEngine::CopyMode CopyTuner::Choose(Direction dir, size_t sizeBytes, bool canMemcpy, bool canPinInPlace)
+{
+    UnpinnedCopyEngine::CopyMode candidates[3] = { UnpinnedCopyEngine::UseStaging };
+    int numCandidates = 1;
+    if (canPinInPlace) {
+        candidates[numCandidates++] = UnpinnedCopyEngine::UsePinInPlace;
+    }
+    if (dir == HostToDevice && canMemcpy) {
+        candidates[numCandidates++] = UnpinnedCopyEngine::UseMemcpy;
+    }
+    if (numCandidates == 1) {
+        return candidates[0];
+    }
+
+    std::lock_guard<std::mutex> l(_lock);
+    Bucket &b = _buckets[dir][BucketIndex(sizeBytes)];
+    uint64_t copy = b._copies++;
+
+    // Try every algorithm a few times first.
+    for (int i = 0; i < numCandidates; i++) {
+        if (b._samples[candidates[i]] < TUNER_MIN_SAMPLES) {
+            return candidates[i];
+        }
+    }
+
+    int best = 0;
+    for (int i = 1; i < numCandidates; i++) {
+        if (b._bytesPerNs[candidates[i]] > b._bytesPerNs[candidates[best]]) {
+            best = i;
+        }
+    }
+
+    // Now and then try the others again, one after the other.
+    if (copy % TUNER_REPROBE_INTERVAL == TUNER_REPROBE_INTERVAL - 1) {
+        int other = (best + 1 + (copy / TUNER_REPROBE_INTERVAL) % (numCandidates - 1)) % numCandidates;
+        return candidates[other];
+    }
+    return candidates[best];
+}
+
+
+//---
+void CopyTuner::Record(Direction dir, size_t sizeBytes, UnpinnedCopyEngine::CopyMode mode, uint64_t elapsedNs)
+{
+    if (mode <= UnpinnedCopyEngine::ChooseBest || mode >= _numModes) {
+        return;
+    }
+    double sample = double(sizeBytes) / double(elapsedNs ? elapsedNs : 1);
+
+    std::lock_guard<std::mutex> l(_lock);
+    Bucket &b = _buckets[dir][BucketIndex(sizeBytes)];
+    if (b._samples[mode] == 0 || b._bytesPerNs[mode] == 0) {
+        b._bytesPerNs[mode] = sample;
+    } else {
+        b._bytesPerNs[mode] = (b._bytesPerNs[mode] * (TUNER_AVG_WEIGHT - 1) + sample) / TUNER_AVG_WEIGHT;
+    }
+    b._samples[mode]++;
+
+    DBOUTL(DB_COPY2, "CopyTuner " << _device << " " << directionNames[dir] << " bucket " << BucketIndex(sizeBytes) + _minLog2
+                     << ": " << modeNames[mode] << " " << sample << " GB/s, average " << b._bytesPerNs[mode] << " GB/s");
+}
+
+
+//---
+bool CopyTuner::LoadProfile(const char *fileName)
+{
+    std::ifstream in(fileName);
+    if (!in) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> l(profileLock());
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string device, direction, bestName;
+        int log2;
+        ProfileEntry e;
+        memset(&e, 0, sizeof(e));
+        if (!(fields >> device >> direction >> log2 >> bestName >> e._bytesPerNs[UnpinnedCopyEngine::UseStaging]
+                     >> e._bytesPerNs[UnpinnedCopyEngine::UsePinInPlace] >> e._bytesPerNs[UnpinnedCopyEngine::UseMemcpy])) {
+            continue;
+        }
+        int dir = (direction == directionNames[HostToDevice]) ? HostToDevice :
+                  (direction == directionNames[DeviceToHost]) ? DeviceToHost : -1;
+        if (dir < 0 || log2 < _minLog2 || log2 > _maxLog2) {
+            continue;
+        }
+        profile()[ProfileKey(device, dir, log2 - _minLog2)] = e;
+    }
+    return true;
+}
+
+
+//---
+bool CopyTuner::SaveProfile(const char *fileName)
+{
+    // tuners still alive write theirs to the profile first
+    std::map<ProfileKey, ProfileEntry> entries;
+    {
+        std::lock_guard<std::mutex> l(profileLock());
+        entries = profile();
+        for (CopyTuner *tuner : liveTuners()) {
+            std::lock_guard<std::mutex> tl(tuner->_lock);
+            for (int dir = 0; dir < 2; dir++) {
+                for (int i = 0; i < _numBuckets; i++) {
+                    const Bucket &b = tuner->_buckets[dir][i];
+                    if (b._copies == 0) {
+                        continue;
+                    }
+                    ProfileEntry e;
+                    for (int m = 0; m < _numModes; m++) {
+                        e._bytesPerNs[m] = b._bytesPerNs[m];
+                    }
+                    entries[ProfileKey(tuner->_device, dir, i)] = e;
+                }
+            }
+        }
+    }
+
+    std::ofstream out(fileName, std::ios::out | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    out << "# HCC unpinned copy profile: device direction log2(size) best GB/s(staging) GB/s(pininplace) GB/s(memcpy)\n";
+    for (auto &p : entries) {
+        const double *bw = p.second._bytesPerNs;
+        int best = UnpinnedCopyEngine::UseStaging;
+        for (int m = UnpinnedCopyEngine::UsePinInPlace; m < _numModes; m++) {
+            if (bw[m] > bw[best]) {
+                best = m;
+            }
+        }
+        out << std::get<0>(p.first) << " " << directionNames[std::get<1>(p.first)] << " " << std::get<2>(p.first) + _minLog2
+            << " " << modeNames[best] << " " << bw[UnpinnedCopyEngine::UseStaging] << " "
+            << bw[UnpinnedCopyEngine::UsePinInPlace] << " " << bw[UnpinnedCopyEngine::UseMemcpy] << "\n";
+    }
+    return bool(out);
+}
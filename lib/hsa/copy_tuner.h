@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2015-2016 Advanced Micro Devices, Inc. All rights reserved.
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANNTY OF ANY KIND, EXPRESS OR
+IMPLIED, INNCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANNY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER INN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR INN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef COPY_TUNER_H
+#define COPY_TUNER_H
+
+#include "unpinned_copy_engine.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+
+//-------------------------------------------------------------------------------------------------
+// Online selection of the unpinned copy algorithm for the ChooseBest mode.  The copies are sorted
+// into power-of-two size buckets per direction.  Every algorithm is tried a few times in a bucket,
+// after which the bucket uses the one with the best average bandwidth, and every so often tries
+// one of the others again in case the machine behaves differently by now.
+//
+// The averages of all tuners can be written to a profile file when the process exits, and read
+// back by the next process, which then starts from the crossover points learned before instead of
+// trying every algorithm again.  Profile lines look like:
+//     <device> <h2d|d2h> <log2 of bucket size> <best algorithm> <GB/s staging> <GB/s pininplace> <GB/s memcpy>
+// where 0 means the algorithm was not measured.
+class CopyTuner {
+public:
+    enum Direction { HostToDevice=0, DeviceToHost=1 };
+
+    // device names the tuner in the profile.
+    CopyTuner(const std::string &device);
+    ~CopyTuner();
+
+    // Pick the algorithm of a copy of sizeBytes.  Memcpy is a candidate for host-to-device copies if
+    // canMemcpy, pin-in-place if canPinInPlace; staging always is.
+    UnpinnedCopyEngine::CopyMode Choose(Direction dir, size_t sizeBytes, bool canMemcpy, bool canPinInPlace);
+
+    // Account a copy of sizeBytes which took elapsedNs with the given algorithm.
+    void Record(Direction dir, size_t sizeBytes, UnpinnedCopyEngine::CopyMode mode, uint64_t elapsedNs);
+
+    // Read the profile, for the tuners created from now on.  Returns false if it cannot be read.
+    static bool LoadProfile(const char *fileName);
+
+    // Write the averages of every tuner, dead or alive, to the profile.
+    static bool SaveProfile(const char *fileName);
+
+private:
+    static const int _minLog2 = 12;   // first bucket, 4KB and smaller
+    static const int _maxLog2 = 32;   // last bucket, 4GB and larger
+    static const int _numBuckets = _maxLog2 - _minLog2 + 1;
+    static const int _numModes = 4;   // indexed by UnpinnedCopyEngine::CopyMode, ChooseBest unused
+
+    struct Bucket {
+        double    _bytesPerNs[_numModes];  // moving average of the bandwidth, 0 until measured
+        int       _samples[_numModes];
+        uint64_t  _copies;                 // copies chosen in the bucket
+    };
+
+    static int BucketIndex(size_t sizeBytes);
+
+    std::string  _device;
+    std::mutex   _lock;
+    Bucket       _buckets[2][_numBuckets];
+};
+
+#endif
@@ -2,13 +2,19 @@
 #include "hc.hpp"
 #include "hc_am.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdlib>
 #include <mutex>
 #include <cstdint>
 #include <iomanip>
+#include <limits>
 #include <hsa/hsa.h>
 #include <hsa/hsa_ext_amd.h>
 
+#include "pinned_range_cache.h"
+
 #define DB_TRACKER 0
 
 #if DB_TRACKER 
@@ -24,6 +30,9 @@
 //=========================================================================================================
 #include <map>
 #include <iostream>
+#include <iterator>
+#include <tuple>
+#include <vector>
 
 namespace hc {
 AmPointerInfo & AmPointerInfo::operator= (const AmPointerInfo &other) 
@@ -122,37 +131,697 @@ std::ostream &operator<<(std::ostream &os, const hc::AmPointerInfo &ap)
     return os;
 }
 
+//=========================================================================================================
+// Caching allocator:
+//=========================================================================================================
+// Opt-in with HCC_AM_CACHE_SIZE=<MB>, the most free memory each allocator keeps.  am_alloc then
+// takes blocks from an allocator per (agent, pool, flags) instead of the HSA runtime, and am_free
+// returns them there.  Small blocks are carved out of slabs, one set of slabs per power-of-two size
+// class.  Larger blocks are whole pool allocations, kept on a free list once freed and handed out
+// again to the smallest request they fit well.
+//
+// Every block handed out is tracked on its own in g_amPointerTracker; the slabs and the free
+// blocks are not tracked at all.
+//
+// Peers are given access to whole pool allocations.  Host slabs are mapped to all peers when they
+// are allocated, as all host memory is.  A device block of a slab cannot be mapped to peers on its
+// own without exposing the other blocks of the slab, so am_map_to_peers refuses it; a large device
+// block is mapped alone, and freed back to the pool rather than cached once it has been.
+
+// smallest and largest size class of the slab-allocated blocks
+#define AM_CACHE_MIN_CLASS_LOG2 (8)
+#define AM_CACHE_MAX_CLASS_LOG2 (16)
+
+// size of the slabs small blocks are carved out of
+#define AM_CACHE_SLAB_SIZE (2 * 1024 * 1024)
+
+// a free large block serves requests down to 1/AM_CACHE_LARGE_FIT of its size
+#define AM_CACHE_LARGE_FIT (2)
+
+// large blocks are allocated in multiples of this
+#define AM_CACHE_LARGE_GRANULE (4096)
+
+// Let the peers access a pool allocation.  With an owner, the owner itself is skipped.
+static am_status_t allow_peer_access(void* ptr, hsa_amd_memory_pool_t* pool, const hc::accelerator* owner,
+                                     std::size_t num_peer, const hc::accelerator* peers);
+
+class AmBlockCache {
+public:
+    AmBlockCache() : _budget(0) {
+        char *env = getenv("HCC_AM_CACHE_SIZE");
+        if (env) {
+            _budget = static_cast<std::size_t>(strtol(env, nullptr, 0)) * 1024 * 1024;
+        }
+    }
+
+    bool enabled() const { return _budget != 0; }
+
+    void *allocate(hc::accelerator &acc, hsa_amd_memory_pool_t pool, unsigned flags, std::size_t sizeBytes);
+
+    // Take back a block handed out by allocate.  Returns false if ptr is not such a block.
+    bool release(void *ptr);
+
+    // True if ptr is a block handed out by allocate.
+    bool owns(void *ptr);
+
+    // Start of the pool allocation holding a block, or ptr if ptr is not a block.
+    void *backing(void *ptr);
+
+    // Pool allocation to map to peers for the block at ptr, or ptr if ptr is not a block.  A large
+    // block is not cached any more once mapped.  Null for a device block of a slab, which cannot be
+    // mapped on its own.
+    void *peerMappable(void *ptr);
+
+    // Free cached memory of acc until at most keepBytes are left per allocator.  Returns the bytes freed.
+    std::size_t trim(const hc::accelerator &acc, std::size_t keepBytes);
+
+    // Free all memory of acc, blocks in use included.
+    void reset(const hc::accelerator &acc);
+
+    void sizeinfo(const hc::accelerator &acc, std::size_t *cachedDeviceMemSize, std::size_t *cachedHostMemSize);
+
+private:
+    struct Slab {
+        char               *_base;
+        std::size_t         _blockSize;
+        int                 _used;
+        std::vector<char*>  _free;
+    };
+
+    struct Allocator {
+        hc::accelerator                     _acc;
+        hsa_amd_memory_pool_t               _pool;
+        unsigned                            _flags;
+        std::vector<Slab*>                  _slabs[AM_CACHE_MAX_CLASS_LOG2 - AM_CACHE_MIN_CLASS_LOG2 + 1];
+        std::multimap<std::size_t, char*>   _freeLarge;      // by size
+        std::size_t                         _reservedBytes;  // allocated from the pool
+        std::size_t                         _inUseBytes;     // of the blocks handed out
+
+        std::size_t cachedBytes() const { return _reservedBytes - _inUseBytes; }
+    };
+
+    struct Block {
+        Allocator   *_allocator;
+        Slab        *_slab;       // null for large blocks
+        std::size_t  _size;
+        bool         _peerMapped; // by am_map_to_peers, large blocks only
+    };
+
+    typedef std::tuple<uint64_t, uint64_t, unsigned> AllocatorKey;
+
+    // Requires _lock.
+    char *poolAllocate(Allocator *a, std::size_t sizeBytes);
+    void poolFree(Allocator *a, char *ptr, std::size_t sizeBytes);
+    std::size_t trimAllocator(Allocator *a, std::size_t keepBytes);
+
+    std::mutex                           _lock;
+    std::map<AllocatorKey, Allocator*>   _allocators;
+    std::map<char*, Block>               _blocks;   // blocks handed out, by address
+    std::size_t                          _budget;
+};
+
+
+//---
+char *AmBlockCache::poolAllocate(Allocator *a, std::size_t sizeBytes)
+{
+    void *ptr = nullptr;
+    hsa_status_t status = hsa_amd_memory_pool_allocate(a->_pool, sizeBytes, 0, &ptr);
+    if (status != HSA_STATUS_SUCCESS) {
+        // the cached memory may be what is missing
+        trimAllocator(a, 0);
+        status = hsa_amd_memory_pool_allocate(a->_pool, sizeBytes, 0, &ptr);
+        if (status != HSA_STATUS_SUCCESS) {
+            return nullptr;
+        }
+    }
+    if (a->_flags & (amHostPinned | amHostCoherent)) {
+        // Host memory is always mapped to all possible peers:
+        auto accs = hc::accelerator::get_all();
+        hsa_amd_memory_pool_t *systemPool = static_cast<hsa_amd_memory_pool_t*>(a->_acc.get_hsa_am_system_region());
+        if (allow_peer_access(ptr, systemPool, nullptr, accs.size(), accs.data()) != AM_SUCCESS) {
+            hsa_amd_memory_pool_free(ptr);
+            return nullptr;
+        }
+    }
+    a->_reservedBytes += sizeBytes;
+    return static_cast<char*>(ptr);
+}
+
+
+//---
+void AmBlockCache::poolFree(Allocator *a, char *ptr, std::size_t sizeBytes)
+{
+    hsa_amd_memory_pool_free(ptr);
+    a->_reservedBytes -= sizeBytes;
+}
+
+
+//---
+void *AmBlockCache::allocate(hc::accelerator &acc, hsa_amd_memory_pool_t pool, unsigned flags, std::size_t sizeBytes)
+{
+    hsa_agent_t *agent = static_cast<hsa_agent_t*>(acc.get_hsa_agent());
+
+    std::lock_guard<std::mutex> l(_lock);
+    Allocator *&a = _allocators[AllocatorKey(agent->handle, pool.handle, flags)];
+    if (a == nullptr) {
+        a = new Allocator();
+        a->_acc = acc;
+        a->_pool = pool;
+        a->_flags = flags;
+        a->_reservedBytes = 0;
+        a->_inUseBytes = 0;
+    }
+
+    char *ptr = nullptr;
+    Block block { a, nullptr, 0, false };
+    if (sizeBytes <= (std::size_t(1) << AM_CACHE_MAX_CLASS_LOG2)) {
+        int sizeClass = AM_CACHE_MIN_CLASS_LOG2;
+        while ((std::size_t(1) << sizeClass) < sizeBytes) {
+            sizeClass++;
+        }
+        std::vector<Slab*> &slabs = a->_slabs[sizeClass - AM_CACHE_MIN_CLASS_LOG2];
+        Slab *slab = nullptr;
+        for (Slab *s : slabs) {
+            if (!s->_free.empty()) {
+                slab = s;
+                break;
+            }
+        }
+        if (slab == nullptr) {
+            char *base = poolAllocate(a, AM_CACHE_SLAB_SIZE);
+            if (base == nullptr) {
+                return nullptr;
+            }
+            slab = new Slab { base, std::size_t(1) << sizeClass, 0, {} };
+            for (std::size_t offset = AM_CACHE_SLAB_SIZE; offset >= slab->_blockSize; offset -= slab->_blockSize) {
+                slab->_free.push_back(base + offset - slab->_blockSize);
+            }
+            slabs.push_back(slab);
+        }
+        ptr = slab->_free.back();
+        slab->_free.pop_back();
+        slab->_used++;
+        block._slab = slab;
+        block._size = slab->_blockSize;
+    } else {
+        // best fit among the free large blocks, if it is not too large
+        auto fit = a->_freeLarge.lower_bound(sizeBytes);
+        if (fit != a->_freeLarge.end() && fit->first <= sizeBytes * AM_CACHE_LARGE_FIT) {
+            ptr = fit->second;
+            block._size = fit->first;
+            a->_freeLarge.erase(fit);
+        } else {
+            block._size = (sizeBytes + AM_CACHE_LARGE_GRANULE - 1) & ~std::size_t(AM_CACHE_LARGE_GRANULE - 1);
+            ptr = poolAllocate(a, block._size);
+            if (ptr == nullptr) {
+                return nullptr;
+            }
+        }
+    }
+
+    a->_inUseBytes += block._size;
+    _blocks[ptr] = block;
+    return ptr;
+}
+
+
+//---
+bool AmBlockCache::release(void *ptr)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    auto b = _blocks.find(static_cast<char*>(ptr));
+    if (b == _blocks.end()) {
+        return false;
+    }
+    Block block = b->second;
+    _blocks.erase(b);
+
+    Allocator *a = block._allocator;
+    a->_inUseBytes -= block._size;
+    if (block._slab) {
+        Slab *slab = block._slab;
+        slab->_free.push_back(static_cast<char*>(ptr));
+        if (--slab->_used == 0 && a->cachedBytes() > _budget) {
+            trimAllocator(a, _budget);
+        }
+    } else if (block._peerMapped || a->cachedBytes() > _budget) {
+        // the next user of a block mapped to peers would be exposed to them
+        poolFree(a, static_cast<char*>(ptr), block._size);
+    } else {
+        a->_freeLarge.insert(std::make_pair(block._size, static_cast<char*>(ptr)));
+    }
+    return true;
+}
+
+
+//---
+bool AmBlockCache::owns(void *ptr)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    return _blocks.find(static_cast<char*>(ptr)) != _blocks.end();
+}
+
+
+//---
+void *AmBlockCache::backing(void *ptr)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    auto b = _blocks.find(static_cast<char*>(ptr));
+    if (b == _blocks.end() || b->second._slab == nullptr) {
+        return ptr;
+    }
+    return b->second._slab->_base;
+}
+
+
+//---
+void *AmBlockCache::peerMappable(void *ptr)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    auto b = _blocks.find(static_cast<char*>(ptr));
+    if (b == _blocks.end()) {
+        return ptr;
+    }
+    Block &block = b->second;
+    if (block._slab == nullptr) {
+        block._peerMapped = true;
+        return ptr;
+    }
+    if (block._allocator->_flags & (amHostPinned | amHostCoherent)) {
+        // already mapped to all peers, like every other host allocation
+        return block._slab->_base;
+    }
+    return nullptr;
+}
+
+
+//---
+std::size_t AmBlockCache::trimAllocator(Allocator *a, std::size_t keepBytes)
+{
+    std::size_t freed = 0;
+
+    // largest free blocks first
+    while (a->cachedBytes() > keepBytes && !a->_freeLarge.empty()) {
+        auto largest = std::prev(a->_freeLarge.end());
+        poolFree(a, largest->second, largest->first);
+        freed += largest->first;
+        a->_freeLarge.erase(largest);
+    }
+
+    for (auto &slabs : a->_slabs) {
+        for (auto s = slabs.begin(); s != slabs.end() && a->cachedBytes() > keepBytes; ) {
+            if ((*s)->_used == 0) {
+                poolFree(a, (*s)->_base, AM_CACHE_SLAB_SIZE);
+                freed += AM_CACHE_SLAB_SIZE;
+                delete *s;
+                s = slabs.erase(s);
+            } else {
+                ++s;
+            }
+        }
+    }
+    return freed;
+}
+
+
+//---
+std::size_t AmBlockCache::trim(const hc::accelerator &acc, std::size_t keepBytes)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    std::size_t freed = 0;
+    for (auto &p : _allocators) {
+        if (p.second->_acc == acc) {
+            freed += trimAllocator(p.second, keepBytes);
+        }
+    }
+    return freed;
+}
+
+
+//---
+void AmBlockCache::reset(const hc::accelerator &acc)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    for (auto b = _blocks.begin(); b != _blocks.end(); ) {
+        if (b->second._allocator->_acc == acc) {
+            Allocator *a = b->second._allocator;
+            a->_inUseBytes -= b->second._size;
+            if (b->second._slab) {
+                b->second._slab->_used--;
+            } else {
+                poolFree(a, b->first, b->second._size);
+            }
+            b = _blocks.erase(b);
+        } else {
+            ++b;
+        }
+    }
+    for (auto p = _allocators.begin(); p != _allocators.end(); ) {
+        if (p->second->_acc == acc) {
+            trimAllocator(p->second, 0);
+            delete p->second;
+            p = _allocators.erase(p);
+        } else {
+            ++p;
+        }
+    }
+}
+
+
+//---
+void AmBlockCache::sizeinfo(const hc::accelerator &acc, std::size_t *cachedDeviceMemSize, std::size_t *cachedHostMemSize)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    for (auto &p : _allocators) {
+        if (p.second->_acc != acc) {
+            continue;
+        }
+        if (p.second->_flags & (amHostPinned | amHostCoherent)) {
+            *cachedHostMemSize += p.second->cachedBytes();
+        } else {
+            *cachedDeviceMemSize += p.second->cachedBytes();
+        }
+    }
+}
+
+AmBlockCache g_amBlockCache;  // Sub-allocator of am_alloc, if enabled.
+
+
+//---
+static am_status_t allow_peer_access(void* ptr, hsa_amd_memory_pool_t* pool, const hc::accelerator* owner,
+                                     std::size_t num_peer, const hc::accelerator* peers)
+{
+    std::vector<hsa_agent_t> agents{hc::accelerator::get_all().size()};
+
+    int peer_count = 0;
+
+    for (auto i = 0; i < num_peer; i++) {
+        // device memory is always accessible to the accelerator it is on
+        auto& a = peers[i];
+        if (owner && a == *owner)
+            continue;
+
+        hsa_agent_t* agent = static_cast<hsa_agent_t*>(a.get_hsa_agent());
+
+        if (!agent) {
+          continue;
+        }
+
+        hsa_amd_memory_pool_access_t access;
+        hsa_status_t  status = hsa_amd_agent_memory_pool_get_info(*agent, *pool, HSA_AMD_AGENT_MEMORY_POOL_INFO_ACCESS, &access);
+        if (HSA_STATUS_SUCCESS != status)
+            return AM_ERROR_MISC;
+
+        // check access
+        if(HSA_AMD_MEMORY_POOL_ACCESS_NEVER_ALLOWED == access)
+            return AM_ERROR_MISC;
+
+        bool add_agent = true;
+
+        for (int ii = 0; ii < peer_count; ii++) {
+            if (agent->handle == agents[ii].handle)
+                add_agent = false;
+        }
+
+        if (add_agent) {
+            agents[peer_count] = *agent;
+            peer_count++;
+        }
+    }
+
+    // allow access to the agents
+    if (peer_count) {
+        hsa_status_t status = hsa_amd_agents_allow_access(peer_count, agents.data(), NULL, ptr);
+        if (status != HSA_STATUS_SUCCESS) {
+            return AM_ERROR_MISC;
+        }
+    }
+    return AM_SUCCESS;
+}
+
+
+// most threads looking up pointers without a lock at the same time, the others take the writer lock
+#define AM_TRACKER_READER_SLOTS (64)
+
+// entries of a chunk of the tracker's array.  A chunk is split when it grows to twice as many, and
+// merged into the next one when it shrinks below a quarter.
+#define AM_TRACKER_CHUNK_ENTRIES (128)
+
 //-------------------------------------------------------------------------------------------------
 // This structure tracks information for each pointer.
 // Uses memory-range-based lookups - so pointers that exist anywhere in the range of hostPtr + size 
 // will find the associated AmPointerInfo.
-// The insertions and lookups use a self-balancing binary tree and should support O(logN) lookup speed.
-// The structure is thread-safe - writers obtain a mutex before modifying the tree.  Multiple simulatenous readers are supported.
+// The ranges are kept in an array sorted by address and cut in chunks.  Lookups binary-search the
+// last range of every chunk and then the chunk, in O(logN) without taking a lock.  Writers obtain a
+// mutex, copy the chunk they change and the array of chunk pointers, and publish the copy; the
+// arrays, chunks and infos replaced are freed once no reader can still be looking at them.
+// Each reader announces the epoch it started in in a slot of its own, and a replaced array is kept
+// until every reader announced has started after it was replaced.
 class AmPointerTracker {
-typedef std::map<AmMemoryRange, hc::AmPointerInfo, AmMemoryRangeCompare> MapTrackerType;
 public:
+    struct Entry {
+        AmMemoryRange               _range;
+        const hc::AmPointerInfo    *_info;
+    };
+
+    AmPointerTracker();
+    ~AmPointerTracker();
 
     void insert(void *pointer, hc::AmPointerInfo &p);
     int remove(void *pointer);
 
-    MapTrackerType::iterator find(const void *hostPtr) ;
-    
-    MapTrackerType::iterator readerLockBegin() { _mutex.lock(); return _tracker.begin(); } ;
-    MapTrackerType::iterator end() { return _tracker.end(); } ;
-    void readerUnlock() { _mutex.unlock(); };
+    // Copy the info of the range holding pointer to info.  Returns false if there is none.
+    bool find(const void *pointer, hc::AmPointerInfo *info);
+
+    // Set the app fields of the range holding pointer.  Returns 1 if updated or 0 if not found.
+    int update(const void *pointer, int appId, unsigned allocationFlags, void *appPtr);
 
+    // Call f on every entry, in address order, with the writers held off.
+    template <typename F>
+    void forEach(F f) {
+        std::lock_guard<std::mutex> l (_mutex);
+        for (const Chunk *c : _current.load(std::memory_order_relaxed)->_chunks) {
+            for (const Entry &e : *c) {
+                f(e);
+            }
+        }
+    };
 
     std::size_t reset (const hc::accelerator &acc);
     void update_peers (const hc::accelerator &acc, int peerCnt, hsa_agent_t *peerAgents) ;
 
 private:
-    MapTrackerType  _tracker;
-    std::mutex      _mutex;
-    //std::shared_timed_mutex _mut;
-    uint64_t        _allocSeqNum = 0;
+    // Consecutive entries of the array.  A published chunk is never changed, writers replace it.
+    typedef std::vector<Entry> Chunk;
+
+    struct Snapshot {
+        std::vector<const Chunk*>   _chunks;    // in address order, none empty
+        std::vector<AmMemoryRange>  _lasts;     // range of the last entry of each chunk
+    };
+
+    struct Retired {
+        uint64_t                                _epoch;     // last epoch the snapshot was current in
+        Snapshot                               *_snapshot;
+        std::vector<const Chunk*>               _chunks;    // replaced in its successor
+        std::vector<const hc::AmPointerInfo*>   _infos;     // dropped from it by its successor
+    };
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t>   _epoch;   // epoch of the lookup in progress, 0 if none
+        std::atomic<bool>       _taken;   // by a thread
+    };
+
+    ReaderSlot *readerSlot();
+
+    // Index of the chunk a range belongs in: the first one whose last range is not below it, or the
+    // number of chunks if there is none.
+    static std::size_t chunkIndex(const Snapshot &s, const AmMemoryRange &range);
+    static const Entry *lookup(const Snapshot &s, const void *pointer, std::size_t *chunk = nullptr);
+
+    // Require _mutex.
+    // Publish the current snapshot with chunks [first, last) replaced by the non-empty ones of chunks.
+    void replace(std::size_t first, std::size_t last, std::vector<Chunk*> chunks,
+                 std::vector<const hc::AmPointerInfo*> dropped);
+    void publish(Snapshot *next, std::vector<const Chunk*> replaced, std::vector<const hc::AmPointerInfo*> dropped);
+    void reclaim();
+
+    std::atomic<Snapshot*>  _current;
+    std::atomic<uint64_t>   _epoch;
+    ReaderSlot              _readers[AM_TRACKER_READER_SLOTS];
+
+    std::mutex              _mutex;
+    std::vector<Retired>    _retired;
+    uint64_t                _allocSeqNum = 0;
 };
 
 
+//---
+AmPointerTracker::AmPointerTracker() :
+    _current(new Snapshot()),
+    _epoch(1)
+{
+    for (ReaderSlot &r : _readers) {
+        r._epoch.store(0);
+        r._taken.store(false);
+    }
+}
+
+
+//---
+AmPointerTracker::~AmPointerTracker()
+{
+    Snapshot *s = _current.load();
+    for (const Chunk *c : s->_chunks) {
+        for (const Entry &e : *c) {
+            delete e._info;
+        }
+        delete c;
+    }
+    delete s;
+    for (Retired &r : _retired) {
+        for (const hc::AmPointerInfo *info : r._infos) {
+            delete info;
+        }
+        for (const Chunk *c : r._chunks) {
+            delete c;
+        }
+        delete r._snapshot;
+    }
+}
+
+
+//---
+// Slot of the calling thread, claimed on its first lookup and given back when it exits.  Null if all
+// slots are taken.
+AmPointerTracker::ReaderSlot *AmPointerTracker::readerSlot()
+{
+    struct Claim {
+        AmPointerTracker   *_tracker = nullptr;
+        ReaderSlot         *_slot = nullptr;
+        ~Claim() {
+            if (_slot) {
+                _slot->_taken.store(false, std::memory_order_release);
+            }
+        }
+    };
+    static thread_local Claim claim;
+
+    if (claim._slot) {
+        return (claim._tracker == this) ? claim._slot : nullptr;
+    }
+    for (ReaderSlot &r : _readers) {
+        bool taken = false;
+        if (!r._taken.load(std::memory_order_relaxed) && r._taken.compare_exchange_strong(taken, true)) {
+            claim._tracker = this;
+            claim._slot = &r;
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+
+//---
+std::size_t AmPointerTracker::chunkIndex(const Snapshot &s, const AmMemoryRange &range)
+{
+    return std::lower_bound(s._lasts.begin(), s._lasts.end(), range, AmMemoryRangeCompare()) - s._lasts.begin();
+}
+
+
+//---
+// Entry of the range holding pointer, null if there is none.  The index of its chunk is stored to chunk.
+const AmPointerTracker::Entry *AmPointerTracker::lookup(const Snapshot &s, const void *pointer, std::size_t *chunk)
+{
+    AmMemoryRange key(pointer, 1);
+    std::size_t ci = chunkIndex(s, key);
+    if (ci == s._chunks.size()) {
+        return nullptr;
+    }
+
+    // first range not entirely below pointer, there is one in the chunk
+    const Chunk &c = *s._chunks[ci];
+    auto e = std::lower_bound(c.begin(), c.end(), key, [](const Entry &lhs, const AmMemoryRange &rhs) {
+        return AmMemoryRangeCompare()(lhs._range, rhs);
+    });
+    if (AmMemoryRangeCompare()(key, e->_range)) {
+        return nullptr;
+    }
+    if (chunk) {
+        *chunk = ci;
+    }
+    return &*e;
+}
+
+
+//---
+void AmPointerTracker::replace(std::size_t first, std::size_t last, std::vector<Chunk*> chunks,
+                               std::vector<const hc::AmPointerInfo*> dropped)
+{
+    const Snapshot &s = *_current.load(std::memory_order_relaxed);
+    Snapshot *next = new Snapshot();
+    std::size_t count = s._chunks.size() - (last - first) + chunks.size();
+    next->_chunks.reserve(count);
+    next->_lasts.reserve(count);
+
+    next->_chunks.insert(next->_chunks.end(), s._chunks.begin(), s._chunks.begin() + first);
+    next->_lasts.insert(next->_lasts.end(), s._lasts.begin(), s._lasts.begin() + first);
+    for (Chunk *c : chunks) {
+        if (c->empty()) {
+            delete c;
+            continue;
+        }
+        next->_chunks.push_back(c);
+        next->_lasts.push_back(c->back()._range);
+    }
+    next->_chunks.insert(next->_chunks.end(), s._chunks.begin() + last, s._chunks.end());
+    next->_lasts.insert(next->_lasts.end(), s._lasts.begin() + last, s._lasts.end());
+
+    publish(next, std::vector<const Chunk*>(s._chunks.begin() + first, s._chunks.begin() + last), std::move(dropped));
+}
+
+
+//---
+void AmPointerTracker::publish(Snapshot *next, std::vector<const Chunk*> replaced, std::vector<const hc::AmPointerInfo*> dropped)
+{
+    Snapshot *prev = _current.exchange(next);
+    // readers which saw prev started in this epoch or before
+    _retired.push_back(Retired{ _epoch.fetch_add(1), prev, std::move(replaced), std::move(dropped) });
+    reclaim();
+}
+
+
+//---
+void AmPointerTracker::reclaim()
+{
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (ReaderSlot &r : _readers) {
+        uint64_t epoch = r._epoch.load();
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    auto keep = _retired.begin();
+    for (auto r = _retired.begin(); r != _retired.end(); ++r) {
+        if (r->_epoch < oldest) {
+            for (const hc::AmPointerInfo *info : r->_infos) {
+                delete info;
+            }
+            for (const Chunk *c : r->_chunks) {
+                delete c;
+            }
+            delete r->_snapshot;
+        } else {
+            if (keep != r) {
+                *keep = std::move(*r);
+            }
+            ++keep;
+        }
+    }
+    _retired.erase(keep, _retired.end());
+}
+
+
 //---
 void AmPointerTracker::insert (void *pointer, hc::AmPointerInfo &p)
 {
@@ -161,7 +830,41 @@ void AmPointerTracker::insert (void *pointer, hc::AmPointerInfo &p)
     p._allocSeqNum = ++ this->_allocSeqNum;
 
     mprintf ("insert: %p + %zu\n", pointer, p._sizeBytes);
-    _tracker.insert(std::make_pair(AmMemoryRange(pointer, p._sizeBytes), p));
+    const Snapshot &s = *_current.load(std::memory_order_relaxed);
+    AmMemoryRange range(pointer, p._sizeBytes);
+    std::size_t ci = chunkIndex(s, range);
+    if (ci == s._chunks.size() && ci != 0) {
+        // above all ranges, appended to the last chunk
+        --ci;
+    }
+
+    Chunk *next = new Chunk();
+    std::size_t last = ci;
+    if (ci < s._chunks.size()) {
+        const Chunk &c = *s._chunks[ci];
+        auto pos = std::lower_bound(c.begin(), c.end(), range, [](const Entry &lhs, const AmMemoryRange &rhs) {
+            return AmMemoryRangeCompare()(lhs._range, rhs);
+        });
+        // ranges overlapping one already tracked are not added
+        if (pos != c.end() && !AmMemoryRangeCompare()(range, pos->_range)) {
+            delete next;
+            return;
+        }
+        next->reserve(c.size() + 1);
+        next->insert(next->end(), c.begin(), pos);
+        next->push_back(Entry{ range, new hc::AmPointerInfo(p) });
+        next->insert(next->end(), pos, c.end());
+        last = ci + 1;
+    } else {
+        next->push_back(Entry{ range, new hc::AmPointerInfo(p) });
+    }
+
+    std::vector<Chunk*> chunks { next };
+    if (next->size() >= 2 * AM_TRACKER_CHUNK_ENTRIES) {
+        chunks.push_back(new Chunk(next->begin() + AM_TRACKER_CHUNK_ENTRIES, next->end()));
+        next->erase(next->begin() + AM_TRACKER_CHUNK_ENTRIES, next->end());
+    }
+    replace(ci, last, std::move(chunks), {});
 }
 
 
@@ -171,17 +874,77 @@ int AmPointerTracker::remove (void *pointer)
 {
     std::lock_guard<std::mutex> l (_mutex);
     mprintf ("remove: %p\n", pointer);
-    return _tracker.erase(AmMemoryRange(pointer,1));
+    const Snapshot &s = *_current.load(std::memory_order_relaxed);
+    std::size_t ci = 0;
+    const Entry *e = lookup(s, pointer, &ci);
+    if (e == nullptr) {
+        return 0;
+    }
+
+    const Chunk &c = *s._chunks[ci];
+    Chunk *next = new Chunk();
+    next->reserve(c.size() - 1);
+    next->insert(next->end(), c.data(), e);
+    next->insert(next->end(), e + 1, c.data() + c.size());
+
+    // a small chunk is merged into the next one, so that the chunks do not dwindle to single entries
+    std::size_t last = ci + 1;
+    if (next->size() < AM_TRACKER_CHUNK_ENTRIES / 4 && last < s._chunks.size() &&
+        next->size() + s._chunks[last]->size() < 2 * AM_TRACKER_CHUNK_ENTRIES) {
+        next->insert(next->end(), s._chunks[last]->begin(), s._chunks[last]->end());
+        ++last;
+    }
+    replace(ci, last, { next }, { e->_info });
+    return 1;
 }
 
 
 //---
-AmPointerTracker::MapTrackerType::iterator  AmPointerTracker::find (const void *pointer)
+bool AmPointerTracker::find (const void *pointer, hc::AmPointerInfo *info)
 {
-    std::lock_guard<std::mutex> l (_mutex);
-    auto iter = _tracker.find(AmMemoryRange(pointer,1));
     mprintf ("find: %p\n", pointer);
-    return iter;
+    ReaderSlot *slot = readerSlot();
+    if (slot == nullptr) {
+        std::lock_guard<std::mutex> l (_mutex);
+        const Entry *e = lookup(*_current.load(std::memory_order_relaxed), pointer);
+        if (e && info) {
+            *info = *e->_info;
+        }
+        return e != nullptr;
+    }
+
+    // announced before the snapshot is loaded, see publish
+    slot->_epoch.store(_epoch.load());
+    const Entry *e = lookup(*_current.load(), pointer);
+    if (e && info) {
+        *info = *e->_info;
+    }
+    slot->_epoch.store(0, std::memory_order_release);
+    return e != nullptr;
+}
+
+
+//---
+int AmPointerTracker::update (const void *pointer, int appId, unsigned allocationFlags, void *appPtr)
+{
+    std::lock_guard<std::mutex> l (_mutex);
+    const Snapshot &s = *_current.load(std::memory_order_relaxed);
+    std::size_t ci = 0;
+    const Entry *e = lookup(s, pointer, &ci);
+    if (e == nullptr) {
+        return 0;
+    }
+
+    hc::AmPointerInfo *info = new hc::AmPointerInfo(*e->_info);
+    info->_appId              = appId;
+    info->_appAllocationFlags = allocationFlags;
+    info->_appPtr             = appPtr;
+
+    const Chunk &c = *s._chunks[ci];
+    Chunk *next = new Chunk(c);
+    (*next)[e - c.data()]._info = info;
+    replace(ci, ci + 1, { next }, { e->_info });
+    return 1;
 }
 
 
@@ -193,38 +956,42 @@ std::size_t AmPointerTracker::reset (const hc::accelerator &acc)
     std::lock_guard<std::mutex> l (_mutex);
     mprintf ("reset: \n");
 
-    std::size_t count = 0;
-    // relies on C++11 (erase returns iterator)
-    for (auto iter = _tracker.begin() ; iter != _tracker.end(); ) {
-        if (iter->second._acc != acc) {
-          iter++;
-          continue;
-        }
-        if (iter->second._isAmManaged) {
-            hsa_amd_memory_pool_free(const_cast<void*> (iter->second._unalignedDevicePointer));
+    const Snapshot &s = *_current.load(std::memory_order_relaxed);
+    std::vector<Chunk*> chunks;
+    std::vector<const hc::AmPointerInfo*> dropped;
+    for (const Chunk *c : s._chunks) {
+        for (const Entry &e : *c) {
+            if (e._info->_acc != acc) {
+                if (chunks.empty() || chunks.back()->size() == AM_TRACKER_CHUNK_ENTRIES) {
+                    chunks.push_back(new Chunk());
+                    chunks.back()->reserve(AM_TRACKER_CHUNK_ENTRIES);
+                }
+                chunks.back()->push_back(e);
+                continue;
+            }
+            // blocks of the caching allocator are freed with it
+            if (e._info->_isAmManaged && !g_amBlockCache.owns(e._info->_unalignedDevicePointer)) {
+                hsa_amd_memory_pool_free(const_cast<void*> (e._info->_unalignedDevicePointer));
+            }
+            dropped.push_back(e._info);
         }
-        count++;
-        iter = _tracker.erase(iter);
     }
 
+    std::size_t count = dropped.size();
+    replace(0, s._chunks.size(), std::move(chunks), std::move(dropped));
     return count;
 }
 
 
 //---
-// Remove all tracked locations, and free the associated memory (if the range was originally allocated by AM).
-// Returns count of ranges removed.
+// Allow the peers to access all tracked locations of acc.
 void AmPointerTracker::update_peers (const hc::accelerator &acc, int peerCnt, hsa_agent_t *peerAgents) 
 {
-    std::lock_guard<std::mutex> l (_mutex);
-
-    // relies on C++11 (erase returns iterator)
-    for (auto iter = _tracker.begin() ; iter != _tracker.end(); ) {
-        if (iter->second._acc == acc) {
-            hsa_amd_agents_allow_access(peerCnt, peerAgents, NULL, const_cast<void*> (iter->first._basePointer));
+    forEach([&](const Entry &e) {
+        if (e._info->_acc == acc) {
+            hsa_amd_agents_allow_access(peerCnt, peerAgents, NULL, const_cast<void*> (e._range._basePointer));
         }
-        iter++;
-    }
+    });
 }
 
 
@@ -267,6 +1034,17 @@ auto_voidp am_aligned_alloc(std::size_t sizeBytes, hc::accelerator &acc, unsigne
         return ptr;
     }
 
+    // Blocks of the caching allocator are aligned to their size class or to a page.
+    if (g_amBlockCache.enabled() && alignment <= (1 << AM_CACHE_MIN_CLASS_LOG2)) {
+        ptr = g_amBlockCache.allocate(acc, *alloc_region, flags, sizeBytes);
+        if (ptr) {
+            bool isDevice = !(flags & (amHostPinned | amHostCoherent));
+            hc::AmPointerInfo ampi(isDevice ? NULL : ptr /*hostPointer*/, ptr /*devicePointer*/, ptr, sizeBytes, acc, isDevice, true /*isAMManaged*/);
+            g_amPointerTracker.insert(ptr, ampi);
+        }
+        return ptr;
+    }
+
     sizeBytes = alignment != 0 ? sizeBytes + alignment : sizeBytes;
     hsa_status_t s1 = hsa_amd_memory_pool_allocate(*alloc_region, sizeBytes, 0, &ptr);
     void *unalignedPtr = ptr;
@@ -309,14 +1087,16 @@ am_status_t am_free(void* ptr)
       return status;
     }
 
-    auto info = g_amPointerTracker.find(ptr);
-    if (info != g_amPointerTracker.end()) {
-        hsa_amd_memory_pool_free(info->second._unalignedDevicePointer);
-    }
+    hc::AmPointerInfo info;
+    void *unalignedPtr = g_amPointerTracker.find(ptr, &info) ? info._unalignedDevicePointer : nullptr;
     int numRemoved = g_amPointerTracker.remove(ptr) ;
     if (numRemoved == 0) {
         status = AM_ERROR_MISC;
     }
+    // untracked before it is released, the caching allocator may hand it out again right away
+    if (unalignedPtr && !g_amBlockCache.release(unalignedPtr)) {
+        hsa_amd_memory_pool_free(unalignedPtr);
+    }
     return status;
 }
 
@@ -338,13 +1118,9 @@ am_status_t am_copy(void*  dst, const void*  src, std::size_t sizeBytes)
 
 am_status_t am_memtracker_getinfo(hc::AmPointerInfo *info, const void *ptr)
 {
-    auto infoI = g_amPointerTracker.find(ptr);
-    if (infoI == g_amPointerTracker.end()) {
+    if (!g_amPointerTracker.find(ptr, info)) {
       return AM_ERROR_MISC;
     }
-    if (info) {
-       *info = infoI->second;
-    }
     return AM_SUCCESS;
 }
 
@@ -361,13 +1137,9 @@ am_status_t am_memtracker_add(void* ptr, hc::AmPointerInfo &info)
 
 am_status_t am_memtracker_update(const void* ptr, int appId, unsigned allocationFlags, void *appPtr)
 {
-    auto iter = g_amPointerTracker.find(ptr);
-    if (iter == g_amPointerTracker.end()) {
+    if (g_amPointerTracker.update(ptr, appId, allocationFlags, appPtr) == 0) {
       return AM_ERROR_MISC;
     }
-    iter->second._appId              = appId;
-    iter->second._appAllocationFlags = allocationFlags;
-    iter->second._appPtr             = appPtr;;
     return AM_SUCCESS;
 }
 
@@ -392,41 +1164,44 @@ void am_memtracker_print(void *targetAddress)
 
     uint64_t beforeD = std::numeric_limits<uint64_t>::max() ;
     uint64_t afterD =  std::numeric_limits<uint64_t>::max() ;
-    auto closestBefore = g_amPointerTracker.end();
-    auto closestAfter  = g_amPointerTracker.end();
+    // copies, the entries may be gone once forEach returns
+    hc::AmPointerInfo closestBefore;
+    hc::AmPointerInfo closestAfter;
     bool foundMatch = false;
 
 
     if (targetAddress) {
-        for (auto iter = g_amPointerTracker.readerLockBegin() ; iter != g_amPointerTracker.end(); iter++) {
-            const auto basePointer = static_cast<const char*> (iter->first._basePointer);
-            const auto endPointer = static_cast<const char*> (iter->first._endPointer);
+        g_amPointerTracker.forEach([&](const AmPointerTracker::Entry &e) {
+            const auto basePointer = static_cast<const char*> (e._range._basePointer);
+            const auto endPointer = static_cast<const char*> (e._range._endPointer);
+            if (foundMatch) {
+                return;
+            }
             if ((targetAddressP >= basePointer) && (targetAddressP < endPointer)) {
                 ptrdiff_t offset = targetAddressP - basePointer;
                 os << "db: memtracker found pointer:" << targetAddress << " offset:" << offset << " bytes inside this allocation:\n";
-                os << "   " << iter->first._basePointer << "-" << iter->first._endPointer << "::  ";
-                os << iter->second << std::endl;
+                os << "   " << e._range._basePointer << "-" << e._range._endPointer << "::  ";
+                os << *e._info << std::endl;
                 foundMatch = true;
-                break;
             } else {
                 if ((targetAddressP < basePointer) && (basePointer - targetAddressP < beforeD)) {
                     beforeD = (basePointer - targetAddressP);
-                    closestBefore = iter;
+                    closestBefore = *e._info;
                 }
                 if ((targetAddressP > endPointer) && (targetAddressP - endPointer < afterD)) {
                     afterD = (targetAddressP - endPointer);
-                    closestAfter = iter;
+                    closestAfter = *e._info;
                 }
             };
 
-        }
+        });
         if (!foundMatch) {
             os << "db: memtracker did not find pointer:" << targetAddress << ".  However, it is closest to the following allocations:\n";
-            if (closestBefore != g_amPointerTracker.end()) {
-                os << "db: closest before: " << beforeD << " bytes before base of: " << closestBefore->second << std::endl;
+            if (beforeD != std::numeric_limits<uint64_t>::max()) {
+                os << "db: closest before: " << beforeD << " bytes before base of: " << closestBefore << std::endl;
             }
-            if (closestAfter != g_amPointerTracker.end()) {
-                os << "db: closest after: " << afterD << " bytes after end of " << closestAfter->second << std::endl ;
+            if (afterD != std::numeric_limits<uint64_t>::max()) {
+                os << "db: closest after: " << afterD << " bytes after end of " << closestAfter << std::endl ;
             }
         }
     } else {
@@ -444,15 +1219,23 @@ void am_memtracker_print(void *targetAddress)
             << setw(12) << left << " Peers" << right
             << "\n";
 
-        for (auto iter = g_amPointerTracker.readerLockBegin() ; iter != g_amPointerTracker.end(); iter++) {
-            os << setw(PTRW) << iter->first._basePointer << "-" << setw(PTRW) << iter->first._endPointer << ": ";
-            printShortPointerInfo(os, iter->second);
-            printRocrPointerInfo(os, iter->first._basePointer);
+        g_amPointerTracker.forEach([&](const AmPointerTracker::Entry &e) {
+            os << setw(PTRW) << e._range._basePointer << "-" << setw(PTRW) << e._range._endPointer << ": ";
+            printShortPointerInfo(os, *e._info);
+            printRocrPointerInfo(os, e._range._basePointer);
             os << "\n";
-        }
+        });
     }
+}
 
-    g_amPointerTracker.readerUnlock();
+
+//---
+void am_memtracker_sizeinfo(const hc::accelerator &acc, std::size_t *deviceMemSize, std::size_t *hostMemSize, std::size_t *userMemSize,
+                            std::size_t *cachedDeviceMemSize, std::size_t *cachedHostMemSize)
+{
+    am_memtracker_sizeinfo(acc, deviceMemSize, hostMemSize, userMemSize);
+    *cachedDeviceMemSize = *cachedHostMemSize = 0;
+    g_amBlockCache.sizeinfo(acc, cachedDeviceMemSize, cachedHostMemSize);
 }
 
 
@@ -460,13 +1243,13 @@ void am_memtracker_print(void *targetAddress)
 void am_memtracker_sizeinfo(const hc::accelerator &acc, std::size_t *deviceMemSize, std::size_t *hostMemSize, std::size_t *userMemSize)
 {
     *deviceMemSize = *hostMemSize = *userMemSize = 0;
-    for (auto iter = g_amPointerTracker.readerLockBegin() ; iter != g_amPointerTracker.end(); iter++) {
-        if (iter->second._acc != acc) {
-          continue;
+    g_amPointerTracker.forEach([&](const AmPointerTracker::Entry &e) {
+        if (e._info->_acc != acc) {
+          return;
         }
-        std::size_t sizeBytes = iter->second._sizeBytes;
-        if (iter->second._isAmManaged) {
-            if (iter->second._isInDeviceMem) {
+        std::size_t sizeBytes = e._info->_sizeBytes;
+        if (e._info->_isAmManaged) {
+            if (e._info->_isInDeviceMem) {
                 *deviceMemSize += sizeBytes;
             } else {
                 *hostMemSize += sizeBytes;
@@ -474,16 +1257,23 @@ void am_memtracker_sizeinfo(const hc::accelerator &acc, std::size_t *deviceMemSi
         } else {
             *userMemSize += sizeBytes;
         }
-    }
-
-    g_amPointerTracker.readerUnlock();
+    });
 }
 
 
 //---
 std::size_t am_memtracker_reset(const hc::accelerator &acc)
 {
-    return g_amPointerTracker.reset(acc);
+    std::size_t count = g_amPointerTracker.reset(acc);
+    g_amBlockCache.reset(acc);
+    return count;
+}
+
+
+//---
+std::size_t am_alloc_cache_trim(const hc::accelerator &acc, std::size_t keepBytes)
+{
+    return g_amBlockCache.trim(acc, keepBytes);
 }
 
 void am_memtracker_update_peers (const hc::accelerator &acc, int peerCnt, hsa_agent_t *peerAgents) 
@@ -520,54 +1310,12 @@ am_status_t am_map_to_peers(void* ptr, std::size_t num_peer, const hc::accelerat
         pool = static_cast<hsa_amd_memory_pool_t*>(ptrAcc.get_hsa_am_system_region()); 
     }
 
-    std::vector<hsa_agent_t> agents{hc::accelerator::get_all().size()};
-
-    int peer_count = 0;
-
-    for (auto i = 0; i < num_peer; i++) {
-        // if pointer is device pointer, and the accelerator itself is included in the list, ignore it
-        auto& a = peers[i];
-        if (info._isInDeviceMem) {
-            if (a == ptrAcc)
-                continue;
-        }
-
-        hsa_agent_t* agent = static_cast<hsa_agent_t*>(a.get_hsa_agent());
-
-        if (!agent) {
-          continue;
-        }
-
-        hsa_amd_memory_pool_access_t access;
-        hsa_status_t  status = hsa_amd_agent_memory_pool_get_info(*agent, *pool, HSA_AMD_AGENT_MEMORY_POOL_INFO_ACCESS, &access);
-        if (HSA_STATUS_SUCCESS != status)
-            return AM_ERROR_MISC;
-
-        // check access
-        if(HSA_AMD_MEMORY_POOL_ACCESS_NEVER_ALLOWED == access)
-            return AM_ERROR_MISC;
-
-        bool add_agent = true;
-
-        for (int ii = 0; ii < peer_count; ii++) {
-            if (agent->handle == agents[ii].handle)
-                add_agent = false;
-        }
-
-        if (add_agent) {
-            agents[peer_count] = *agent;
-            peer_count++;
-        }
-    }
-
-    // allow access to the agents
-    if (peer_count) {
-        hsa_status_t status = hsa_amd_agents_allow_access(peer_count, agents.data(), NULL, ptr);
-        if (status != HSA_STATUS_SUCCESS) {
-            return AM_ERROR_MISC;
-        }
+    // device blocks of the caching allocator sharing a slab with others cannot be mapped alone
+    void *backing = g_amBlockCache.peerMappable(ptr);
+    if (backing == nullptr) {
+        return AM_ERROR_MISC;
     }
-    return AM_SUCCESS;
+    return allow_peer_access(backing, pool, info._isInDeviceMem ? &ptrAcc : nullptr, num_peer, peers);
 }
 
 am_status_t am_memory_host_lock(hc::accelerator &ac, void *hostPtr, std::size_t size, hc::accelerator *visible_ac, std::size_t num_visible_ac)
@@ -577,6 +1325,8 @@ am_status_t am_memory_host_lock(hc::accelerator &ac, void *hostPtr, std::size_t
     for (int i = 0; i < num_visible_ac; i++) {
         agents.push_back(*static_cast<hsa_agent_t*>(visible_ac[i].get_hsa_agent()));
     }
+    // the pages may still be locked by the pin-in-place copies
+    PinnedRangeCache::get().invalidate(hostPtr, size);
     hsa_status_t hsa_status = hsa_amd_memory_lock(hostPtr, size, &agents[0], num_visible_ac, &devPtr);
     if (hsa_status != HSA_STATUS_SUCCESS) {
         return AM_ERROR_MISC;
@@ -594,6 +1344,10 @@ am_status_t am_memory_host_unlock(hc::accelerator &ac, void *hostPtr)
     hc::AmPointerInfo amPointerInfo(NULL, NULL, NULL, 0, ac, 0, 0);
     am_status = am_memtracker_getinfo(&amPointerInfo, hostPtr);
     if (am_status != AM_SUCCESS) {
+        // not locked by am_memory_host_lock, but maybe kept locked by pin-in-place copies
+        if (PinnedRangeCache::get().invalidate(hostPtr, 1) > 0) {
+            return AM_SUCCESS;
+        }
         return am_status;
     }
     hsa_status_t hsa_status = hsa_amd_memory_unlock(hostPtr);
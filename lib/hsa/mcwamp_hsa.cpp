@@ -9,6 +9,7 @@
 #include "../hc2/headers/types/program_state.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
@@ -41,6 +42,8 @@
 
 #include "hc_am_internal.hpp"
 #include "unpinned_copy_engine.h"
+#include "copy_tuner.h"
+#include "pinned_range_cache.h"
 #include "hc_rt_debug.h"
 #include "hc_printf.hpp"
 
@@ -59,23 +62,59 @@
 // kernel dispatch speed optimization flags
 /////////////////////////////////////////////////
 
-// size of default kernarg buffer in the kernarg pool in HSAContext
-#define KERNARG_BUFFER_SIZE (512)
+// kernarg buffers in the kernarg pool of HSADevice come in size classes,
+// powers of two from KERNARG_MIN_CLASS_SIZE to KERNARG_MAX_CLASS_SIZE.
+// Larger kernargs are allocated for the dispatch and freed with it.
+#define KERNARG_MIN_CLASS_SIZE (256)
+#define KERNARG_MAX_CLASS_SIZE (8*1024)
+#define KERNARG_CLASS_COUNT (6)
 
-// number of pre-allocated kernarg buffers in HSAContext
-// Not required but typically should be greater than HCC_SIGNAL_POOL_SIZE 
-// (some kernels don't allocate signals but nearly all need kernargs)
-#define KERNARG_POOL_SIZE (1024)
+// bytes of kernarg memory each size class of the kernarg pool grows by
+// Set to 0 to allocate every kernarg buffer the ring of its queue can't hold
+#define KERNARG_POOL_SLAB_SIZE (64*1024)
+
+// alignment of kernarg buffers carved out of the kernarg ring of a queue
+#define KERNARG_RING_ALIGNMENT (64)
+
+// kernel arguments up to this many bytes are gathered inside the HSADispatch
+// before they are copied to kernarg memory, larger ones in a heap buffer
+#define KERNARG_INLINE_SIZE (256)
+
+// number of freed HSADispatch objects, and of blocks of each other size
+// allocated per launch, a thread keeps for reuse
+#define DISPATCH_CACHE_SIZE (64)
+
+// maximum number of packets of a command graph written into a queue before
+// the doorbell is rung
+#define GRAPH_RUN_MAX_PACKETS (256)
+
+// hcWaitModeHybrid waits spin for twice the moving average of the recent
+// waits on their queue, 1/HYBRID_WAIT_AVG_WEIGHT of which is the latest
+// wait. Waits longer than HCC_WAIT_SPIN_MAX_US are not worth spinning for:
+// the budget drops to HYBRID_WAIT_MIN_SPIN_NS, which still catches ops
+// that have just completed.
+#define HYBRID_WAIT_AVG_WEIGHT (8)
+#define HYBRID_WAIT_MIN_SPIN_NS (2000)
+
+
+// number of signals a thread moves between its signal cache and the global
+// free list of the signal pool at a time.  A thread caches up to twice as many.
+#define SIGNAL_CACHE_BATCH (32)
+
+// upper bound on the number of times the signal pool can grow
+#define SIGNAL_POOL_MAX_CHUNKS (4096)
 
 
 // Maximum number of inflight commands sent to a single queue.
-// If limit is exceeded, HCC will force a queue wait to reclaim
-// resources (signals, kernarg)
+// If limit is exceeded, HCC waits for the oldest command before sending
+// another one, to reclaim resources (signals, kernarg)
 // MUST be a power of 2.
 #define MAX_INFLIGHT_COMMANDS_PER_QUEUE  (2*8192)
 
-// threshold to clean up finished kernel in HSAQueue.asyncOps
-#define ASYNCOPS_VECTOR_GC_SIZE (2*8192)
+// initial capacity of the ring of inflight ops of a queue, it doubles when
+// full up to MAX_INFLIGHT_COMMANDS_PER_QUEUE
+// MUST be a power of 2.
+#define ASYNCOPS_RING_MIN_SIZE (64)
 
 
 //---
@@ -84,11 +123,16 @@ int HCC_PRINT_ENV=0;
 
 int HCC_SIGNAL_POOL_SIZE=512;
 
+// Size of the kernarg ring of each queue in KB, 0 disables the rings
+int HCC_KERNARG_RING_SIZE=256;
+
 int HCC_UNPINNED_COPY_MODE = UnpinnedCopyEngine::UseStaging;
 
 int HCC_CHECK_COPY=0;
 
 // Copy thresholds, in KB.  These are used for "choose-best" copy mode.
+// With HCC_COPY_TUNER=1 they are ignored: the tuner picks the algorithm,
+// and tries pin-in-place for all but copies of a few pages.
 long int HCC_H2D_STAGING_THRESHOLD    = 64;
 long int HCC_H2D_PININPLACE_THRESHOLD = 4096;
 long int HCC_D2H_PININPLACE_THRESHOLD = 1024;
@@ -96,6 +140,33 @@ long int HCC_D2H_PININPLACE_THRESHOLD = 1024;
 // Staging buffer size in KB for unpinned copy engines
 int HCC_STAGING_BUFFER_SIZE = 4*1024;
 
+// Number of copies an unpinned copy engine runs concurrently, each with a
+// set of staging buffers of its own
+int HCC_UNPINNED_COPY_CHANNELS = 4;
+
+// Number of threads sharing the memcpy of a chunk into or out of a staging
+// buffer, 1 to copy on the calling thread only
+int HCC_STAGING_COPY_THREADS = 4;
+
+// Use non-temporal stores for the memcpys of staging copies
+int HCC_STAGING_COPY_NONTEMPORAL = 1;
+
+// Most host memory in MB kept locked after pin-in-place copies, for later
+// copies of the same buffers. 0 unlocks it after every copy. Host memory
+// copied with the cache on must be unlocked with am_memory_host_unlock before
+// it is freed or unmapped.
+int HCC_PINNED_CACHE_SIZE = 0;
+
+// Pick the algorithm of ChooseBest unpinned copies by measuring them rather
+// than by the thresholds.
+int HCC_COPY_TUNER = 1;
+
+// Profile file of the copy tuner: read at startup, written at exit
+char * HCC_COPY_PROFILE=nullptr;
+
+// Longest spin of a hcWaitModeHybrid wait in us
+int HCC_WAIT_SPIN_MAX_US = 100;
+
 // Default GPU device
 unsigned int HCC_DEFAULT_GPU = 0;
 
@@ -615,6 +686,7 @@ private:
     hsa_executable_symbol_t hsaExecutableSymbol;
     uint32_t static_group_segment_size;
     uint32_t private_segment_size;
+    uint32_t kernarg_segment_size;
     uint16_t workitem_vgpr_count;
     friend class HSADispatch;
 
@@ -646,6 +718,13 @@ public:
                 &this->private_segment_size);
         STATUS_CHECK(status, __LINE__);
 
+        status =
+            hsa_executable_symbol_get_info(
+                _hsaExecutableSymbol,
+                HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE,
+                &this->kernarg_segment_size);
+        STATUS_CHECK(status, __LINE__);
+
         workitem_vgpr_count = 0;
 
         uint16_t ext_version_major = 1;
@@ -696,6 +775,278 @@ public:
     }
 }; // end of HSAKernel
 
+// KernargRing
+//
+// Kernarg memory of one queue. Buffers are carved out of the ring in dispatch
+// order and reclaimed in the same order, once the dispatches which used them
+// have retired, so that allocating is a bump of the head in the common case.
+//
+// alloc is only called with the ROCr queue of the owning HSAQueue locked.
+// release may be called from any thread.
+class KernargRing {
+public:
+    KernargRing(hsa_agent_t agent, hsa_amd_memory_pool_t region, size_t size) :
+        base(nullptr), size(size), head(0), tail(0),
+        recordCount(2 * (size / KERNARG_RING_ALIGNMENT) + 1), records(new Record[recordCount]),
+        recordHead(0), recordTail(0)
+    {
+        hsa_status_t status = hsa_amd_memory_pool_allocate(region, size, 0, (void**)&base);
+        STATUS_CHECK(status, __LINE__);
+
+        status = hsa_amd_agents_allow_access(1, &agent, NULL, base);
+        STATUS_CHECK(status, __LINE__);
+
+        DBOUTL(DB_RESOURCE, "Allocated kernarg ring of " << size << " bytes at " << (void*)base);
+    }
+
+    ~KernargRing() {
+        hsa_amd_memory_pool_free(base);
+    }
+
+    // allocate bytes of kernarg memory. Returns nullptr if the ring is full,
+    // otherwise record identifies the buffer for release
+    void* alloc(size_t bytes, int* record) {
+        bytes = (bytes + KERNARG_RING_ALIGNMENT - 1) & ~size_t(KERNARG_RING_ALIGNMENT - 1);
+        if (bytes > size) {
+            return nullptr;
+        }
+
+        reclaim();
+
+        // buffers don't wrap around the end of the ring, the rest of the ring
+        // is skipped with a filler record instead
+        size_t pos = head % size;
+        size_t pad = (pos + bytes > size) ? size - pos : 0;
+        if ((head + pad + bytes - tail > size) || (recordHead + 2 - recordTail > recordCount)) {
+            return nullptr;
+        }
+        if (pad) {
+            push(head + pad, true);
+            head += pad;
+        }
+
+        *record = push(head + bytes, false);
+        void* ret = base + (head % size);
+        head += bytes;
+        return ret;
+    }
+
+    // the dispatch which used the buffer has retired
+    void release(int record) {
+        records[record].done.store(true, std::memory_order_release);
+    }
+
+private:
+    struct Record {
+        uint64_t end;
+        std::atomic<bool> done;
+    };
+
+    int push(uint64_t end, bool done) {
+        int index = recordHead % recordCount;
+        records[index].end = end;
+        records[index].done.store(done, std::memory_order_relaxed);
+        ++recordHead;
+        return index;
+    }
+
+    // move the tail past every released buffer at the tail
+    void reclaim() {
+        while (recordTail != recordHead) {
+            Record& r = records[recordTail % recordCount];
+            if (!r.done.load(std::memory_order_acquire)) {
+                break;
+            }
+            tail = r.end;
+            ++recordTail;
+        }
+    }
+
+    char* base;
+    size_t size;
+
+    // byte offsets of the next allocation and of the oldest live buffer,
+    // both only ever grow
+    uint64_t head;
+    uint64_t tail;
+
+    // one record per buffer and filler, in allocation order
+    size_t recordCount;
+    std::unique_ptr<Record[]> records;
+    uint64_t recordHead;
+    uint64_t recordTail;
+};
+
+// Per-thread cache of freed memory blocks of one size, which keeps the
+// objects created for every kernel launch away from malloc.
+//
+// A block goes back to the cache of the thread freeing it, up to
+// DISPATCH_CACHE_SIZE blocks, so a thread which launches kernels and waits
+// for them is served from its cache in steady state.
+template <size_t Size>
+class BlockCache {
+    // plain data, so that it can still be used while the thread exits
+    struct Blocks {
+        void* blocks[DISPATCH_CACHE_SIZE];
+        int count;  // -1 once the thread has drained its cache on exit
+    };
+    static thread_local Blocks cache;
+
+    struct Drain {
+        ~Drain() {
+            for (int i = 0; i < cache.count; ++i) {
+                ::operator delete(cache.blocks[i]);
+            }
+            cache.count = -1;
+        }
+    };
+    static thread_local Drain drain;
+
+public:
+    static void* alloc() {
+        if (cache.count > 0) {
+            return cache.blocks[--cache.count];
+        }
+        return ::operator new(Size);
+    }
+
+    static void release(void* p) {
+        if ((cache.count >= 0) && (cache.count < DISPATCH_CACHE_SIZE)) {
+            // constructs the drain of this thread on first use
+            (void)&drain;
+            cache.blocks[cache.count++] = p;
+        } else {
+            ::operator delete(p);
+        }
+    }
+};
+
+template <size_t Size>
+thread_local typename BlockCache<Size>::Blocks BlockCache<Size>::cache;
+
+template <size_t Size>
+thread_local typename BlockCache<Size>::Drain BlockCache<Size>::drain;
+
+// Allocator serving single objects from the BlockCache of their size, used
+// for the control blocks of the shared_ptrs of kernel dispatches.
+template <typename T>
+struct CachedAllocator {
+    typedef T value_type;
+
+    CachedAllocator() = default;
+    template <typename U>
+    CachedAllocator(const CachedAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n == 1) {
+            return static_cast<T*>(BlockCache<sizeof(T)>::alloc());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n == 1) {
+            BlockCache<sizeof(T)>::release(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const CachedAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const CachedAllocator<U>&) const { return false; }
+};
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Waits of the ops of a queue on their completion signal. hcWaitModeHybrid
+// waits poll the signal for a spin budget derived from a moving average of
+// how long the recent waits took, then block.
+class HSAWaiter {
+public:
+    HSAWaiter() : avgWaitNs(uint64_t(HCC_WAIT_SPIN_MAX_US) * 1000 / 2), spinCount(0), blockCount(0) {}
+
+    // wait until signal satisfies cond against value, return the value of
+    // the signal
+    hsa_signal_value_t wait(hsa_signal_t signal, hsa_signal_condition_t cond, hsa_signal_value_t value, Kalmar::hcWaitMode mode);
+
+    uint64_t spinBudgetNs() const {
+        uint64_t budget = 2 * avgWaitNs.load(std::memory_order_relaxed);
+        return (budget > uint64_t(HCC_WAIT_SPIN_MAX_US) * 1000) ? HYBRID_WAIT_MIN_SPIN_NS : std::max<uint64_t>(budget, HYBRID_WAIT_MIN_SPIN_NS);
+    }
+
+    Kalmar::hcWaitStats stats() const {
+        Kalmar::hcWaitStats s;
+        s.spinCount = spinCount.load(std::memory_order_relaxed);
+        s.blockCount = blockCount.load(std::memory_order_relaxed);
+        s.spinBudgetNs = spinBudgetNs();
+        return s;
+    }
+
+private:
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool satisfied(hsa_signal_condition_t cond, hsa_signal_value_t v, hsa_signal_value_t value) {
+        switch (cond) {
+            case HSA_SIGNAL_CONDITION_EQ:  return v == value;
+            case HSA_SIGNAL_CONDITION_NE:  return v != value;
+            case HSA_SIGNAL_CONDITION_LT:  return v < value;
+            case HSA_SIGNAL_CONDITION_GTE: return v >= value;
+        }
+        return true;
+    }
+
+    // racing updates from waits on several threads may drop a sample
+    void record(uint64_t ns) {
+        int64_t avg = avgWaitNs.load(std::memory_order_relaxed);
+        avg += (int64_t(ns) - avg) / HYBRID_WAIT_AVG_WEIGHT;
+        avgWaitNs.store(avg, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> avgWaitNs;
+    std::atomic<uint64_t> spinCount;
+    std::atomic<uint64_t> blockCount;
+};
+
+hsa_signal_value_t HSAWaiter::wait(hsa_signal_t signal, hsa_signal_condition_t cond, hsa_signal_value_t value, Kalmar::hcWaitMode mode) {
+    if (mode != Kalmar::hcWaitModeHybrid) {
+        return hsa_signal_wait_scacquire(signal, cond, value, UINT64_MAX,
+                                         (mode == Kalmar::hcWaitModeActive) ? HSA_WAIT_STATE_ACTIVE : HSA_WAIT_STATE_BLOCKED);
+    }
+
+    uint64_t start = now();
+    uint64_t deadline = start + spinBudgetNs();
+    for (uint32_t spin = 1; ; ++spin) {
+        hsa_signal_value_t v = hsa_signal_load_scacquire(signal);
+        if (satisfied(cond, v, value)) {
+            spinCount.fetch_add(1, std::memory_order_relaxed);
+            record(now() - start);
+            return v;
+        }
+        // the clock is read every few polls only
+        if ((spin & 15) == 0 && now() >= deadline) {
+            break;
+        }
+        cpuRelax();
+    }
+
+    DBOUT(DB_WAIT, "  hybrid wait on signal=" << std::hex << signal.handle << std::dec << " blocks after spinning " << (now() - start) << "ns\n");
+    blockCount.fetch_add(1, std::memory_order_relaxed);
+    hsa_signal_value_t v = hsa_signal_wait_scacquire(signal, cond, value, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
+    record(now() - start);
+    return v;
+}
+
 // Stores the device and queue for op coordinate:
 struct HSAOpCoord
 {
@@ -711,21 +1062,30 @@ public:
     HSAOp(Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) ;
 
     const HSAOpCoord opCoord() const { return _opCoord; };
-    int asyncOpsIndex() const { return _asyncOpsIndex; };
+    // sequence number of the op in the ring of inflight ops of its queue
+    uint64_t asyncOpsIndex() const { return _asyncOpsIndex; };
 
-    void asyncOpsIndex(int asyncOpsIndex) { _asyncOpsIndex = asyncOpsIndex; };
+    void asyncOpsIndex(uint64_t asyncOpsIndex) { _asyncOpsIndex = asyncOpsIndex; };
 
     void* getNativeHandle() override { return &_signal; }
 
     virtual bool barrierNextSyncNeedsSysRelease() const { return 0; };
     virtual bool barrierNextKernelNeedsSysAcquire() const { return 0; };
 
+    // the op has left the ring of inflight ops of its queue, what only its
+    // packet needed can go even if the op itself lives on
+    virtual void retired() {};
+
     Kalmar::HSAQueue *hsaQueue() const;
     bool isReady() override;
+    void notifyCompletion(Kalmar::CompletionService::callback_fn callback) override;
 protected:
+    // wait for the completion signal of the op, see HSAWaiter
+    hsa_signal_value_t waitSignal(hsa_signal_condition_t cond, hsa_signal_value_t value, Kalmar::hcWaitMode mode);
+
     uint64_t     apiStartTick;
     HSAOpCoord   _opCoord;
-    int          _asyncOpsIndex;
+    uint64_t     _asyncOpsIndex;
 
     hsa_signal_t _signal;
     int          _signalIndex;
@@ -742,7 +1102,7 @@ private:
     bool isSingleStepCopy;; // copy was performed on fast-path via a single call to the HSA copy routine
     bool isPeerToPeer;
     uint64_t apiStartTick;
-    hsa_wait_state_t waitMode;
+    Kalmar::hcWaitMode waitMode;
 
     std::shared_future<void>* future;
 
@@ -770,14 +1130,7 @@ public:
 
 
     void setWaitMode(Kalmar::hcWaitMode mode) override {
-        switch (mode) {
-            case Kalmar::hcWaitModeBlocked:
-                waitMode = HSA_WAIT_STATE_BLOCKED;
-            break;
-            case Kalmar::hcWaitModeActive:
-                waitMode = HSA_WAIT_STATE_ACTIVE;
-            break;
-        }
+        waitMode = mode;
     }
 
 
@@ -876,7 +1229,7 @@ private:
 class HSABarrier : public HSAOp {
 private:
     bool isDispatched;
-    hsa_wait_state_t waitMode;
+    Kalmar::hcWaitMode waitMode;
 
 
     std::shared_future<void>* future;
@@ -909,14 +1262,7 @@ public:
 
 
     void setWaitMode(Kalmar::hcWaitMode mode) override {
-        switch (mode) {
-            case Kalmar::hcWaitModeBlocked:
-                waitMode = HSA_WAIT_STATE_BLOCKED;
-            break;
-            case Kalmar::hcWaitModeActive:
-                waitMode = HSA_WAIT_STATE_ACTIVE;
-            break;
-        }
+        waitMode = mode;
     }
 
 
@@ -932,7 +1278,7 @@ public:
         _acquire_scope(hc::no_scope),
         _barrierNextSyncNeedsSysRelease(false),
         _barrierNextKernelNeedsSysAcquire(false),
-        waitMode(HSA_WAIT_STATE_BLOCKED)
+        waitMode(Kalmar::hcWaitModeBlocked)
     {
 
         if (dependent_op != nullptr) {
@@ -953,7 +1299,7 @@ public:
         _acquire_scope(hc::no_scope),
         _barrierNextSyncNeedsSysRelease(false),
         _barrierNextKernelNeedsSysAcquire(false),
-        waitMode(HSA_WAIT_STATE_BLOCKED),
+        waitMode(Kalmar::hcWaitModeBlocked),
         depCount(0)
     {
         if ((count >= 0) && (count <= 5)) {
@@ -982,6 +1328,12 @@ public:
 
     hsa_status_t enqueueAsync(hc::memory_scope memory_scope);
 
+    // the steps of enqueueAsync, for callers which write the barrier packet
+    // into the locked queue along with other packets
+    void prepareAsync(hc::memory_scope fenceScope);
+    void writePacket(hsa_barrier_and_packet_t* barrier);
+    void completeAsync();
+
     // wait for the barrier to complete
     hsa_status_t waitComplete();
 
@@ -1007,39 +1359,52 @@ private:
     const char *kernel_name;
     const HSAKernel* kernel;
 
+    // kernel arguments, in arg_inline until they outgrow it and in arg_vec
+    // from then on
+    uint8_t arg_inline[KERNARG_INLINE_SIZE];
     std::vector<uint8_t> arg_vec;
+    size_t arg_size;
     uint32_t arg_count;
-    size_t prevArgVecCapacity;
     void* kernargMemory;
     int kernargMemoryIndex;
+    // queue ring kernargMemory was taken from, if any
+    std::shared_ptr<KernargRing> kernargRing;
 
 
     hsa_kernel_dispatch_packet_t aql;
     bool isDispatched;
-    hsa_wait_state_t waitMode;
+    Kalmar::hcWaitMode waitMode;
 
 
+    // points to asyncFuture once the kernel is dispatched asynchronously
     std::shared_future<void>* future;
+    std::shared_future<void> asyncFuture;
 
 public:
     std::shared_future<void>* getFuture() override { return future; }
 
+    // dispatches are created for every launch, keep them off the heap
+    static void* operator new(size_t size) {
+        assert(size == sizeof(HSADispatch));
+        return BlockCache<sizeof(HSADispatch)>::alloc();
+    }
+    static void operator delete(void* p) {
+        BlockCache<sizeof(HSADispatch)>::release(p);
+    }
+
     void setKernelName(const char *x_kernel_name) { kernel_name = x_kernel_name;};
     const char *getKernelName() { return kernel_name ? kernel_name : (kernel ? kernel->shortKernelName.c_str() : "<unknown_kernel>"); };
     const char *getLongKernelName() { return (kernel ? kernel->getLongKernelName().c_str() : "<unknown_kernel>"); };
 
 
     void setWaitMode(Kalmar::hcWaitMode mode) override {
-        switch (mode) {
-            case Kalmar::hcWaitModeBlocked:
-                waitMode = HSA_WAIT_STATE_BLOCKED;
-            break;
-            case Kalmar::hcWaitModeActive:
-                waitMode = HSA_WAIT_STATE_ACTIVE;
-            break;
-        }
+        waitMode = mode;
     }
 
+    // give the kernarg buffer back as soon as the packet is done, the op
+    // may be kept alive much longer by its completion_future
+    void retired() override;
+
 
     ~HSADispatch() {
 
@@ -1065,10 +1430,15 @@ public:
 
     hsa_status_t clearArgs() {
         arg_count = 0;
+        arg_size = 0;
         arg_vec.clear();
         return HSA_STATUS_SUCCESS;
     }
 
+    const uint8_t* getArgs() const { return (arg_size <= KERNARG_INLINE_SIZE) ? arg_inline : arg_vec.data(); }
+    size_t getArgSize() const { return arg_size; }
+    const HSAKernel* getKernel() const { return kernel; }
+
 
     void overrideAcquireFenceIfNeeded();
     hsa_status_t setLaunchConfiguration(const int dims, size_t *globalDims, size_t *localDims,
@@ -1088,6 +1458,9 @@ public:
 
     void dispose();
 
+    // give back the kernarg buffer, to the queue ring or the device pool
+    void releaseKernarg();
+
     uint64_t getTimestampFrequency() override {
         // get system tick frequency
         uint64_t timestamp_frequency_hz = 0L;
@@ -1102,19 +1475,34 @@ public:
     const hsa_kernel_dispatch_packet_t &getAql() const { return aql; };
 
 private:
+    // make room for size bytes of arguments, returns where they start
+    uint8_t* growArgs(size_t size) {
+        if (size <= KERNARG_INLINE_SIZE) {
+            return arg_inline;
+        }
+        if (arg_size <= KERNARG_INLINE_SIZE) {
+            // moving out of arg_inline, reserve what the kernel takes
+            arg_vec.reserve(std::max<size_t>(size, kernel ? kernel->kernarg_segment_size : 0));
+            arg_vec.assign(arg_inline, arg_inline + arg_size);
+        }
+        arg_vec.resize(size);
+        return arg_vec.data();
+    }
+
     template <typename T>
     hsa_status_t pushArgPrivate(T val) {
         /* add padding if necessary */
-        int padding_size = (arg_vec.size() % sizeof(T)) ? (sizeof(T) - (arg_vec.size() % sizeof(T))) : 0;
+        size_t padding_size = (arg_size % sizeof(T)) ? (sizeof(T) - (arg_size % sizeof(T))) : 0;
         DBOUT(DB_KERNARG, "push " << (sizeof(T) + padding_size) << " bytes into kernarg: ");
 
+        uint8_t* args = growArgs(arg_size + padding_size + sizeof(T));
         for (size_t i = 0; i < padding_size; ++i) {
-            arg_vec.push_back((uint8_t)0x00);
+            args[arg_size++] = 0x00;
             DBOUT(DB_KERNARG, std::hex << std::setw(2) << std::setfill('0') << 0x00 << " ");
         }
         uint8_t* ptr = static_cast<uint8_t*>(static_cast<void*>(&val));
         for (size_t i = 0; i < sizeof(T); ++i) {
-            arg_vec.push_back(ptr[i]);
+            args[arg_size++] = ptr[i];
             DBOUT(DB_KERNARG, std::hex << std::setw(2) << std::setfill('0') << +ptr[i] << " ");
         }
         DBOUT(DB_KERNARG, std::endl);
@@ -1125,6 +1513,106 @@ private:
 
 }; // end of HSADispatch
 
+// Op returned for the commands recorded by a queue which is capturing, see
+// HSAGraph. Nothing runs, the op is complete from the start.
+class HSACapturedOp : public HSAOp {
+private:
+    std::shared_future<void> future;
+
+public:
+    HSACapturedOp(Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) :
+        HSAOp(queue, commandKind),
+        future(std::async(std::launch::deferred, [] {}).share()) {}
+
+    std::shared_future<void>* getFuture() override { return &future; }
+
+    bool isReady() override { return true; }
+}; // end of HSACapturedOp
+
+// The commands recorded from an HSAQueue between beginCapture and endCapture.
+//
+// Kernel dispatches and markers are kept as AQL packets which are finished
+// but for the header, with the kernel arguments in kernarg memory owned by the
+// graph. Replay writes each run of consecutive packets into the queue in one
+// go, closed by a barrier-AND packet whose signal tracks the run, and rings
+// the doorbell once per run. Copies are not AQL packets, they are enqueued
+// again between the runs.
+//
+// Only in-order queues record commands, so the packets need no signals of
+// their own: they are ordered by the barrier bit.
+class HSAGraph final : public Kalmar::KalmarGraph {
+private:
+    union AqlPacket {
+        hsa_kernel_dispatch_packet_t dispatch;
+        hsa_barrier_and_packet_t barrier;
+    };
+
+    struct Node {
+        hc::hcCommandKind kind;
+
+        // kernels and markers
+        AqlPacket packet;
+        uint16_t header;
+        const HSAKernel* kernel;
+        void* kernargMemory;
+        int kernargMemoryIndex;
+        size_t kernargSize;
+
+        // copies
+        const void* src;
+        void* dst;
+        size_t width;
+        size_t height;
+        size_t srcPitch;
+        size_t dstPitch;
+        bool is2d;
+        hc::AmPointerInfo srcInfo;
+        hc::AmPointerInfo dstInfo;
+        const Kalmar::KalmarDevice* copyDevice;
+
+        Node(hc::hcCommandKind kind) :
+            kind(kind), header(0), kernel(nullptr), kernargMemory(nullptr), kernargMemoryIndex(-1), kernargSize(0),
+            src(nullptr), dst(nullptr), width(0), height(0), srcPitch(0), dstPitch(0), is2d(false), copyDevice(nullptr)
+        {
+            memset(&packet, 0, sizeof(packet));
+        }
+    };
+
+    Kalmar::HSAQueue* queue;
+    std::vector<Node> nodes;
+
+    // op completing after the last replay, the kernarg memory of the graph
+    // is not written to before it completes
+    std::shared_ptr<Kalmar::KalmarAsyncOp> lastReplay;
+
+    void waitLastReplay();
+
+    // write nodes [begin, end), all AQL packets, into the queue
+    std::shared_ptr<Kalmar::KalmarAsyncOp> replayPackets(size_t begin, size_t end, bool last);
+
+public:
+    HSAGraph(Kalmar::HSAQueue* queue) : queue(queue) {}
+
+    ~HSAGraph();
+
+    std::shared_ptr<Kalmar::KalmarAsyncOp> recordKernel(const HSADispatch* dispatch);
+    std::shared_ptr<Kalmar::KalmarAsyncOp> recordKernel(const hsa_kernel_dispatch_packet_t* aql, const void* args, size_t argSize);
+    std::shared_ptr<Kalmar::KalmarAsyncOp> recordMarker(int count, std::shared_ptr<Kalmar::KalmarAsyncOp>* depOps, hc::memory_scope fenceScope);
+    std::shared_ptr<Kalmar::KalmarAsyncOp> recordCopy(const void* src, void* dst, size_t width, size_t height, size_t srcPitch, size_t dstPitch, bool is2d,
+                                                      const hc::AmPointerInfo& srcInfo, const hc::AmPointerInfo& dstInfo,
+                                                      const Kalmar::KalmarDevice* copyDevice);
+
+    size_t getCommandCount() const override { return nodes.size(); }
+
+    hc::hcCommandKind getCommandKind(size_t i) const override {
+        return (i < nodes.size()) ? nodes[i].kind : hc::hcCommandInvalid;
+    }
+
+    void setKernelArgs(size_t i, void* kernel) override;
+
+    std::shared_ptr<Kalmar::KalmarAsyncOp> replay() override;
+}; // end of HSAGraph
+
 //-----
 //Structure used to extract information from memory pool
 struct pool_iterator
@@ -1278,14 +1766,25 @@ private:
     bool         drainingQueue_;  // mode that we are draining queue, used to allow barrier ops to be enqueued.
 
     //
-    // kernel dispatches and barriers associated with this HSAQueue instance
+    // kernel dispatches, barriers and copies associated with this HSAQueue
+    // instance
     //
     // When a kernel k is dispatched, we'll get a KalmarAsyncOp f.
-    // This vector would hold f.  acccelerator_view::wait() would trigger
-    // HSAQueue::wait(), and all future objects in the KalmarAsyncOp objects
-    // will be waited on.
+    // This ring would hold f.  acccelerator_view::wait() would trigger
+    // HSAQueue::wait(), and the KalmarAsyncOp objects will be waited on.
+    //
+    // Ops are numbered in submission order.  Op number n is held in
+    // asyncOps[n & (asyncOps.size()-1)] for as long as
+    // asyncOpsTail <= n < asyncOpsHead, and every slot in that range holds an
+    // op.  Ops are retired at the tail only: completing an op retires all
+    // older ones with it (see removeAsyncOp).
     //
     std::vector< std::shared_ptr<HSAOp> > asyncOps;
+    uint64_t asyncOpsHead;
+    uint64_t asyncOpsTail;
+
+    // kernarg memory of the dispatches into this queue, created on first use
+    std::shared_ptr<KernargRing> kernargRing;
 
     uint64_t                                      queueSeqNum; // sequence-number of this queue.
 
@@ -1324,8 +1823,10 @@ private:
     // When a kenrel k is to be dispatched, kernelBufferMap[k] will be traversed
     // to figure out if there is any previous kernel dispatch associated for
     // each buffer b used by k.  This is done by checking bufferKernelMap[b].
-    // If there are previous kernel dispatches which use b, then we wait on
-    // them before dispatch kernel k. bufferKernelMap[b] will be cleared then.
+    // If there are previous kernel dispatches which use b and are still
+    // running, k is made to depend on them on the device, with barrier-AND
+    // packets ahead of k (see enqueueBufferDeps). bufferKernelMap[b] will be
+    // cleared then.
     //
     // After kernel k is dispatched, we'll get a KalmarAsync object f, we then
     // walk through each buffer b used by k and mark the association as:
@@ -1344,6 +1845,13 @@ private:
     // value: a vector of buffers used by the kernel
     std::map<void*, std::vector<void*> > kernelBufferMap;
 
+    // graph the commands are recorded into while the queue is capturing,
+    // nullptr otherwise
+    std::shared_ptr<HSAGraph> captureGraph;
+
+    // waits of the ops of the queue on their completion signals
+    HSAWaiter waiter;
+
     // signal used by sync copy only
     hsa_signal_t  sync_copy_signal;
 
@@ -1383,9 +1891,9 @@ public:
     void printAsyncOps(std::ostream &s = std::cerr)
     {
         hsa_signal_value_t oldv=0;
-        s << *this << " : " << asyncOps.size() << " op entries\n";
-        for (int i=0; i<asyncOps.size(); i++) {
-            const std::shared_ptr<HSAOp> &op = asyncOps[i];
+        s << *this << " : " << (asyncOpsHead - asyncOpsTail) << " op entries\n";
+        for (uint64_t i=asyncOpsTail; i<asyncOpsHead; i++) {
+            const std::shared_ptr<HSAOp> &op = asyncOpSlot(i);
             s << "index:" << std::setw(4) << i ;
             if (op != nullptr) {
                 s << " op#"<< op->getSeqNum() ;
@@ -1433,17 +1941,28 @@ public:
 
 
 
-        if (!drainingQueue_ && (asyncOps.size() >= MAX_INFLIGHT_COMMANDS_PER_QUEUE-1)) {
-            DBOUT(DB_WAIT, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " force sync\n");
-            DBOUT(DB_RESOURCE, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " force sync\n");
+        if (asyncOpsHead - asyncOpsTail >= std::min<uint64_t>(asyncOps.size(), MAX_INFLIGHT_COMMANDS_PER_QUEUE-1)) {
+            // ring is full, drop the ops which have completed before growing
+            // it or waiting for one
+            reclaimAsyncOps();
+        }
+
+        if (!drainingQueue_ && (asyncOpsHead - asyncOpsTail >= MAX_INFLIGHT_COMMANDS_PER_QUEUE-1)) {
+            DBOUT(DB_WAIT, "*** Hit max inflight ops inflight=" << (asyncOpsHead - asyncOpsTail) << ". " << op << " wait for oldest\n");
+            DBOUT(DB_RESOURCE, "*** Hit max inflight ops inflight=" << (asyncOpsHead - asyncOpsTail) << ". " << op << " wait for oldest\n");
 
             drainingQueue_ = true;
 
-            wait();
+            waitOldestAsyncOp();
+        }
+
+        if (asyncOpsHead - asyncOpsTail == asyncOps.size()) {
+            growAsyncOps();
         }
-        op->asyncOpsIndex(asyncOps.size());
+        op->asyncOpsIndex(asyncOpsHead);
         youngestCommandKind = op->getCommandKind();
-        asyncOps.push_back(std::move(op));
+        asyncOpSlot(asyncOpsHead) = std::move(op);
+        ++asyncOpsHead;
 
         drainingQueue_ = false;
 
@@ -1468,12 +1987,12 @@ public:
 
         assert (newCommandKind != hcCommandInvalid);
 
-        if (!asyncOps.empty() && asyncOps.back().get()!=nullptr) {
+        if (asyncOpsHead != asyncOpsTail) {
             assert (youngestCommandKind != hcCommandInvalid);
 
             // Ensure we have not already added the op we are checking into asyncOps,
             // that must be done after we check for deps.
-            if (newOp && (newOp == asyncOps.back().get())) {
+            if (newOp && (newOp == youngestAsyncOp().get())) {
                 throw Kalmar::runtime_exception("enqueued op before checking dependencies!", 0);
             }
 
@@ -1494,7 +2013,7 @@ public:
             } else if (isCopyCommand(newCommandKind) && isCopyCommand(youngestCommandKind)) {
                 assert (newOp);
                 auto hsaCopyOp = static_cast<const HSACopy*> (newOp);
-                auto youngestCopyOp = static_cast<const HSACopy*> (asyncOps.back().get());
+                auto youngestCopyOp = static_cast<const HSACopy*> (youngestAsyncOp().get());
                 if (hsaCopyOp->getCopyDevice() != youngestCopyOp->getCopyDevice()) {
                     // This covers cases where two copies are back-to-back in the queue but use different copy engines.
                     // In this case there is no implicit dependency between the ops so we need to add one
@@ -1510,7 +2029,7 @@ public:
 
             if (needDep) {
                 DBOUT(DB_CMD2, "command type changed " << getHcCommandKindString(youngestCommandKind) << "  ->  " << getHcCommandKindString(newCommandKind) << "\n") ;
-                return asyncOps.back();
+                return youngestAsyncOp();
             }
         }
 
@@ -1528,19 +2047,17 @@ public:
 
     int getPendingAsyncOps() override {
         int count = 0;
-        for (int i = 0; i < asyncOps.size(); ++i) {
-            auto &asyncOp = asyncOps[i];
+        for (uint64_t i = asyncOpsTail; i < asyncOpsHead; ++i) {
+            auto &asyncOp = asyncOpSlot(i);
 
-            if (asyncOp != nullptr) {
-                hsa_signal_t signal = *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
-                if (signal.handle) {
-                    hsa_signal_value_t v = hsa_signal_load_scacquire(signal);
-                    if (v != 0) {
-                        ++count;
-                    }
-                } else {
+            hsa_signal_t signal = *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
+            if (signal.handle) {
+                hsa_signal_value_t v = hsa_signal_load_scacquire(signal);
+                if (v != 0) {
                     ++count;
                 }
+            } else {
+                ++count;
             }
         }
         return count;
@@ -1548,17 +2065,14 @@ public:
 
 
     bool isEmpty() override {
-        // Have to walk asyncOps since it can contain null pointers (if event is waited on and removed)
-        // Also not all commands contain signals.
+        // Only the youngest op needs to be checked, ops that have been waited
+        // on are already retired from the ring.
+        // Not all commands contain signals.
         
         bool isEmpty = true;
 
-        const auto& oldest = find_if(
-                    asyncOps.crbegin(), asyncOps.crend(), [](const std::shared_ptr<HSAOp> &asyncOp) { return asyncOp != nullptr; });
-
-
-        if (oldest != asyncOps.crend()) {
-            hsa_signal_t signal = *(static_cast <hsa_signal_t*> ((*oldest)->getNativeHandle()));
+        if (asyncOpsHead != asyncOpsTail) {
+            hsa_signal_t signal = *(static_cast <hsa_signal_t*> (youngestAsyncOp()->getNativeHandle()));
             if (signal.handle) {
                 hsa_signal_value_t v = hsa_signal_load_scacquire(signal);
                 if (v != 0) {
@@ -1576,14 +2090,23 @@ public:
     };
 
 
-    // Must retain this exact function signature here even though mode not used since virtual interface in
-    // runtime depends on this signature.
-    void wait(hcWaitMode mode = hcWaitModeBlocked) override {
+    hcWaitStats getWaitStats() override { return waiter.stats(); }
+
+    HSAWaiter& getWaiter() { return waiter; }
+
+
+    void wait(hcWaitMode mode) override {
         // wait on all previous async operations to complete
-        // Go in reverse order (from youngest to oldest).
-        // Ensures younger ops have chance to complete before older ops reclaim their resources
+        //
+        // In an in-order queue every op completes after all older ones, so
+        // only the youngest op has to be waited on.  Ops of an any-order queue
+        // are waited on from the oldest one.
         //
 
+        if (captureGraph) {
+            throw Kalmar::runtime_exception("cannot wait on an accelerator_view while it is capturing commands", 0);
+        }
+
 
         if (HCC_OPT_FLUSH && nextSyncNeedsSysRelease()) {
 
@@ -1601,25 +2124,20 @@ public:
 
 
 
-        bool foundFirstValidOp = false;
+        if (asyncOpsHead != asyncOpsTail) {
+            hsa_signal_t sig =  *(static_cast <hsa_signal_t*> (youngestAsyncOp()->getNativeHandle()));
+            assert(sig.handle != 0);
 
-        for (int i = asyncOps.size()-1; i >= 0;  i--) {
-            if (asyncOps[i] != nullptr) {
-                auto asyncOp = asyncOps[i];
-                if (!foundFirstValidOp) {
-                    hsa_signal_t sig =  *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
-                    assert(sig.handle != 0);
-                    foundFirstValidOp = true;
-                }
-                // wait on valid futures only
-                std::shared_future<void>* future = asyncOp->getFuture();
-                if (future && future->valid()) {
-                    future->wait();
+            if (get_execute_order() == execute_in_order) {
+                waitAsyncOp(std::shared_ptr<HSAOp>(youngestAsyncOp()), mode);
+            } else {
+                while (asyncOpsHead != asyncOpsTail) {
+                    waitAsyncOp(std::shared_ptr<HSAOp>(asyncOpSlot(asyncOpsTail)), mode);
                 }
             }
         }
         // clear async operations table
-        asyncOps.clear();
+        retireAsyncOps(asyncOpsHead);
    }
 
     void LaunchKernel(void *ker, size_t nr_dim, size_t *global, size_t *local) override {
@@ -1629,19 +2147,21 @@ public:
     void LaunchKernelWithDynamicGroupMemory(void *ker, size_t nr_dim, size_t *global, size_t *local, size_t dynamic_group_size) override {
         HSADispatch *dispatch =
             reinterpret_cast<HSADispatch*>(ker);
+        if (captureGraph) {
+            kernelBufferMap.erase(ker);
+            delete(dispatch);
+            throw Kalmar::runtime_exception("synchronous kernel launches cannot be captured", 0);
+        }
         size_t tmp_local[] = {0, 0, 0};
         if (!local)
             local = tmp_local;
         dispatch->setLaunchConfiguration(nr_dim, global, local, dynamic_group_size);
 
-        // wait for previous kernel dispatches be completed
-        std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                      [&] (void* buffer) {
-                        waitForDependentAsyncOps(buffer);
-                      });
-
         waitForStreamDeps(dispatch);
 
+        // order the dispatch after previous kernel dispatches writing its buffers
+        enqueueBufferDeps(ker);
+
 
 
         // dispatch the kernel
@@ -1649,7 +2169,6 @@ public:
         dispatch->dispatchKernelWaitComplete();
 
         // clear data in kernelBufferMap
-        kernelBufferMap[ker].clear();
         kernelBufferMap.erase(ker);
 
         delete(dispatch);
@@ -1665,24 +2184,25 @@ public:
         HSADispatch *dispatch =
             reinterpret_cast<HSADispatch*>(ker);
 
+        if (captureGraph) {
+            return captureKernel(dispatch, nr_dim, global, local, dynamic_group_size);
+        }
 
 
         bool hasArrayViewBufferDeps = (kernelBufferMap.find(ker) != kernelBufferMap.end());
 
 
+        waitForStreamDeps(dispatch);
+
         if (hasArrayViewBufferDeps) {
-            // wait for previous kernel dispatches be completed
-            std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                      [&] (void* buffer) {
-                        waitForDependentAsyncOps(buffer);
-                     });
+            // order the dispatch after previous kernel dispatches writing its
+            // buffers, without blocking the host
+            enqueueBufferDeps(ker);
         }
 
-        waitForStreamDeps(dispatch);
-
 
         // create a shared_ptr instance
-        std::shared_ptr<KalmarAsyncOp> sp_dispatch(dispatch);
+        std::shared_ptr<KalmarAsyncOp> sp_dispatch(dispatch, std::default_delete<HSADispatch>(), CachedAllocator<HSADispatch>());
         // associate the kernel dispatch with this queue
         pushAsyncOp(std::static_pointer_cast<HSAOp> (sp_dispatch));
 
@@ -1712,6 +2232,55 @@ public:
     }
 
 
+    // record the dispatch into the graph being captured, instead of
+    // dispatching it
+    std::shared_ptr<KalmarAsyncOp> captureKernel(HSADispatch *dispatch, size_t nr_dim, size_t *global, size_t *local, size_t dynamic_group_size) {
+        std::unique_ptr<HSADispatch> owner(dispatch);
+
+        // the buffers of the kernel are not tracked, the graph runs in order
+        kernelBufferMap.erase(dispatch);
+
+        size_t tmp_local[] = {0, 0, 0};
+        if (!local)
+            local = tmp_local;
+
+        // the fences the kernel needs after the commands before it are
+        // decided on replay, leave the state of the queue alone
+        bool needsSysAcquire = nextKernelNeedsSysAcquire();
+        setNextKernelNeedsSysAcquire(false);
+        dispatch->setLaunchConfiguration(nr_dim, global, local, dynamic_group_size);
+        setNextKernelNeedsSysAcquire(needsSysAcquire);
+
+        return captureGraph->recordKernel(dispatch);
+    }
+
+    bool beginCapture() override {
+        if (get_execute_order() != execute_in_order) {
+            throw Kalmar::runtime_exception("only execute_in_order accelerator_views can capture commands", 0);
+        }
+        if (captureGraph) {
+            throw Kalmar::runtime_exception("accelerator_view is already capturing commands", 0);
+        }
+
+        // the queue cannot be waited on while capturing, release what the
+        // kernels before wrote now
+        releaseToSystemIfNeeded();
+
+        captureGraph = std::make_shared<HSAGraph>(this);
+        return true;
+    }
+
+    std::shared_ptr<KalmarGraph> endCapture() override {
+        std::shared_ptr<KalmarGraph> graph = captureGraph;
+        captureGraph = nullptr;
+        return graph;
+    }
+
+    bool isCapturing() const { return captureGraph != nullptr; }
+
+    // drop the buffers registered by Push for a kernel which is not launched
+    void discardKernelBuffers(void* ker) { kernelBufferMap.erase(ker); }
+
     void releaseToSystemIfNeeded()
     {
         if (HCC_OPT_FLUSH && nextSyncNeedsSysRelease()) {
@@ -1723,6 +2292,54 @@ public:
     }
 
 
+    // make the next command in this queue depend on the kernel dispatches
+    // which wrote one of the buffers of kernel ker and have not completed yet.
+    //
+    // The dependencies are resolved by the packet processor: up to
+    // HSA_BARRIER_DEP_SIGNAL_CNT of them go into each barrier-AND packet
+    // enqueued here, which holds back the packets behind it until the
+    // dependencies complete. The host never waits.
+    void enqueueBufferDeps(void* ker) {
+        auto kernelBuffers = kernelBufferMap.find(ker);
+        if (kernelBuffers == kernelBufferMap.end()) {
+            return;
+        }
+
+        std::vector<std::shared_ptr<KalmarAsyncOp>> depOps;
+        for (void* buffer : kernelBuffers->second) {
+            auto&& dependentAsyncOpVector = bufferKernelMap[buffer];
+            for (auto&& dependentAsyncOp : dependentAsyncOpVector) {
+                auto dependentAsyncOpPointer = dependentAsyncOp.lock();
+                if (dependentAsyncOpPointer == nullptr) {
+                    continue;
+                }
+                // completed dispatches need no packet
+                hsa_signal_t signal = *(static_cast <hsa_signal_t*> (dependentAsyncOpPointer->getNativeHandle()));
+                if (signal.handle == 0 || hsa_signal_load_scacquire(signal) == 0) {
+                    continue;
+                }
+                if (std::find(depOps.begin(), depOps.end(), dependentAsyncOpPointer) == depOps.end()) {
+                    depOps.push_back(dependentAsyncOpPointer);
+                }
+            }
+            dependentAsyncOpVector.clear();
+        }
+
+        // The dependencies are all earlier dispatches into this queue. When
+        // the queue executes in order, the barrier bit of the new dispatch
+        // already keeps it from starting before they complete.
+        if (depOps.empty() || get_execute_order() == Kalmar::execute_in_order) {
+            return;
+        }
+
+        DBOUT(DB_CMD2, "  enqueueBufferDeps: " << depOps.size() << " unfinished dependencies on buffers of kernel " << ker << "\n");
+        for (size_t i = 0; i < depOps.size(); i += HSA_BARRIER_DEP_SIGNAL_CNT) {
+            int count = std::min<size_t>(HSA_BARRIER_DEP_SIGNAL_CNT, depOps.size() - i);
+            EnqueueMarkerWithDependency(count, &depOps[i], hc::accelerator_scope);
+        }
+    }
+
+
     // wait for dependent async operations to complete
     void waitForDependentAsyncOps(void* buffer) {
         auto&& dependentAsyncOpVector = bufferKernelMap[buffer];
@@ -1959,6 +2576,10 @@ public:
 
     void releaseLockedRocrQueue();
 
+    // kernarg ring of this queue, nullptr if rings are disabled
+    // must be called with the ROCr queue locked
+    const std::shared_ptr<KernargRing>& getKernargRing();
+
 
     void* getHSAAgent() override;
 
@@ -2025,6 +2646,10 @@ public:
 
         hsa_status_t status = HSA_STATUS_SUCCESS;
 
+        if (captureGraph) {
+            return captureGraph->recordMarker(0, nullptr, release_scope);
+        }
+
         // create shared_ptr instance
         std::shared_ptr<HSABarrier> barrier = std::make_shared<HSABarrier>(this, 0, nullptr);
         // associate the barrier with this queue
@@ -2055,6 +2680,10 @@ public:
 
         hsa_status_t status = HSA_STATUS_SUCCESS;
 
+        if (captureGraph && (count >= 0) && (count <= HSA_BARRIER_DEP_SIGNAL_CNT)) {
+            return captureGraph->recordMarker(count, depOps, fenceScope);
+        }
+
         if ((count >= 0) && (count <= HSA_BARRIER_DEP_SIGNAL_CNT)) {
 
             // create shared_ptr instance
@@ -2138,7 +2767,7 @@ public:
     void copy(const void *src, void *dst, size_t size_bytes) override {
         DBOUT(DB_COPY, "HSAQueue::copy(" << src << ", " << dst << ", " << size_bytes << ")\n");
         // wait for all previous async commands in this queue to finish
-        this->wait();
+        this->wait(hcWaitModeHybrid);
 
         // create a HSACopy instance
         HSACopy* copyCommand = new HSACopy(this, src, dst, size_bytes);
@@ -2159,50 +2788,109 @@ public:
 
     // remove finished async operation from waiting list
     void removeAsyncOp(HSAOp* asyncOp) {
-        int targetIndex = asyncOp->asyncOpsIndex();
+        uint64_t targetIndex = asyncOp->asyncOpsIndex();
 
         // Make sure the opindex is still valid.
-        // If the queue is destroyed first it may not exist in asyncops anymore so no need to destroy.
-        if (targetIndex < asyncOps.size() &&
-            asyncOp == asyncOps[targetIndex].get()) {
+        // The op is gone from the ring already if it, or a younger op, has
+        // been waited on before, or if it is being released by the ring.
+        if (targetIndex >= asyncOpsTail && targetIndex < asyncOpsHead &&
+            asyncOp == asyncOpSlot(targetIndex).get()) {
 
             // All older ops are known to be done and we can reclaim their resources here:
             // Both execute_in_order and execute_any_order flags always remove ops in-order at the end of the pipe.
-            // Note if not found above targetIndex=-1 and we skip the loop:
-            for (int i = targetIndex; i>=0; i--) {
-                Kalmar::KalmarAsyncOp *op = asyncOps[i].get();
-                if (op) {
-                    asyncOps[i].reset();
+            retireAsyncOps(targetIndex + 1);
+        }
+    }
+
+private:
+    std::shared_ptr<HSAOp> &asyncOpSlot(uint64_t index) {
+        return asyncOps[index & (asyncOps.size() - 1)];
+    }
+
+    // only valid if the ring is not empty
+    std::shared_ptr<HSAOp> &youngestAsyncOp() {
+        return asyncOpSlot(asyncOpsHead - 1);
+    }
+
+    // Drop the ops older than op number end from the ring.
+    void retireAsyncOps(uint64_t end) {
+        while (asyncOpsTail < end) {
+            // The slot is emptied and the tail moved before the op is
+            // released, as releasing an op which is still marked in flight
+            // waits for it and calls back into removeAsyncOp.
+            std::shared_ptr<HSAOp> op = std::move(asyncOpSlot(asyncOpsTail));
+            ++asyncOpsTail;
+            op->retired();
 
         #if CHECK_OLDER_COMPLETE
-                    // opportunistically update status for any ops we encounter along the way:
-                    hsa_signal_t signal =  *(static_cast<hsa_signal_t*> (op->getNativeHandle()));
-
-                    // v<0 : no signal, v==0 signal and done, v>0 : signal and not done:
-                    hsa_signal_value_t v = -1;
-                    if (signal.handle)
-                        v = hsa_signal_load_scacquire(signal);
-                    assert (v <=0);
+            // opportunistically update status for any ops we encounter along the way:
+            hsa_signal_t signal =  *(static_cast<hsa_signal_t*> (op->getNativeHandle()));
+
+            // v<0 : no signal, v==0 signal and done, v>0 : signal and not done:
+            hsa_signal_value_t v = -1;
+            if (signal.handle)
+                v = hsa_signal_load_scacquire(signal);
+            assert (v <=0);
         #endif
+        }
+    }
 
-                } else {
-                    // The queue is retired in-order, and ops only inserted at "top", and ops can only be removed at two defined points:
-                    //   - Draining the entire queue in HSAQueue::wait() - this calls asyncOps.clear()
-                    //   - Events in the middle of the queue can be removed, but will call this function which removes all older ops.
-                    //   So once we remove the asyncOps, there is no way for an older async op to be come non-null and we can stop search here:
+    // Retire the ops at the tail whose signal shows they have completed.
+    // Ops without a signal can't be checked and stop the scan.
+    void reclaimAsyncOps() {
+        uint64_t end = asyncOpsTail;
+        while (end != asyncOpsHead) {
+            hsa_signal_t signal = *(static_cast<hsa_signal_t*> (asyncOpSlot(end)->getNativeHandle()));
+            if (!signal.handle || hsa_signal_load_scacquire(signal) != 0) {
+                break;
+            }
+            ++end;
+        }
+        retireAsyncOps(end);
+    }
 
-                    break; // stop searching if we find null, there cannot be any more valid pointers below.
-                }
+    // Wait for op, which is held by the ring, and retire it along with all
+    // older ops.
+    void waitAsyncOp(const std::shared_ptr<HSAOp> &asyncOp, hcWaitMode mode = hcWaitModeHybrid) {
+        std::shared_future<void>* future = asyncOp->getFuture();
+        if (future && future->valid()) {
+            asyncOp->setWaitMode(mode);
+            future->wait();
+        } else {
+            hsa_signal_t signal = *(static_cast<hsa_signal_t*> (asyncOp->getNativeHandle()));
+            if (signal.handle) {
+                waiter.wait(signal, HSA_SIGNAL_CONDITION_LT, 1, mode);
+            }
+        }
+        retireAsyncOps(asyncOp->asyncOpsIndex() + 1);
+    }
+
+    // Make room in a ring which hit MAX_INFLIGHT_COMMANDS_PER_QUEUE by waiting
+    // for the oldest op with a signal, ops without one are complete once a
+    // younger op is.
+    void waitOldestAsyncOp() {
+        for (uint64_t i = asyncOpsTail; i != asyncOpsHead; ++i) {
+            hsa_signal_t signal = *(static_cast<hsa_signal_t*> (asyncOpSlot(i)->getNativeHandle()));
+            if (signal.handle) {
+                waitAsyncOp(std::shared_ptr<HSAOp>(asyncOpSlot(i)));
+                return;
             }
         }
+        // nothing to wait for in the ring, sync the queue instead
+        wait(hcWaitModeHybrid);
+    }
 
+    // Double the capacity of a full ring.
+    void growAsyncOps() {
+        assert (asyncOps.size() < MAX_INFLIGHT_COMMANDS_PER_QUEUE);
 
-        // GC for finished kernels
-        if (asyncOps.size() > ASYNCOPS_VECTOR_GC_SIZE) {
-            DBOUTL(DB_RESOURCE, "asyncOps size=" << asyncOps.size() << " exceeds collection size, compacting");
-            asyncOps.erase(std::remove(asyncOps.begin(), asyncOps.end(), nullptr),
-                         asyncOps.end());
+        std::vector< std::shared_ptr<HSAOp> > ring(asyncOps.size() * 2);
+        for (uint64_t i = asyncOpsTail; i != asyncOpsHead; ++i) {
+            ring[i & (ring.size() - 1)] = std::move(asyncOpSlot(i));
         }
+        asyncOps.swap(ring);
+
+        DBOUTL(DB_RESOURCE, *this << " grew inflight op ring to " << asyncOps.size() << " entries");
     }
 };
 
@@ -2233,10 +2921,16 @@ class HSADevice final : public KalmarDevice
     friend std::ostream& operator<<(std::ostream& os, const HSAQueue & hav);
 private:
     /// memory pool for kernargs
-    std::vector<void*> kernargPool;
-    std::vector<bool> kernargPoolFlag;
-    int kernargCursor;
-    std::mutex kernargPoolMutex;
+    ///
+    /// Fallback for dispatches whose queue has no room left in its kernarg
+    /// ring: one free list per size class, each with a lock of its own, which
+    /// grows by KERNARG_POOL_SLAB_SIZE bytes at a time.
+    struct KernargClass {
+        std::mutex lock;
+        std::vector<void*> freeBuffers;
+        std::vector<void*> slabs;
+    };
+    KernargClass kernargPool[KERNARG_CLASS_COUNT];
 
 
     std::map<std::string, HSAKernel *> programs;
@@ -2281,6 +2975,7 @@ public:
     // Structures to manage unpinnned memory copies
     class UnpinnedCopyEngine      *copy_engine[2]; // one for each direction.
     UnpinnedCopyEngine::CopyMode  copy_mode;
+    CopyTuner                     *copy_tuner;     // shared by both copy engines, null if HCC_COPY_TUNER=0
 
     // Creates or steals a rocrQueue and returns it in theif->rocrQueue
     void createOrstealRocrQueue(Kalmar::HSAQueue *thief, queue_priority priority = priority_normal) {
@@ -2529,6 +3224,11 @@ public:
         return agent;
     }
 
+    // packets of the ROCr queues created for the device
+    size_t getQueueSize() const {
+        return queue_size;
+    }
+
     hsa_agent_t& getHostAgent() {
         return hostAgent;
     }
@@ -2567,24 +3267,16 @@ public:
         queues_mutex.unlock();
 
         // deallocate kernarg buffers in the pool
-#if KERNARG_POOL_SIZE > 0
-        kernargPoolMutex.lock();
-
-        hsa_status_t status = HSA_STATUS_SUCCESS;
-
-        // kernargPool is allocated in batch, KERNARG_POOL_SIZE for each
-        // allocation. it is therefore be released also in batch.
-        for (int i = 0; i < kernargPool.size() / KERNARG_POOL_SIZE; ++i) {
-            hsa_amd_memory_pool_free(kernargPool[i * KERNARG_POOL_SIZE]);
-            STATUS_CHECK(status, __LINE__);
+        // kernarg buffers are allocated in slabs, which are released as a whole
+        for (auto&& kernargClass : kernargPool) {
+            std::lock_guard<std::mutex> l(kernargClass.lock);
+            for (void* slab : kernargClass.slabs) {
+                hsa_amd_memory_pool_free(slab);
+            }
+            kernargClass.slabs.clear();
+            kernargClass.freeBuffers.clear();
         }
 
-        kernargPool.clear();
-        kernargPoolFlag.clear();
-
-        kernargPoolMutex.unlock();
-#endif
-
         // release all data in programs
         for (auto kernel_iterator : programs) {
             delete kernel_iterator.second;
@@ -2604,6 +3296,8 @@ public:
                 copy_engine[i] = NULL;
             }
         }
+        delete copy_tuner;
+        copy_tuner = NULL;
 
 
         DBOUT(DB_INIT, "HSADevice::~HSADevice() out\n");
@@ -2768,6 +3462,10 @@ public:
     }
 
     void* CreateKernel(const char* fun, Kalmar::KalmarQueue *queue) override {
+        return CreateDispatch(GetKernel(fun, queue), queue);
+    }
+
+    void* GetKernel(const char* fun, Kalmar::KalmarQueue *queue) override {
         // try load kernels lazily in case it was not done so at bootstrap
         // due to HCC_LAZYINIT env var
         if (executables.size() == 0) {
@@ -2916,11 +3614,15 @@ public:
             programs[str] = kernel;
         }
 
+        return kernel;
+    }
+
+    void* CreateDispatch(void* kernel, Kalmar::KalmarQueue *queue) override {
         // HSADispatch instance will be deleted in:
         // HSAQueue::LaunchKernel()
         // or it will be created as a shared_ptr<KalmarAsyncOp> in:
         // HSAQueue::LaunchKernelAsync()
-        HSADispatch *dispatch = new HSADispatch(this, queue, kernel);
+        HSADispatch *dispatch = new HSADispatch(this, queue, static_cast<HSAKernel*>(kernel));
         return dispatch;
     }
 
@@ -3037,15 +3739,21 @@ public:
         return cpu_accessible_am;
     };
 
-    void releaseKernargBuffer(void* kernargBuffer, int kernargBufferIndex) {
-        if ( (KERNARG_POOL_SIZE > 0) && (kernargBufferIndex >= 0) ) {
-            kernargPoolMutex.lock();
-
-
-            // mark the kernarg buffer pointed by kernelBufferIndex as available
-            kernargPoolFlag[kernargBufferIndex] = false;
+    // size class of kernarg buffers of size bytes, -1 if there is none
+    static int kernargClassOf(int size) {
+        int kernargClass = 0;
+        for (int classSize = KERNARG_MIN_CLASS_SIZE; classSize < size; classSize *= 2) {
+            ++kernargClass;
+        }
+        return (KERNARG_POOL_SLAB_SIZE > 0 && kernargClass < KERNARG_CLASS_COUNT) ? kernargClass : -1;
+    }
 
-            kernargPoolMutex.unlock();
+    void releaseKernargBuffer(void* kernargBuffer, int kernargBufferIndex) {
+        if (kernargBufferIndex >= 0) {
+            // return the buffer to the free list of its size class
+            KernargClass& kernargClass = kernargPool[kernargBufferIndex];
+            std::lock_guard<std::mutex> l(kernargClass.lock);
+            kernargClass.freeBuffers.push_back(kernargBuffer);
          } else {
             if (kernargBuffer != nullptr) {
                 hsa_amd_memory_pool_free(kernargBuffer);
@@ -3053,113 +3761,50 @@ public:
          }
     }
 
-    void growKernargBuffer()
+    // increase the pool of size class kernargClassIndex by KERNARG_POOL_SLAB_SIZE
+    // the lock of the class must be held
+    void growKernargBuffer(int kernargClassIndex)
     {
+        KernargClass& kernargClass = kernargPool[kernargClassIndex];
+        const size_t bufferSize = size_t(KERNARG_MIN_CLASS_SIZE) << kernargClassIndex;
+        const size_t slabSize = std::max<size_t>(KERNARG_POOL_SLAB_SIZE, bufferSize);
+
         uint8_t * kernargMemory = nullptr;
-        // increase kernarg pool on demand by KERNARG_POOL_SIZE
         hsa_amd_memory_pool_t kernarg_region = getHSAKernargRegion();
 
-        hsa_status_t status = hsa_amd_memory_pool_allocate(kernarg_region, KERNARG_POOL_SIZE * KERNARG_BUFFER_SIZE, 0, (void**)(&kernargMemory));
+        hsa_status_t status = hsa_amd_memory_pool_allocate(kernarg_region, slabSize, 0, (void**)(&kernargMemory));
         STATUS_CHECK(status, __LINE__);
 
         status = hsa_amd_agents_allow_access(1, &agent, NULL, kernargMemory);
         STATUS_CHECK(status, __LINE__);
 
-        for (size_t i = 0; i < KERNARG_POOL_SIZE * KERNARG_BUFFER_SIZE; i+=KERNARG_BUFFER_SIZE) {
-            kernargPool.push_back(kernargMemory+i);
-            kernargPoolFlag.push_back(false);
+        if (!kernargClass.slabs.empty()) {
+            DBOUTL(DB_RESOURCE, "Growing kernarg pool of " << bufferSize << " byte buffers to "
+                                << (kernargClass.slabs.size() + 1) * slabSize << " bytes");
+        }
+        kernargClass.slabs.push_back(kernargMemory);
+        for (size_t i = 0; i + bufferSize <= slabSize; i += bufferSize) {
+            kernargClass.freeBuffers.push_back(kernargMemory + i);
         };
     }
 
     std::pair<void*, int> getKernargBuffer(int size) {
         void* ret = nullptr;
-        int cursor = 0;
-
-        // find an available buffer in the pool in case
-        // - kernarg pool is available
-        // - requested size is smaller than KERNARG_BUFFER_SIZE
-        if ( (KERNARG_POOL_SIZE > 0) && (size <= KERNARG_BUFFER_SIZE) ) {
-            kernargPoolMutex.lock();
-            cursor = kernargCursor;
-
-            if (kernargPoolFlag[cursor] == false) {
-                // the cursor is valid, use it
-                ret = kernargPool[cursor];
-
-                // set the kernarg buffer as used
-                kernargPoolFlag[cursor] = true;
-
-                // simply move the cursor to the next index
-                ++kernargCursor;
-                if (kernargCursor == kernargPool.size()) kernargCursor = 0;
-            } else {
-                // the cursor is not valid, sequentially find the next available slot
-                bool found = false;
-
-                int startingCursor = cursor;
-                do {
-                    ++cursor;
-                    if (cursor == kernargPool.size()) cursor = 0;
-
-                    if (kernargPoolFlag[cursor] == false) {
-                        // the cursor is valid, use it
-                        ret = kernargPool[cursor];
-
-                        // set the kernarg buffer as used
-                        kernargPoolFlag[cursor] = true;
-
-                        // simply move the cursor to the next index
-                        kernargCursor = cursor + 1;
-                        if (kernargCursor == kernargPool.size()) kernargCursor = 0;
-
-                        // break from the loop
-                        found = true;
-                        break;
-                    }
-                } while(cursor != startingCursor); // ensure we at most scan the vector once
-
-                if (found == false) {
-                    hsa_status_t status = HSA_STATUS_SUCCESS;
-
-                    // increase kernarg pool on demand by KERNARG_POOL_SIZE
-                    hsa_amd_memory_pool_t kernarg_region = getHSAKernargRegion();
-
-                    // keep track of the size of kernarg pool before increasing it
-                    int oldKernargPoolSize = kernargPool.size();
-                    int oldKernargPoolFlagSize = kernargPoolFlag.size();
-                    assert(oldKernargPoolSize == oldKernargPoolFlagSize);
-
-
-                    growKernargBuffer();
-                    assert(kernargPool.size() == oldKernargPoolSize + KERNARG_POOL_SIZE);
-                    assert(kernargPoolFlag.size() == oldKernargPoolFlagSize + KERNARG_POOL_SIZE);
-
-                    // set return values, after the pool has been increased
-
-                    // use the first item in the newly allocated pool
-                    cursor = oldKernargPoolSize;
-
-                    // access the new item through the newly assigned cursor
-                    ret = kernargPool[cursor];
-
-                    // mark the item as used
-                    kernargPoolFlag[cursor] = true;
-
-                    // simply move the cursor to the next index
-                    kernargCursor = cursor + 1;
-                    if (kernargCursor == kernargPool.size()) kernargCursor = 0;
-
-                    found = true;
-                }
 
+        // take a buffer of the smallest size class which fits
+        int kernargClassIndex = kernargClassOf(size);
+        if (kernargClassIndex >= 0) {
+            KernargClass& kernargClass = kernargPool[kernargClassIndex];
+            std::lock_guard<std::mutex> l(kernargClass.lock);
+            if (kernargClass.freeBuffers.empty()) {
+                growKernargBuffer(kernargClassIndex);
             }
-
-            kernargPoolMutex.unlock();
-            memset (ret, 0x00, KERNARG_BUFFER_SIZE);
+            ret = kernargClass.freeBuffers.back();
+            kernargClass.freeBuffers.pop_back();
         } else {
             // allocate new buffers in case:
-            // - the kernarg pool is set at compile-time
-            // - requested kernarg buffer size is larger than KERNARG_BUFFER_SIZE
+            // - the kernarg pool is disabled at compile-time
+            // - requested kernarg buffer size is larger than KERNARG_MAX_CLASS_SIZE
             //
 
             hsa_status_t status = HSA_STATUS_SUCCESS;
@@ -3172,16 +3817,11 @@ public:
             STATUS_CHECK(status, __LINE__);
 
             DBOUTL(DB_RESOURCE, "Allocating non-pool kernarg buffer size=" << size );
-
-            // set cursor value as -1 to notice the buffer would be deallocated
-            // instead of recycled back into the pool
-            cursor = -1;
-            memset (ret, 0x00, size);
         }
 
-
-
-        return std::make_pair(ret, cursor);
+        // the dispatch fills in all size bytes, an index of -1 notes the
+        // buffer is deallocated instead of recycled back into the pool
+        return std::make_pair(ret, kernargClassIndex);
     }
 
     void* getSymbolAddress(const char* symbolName) override {
@@ -3363,6 +4003,12 @@ void hccgetenv(const char *var_name, char **var, const char *usage)
 #define GET_ENV_STRING(envVar, usage)  hccgetenv (#envVar, &envVar, usage)
 
 
+// Whether the signal pool of the context is alive, and the number of exiting
+// threads returning their signal caches to it. Kept out of the context, which
+// the caches of threads exiting after its destruction must not touch; atomics
+// are trivially destroyed, so they stay readable during all of the exit.
+static std::atomic<bool> s_signalPoolAlive(false);
+static std::atomic<int> s_signalCacheExits(0);
 
 class HSAContext final : public KalmarContext
 {
@@ -3370,10 +4016,50 @@ public:
     std::map<uint64_t, HSADevice *> agentToDeviceMap_;
 private:
     /// memory pool for signals
-    std::vector<hsa_signal_t> signalPool;
-    std::vector<bool> signalPoolFlag;
-    int signalCursor;
+    ///
+    /// Signals are created in chunks of signalChunkSize slots, which live as
+    /// long as the context; a signal is named by the index of its slot. Free
+    /// slots are kept on a lock-free list, and every thread keeps a cache of
+    /// them so that most getSignal / releaseSignal calls touch no shared state.
+    struct SignalSlot {
+        hsa_signal_t signal;
+        // index + 1 of the next free slot, 0 ends the list
+        std::atomic<uint32_t> next;
+    };
+
+    /// free slots owned by one thread
+    struct SignalCache {
+        HSAContext* owner = nullptr;
+        std::vector<uint32_t> slots;
+        // getSignal calls served from the cache, not yet added to signalCacheHits
+        uint64_t hits = 0;
+
+        ~SignalCache() {
+            if (!owner) {
+                return;
+            }
+            // the context waits for the exits it may have missed before
+            // destroying the pool; once it is gone, the signals are leaked
+            s_signalCacheExits.fetch_add(1, std::memory_order_seq_cst);
+            if (s_signalPoolAlive.load(std::memory_order_seq_cst)) {
+                owner->flushSignalCache(*this, slots.size());
+            }
+            s_signalCacheExits.fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    std::atomic<SignalSlot*> signalChunks[SIGNAL_POOL_MAX_CHUNKS];
+    std::atomic<int> signalChunkCount;
+    int signalChunkSize;
+    // top of the free list: ABA tag in the upper 32 bits, index + 1 of the
+    // first free slot in the lower 32 bits
+    std::atomic<uint64_t> signalFreeHead;
+    // held only while growing the pool
     std::mutex signalPoolMutex;
+
+    std::atomic<uint64_t> signalCacheHits;
+    std::atomic<uint64_t> signalCacheMisses;
+    std::atomic<uint64_t> signalPoolGrowth;
     /* TODO: Modify properly when supporing multi-gpu.
     When using memory pool api, each agent will only report memory pool
     which is attached with the agent itself physically, eg, GPU won't
@@ -3451,7 +4137,8 @@ public:
     void ReadHccEnv() ;
     std::ostream &getHccProfileStream() const { return *hccProfileStream; };
 
-    HSAContext() : KalmarContext(), signalPool(), signalPoolFlag(), signalCursor(0), signalPoolMutex() {
+    HSAContext() : KalmarContext(), signalChunks(), signalChunkCount(0), signalChunkSize(0), signalFreeHead(0),
+                   signalPoolMutex(), signalCacheHits(0), signalCacheMisses(0), signalPoolGrowth(0) {
         host.handle = (uint64_t)-1;
 
         ReadHccEnv();
@@ -3494,131 +4181,157 @@ public:
         }
         def = Devices[first_gpu_index + HCC_DEFAULT_GPU];
 
-        signalPoolMutex.lock();
-
         // pre-allocate signals
         DBOUT(DB_SIG,  " pre-allocate " << HCC_SIGNAL_POOL_SIZE << " signals\n");
-        for (int i = 0; i < HCC_SIGNAL_POOL_SIZE; ++i) {
-          hsa_signal_t signal;
-          status = hsa_signal_create(1, 0, NULL, &signal);
-          STATUS_CHECK(status, __LINE__);
-          signalPool.push_back(signal);
-          signalPoolFlag.push_back(false);
-        }
-
-        signalPoolMutex.unlock();
+        signalChunkSize = std::max(HCC_SIGNAL_POOL_SIZE, SIGNAL_CACHE_BATCH);
+        growSignalPool();
+        s_signalPoolAlive.store(true, std::memory_order_release);
 
         initPrintfBuffer();
 
         init_success = true;
     }
 
-    void releaseSignal(hsa_signal_t signal, int signalIndex) {
-
-        if (signal.handle) {
-
-            DBOUT(DB_SIG, "  releaseSignal: 0x" << std::hex << signal.handle << std::dec << " and restored value to 1\n");
-            hsa_status_t status = HSA_STATUS_SUCCESS;
-            signalPoolMutex.lock();
-
-            // restore signal to the initial value 1
-            hsa_signal_store_screlease(signal, 1);
-
-            // mark the signal pointed by signalIndex as available
-            signalPoolFlag[signalIndex] = false;
-
-            signalPoolMutex.unlock();
+private:
+    SignalSlot& signalSlot(uint32_t index) {
+        return signalChunks[index / signalChunkSize].load(std::memory_order_acquire)[index % signalChunkSize];
+    }
+
+    uint32_t signalCapacity() {
+        return signalChunkCount.load(std::memory_order_acquire) * signalChunkSize;
+    }
+
+    // push the chain of slots first .. last, already linked through next,
+    // onto the free list
+    void pushFreeSignals(uint32_t first, uint32_t last) {
+        uint64_t head = signalFreeHead.load(std::memory_order_relaxed);
+        uint64_t newHead;
+        do {
+            signalSlot(last).next.store(uint32_t(head), std::memory_order_relaxed);
+            newHead = (((head >> 32) + 1) << 32) | (first + 1);
+        } while (!signalFreeHead.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // pop up to count slots off the free list into cache, returns the number popped
+    size_t popFreeSignals(std::vector<uint32_t>& cache, size_t count) {
+        uint64_t head = signalFreeHead.load(std::memory_order_acquire);
+        for (;;) {
+            // Walk the first count slots. The slots are never freed, so a
+            // stale next read while other threads change the list names some
+            // valid slot, and the tag makes the CAS fail in that case.
+            uint32_t capacity = signalCapacity();
+            uint32_t link = uint32_t(head);
+            size_t n = 0;
+            while (link != 0 && link <= capacity && n < count) {
+                cache.push_back(link - 1);
+                link = signalSlot(link - 1).next.load(std::memory_order_relaxed);
+                ++n;
+            }
+            uint64_t newHead = (((head >> 32) + 1) << 32) | link;
+            if (n == 0 || signalFreeHead.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire)) {
+                return n;
+            }
+            cache.resize(cache.size() - n);
         }
     }
 
-    std::pair<hsa_signal_t, int> getSignal() {
-        hsa_signal_t ret;
-
-        signalPoolMutex.lock();
-        int cursor = signalCursor;
-
-        if (signalPoolFlag[cursor] == false) {
-            // the cursor is valid, use it
-            ret = signalPool[cursor];
+    // create signalChunkSize more signals and put them on the free list
+    void growSignalPool() {
+        std::lock_guard<std::mutex> l(signalPoolMutex);
 
-            // set the signal as used
-            signalPoolFlag[cursor] = true;
-
-            // simply move the cursor to the next index
-            ++signalCursor;
-            if (signalCursor == signalPool.size()) signalCursor = 0;
-        } else {
-            // the cursor is not valid, sequentially find the next available slot
-            bool found = false;
-            int startingCursor = cursor;
-            do {
-                ++cursor;
-                if (cursor == signalPool.size()) cursor = 0;
-
-                if (signalPoolFlag[cursor] == false) {
-                    // the cursor is valid, use it
-                    ret = signalPool[cursor];
-
-                    // set the signal as used
-                    signalPoolFlag[cursor] = true;
-
-                    // simply move the cursor to the next index
-                    signalCursor = cursor + 1;
-                    if (signalCursor == signalPool.size()) signalCursor = 0;
-
-                    // break from the loop
-                    found = true;
-                    break;
-                }
-            } while(cursor != startingCursor); // ensure we at most scan the vector once
+        // another thread may have grown the pool in the meantime
+        if (uint32_t(signalFreeHead.load(std::memory_order_acquire)) != 0) {
+            return;
+        }
 
-            if (found == false) {
-                hsa_status_t status = HSA_STATUS_SUCCESS;
+        int chunk = signalChunkCount.load(std::memory_order_relaxed);
+        if (chunk == SIGNAL_POOL_MAX_CHUNKS) {
+            throw Kalmar::runtime_exception("HSA signal pool exhausted", chunk);
+        }
+        if (chunk) {
+            DBOUTL(DB_RESOURCE, "Growing signal pool from " << signalCapacity() << " to " << signalCapacity() + signalChunkSize);
+        }
 
-                // increase signal pool on demand by HCC_SIGNAL_POOL_SIZE
+        SignalSlot* slots = new SignalSlot[signalChunkSize];
+        uint32_t base = chunk * signalChunkSize;
+        for (int i = 0; i < signalChunkSize; ++i) {
+            hsa_status_t status = hsa_signal_create(1, 0, NULL, &slots[i].signal);
+            STATUS_CHECK(status, __LINE__);
+            slots[i].next.store(i + 1 < signalChunkSize ? base + i + 2 : 0, std::memory_order_relaxed);
+        }
+        signalChunks[chunk].store(slots, std::memory_order_release);
+        signalChunkCount.store(chunk + 1, std::memory_order_release);
+        if (chunk) {
+            signalPoolGrowth.fetch_add(1, std::memory_order_relaxed);
+        }
 
-                // keep track of the size of signal pool before increasing it
-                int oldSignalPoolSize = signalPool.size();
-                int oldSignalPoolFlagSize = signalPoolFlag.size();
-                assert(oldSignalPoolSize == oldSignalPoolFlagSize);
+        pushFreeSignals(base, base + signalChunkSize - 1);
 
-                DBOUTL(DB_RESOURCE, "Growing signal pool from " << signalPool.size() << " to " << signalPool.size() + HCC_SIGNAL_POOL_SIZE);
+        DBOUT(DB_SIG,  "grew signal pool to size=" << signalCapacity() << "\n");
+    }
 
-                // increase signal pool on demand for another HCC_SIGNAL_POOL_SIZE
-                for (int i = 0; i < HCC_SIGNAL_POOL_SIZE; ++i) {
-                    hsa_signal_t signal;
-                    status = hsa_signal_create(1, 0, NULL, &signal);
-                    STATUS_CHECK(status, __LINE__);
-                    signalPool.push_back(signal);
-                    signalPoolFlag.push_back(false);
-                }
+    // return count slots from the back of cache to the free list
+    void flushSignalCache(SignalCache& cache, size_t count) {
+        if (cache.hits) {
+            signalCacheHits.fetch_add(cache.hits, std::memory_order_relaxed);
+            cache.hits = 0;
+        }
+        if (count == 0) {
+            return;
+        }
+        size_t first = cache.slots.size() - count;
+        for (size_t i = first; i + 1 < cache.slots.size(); ++i) {
+            signalSlot(cache.slots[i]).next.store(cache.slots[i + 1] + 1, std::memory_order_relaxed);
+        }
+        pushFreeSignals(cache.slots[first], cache.slots.back());
+        cache.slots.resize(first);
+    }
 
-                DBOUT(DB_SIG,  "grew signal pool to size=" << signalPool.size() << "\n");
+    SignalCache& signalCache() {
+        static thread_local SignalCache cache;
+        if (cache.owner == nullptr) {
+            cache.owner = this;
+            cache.slots.reserve(2 * SIGNAL_CACHE_BATCH);
+        }
+        return cache;
+    }
 
-                assert(signalPool.size() == oldSignalPoolSize + HCC_SIGNAL_POOL_SIZE);
-                assert(signalPoolFlag.size() == oldSignalPoolFlagSize + HCC_SIGNAL_POOL_SIZE);
+public:
+    void releaseSignal(hsa_signal_t signal, int signalIndex) {
 
-                // set return values, after the pool has been increased
+        if (signal.handle) {
 
-                // use the first item in the newly allocated pool
-                cursor = oldSignalPoolSize;
+            DBOUT(DB_SIG, "  releaseSignal: 0x" << std::hex << signal.handle << std::dec << " and restored value to 1\n");
 
-                // access the new item through the newly assigned cursor
-                ret = signalPool[cursor];
+            // restore signal to the initial value 1
+            hsa_signal_store_screlease(signal, 1);
 
-                // mark the item as used
-                signalPoolFlag[cursor] = true;
+            // signals are commonly released by a different thread than the
+            // one which got them, overflowing caches go back to the pool
+            SignalCache& cache = signalCache();
+            cache.slots.push_back(signalIndex);
+            if (cache.slots.size() >= 2 * SIGNAL_CACHE_BATCH) {
+                flushSignalCache(cache, SIGNAL_CACHE_BATCH);
+            }
+        }
+    }
 
-                // simply move the cursor to the next index
-                signalCursor = cursor + 1;
-                if (signalCursor == signalPool.size()) signalCursor = 0;
+    std::pair<hsa_signal_t, int> getSignal() {
+        SignalCache& cache = signalCache();
 
-                found = true;
+        if (cache.slots.empty()) {
+            signalCacheMisses.fetch_add(1, std::memory_order_relaxed);
+            flushSignalCache(cache, 0);
+            while (popFreeSignals(cache.slots, SIGNAL_CACHE_BATCH) == 0) {
+                growSignalPool();
             }
+        } else {
+            ++cache.hits;
         }
 
-        signalPoolMutex.unlock();
-        return std::make_pair(ret, cursor);
+        uint32_t index = cache.slots.back();
+        cache.slots.pop_back();
+        return std::make_pair(signalSlot(index).signal, int(index));
     }
 
     ~HSAContext() {
@@ -3646,19 +4359,35 @@ public:
         Devices.clear();
         def = nullptr;
 
-        signalPoolMutex.lock();
+        // after the devices, their copy tuners have handed over what they learned
+        if (HCC_COPY_PROFILE) {
+            CopyTuner::SaveProfile(HCC_COPY_PROFILE);
+        }
 
-        // deallocate signals in the pool
-        for (int i = 0; i < signalPool.size(); ++i) {
-            hsa_signal_t signal;
-            status = hsa_signal_destroy(signalPool[i]);
-            STATUS_CHECK(status, __LINE__);
+        // caches of threads exiting from now on are not returned, those
+        // being returned already are waited for
+        s_signalPoolAlive.store(false, std::memory_order_seq_cst);
+        while (s_signalCacheExits.load(std::memory_order_seq_cst) != 0) {
+            std::this_thread::yield();
         }
 
-        signalPool.clear();
-        signalPoolFlag.clear();
+        DBOUTL(DB_RESOURCE, "Signal pool: " << signalCapacity() << " signals, " << signalCacheHits.load()
+                            << " cache hits, " << signalCacheMisses.load() << " cache misses, grew "
+                            << signalPoolGrowth.load() << " times");
 
-        signalPoolMutex.unlock();
+        // deallocate signals in the pool
+        int chunkCount = signalChunkCount.load(std::memory_order_acquire);
+        for (int chunk = 0; chunk < chunkCount; ++chunk) {
+            SignalSlot* slots = signalChunks[chunk].load(std::memory_order_relaxed);
+            for (int i = 0; i < signalChunkSize; ++i) {
+                status = hsa_signal_destroy(slots[i].signal);
+                STATUS_CHECK(status, __LINE__);
+            }
+            delete [] slots;
+            signalChunks[chunk].store(nullptr, std::memory_order_relaxed);
+        }
+        signalChunkCount.store(0, std::memory_order_relaxed);
+        signalFreeHead.store(0, std::memory_order_relaxed);
 
         // shutdown HSA runtime
         status = hsa_shut_down();
@@ -3756,17 +4485,34 @@ void HSAContext::ReadHccEnv()
 
     GET_ENV_INT(HCC_SIGNAL_POOL_SIZE, "Number of pre-allocated HSA signals.  Signals are precious resource so manage carefully");
 
+    GET_ENV_INT(HCC_KERNARG_RING_SIZE, "Size (in KB) of the kernarg ring of each queue, 0 disables the rings");
+
     GET_ENV_INT(HCC_UNPINNED_COPY_MODE, "Select algorithm for unpinned copies. 0=ChooseBest(see thresholds), 1=PinInPlace, 2=StagingBuffer, 3=Memcpy");
 
     GET_ENV_INT(HCC_CHECK_COPY, "Check dst == src after each copy operation.  Only works on large-bar systems.");
 
 
     // Select thresholds to use for unpinned copies
-    GET_ENV_INT (HCC_H2D_STAGING_THRESHOLD,    "Min size (in KB) to use staging buffer algorithm for H2D copy if ChooseBest algorithm selected");
-    GET_ENV_INT (HCC_H2D_PININPLACE_THRESHOLD, "Min size (in KB) to use pin-in-place algorithm for H2D copy if ChooseBest algorithm selected");
-    GET_ENV_INT (HCC_D2H_PININPLACE_THRESHOLD, "Min size (in KB) to use pin-in-place for D2H copy if ChooseBest algorithm selected");
+    GET_ENV_INT (HCC_H2D_STAGING_THRESHOLD,    "Min size (in KB) to use staging buffer algorithm for H2D copy if ChooseBest algorithm selected, ignored unless HCC_COPY_TUNER=0");
+    GET_ENV_INT (HCC_H2D_PININPLACE_THRESHOLD, "Min size (in KB) to use pin-in-place algorithm for H2D copy if ChooseBest algorithm selected, ignored unless HCC_COPY_TUNER=0");
+    GET_ENV_INT (HCC_D2H_PININPLACE_THRESHOLD, "Min size (in KB) to use pin-in-place for D2H copy if ChooseBest algorithm selected, ignored unless HCC_COPY_TUNER=0");
 
     GET_ENV_INT (HCC_STAGING_BUFFER_SIZE, "Unpinned copy engine staging buffer size in KB");
+
+    GET_ENV_INT (HCC_UNPINNED_COPY_CHANNELS, "Max number of unpinned copies run concurrently by a copy engine, each with staging buffers of its own");
+
+    GET_ENV_INT (HCC_STAGING_COPY_THREADS, "Number of threads sharing the CPU memcpy of a staging buffer chunk");
+    GET_ENV_INT (HCC_STAGING_COPY_NONTEMPORAL, "Use non-temporal stores for the CPU memcpy of staging buffer chunks");
+
+    GET_ENV_INT (HCC_PINNED_CACHE_SIZE, "Max host memory (in MB) kept locked by pin-in-place copies for reuse, 0 to unlock after every copy (the default)");
+
+    GET_ENV_INT (HCC_COPY_TUNER, "Pick the ChooseBest unpinned copy algorithm from measured bandwidths instead of the thresholds");
+    GET_ENV_STRING (HCC_COPY_PROFILE, "File the copy tuner reads learned bandwidths from at startup and writes them to at exit");
+    if (HCC_COPY_PROFILE) {
+        CopyTuner::LoadProfile(HCC_COPY_PROFILE);
+    }
+
+    GET_ENV_INT (HCC_WAIT_SPIN_MAX_US, "Longest time (in us) a hybrid wait spins before it blocks");
   
     // Change the default GPU
     GET_ENV_INT (HCC_DEFAULT_GPU, "Change the default GPU (Default is device 0)");
@@ -3801,10 +4547,11 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
                                rocrQueues(/*empty*/), rocrQueuesMutex(),
                                ri(),
                                useCoarseGrainedRegion(false),
-                               kernargPool(), kernargPoolFlag(), kernargCursor(0), kernargPoolMutex(),
+                               kernargPool(),
                                executables(),
                                path(), description(), hostAgent(host),
-                               versionMajor(0), versionMinor(0), accSeqNum(x_accSeqNum), queueSeqNums(0) {
+                               versionMajor(0), versionMinor(0), accSeqNum(x_accSeqNum), queueSeqNums(0),
+                               copy_tuner(nullptr) {
     DBOUT(DB_INIT, "HSADevice::HSADevice()\n");
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
@@ -3853,6 +4600,7 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
 
         // Check that the queue size is valid, these assumptions are used in hsa_queue_create.
         assert (__builtin_popcount(MAX_INFLIGHT_COMMANDS_PER_QUEUE) == 1); // make sure this is power of 2.
+        assert (__builtin_popcount(ASYNCOPS_RING_MIN_SIZE) == 1);
     }
 
     status = hsa_amd_profiling_async_copy_enable(1);
@@ -3885,11 +4633,11 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
     }
     useCoarseGrainedRegion = result;
 
-    /// pre-allocate a pool of kernarg buffers in case:
+    /// pre-allocate kernarg buffers of the smallest size class in case:
     /// - kernarg region is available
-    /// - compile-time macro KERNARG_POOL_SIZE is larger than 0
-#if KERNARG_POOL_SIZE > 0
-    growKernargBuffer();
+    /// - compile-time macro KERNARG_POOL_SLAB_SIZE is larger than 0
+#if KERNARG_POOL_SLAB_SIZE > 0
+    growKernargBuffer(0);
 #endif
 
     // Setup AM pool.
@@ -3949,13 +4697,19 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) :
     this->cpu_accessible_am = false;
 
     hsa_amd_memory_pool_t hostPool = (getHSAAMHostRegion());
-    copy_engine[0] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging buffers*/,
+    PinnedRangeCache::get().setBudget(size_t(HCC_PINNED_CACHE_SIZE) * 1024 * 1024);
+
+    this->copy_tuner = HCC_COPY_TUNER ? new CopyTuner(std::string(path.begin(), path.end())) : nullptr;
+
+    copy_engine[0] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging buffers*/, HCC_UNPINNED_COPY_CHANNELS,
+                                            HCC_STAGING_COPY_THREADS, HCC_STAGING_COPY_NONTEMPORAL != 0, this->copy_tuner,
                                             this->cpu_accessible_am,
                                             HCC_H2D_STAGING_THRESHOLD,
                                             HCC_H2D_PININPLACE_THRESHOLD,
                                             HCC_D2H_PININPLACE_THRESHOLD);
 
-    copy_engine[1] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging Buffers*/,
+    copy_engine[1] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging Buffers*/, HCC_UNPINNED_COPY_CHANNELS,
+                                            HCC_STAGING_COPY_THREADS, HCC_STAGING_COPY_NONTEMPORAL != 0, this->copy_tuner,
                                             this->cpu_accessible_am,
                                             HCC_H2D_STAGING_THRESHOLD,
                                             HCC_H2D_PININPLACE_THRESHOLD,
@@ -4007,7 +4761,7 @@ std::ostream& operator<<(std::ostream& os, const HSAQueue & hav)
 HSAQueue::HSAQueue(KalmarDevice* pDev, hsa_agent_t agent, execute_order order, queue_priority priority) :
     KalmarQueue(pDev, queuing_mode_automatic, order, priority),
     rocrQueue(nullptr),
-    asyncOps(), drainingQueue_(false),
+    drainingQueue_(false), asyncOps(ASYNCOPS_RING_MIN_SIZE), asyncOpsHead(0), asyncOpsTail(0),
     valid(true), _nextSyncNeedsSysRelease(false), _nextKernelNeedsSysAcquire(false), bufferKernelMap(), kernelBufferMap()
 {
     {
@@ -4043,8 +4797,11 @@ void HSAQueue::dispose() override {
         std::lock_guard<std::mutex> rl(device->rocrQueuesMutex);
         std::lock_guard<std::recursive_mutex> l(this->qmutex);
 
+        // drop a capture which was never ended
+        captureGraph = nullptr;
+
         // wait on all existing kernel dispatches and barriers to complete
-        wait();
+        wait(hcWaitModeHybrid);
 
         this->valid = false;
 
@@ -4097,6 +4854,16 @@ void HSAQueue::releaseLockedRocrQueue()
     this->qmutex.unlock();
 }
 
+const std::shared_ptr<KernargRing>& HSAQueue::getKernargRing()
+{
+    if (!kernargRing && (HCC_KERNARG_RING_SIZE > 0)) {
+        auto device = static_cast<Kalmar::HSADevice*>(this->getDev());
+        kernargRing = std::make_shared<KernargRing>(device->getAgent(), device->getHSAKernargRegion(),
+                                                    size_t(HCC_KERNARG_RING_SIZE) * 1024);
+    }
+    return kernargRing;
+}
+
 inline void*
 HSAQueue::getHSAAgent() override {
     return static_cast<void*>(&(static_cast<HSADevice*>(getDev())->getAgent()));
@@ -4128,7 +4895,7 @@ void HSAQueue::copy_ext(const void *src, void *dst, size_t size_bytes, hc::hcCom
               const Kalmar::KalmarDevice *copyDevice, bool forceUnpinnedCopy) override {
     // wait for all previous async commands in this queue to finish
     // TODO - can remove this synchronization, copy is tail-synchronous not required on front end.
-    this->wait();
+    this->wait(hcWaitModeHybrid);
 
 
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
@@ -4163,7 +4930,7 @@ void HSAQueue::copy_ext(const void *src, void *dst, size_t size_bytes, hc::hcCom
 }
 
 void HSAQueue::copy2d_ext(const void *src, void *dst, size_t width, size_t height, size_t srcPitch, size_t dstPitch, hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrInfo, const hc::AmPointerInfo &dstPtrInfo, const Kalmar::KalmarDevice *copyDevice, bool forceUnpinnedCopy) { 
-    this->wait();
+    this->wait(hcWaitModeHybrid);
 
 
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
@@ -4183,6 +4950,10 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopyExt(const void* src, vo
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
 
+    if (captureGraph) {
+        return captureGraph->recordCopy(src, dst, size_bytes, 1, 0, 0, false, srcPtrInfo, dstPtrInfo, copyDevice);
+    }
+
     // create shared_ptr instance
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
     std::shared_ptr<HSACopy> copyCommand = std::make_shared<HSACopy>(this, src, dst, size_bytes);
@@ -4204,6 +4975,10 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy2dExt(const void* src,
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
 
+    if (captureGraph) {
+        return captureGraph->recordCopy(src, dst, width, height, srcPitch, dstPitch, true, srcPtrInfo, dstPtrInfo, copyDevice);
+    }
+
     //create shared_ptr instance
     const Kalmar::HSADevice *copy2dDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
     std::shared_ptr<HSACopy> copy2dCommand = std::make_shared<HSACopy>(this, src, dst, width*height);
@@ -4258,6 +5033,10 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy(const void *src, void
         copyDevice = nullptr; // H2H
     }
 
+    if (captureGraph) {
+        return captureGraph->recordCopy(src, dst, size_bytes, 1, 0, 0, false, srcPtrInfo, dstPtrInfo, copyDevice);
+    }
+
     // enqueue the async copy command
     status = copyCommand.get()->enqueueAsyncCopyCommand(copyDevice, srcPtrInfo, dstPtrInfo);
     STATUS_CHECK(status, __LINE__);
@@ -4290,6 +5069,14 @@ HSAQueue::dispatch_hsa_kernel(const hsa_kernel_dispatch_packet_t *aql,
     }
 
 
+    if (captureGraph) {
+        std::shared_ptr<KalmarAsyncOp> op = captureGraph->recordKernel(aql, args, argSize);
+        if (cf) {
+            *cf = hc::completion_future(op);
+        }
+        return;
+    }
+
     Kalmar::HSADevice* device = static_cast<Kalmar::HSADevice*>(this->getDev());
 
     std::shared_ptr<HSADispatch> sp_dispatch = std::make_shared<HSADispatch>(device, this/*queue*/, nullptr, aql);
@@ -4333,7 +5120,7 @@ HSADispatch::HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue *queue,
     kernel_name(nullptr),
     kernel(_kernel),
     isDispatched(false),
-    waitMode(HSA_WAIT_STATE_BLOCKED),
+    waitMode(Kalmar::hcWaitModeBlocked),
     future(nullptr),
     kernargMemory(nullptr)
 {
@@ -4479,11 +5266,21 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
     //printf("hostKernargSize size: %d in bytesn", hostKernargSize);
 
     if (hostKernargSize > 0) {
-        hsa_amd_memory_pool_t kernarg_region = device->getHSAKernargRegion();
-        std::pair<void*, int> ret = device->getKernargBuffer(hostKernargSize);
-        kernargMemory = ret.first;
-        kernargMemoryIndex = ret.second;
-        //std::cerr << "op #" << getSeqNum() << " allocated kernarg cursor=" << kernargMemoryIndex << "\n";
+        // carve the kernargs out of the ring of the queue, which is locked,
+        // and only go to the pool of the device when the ring is full
+        const std::shared_ptr<KernargRing>& ring = hsaQueue()->getKernargRing();
+        if (ring) {
+            kernargMemory = ring->alloc(hostKernargSize, &kernargMemoryIndex);
+        }
+        if (kernargMemory != nullptr) {
+            kernargRing = ring;
+        } else {
+            std::pair<void*, int> ret = device->getKernargBuffer(hostKernargSize);
+            kernargMemory = ret.first;
+            kernargMemoryIndex = ret.second;
+        }
+        DBOUTL(DB_KERNARG, "op#" << getSeqNum() << " allocated kernarg index=" << kernargMemoryIndex
+                           << (kernargRing ? " from the queue ring" : " from the device pool"));
 
         // as kernarg buffers are fine-grained, we can directly use memcpy
         memcpy(kernargMemory, hostKernarg, hostKernargSize);
@@ -4560,7 +5357,7 @@ HSADispatch::waitComplete() {
         DBOUT(DB_MISC, "wait for kernel dispatch op#" << *this  << " completion with wait flag: " << waitMode << "  signal="<< std::hex  << _signal.handle << std::dec << "\n");
 
         // wait for completion
-        if (hsa_signal_wait_scacquire(_signal, HSA_SIGNAL_CONDITION_LT, 1, uint64_t(-1), waitMode)!=0) {
+        if (waitSignal(HSA_SIGNAL_CONDITION_LT, 1, waitMode)!=0) {
             throw Kalmar::runtime_exception("Signal wait returned unexpected value\n", 0);
         }
 
@@ -4603,7 +5400,7 @@ HSADispatch::dispatchKernelWaitComplete() {
         hsa_queue_t* rocrQueue = hsaQueue()->acquireLockedRocrQueue();
 
         // dispatch kernel
-        status = dispatchKernel(rocrQueue, arg_vec.data(), arg_vec.size(), true);
+        status = dispatchKernel(rocrQueue, getArgs(), arg_size, true);
         STATUS_CHECK(status, __LINE__);
 
         hsaQueue()->releaseLockedRocrQueue();
@@ -4622,7 +5419,7 @@ HSADispatch::dispatchKernelWaitComplete() {
 inline hsa_status_t
 HSADispatch::dispatchKernelAsyncFromOp()
 {
-    return dispatchKernelAsync(arg_vec.data(), arg_vec.size(), true);
+    return dispatchKernelAsync(getArgs(), arg_size, true);
 }
 
 inline hsa_status_t
@@ -4630,7 +5427,7 @@ HSADispatch::dispatchKernelAsync(const void *hostKernarg, int hostKernargSize, b
 
 
     if (HCC_SERIALIZE_KERNEL & 0x1) {
-        hsaQueue()->wait();
+        hsaQueue()->wait(Kalmar::hcWaitModeHybrid);
     }
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
@@ -4652,10 +5449,12 @@ HSADispatch::dispatchKernelAsync(const void *hostKernarg, int hostKernargSize, b
     }
 
 
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
+    // the shared state of the future is the only allocation left of an
+    // asynchronous kernel launch, completion_future needs a std::shared_future
+    asyncFuture = std::async(std::launch::deferred, [&] {
         waitComplete();
-    }).share());
+    }).share();
+    future = &asyncFuture;
 
     if (HCC_SERIALIZE_KERNEL & 0x2) {
         status = waitComplete();
@@ -4666,13 +5465,33 @@ HSADispatch::dispatchKernelAsync(const void *hostKernarg, int hostKernargSize, b
     return status;
 }
 
+inline void
+HSADispatch::retired() {
+    // ops leave the ring once they are known to be done, but only a signal
+    // can confirm it
+    if (kernargMemory != nullptr && (_signal.handle == 0 || hsa_signal_load_scacquire(_signal) <= 0)) {
+      releaseKernarg();
+    }
+}
+
+inline void
+HSADispatch::releaseKernarg() {
+    DBOUTL(DB_KERNARG, "op#" << getSeqNum() << " releasing kernarg buffer index=" << kernargMemoryIndex);
+    if (kernargRing) {
+      kernargRing->release(kernargMemoryIndex);
+      kernargRing.reset();
+    } else {
+      device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
+    }
+    kernargMemory = nullptr;
+}
+
 inline void
 HSADispatch::dispose() {
     hsa_status_t status;
+    // ops which never retired from their queue
     if (kernargMemory != nullptr) {
-      //std::cerr << "op#" << getSeqNum() << " releasing kernal arg buffer index=" << kernargMemoryIndex<< "\n";
-      device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
-      kernargMemory = nullptr;
+      releaseKernarg();
     }
 
     clearArgs();
@@ -4688,7 +5507,7 @@ HSADispatch::dispose() {
     Kalmar::ctx.releaseSignal(_signal, _signalIndex);
 
     if (future != nullptr) {
-      delete future;
+      asyncFuture = std::shared_future<void>();
       future = nullptr;
     }
 }
@@ -4879,7 +5698,7 @@ HSABarrier::waitComplete() {
     DBOUT(DB_WAIT,  "  wait for barrier " << *this << " completion with wait flag: " << waitMode << "  signal="<< std::hex  << _signal.handle << std::dec <<"...\n");
 
     // Wait on completion signal until the barrier is finished
-    hsa_signal_wait_scacquire(_signal, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, waitMode);
+    waitSignal(HSA_SIGNAL_CONDITION_EQ, 0, waitMode);
 
 
     // unregister this async operation from HSAQueue
@@ -4897,6 +5716,39 @@ HSABarrier::waitComplete() {
 inline hsa_status_t
 HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
 
+    prepareAsync(fenceScope);
+
+    {
+        hsa_queue_t* rocrQueue = hsaQueue()->acquireLockedRocrQueue();
+
+        // Obtain the write index for the command queue
+        uint64_t index = hsa_queue_load_write_index_relaxed(rocrQueue);
+        const uint32_t queueMask = rocrQueue->size - 1;
+        uint64_t nextIndex = index + 1;
+        if (nextIndex - hsa_queue_load_read_index_scacquire(rocrQueue) >= rocrQueue->size) {
+          checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, rocrQueue);
+        }
+
+        // Define the barrier packet to be at the calculated queue index address
+        hsa_barrier_and_packet_t* barrier = &(((hsa_barrier_and_packet_t*)(rocrQueue->base_address))[index&queueMask]);
+        writePacket(barrier);
+
+        // Increment write index and ring doorbell to dispatch the kernel
+        hsa_queue_store_write_index_relaxed(rocrQueue, nextIndex);
+        hsa_signal_store_relaxed(rocrQueue->doorbell_signal, index);
+
+        hsaQueue()->releaseLockedRocrQueue();
+    }
+
+    completeAsync();
+
+    return HSA_STATUS_SUCCESS;
+}
+
+// set up the fences and the completion signal of the barrier
+inline void
+HSABarrier::prepareAsync(hc::memory_scope fenceScope) {
+
     if (fenceScope == hc::system_scope) {
         hsaQueue()->setNextSyncNeedsSysRelease(false);
     };
@@ -4954,47 +5806,33 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
     header |= (1 << HSA_PACKET_HEADER_BARRIER);
 #endif
     header |= fenceBits;
+}
 
-
-    {
-        hsa_queue_t* rocrQueue = hsaQueue()->acquireLockedRocrQueue();
-
-        // Obtain the write index for the command queue
-        uint64_t index = hsa_queue_load_write_index_relaxed(rocrQueue);
-        const uint32_t queueMask = rocrQueue->size - 1;
-        uint64_t nextIndex = index + 1;
-        if (nextIndex - hsa_queue_load_read_index_scacquire(rocrQueue) >= rocrQueue->size) {
-          checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, rocrQueue);
-        }
-
-        // Define the barrier packet to be at the calculated queue index address
-        hsa_barrier_and_packet_t* barrier = &(((hsa_barrier_and_packet_t*)(rocrQueue->base_address))[index&queueMask]);
-        memset(barrier, 0, sizeof(hsa_barrier_and_packet_t));
+// fill in the barrier packet at its slot of the locked queue, header last
+inline void
+HSABarrier::writePacket(hsa_barrier_and_packet_t* barrier) {
+    memset(barrier, 0, sizeof(hsa_barrier_and_packet_t));
 
 
-        // setup dependent signals
-        if ((depCount > 0) && (depCount <= 5)) {
-            for (int i = 0; i < depCount; ++i) {
-                barrier->dep_signal[i] = *(static_cast <hsa_signal_t*> (depAsyncOps[i]->getNativeHandle()));
-            }
+    // setup dependent signals
+    if ((depCount > 0) && (depCount <= 5)) {
+        for (int i = 0; i < depCount; ++i) {
+            barrier->dep_signal[i] = *(static_cast <hsa_signal_t*> (depAsyncOps[i]->getNativeHandle()));
         }
+    }
 
-        barrier->completion_signal = _signal;
-
-        // Set header last:
-        barrier->header = header;
-
-        DBOUTL(DB_AQL, " barrier_aql " << *this << " "<< *barrier );
-        DBOUTL(DB_AQL2, rawAql(*barrier));
-
+    barrier->completion_signal = _signal;
 
-        // Increment write index and ring doorbell to dispatch the kernel
-        hsa_queue_store_write_index_relaxed(rocrQueue, nextIndex);
-        hsa_signal_store_relaxed(rocrQueue->doorbell_signal, index);
+    // Set header last:
+    barrier->header = header;
 
-        hsaQueue()->releaseLockedRocrQueue();
-    }
+    DBOUTL(DB_AQL, " barrier_aql " << *this << " "<< *barrier );
+    DBOUTL(DB_AQL2, rawAql(*barrier));
+}
 
+// the barrier packet is in the queue
+inline void
+HSABarrier::completeAsync() {
     isDispatched = true;
 
     // capture the state of these flags after the barrier executes.
@@ -5005,9 +5843,6 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
     future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
         waitComplete();
     }).share());
-
-
-    return HSA_STATUS_SUCCESS;
 }
 
 
@@ -5081,7 +5916,7 @@ HSAOpCoord::HSAOpCoord(Kalmar::HSAQueue *queue) :
 HSAOp::HSAOp(Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) :
     KalmarAsyncOp(queue, commandKind),
     _opCoord(static_cast<Kalmar::HSAQueue*> (queue)),
-    _asyncOpsIndex(-1),
+    _asyncOpsIndex(UINT64_MAX),
 
     _signalIndex(-1),
     _agent(static_cast<Kalmar::HSADevice*>(hsaQueue()->getDev())->getAgent())
@@ -5104,6 +5939,45 @@ bool HSAOp::isReady() override {
     return ready;
 }
 
+// waits of ops without a queue
+static HSAWaiter unqueuedWaiter;
+
+hsa_signal_value_t HSAOp::waitSignal(hsa_signal_condition_t cond, hsa_signal_value_t value, Kalmar::hcWaitMode mode) {
+    HSAWaiter& waiter = hsaQueue() ? hsaQueue()->getWaiter() : unqueuedWaiter;
+    return waiter.wait(_signal, cond, value, mode);
+}
+
+// Run by the ROCr event thread once the signal of an op drops below 1. The
+// event thread serves every async handler of the process, the continuation
+// is handed to the executor threads of the CompletionService.
+static bool HSAOpCompletionHandler(hsa_signal_value_t value, void* arg) {
+    Kalmar::CompletionService::callback_fn* callback = static_cast<Kalmar::CompletionService::callback_fn*>(arg);
+    Kalmar::CompletionService::post(std::move(*callback));
+    delete callback;
+    return false;
+}
+
+void HSAOp::notifyCompletion(Kalmar::CompletionService::callback_fn callback) override {
+    if (_signal.handle != 0 && hsa_signal_load_scacquire(_signal) != 0) {
+        Kalmar::CompletionService::callback_fn* arg = new Kalmar::CompletionService::callback_fn(std::move(callback));
+        hsa_status_t status = hsa_amd_signal_async_handler(_signal, HSA_SIGNAL_CONDITION_LT, 1,
+                                                           HSAOpCompletionHandler, arg);
+        if (status == HSA_STATUS_SUCCESS) {
+            return;
+        }
+
+        // fall back to the waiter thread of the CompletionService
+        DBOUT(DB_MISC, "hsa_amd_signal_async_handler failed for op#" << *this << ", status=" << status << "\n");
+        callback = std::move(*arg);
+        delete arg;
+        KalmarAsyncOp::notifyCompletion(std::move(callback));
+        return;
+    }
+
+    // completed already, or a null signal which is considered complete
+    Kalmar::CompletionService::post(std::move(callback));
+}
+
 
 // ----------------------------------------------------------------------
 // member function implementation of HSACopy
@@ -5112,7 +5986,7 @@ bool HSAOp::isReady() override {
 // Copy mode will be set later on.
 // HSA signals would be waited in HSA_WAIT_STATE_ACTIVE by default for HSACopy instances
 HSACopy::HSACopy(Kalmar::KalmarQueue *queue, const void* src_, void* dst_, size_t sizeBytes_) : HSAOp(queue, Kalmar::hcCommandInvalid),
-    isSubmitted(false), isAsync(false), isSingleStepCopy(false), isPeerToPeer(false), future(nullptr), depAsyncOp(nullptr), copyDevice(nullptr), waitMode(HSA_WAIT_STATE_ACTIVE),
+    isSubmitted(false), isAsync(false), isSingleStepCopy(false), isPeerToPeer(false), future(nullptr), depAsyncOp(nullptr), copyDevice(nullptr), waitMode(Kalmar::hcWaitModeActive),
     src(src_), dst(dst_),
     sizeBytes(sizeBytes_)
 {
@@ -5141,7 +6015,7 @@ HSACopy::waitComplete() {
     }
 
     // Wait on completion signal until the async copy is finished
-    hsa_signal_wait_scacquire(_signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, waitMode);
+    waitSignal(HSA_SIGNAL_CONDITION_LT, 1, waitMode);
 
 
     // unregister this async operation from HSAQueue
@@ -5392,7 +6266,7 @@ HSACopy::enqueueAsyncCopyCommand(const Kalmar::HSADevice *copyDevice, const hc::
 
 
     if (HCC_SERIALIZE_COPY & 0x1) {
-        hsaQueue()->wait();
+        hsaQueue()->wait(Kalmar::hcWaitModeHybrid);
     }
 
     // Performs an async copy.
@@ -5484,7 +6358,7 @@ inline hsa_status_t
 HSACopy::enqueueAsyncCopy2dCommand(size_t width, size_t height, size_t srcPitch, size_t dstPitch, const Kalmar::HSADevice *copyDevice, const hc::AmPointerInfo &srcPtrInfo, const hc::AmPointerInfo &dstPtrInfo) {
     hsa_status_t status = HSA_STATUS_SUCCESS;
     if (HCC_SERIALIZE_COPY & 0x1) {
-        hsaQueue()->wait();
+        hsaQueue()->wait(Kalmar::hcWaitModeHybrid);
     }
 
     // enqueue async copy command
@@ -5699,7 +6573,7 @@ HSACopy::syncCopyExt(hc::hcCommandKind copyDir, const hc::AmPointerInfo &srcPtrI
 
         if (hsa_status == HSA_STATUS_SUCCESS) {
             DBOUT(DB_COPY, "HSACopy::syncCopyExt(), wait for completion...");
-            hsa_signal_wait_relaxed(_signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, waitMode);
+            waitSignal(HSA_SIGNAL_CONDITION_LT, 1, waitMode);
 
             DBOUT(DB_COPY,"done!\n");
         } else {
@@ -5736,7 +6610,7 @@ void HSACopy::syncCopy2DExt(hc::hcCommandKind copyDir,
     hsa_status_t hsa_status = hcc_memory_async_copy_rect(copyDir, copyDevice, dstPtrInfo, srcPtrInfo, width, height, srcPitch, dstPitch, depSignalCnt, depSignalCnt ? &depSignal:NULL, _signal);
     if (hsa_status == HSA_STATUS_SUCCESS) {
         DBOUT(DB_COPY, "HSACopy::syncCopy2DExt(), wait for completion...");
-        hsa_signal_wait_relaxed(_signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, waitMode);
+        waitSignal(HSA_SIGNAL_CONDITION_LT, 1, waitMode);
         DBOUT(DB_COPY,"done!\n");
     } else {
         DBOUT(DB_COPY, "HSACopy::syncCopy2DExt(), hcc_amd_memory_async_copy_rect() returns: 0x" << std::hex << hsa_status << std::dec <<"\n");
@@ -5803,6 +6677,252 @@ HSACopy::syncCopy() {
 };
 
 
+// ----------------------------------------------------------------------
+// member function implementation of HSAGraph
+// ----------------------------------------------------------------------
+
+HSAGraph::~HSAGraph() {
+    waitLastReplay();
+
+    Kalmar::HSADevice* device = queue->getHSADev();
+    for (Node& node : nodes) {
+        if (node.kernargMemory != nullptr) {
+            device->releaseKernargBuffer(node.kernargMemory, node.kernargMemoryIndex);
+        }
+    }
+}
+
+void HSAGraph::waitLastReplay() {
+    if (lastReplay) {
+        lastReplay->getFuture()->wait();
+        lastReplay = nullptr;
+    }
+}
+
+std::shared_ptr<Kalmar::KalmarAsyncOp>
+HSAGraph::recordKernel(const HSADispatch* dispatch) {
+    std::shared_ptr<Kalmar::KalmarAsyncOp> op = recordKernel(&dispatch->getAql(), dispatch->getArgs(), dispatch->getArgSize());
+    nodes.back().kernel = dispatch->getKernel();
+
+    // the header set up by setLaunchConfiguration only holds the fences
+    nodes.back().header |= (HSA_PACKET_TYPE_KERNEL_DISPATCH << HSA_PACKET_HEADER_TYPE);
+    return op;
+}
+
+std::shared_ptr<Kalmar::KalmarAsyncOp>
+HSAGraph::recordKernel(const hsa_kernel_dispatch_packet_t* aql, const void* args, size_t argSize) {
+    Node node(Kalmar::hcCommandKernel);
+    node.packet.dispatch = *aql;
+    node.packet.dispatch.header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    node.packet.dispatch.completion_signal.handle = 0;
+    node.header = aql->header | (1 << HSA_PACKET_HEADER_BARRIER);
+
+    if (argSize > 0) {
+        // the arguments stay in kernarg memory of the graph, replays only
+        // write the packets
+        std::pair<void*, int> ret = queue->getHSADev()->getKernargBuffer(argSize);
+        node.kernargMemory = ret.first;
+        node.kernargMemoryIndex = ret.second;
+        node.kernargSize = argSize;
+        memcpy(node.kernargMemory, args, argSize);
+    }
+    node.packet.dispatch.kernarg_address = node.kernargMemory;
+
+    DBOUTL(DB_CMD, "  graph " << this << " recorded kernel #" << nodes.size() << " " << node.packet.dispatch);
+    nodes.push_back(node);
+
+    return std::make_shared<HSACapturedOp>(queue, Kalmar::hcCommandKernel);
+}
+
+std::shared_ptr<Kalmar::KalmarAsyncOp>
+HSAGraph::recordMarker(int count, std::shared_ptr<Kalmar::KalmarAsyncOp>* depOps, hc::memory_scope fenceScope) {
+    for (int i = 0; i < count; ++i) {
+        // the graph is replayed in order, which covers the commands of the
+        // queue. The commands of other queues are gone by then.
+        if (depOps[i] && (depOps[i]->getQueue() != queue)) {
+            throw Kalmar::runtime_exception("dependencies on other accelerator_views cannot be captured", 0);
+        }
+    }
+
+    unsigned fenceBits = 0;
+    switch (fenceScope) {
+        case hc::no_scope:
+            fenceBits = ((HSA_FENCE_SCOPE_NONE) << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE) |
+                        ((HSA_FENCE_SCOPE_NONE) << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE);
+            break;
+        case hc::accelerator_scope:
+            fenceBits = ((HSA_FENCE_SCOPE_AGENT) << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE) |
+                        ((HSA_FENCE_SCOPE_AGENT) << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE);
+            break;
+        case hc::system_scope:
+            fenceBits = ((HSA_FENCE_SCOPE_SYSTEM) << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE) |
+                        ((HSA_FENCE_SCOPE_SYSTEM) << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE);
+            break;
+        default:
+            STATUS_CHECK(HSA_STATUS_ERROR_INVALID_ARGUMENT, __LINE__);
+    }
+
+    Node node(Kalmar::hcCommandMarker);
+    node.packet.barrier.header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    node.header = (HSA_PACKET_TYPE_BARRIER_AND << HSA_PACKET_HEADER_TYPE) | (1 << HSA_PACKET_HEADER_BARRIER) | fenceBits;
+
+    DBOUTL(DB_CMD, "  graph " << this << " recorded marker #" << nodes.size() << " fenceScope=" << fenceScope);
+    nodes.push_back(node);
+
+    return std::make_shared<HSACapturedOp>(queue, Kalmar::hcCommandMarker);
+}
+
+std::shared_ptr<Kalmar::KalmarAsyncOp>
+HSAGraph::recordCopy(const void* src, void* dst, size_t width, size_t height, size_t srcPitch, size_t dstPitch, bool is2d,
+                     const hc::AmPointerInfo& srcInfo, const hc::AmPointerInfo& dstInfo,
+                     const Kalmar::KalmarDevice* copyDevice) {
+    Node node(resolveMemcpyDirection(srcInfo._isInDeviceMem, dstInfo._isInDeviceMem));
+    node.src = src;
+    node.dst = dst;
+    node.width = width;
+    node.height = height;
+    node.srcPitch = srcPitch;
+    node.dstPitch = dstPitch;
+    node.is2d = is2d;
+    node.srcInfo = srcInfo;
+    node.dstInfo = dstInfo;
+    node.copyDevice = copyDevice;
+
+    DBOUTL(DB_CMD, "  graph " << this << " recorded copy #" << nodes.size() << " " << getHcCommandKindString(node.kind)
+                   << " src=" << src << " dst=" << dst << " size=" << width * height);
+    nodes.push_back(node);
+
+    return std::make_shared<HSACapturedOp>(queue, node.kind);
+}
+
+void HSAGraph::setKernelArgs(size_t i, void* ker) {
+    std::unique_ptr<HSADispatch> dispatch(reinterpret_cast<HSADispatch*>(ker));
+    queue->discardKernelBuffers(ker);
+
+    if ((i >= nodes.size()) || (nodes[i].kind != Kalmar::hcCommandKernel)) {
+        throw Kalmar::runtime_exception("command of the graph is not a kernel", i);
+    }
+
+    Node& node = nodes[i];
+    if ((node.kernel == nullptr) || (dispatch->getKernel() != node.kernel) || (dispatch->getArgSize() != node.kernargSize)) {
+        throw Kalmar::runtime_exception("kernel arguments do not match the kernel recorded", i);
+    }
+
+    // the packets of the last replay may still be reading the arguments
+    waitLastReplay();
+
+    memcpy(node.kernargMemory, dispatch->getArgs(), node.kernargSize);
+}
+
+std::shared_ptr<Kalmar::KalmarAsyncOp> HSAGraph::replay() {
+    if (queue->isCapturing()) {
+        throw Kalmar::runtime_exception("cannot replay a command graph while the accelerator_view is capturing commands", 0);
+    }
+
+    // a run of packets and the barrier closing it have to fit in the queue at once
+    Kalmar::HSADevice* device = static_cast<Kalmar::HSADevice*>(queue->getDev());
+    const size_t maxRun = std::min<size_t>(GRAPH_RUN_MAX_PACKETS, device->getQueueSize() - 1);
+
+    std::shared_ptr<Kalmar::KalmarAsyncOp> op;
+    size_t i = 0;
+    while (i < nodes.size()) {
+        if (Kalmar::isCopyCommand(nodes[i].kind)) {
+            const Node& node = nodes[i];
+            if (node.is2d) {
+                op = queue->EnqueueAsyncCopy2dExt(node.src, node.dst, node.width, node.height, node.srcPitch, node.dstPitch,
+                                                  node.kind, node.srcInfo, node.dstInfo, node.copyDevice);
+            } else {
+                op = queue->EnqueueAsyncCopyExt(node.src, node.dst, node.width,
+                                                node.kind, node.srcInfo, node.dstInfo, node.copyDevice);
+            }
+            ++i;
+        } else {
+            size_t end = i;
+            while ((end < nodes.size()) && !Kalmar::isCopyCommand(nodes[end].kind) && (end - i < maxRun)) {
+                ++end;
+            }
+            op = replayPackets(i, end, end == nodes.size());
+            i = end;
+        }
+    }
+
+    if (!op) {
+        // nothing recorded, completes after the commands before
+        op = queue->EnqueueMarker(hc::system_scope);
+    }
+
+    lastReplay = op;
+    return op;
+}
+
+std::shared_ptr<Kalmar::KalmarAsyncOp> HSAGraph::replayPackets(size_t begin, size_t end, bool last) {
+    // order the packets after a copy before them, like waitForStreamDeps
+    std::shared_ptr<Kalmar::KalmarAsyncOp> depOp = queue->detectStreamDeps(Kalmar::hcCommandKernel, nullptr);
+    if (depOp != nullptr) {
+        queue->EnqueueMarkerWithDependency(1, &depOp, HCC_OPT_FLUSH ? hc::no_scope : hc::system_scope);
+    }
+
+    bool hasKernels = false;
+    for (size_t i = begin; i < end; ++i) {
+        hasKernels |= (nodes[i].kind == Kalmar::hcCommandKernel);
+    }
+    if (hasKernels) {
+        queue->setNextSyncNeedsSysRelease(true);
+    }
+
+    // the barrier closing the packets tracks them. The last one releases the
+    // results to the host, like a marker would.
+    std::shared_ptr<HSABarrier> barrier = std::make_shared<HSABarrier>(queue, 0, nullptr);
+    queue->pushAsyncOp(barrier);
+    barrier->prepareAsync(last ? hc::system_scope : hc::no_scope);
+
+    {
+        const uint64_t packetCount = (end - begin) + 1;
+        hsa_queue_t* rocrQueue = queue->acquireLockedRocrQueue();
+        assert(packetCount <= rocrQueue->size);
+        uint64_t index = hsa_queue_load_write_index_relaxed(rocrQueue);
+        while (index + packetCount - hsa_queue_load_read_index_scacquire(rocrQueue) > rocrQueue->size) {
+            // the packet processor has not caught up with the queue yet, let
+            // the other submitters in while it does
+            queue->releaseLockedRocrQueue();
+            std::this_thread::yield();
+            rocrQueue = queue->acquireLockedRocrQueue();
+            index = hsa_queue_load_write_index_relaxed(rocrQueue);
+        }
+        const uint32_t queueMask = rocrQueue->size - 1;
+
+        AqlPacket* packets = static_cast<AqlPacket*>(rocrQueue->base_address);
+        for (size_t i = begin; i < end; ++i) {
+            uint16_t header = nodes[i].header;
+            if ((i == begin) && queue->nextKernelNeedsSysAcquire()) {
+                // pick up what the copies before wrote
+                header |= ((HSA_FENCE_SCOPE_SYSTEM) << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE);
+                queue->setNextKernelNeedsSysAcquire(false);
+            }
+
+            AqlPacket* packet = &packets[(index + (i - begin)) & queueMask];
+            *packet = nodes[i].packet;
+
+            // Lastly copy in the header:
+            packet->dispatch.header = header;
+        }
+        barrier->writePacket(&packets[(index + packetCount - 1) & queueMask].barrier);
+
+        DBOUTL(DB_AQL, " graph " << this << " replayed " << (end - begin) << " packets (hwq=" << rocrQueue << ") " << *barrier);
+
+        // Ring door bell once for all packets
+        hsa_queue_store_write_index_relaxed(rocrQueue, index + packetCount);
+        hsa_signal_store_relaxed(rocrQueue->doorbell_signal, index + packetCount - 1);
+
+        queue->releaseLockedRocrQueue();
+    }
+
+    barrier->completeAsync();
+
+    return barrier;
+}
+
+
 // ----------------------------------------------------------------------
 // extern "C" functions
 // ----------------------------------------------------------------------
@@ -0,0 +1,216 @@
+/*
+Copyright (c) 2015-2016 Advanced Micro Devices, Inc. All rights reserved.
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANNTY OF ANY KIND, EXPRESS OR
+IMPLIED, INNCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANNY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER INN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR INN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <hsa/hsa_ext_amd.h>
+
+#include <unistd.h>
+
+#include "pinned_range_cache.h"
+
+
+static uintptr_t pageSize()
+{
+    static uintptr_t size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+
+//---
+PinnedRangeCache &PinnedRangeCache::get()
+{
+    // Never deleted: copies may still be releasing ranges while the process exits.
+    static PinnedRangeCache *cache = new PinnedRangeCache();
+    return *cache;
+}
+
+
+//---
+void PinnedRangeCache::setBudget(size_t budgetBytes)
+{
+    std::lock_guard<std::mutex> l(_lock);
+    _budget = budgetBytes;
+}
+
+
+//---
+PinnedRangeCache::IndexIter PinnedRangeCache::firstAfter(uintptr_t addr)
+{
+    return _byEnd.upper_bound(addr);
+}
+
+
+//---
+bool PinnedRangeCache::stillLocked(const Entry &e)
+{
+    hsa_amd_pointer_info_t info;
+    info.size = sizeof(info);
+    hsa_status_t status = hsa_amd_pointer_info(reinterpret_cast<void*>(e._base), &info, nullptr, nullptr, nullptr);
+    return status == HSA_STATUS_SUCCESS && info.type == HSA_EXT_POINTER_TYPE_LOCKED &&
+           reinterpret_cast<uintptr_t>(info.hostBaseAddress) == e._base &&
+           info.agentBaseAddress == e._agentBase && info.sizeInBytes == e._lockedSize;
+}
+
+
+//---
+void PinnedRangeCache::drop(IndexIter i)
+{
+    EntryIter e = i->second;
+    _byEnd.erase(i);
+    if (e->_users == 0) {
+        hsa_amd_memory_unlock(reinterpret_cast<void*>(e->_base));
+        _lockedBytes -= e->_end - e->_base;
+        _lru.erase(e);
+    } else {
+        e->_dropped = true;
+        _dropped.splice(_dropped.begin(), _lru, e);
+    }
+}
+
+
+//---
+hsa_status_t PinnedRangeCache::acquire(hsa_agent_t agent, const void *ptr, size_t sizeBytes, Pin *pin)
+{
+    uintptr_t base = reinterpret_cast<uintptr_t>(ptr) & ~(pageSize() - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(ptr) + sizeBytes + pageSize() - 1) & ~(pageSize() - 1);
+    {
+        std::lock_guard<std::mutex> l(_lock);
+
+        IndexIter i = firstAfter(base);
+        if (i != _byEnd.end() && i->second->_base <= base && end <= i->second->_end &&
+            i->second->_users == 0 && i->second->_agent.handle == agent.handle && !stillLocked(*i->second)) {
+            // Unlocked or locked again behind the cache's back: forget the range without unlocking
+            // it, and lock it again below.
+            EntryIter e = i->second;
+            _byEnd.erase(i);
+            _lockedBytes -= e->_end - e->_base;
+            _lru.erase(e);
+            i = firstAfter(base);
+        }
+        if (i != _byEnd.end() && i->second->_base <= base && end <= i->second->_end &&
+            i->second->_agent.handle == agent.handle) {
+            // Hit: the range stays locked, move it to the front of the LRU.
+            EntryIter e = i->second;
+            e->_users++;
+            _lru.splice(_lru.begin(), _lru, e);
+            pin->_agentPtr = e->_agentBase + (reinterpret_cast<uintptr_t>(ptr) - e->_base);
+            pin->_hostPtr = nullptr;
+            pin->_entry = &*e;
+            return HSA_STATUS_SUCCESS;
+        }
+
+        bool cacheable = (end - base) <= _budget;
+
+        // Overlapping ranges are unlocked first, the same pages cannot be locked twice.
+        for (IndexIter j = i; cacheable && j != _byEnd.end() && j->second->_base < end; ++j) {
+            cacheable = (j->second->_users == 0);
+        }
+        if (cacheable) {
+            while (i != _byEnd.end() && i->second->_base < end) {
+                drop(i++);
+            }
+        }
+
+        // Make room for the range, least recently used first.
+        for (EntryIter e = _lru.end(); cacheable && _lockedBytes + (end - base) > _budget && e != _lru.begin(); ) {
+            EntryIter victim = --e;
+            if (victim->_users == 0) {
+                ++e;
+                drop(_byEnd.find(victim->_end));
+            }
+        }
+        cacheable = cacheable && (_lockedBytes + (end - base) <= _budget);
+
+        if (cacheable) {
+            void *agentBase = nullptr;
+            hsa_status_t status = hsa_amd_memory_lock(reinterpret_cast<void*>(base), end - base, &agent, 1, &agentBase);
+            if (status == HSA_STATUS_SUCCESS) {
+                hsa_amd_pointer_info_t info;
+                info.size = sizeof(info);
+                size_t lockedSize = end - base;
+                if (hsa_amd_pointer_info(reinterpret_cast<void*>(base), &info, nullptr, nullptr, nullptr) == HSA_STATUS_SUCCESS) {
+                    lockedSize = info.sizeInBytes;
+                }
+                _lru.push_front(Entry{base, end, agent, static_cast<char*>(agentBase), lockedSize, 1, false});
+                _byEnd[end] = _lru.begin();
+                _lockedBytes += end - base;
+                pin->_agentPtr = static_cast<char*>(agentBase) + (reinterpret_cast<uintptr_t>(ptr) - base);
+                pin->_hostPtr = nullptr;
+                pin->_entry = &_lru.front();
+                return HSA_STATUS_SUCCESS;
+            }
+            // Fall back to locking just this copy's range, as without the cache.
+        }
+    }
+
+    // Not cached: locked for this copy only.
+    pin->_hostPtr = const_cast<void*>(ptr);
+    pin->_entry = nullptr;
+    return hsa_amd_memory_lock(const_cast<void*>(ptr), sizeBytes, &agent, 1, &pin->_agentPtr);
+}
+
+
+//---
+void PinnedRangeCache::release(const Pin &pin)
+{
+    if (pin._entry == nullptr) {
+        hsa_amd_memory_unlock(pin._hostPtr);
+        return;
+    }
+
+    std::lock_guard<std::mutex> l(_lock);
+    Entry *entry = pin._entry;
+    if (--entry->_users == 0 && entry->_dropped) {
+        hsa_amd_memory_unlock(reinterpret_cast<void*>(entry->_base));
+        _lockedBytes -= entry->_end - entry->_base;
+        for (EntryIter e = _dropped.begin(); e != _dropped.end(); ++e) {
+            if (&*e == entry) {
+                _dropped.erase(e);
+                break;
+            }
+        }
+    }
+}
+
+
+//---
+bool PinnedRangeCache::contains(hsa_agent_t agent, const void *ptr, size_t sizeBytes)
+{
+    uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+    std::lock_guard<std::mutex> l(_lock);
+    IndexIter i = firstAfter(begin);
+    return i != _byEnd.end() && i->second->_base <= begin && begin + sizeBytes <= i->second->_end &&
+           i->second->_agent.handle == agent.handle;
+}
+
+
+//---
+int PinnedRangeCache::invalidate(const void *ptr, size_t sizeBytes)
+{
+    uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t end = begin + (sizeBytes ? sizeBytes : 1);
+    int count = 0;
+
+    std::lock_guard<std::mutex> l(_lock);
+    IndexIter i = firstAfter(begin);
+    while (i != _byEnd.end() && i->second->_base < end) {
+        drop(i++);
+        count++;
+    }
+    return count;
+}
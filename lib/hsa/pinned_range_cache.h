@@ -0,0 +1,107 @@
+/*
+Copyright (c) 2015-2016 Advanced Micro Devices, Inc. All rights reserved.
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANNTY OF ANY KIND, EXPRESS OR
+IMPLIED, INNCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANNY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER INN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR INN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef PINNED_RANGE_CACHE_H
+#define PINNED_RANGE_CACHE_H
+
+#include "hsa/hsa.h"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+
+
+//-------------------------------------------------------------------------------------------------
+// Registration cache of the pin-in-place copies.  Locking host memory with hsa_amd_memory_lock
+// pins every page of the range, which costs about as much as the copy itself for large buffers.
+// Rather than unlocking the range once the copy is done, the cache keeps it locked so that the
+// next copy from or to the same buffer goes straight to the DMA.
+//
+// Entries are page-aligned ranges locked for one agent.  The least recently used entries not held
+// by a copy are unlocked once the locked bytes exceed the budget.  am_memory_host_unlock on a
+// pointer of a cached range drops the range.
+//
+// Nothing tells the cache when memory is freed or unmapped, so it is off unless a budget is set:
+// memory copied with the cache on must be released with am_memory_host_unlock before it is freed.
+// A cached range is checked against the runtime's record of the locked range before it is reused,
+// which catches ranges unlocked or locked again behind the cache's back, but not the same
+// addresses mapped again to other pages.
+//
+// The cache is shared by the copy engines of all devices of the process.
+class PinnedRangeCache {
+private:
+    struct Entry {
+        uintptr_t    _base;
+        uintptr_t    _end;
+        hsa_agent_t  _agent;
+        char        *_agentBase;
+        size_t       _lockedSize;  // as recorded by the runtime
+        int          _users;    // copies holding the range
+        bool         _dropped;  // in _dropped, unlocked by the last release
+    };
+
+public:
+    // A locked range held by a copy, from acquire to release.
+    struct Pin {
+        void        *_agentPtr;  // address the agent copies from or to
+        void        *_hostPtr;   // host pointer locked for this copy only, if _entry is null
+        Entry       *_entry;
+    };
+
+    static PinnedRangeCache &get();
+
+    // Set the most bytes kept locked by the cache.  0 disables the cache.
+    void setBudget(size_t budgetBytes);
+
+    // Lock [ptr, ptr+sizeBytes) for agent, or find it in the cache.
+    hsa_status_t acquire(hsa_agent_t agent, const void *ptr, size_t sizeBytes, Pin *pin);
+    void release(const Pin &pin);
+
+    // True if the range is in the cache, locked for agent.
+    bool contains(hsa_agent_t agent, const void *ptr, size_t sizeBytes);
+
+    // Drop the cached ranges overlapping [ptr, ptr+sizeBytes).  Returns the number of ranges dropped.
+    int invalidate(const void *ptr, size_t sizeBytes);
+
+private:
+    typedef std::list<Entry>::iterator EntryIter;
+    typedef std::map<uintptr_t, EntryIter>::iterator IndexIter;
+
+    PinnedRangeCache() : _budget(0), _lockedBytes(0) {}
+
+    // First cached range ending after addr.  Requires _lock.
+    IndexIter firstAfter(uintptr_t addr);
+
+    // True if the runtime still has the range locked as it was when cached.
+    static bool stillLocked(const Entry &e);
+
+    // Remove a range from the cache, unlocking it now or once the last copy holding it is done.
+    // Requires _lock.
+    void drop(IndexIter i);
+
+    std::mutex                      _lock;
+    std::list<Entry>                _lru;      // cached ranges, most recently used first
+    std::list<Entry>                _dropped;  // ranges dropped while held by a copy
+    std::map<uintptr_t, EntryIter>  _byEnd;    // cached ranges by end address, they never overlap
+    size_t                          _budget;
+    size_t                          _lockedBytes;  // bytes of _lru and _dropped
+};
+
+#endif
@@ -17,16 +17,30 @@ OUT OF OR INN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <atomic>
+#include <chrono>
 #include <hc.hpp>
 #include <hc_am.hpp>
 
 #include <hsa/hsa_ext_amd.h>
 
+#include <kalmar_cpu_pool.h>
+
 #include "unpinned_copy_engine.h"
+#include "copy_tuner.h"
+#include "pinned_range_cache.h"
 #include "hc_rt_debug.h"
 
+// bytes of the next source chunk of a host-to-device staging copy prefetched while the DMA of the
+// previous chunk is running
+#define STAGING_PREFETCH_SIZE (256*1024)
+
+// smallest copy the tuner tries pin-in-place for; smaller copies would lock pages of arbitrary small
+// buffers such as the stack, larger ones are left to the measurements to decide
+#define TUNER_PININPLACE_MIN_SIZE (16*1024)
+
 #define THROW_ERROR(err, hsaErr) { hc::print_backtrace(); throw (Kalmar::runtime_exception("HCC unpinned copy engine error", hsaErr)); }
 
 void errorCheck(hsa_status_t hsa_error_code, int line_num, std::string str) {
@@ -82,67 +96,176 @@ static hsa_status_t find_gpu(hsa_agent_t agent, void *data) {
 }
 
 //-------------------------------------------------------------------------------------------------
-UnpinnedCopyEngine::UnpinnedCopyEngine(hsa_agent_t hsaAgent, hsa_agent_t cpuAgent, size_t bufferSize, int numBuffers, 
+UnpinnedCopyEngine::UnpinnedCopyEngine(hsa_agent_t hsaAgent, hsa_agent_t cpuAgent, size_t bufferSize, int numBuffers, int numChannels,
+                                       int stagingThreads, bool nonTemporal, CopyTuner *tuner,
                                        bool isLargeBar, int thresholdH2DDirectStaging, 
                                        int thresholdH2DStagingPinInPlace, int thresholdD2H) :
     _hsaAgent(hsaAgent),
     _cpuAgent(cpuAgent),
     _bufferSize(bufferSize),
     _numBuffers(numBuffers > _max_buffers ? _max_buffers : numBuffers),
+    _maxChannels(numChannels < 1 ? 1 : numChannels),
+    _stagingThreads(stagingThreads < 1 ? 1 : stagingThreads),
+    _nonTemporal(nonTemporal),
+    _tuner(tuner),
     _isLargeBar(isLargeBar),
     _hipH2DTransferThresholdDirectOrStaging(thresholdH2DDirectStaging),
     _hipH2DTransferThresholdStagingOrPininplace(thresholdH2DStagingPinInPlace),
     _hipD2HTransferThreshold(thresholdD2H)
 {
-    hsa_amd_memory_pool_t sys_pool;
-    hsa_status_t err = hsa_amd_agent_iterate_memory_pools(_cpuAgent, findGlobalPool, &sys_pool);
+    hsa_status_t err = hsa_amd_agent_iterate_memory_pools(_cpuAgent, findGlobalPool, &_sysPool);
 
-    // Generate a packed C-style array of agents, for use below with hsa_amd_agents_allow_access
+    // Agents the staging buffers are made accessible to, for use with hsa_amd_agents_allow_access
     // TODO - should this include the CPU agents as well?
-    std::vector<hsa_agent_t> agents;
-    err = hsa_iterate_agents(&find_gpu, &agents);
+    err = hsa_iterate_agents(&find_gpu, &_gpuAgents);
     ErrorCheck(err);
-    hsa_agent_t * agentBlock = new hsa_agent_t[agents.size()];
-    int i=0;
-    for (auto iter=agents.begin(); iter!= agents.end(); iter++) {
-        agentBlock[i++] = *iter;
-        assert (i<=agents.size());
-    };
 
-    ErrorCheck(err);
+    // The first channel is created up front, the others when copies run concurrently.
+    Channel *channel = CreateChannel();
+    _channels.push_back(channel);
+    _freeChannels.push_back(channel);
+};
+
+
+//---
+UnpinnedCopyEngine::~UnpinnedCopyEngine()
+{
+    for (auto channel : _channels) {
+        DestroyChannel(channel);
+    }
+}
+
+
+//---
+UnpinnedCopyEngine::Channel *UnpinnedCopyEngine::CreateChannel()
+{
+    Channel *channel = new Channel();
     for (int i=0; i<_numBuffers; i++) {
         // TODO - experiment with alignment here.
-        err = hsa_amd_memory_pool_allocate(sys_pool, _bufferSize, 0, (void**)(&_pinnedStagingBuffer[i]));
+        hsa_status_t err = hsa_amd_memory_pool_allocate(_sysPool, _bufferSize, 0, (void**)(&channel->_pinnedStagingBuffer[i]));
         ErrorCheck(err);
 
-        if ((err != HSA_STATUS_SUCCESS) || (_pinnedStagingBuffer[i] == NULL)) {
+        if ((err != HSA_STATUS_SUCCESS) || (channel->_pinnedStagingBuffer[i] == NULL)) {
+            channel->_pinnedStagingBuffer[i] = NULL;
+            DestroyChannel(channel);
             THROW_ERROR(hipErrorMemoryAllocation, err);
         }
 
         // Allow access from every agent:
         // This is used in peer-to-peer copies, since we use the buffers to copy from different agents.
         // TODO - may want to review this algorithm for NUMA locality - it might be faster to use staging buffer closer to devices?
-        err = hsa_amd_agents_allow_access(agents.size(), agentBlock, NULL, _pinnedStagingBuffer[i]);
+        err = hsa_amd_agents_allow_access(_gpuAgents.size(), _gpuAgents.data(), NULL, channel->_pinnedStagingBuffer[i]);
         ErrorCheck(err);
 
-        hsa_signal_create(0, 0, NULL, &_completionSignal[i]);
-        hsa_signal_create(0, 0, NULL, &_completionSignal2[i]);
+        hsa_signal_create(0, 0, NULL, &channel->_completionSignal[i]);
+        hsa_signal_create(0, 0, NULL, &channel->_completionSignal2[i]);
     }
+    DBOUTL(DB_COPY2, "Unpinned Copy: created staging channel with " << _numBuffers << " buffers of " << _bufferSize << " bytes");
+    return channel;
+}
 
-};
+
+//---
+UnpinnedCopyEngine::Channel *UnpinnedCopyEngine::AcquireChannel()
+{
+    std::unique_lock<std::mutex> l(_channelLock);
+    if (_freeChannels.empty() && (_channels.size() < static_cast<size_t>(_maxChannels))) {
+        // Reserve the slot so that concurrent copies don't exceed _maxChannels, and allocate
+        // outside the lock.
+        _channels.push_back(nullptr);
+        l.unlock();
+        Channel *channel = nullptr;
+        try {
+            channel = CreateChannel();
+        } catch (...) {
+            l.lock();
+            _channels.erase(std::find(_channels.begin(), _channels.end(), nullptr));
+            _channelFree.notify_one();
+            throw;
+        }
+        l.lock();
+        *std::find(_channels.begin(), _channels.end(), nullptr) = channel;
+        return channel;
+    }
+
+    _channelFree.wait(l, [&] { return !_freeChannels.empty(); });
+    Channel *channel = _freeChannels.back();
+    _freeChannels.pop_back();
+    return channel;
+}
 
 
 //---
-UnpinnedCopyEngine::~UnpinnedCopyEngine()
+void UnpinnedCopyEngine::ReleaseChannel(Channel *channel)
+{
+    {
+        std::lock_guard<std::mutex> l(_channelLock);
+        _freeChannels.push_back(channel);
+    }
+    _channelFree.notify_one();
+}
+
+
+// Helper threads of the staging memcpys, shared by the copy engines of all devices.  The pool is
+// never deleted, its workers sleep while there are no staging copies.
+static Kalmar::CPUThreadPool &stagingPool(int threads)
+{
+    static Kalmar::CPUThreadPool *pool = new Kalmar::CPUThreadPool(threads - 1);
+    return *pool;
+}
+
+
+//---
+void UnpinnedCopyEngine::StagingMemcpy(void* dst, const void* src, size_t sizeBytes)
+{
+    if (_stagingThreads > 1) {
+        Kalmar::parallel_memcpy(stagingPool(_stagingThreads), dst, src, sizeBytes, _nonTemporal);
+    } else if (_nonTemporal) {
+        Kalmar::stream_memcpy(dst, src, sizeBytes);
+    } else {
+        memcpy(dst, src, sizeBytes);
+    }
+}
+
+
+static void prefetchRange(const char *p, size_t sizeBytes)
+{
+    for (size_t i = 0; i < sizeBytes; i += 64) {
+        __builtin_prefetch(p + i, 0 /*read*/, 2);
+    }
+}
+
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// GB/s of a staging copy started at start, for DB_COPY2.
+static double copyBandwidth(std::chrono::steady_clock::time_point start, size_t sizeBytes)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return sizeBytes / elapsed.count() / (1024.0 * 1024.0 * 1024.0);
+}
+
+
+//---
+void UnpinnedCopyEngine::DestroyChannel(Channel *channel)
 {
     for (int i=0; i<_numBuffers; i++) {
-        if (_pinnedStagingBuffer[i]) {
-            hsa_amd_memory_pool_free(_pinnedStagingBuffer[i]);
-            _pinnedStagingBuffer[i] = NULL;
+        if (channel->_pinnedStagingBuffer[i]) {
+            hsa_amd_memory_pool_free(channel->_pinnedStagingBuffer[i]);
+            channel->_pinnedStagingBuffer[i] = NULL;
+        }
+        if (channel->_completionSignal[i].handle) {
+            hsa_signal_destroy(channel->_completionSignal[i]);
+        }
+        if (channel->_completionSignal2[i].handle) {
+            hsa_signal_destroy(channel->_completionSignal2[i]);
         }
-        hsa_signal_destroy(_completionSignal[i]);
-        hsa_signal_destroy(_completionSignal2[i]);
     }
+    delete channel;
 }
 
 
@@ -152,15 +275,19 @@ UnpinnedCopyEngine::~UnpinnedCopyEngine()
 //IN: dst - dest pointer - must be accessible from host CPU.
 //IN: src - src pointer for copy.  Must be accessible from agent this buffer is associated with (via _hsaAgent)
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
-void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor)
+void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                                    std::chrono::steady_clock::time_point *started)
 {
     if (waitFor)
         hsa_signal_wait_scacquire(*waitFor, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
 
-    // Make sure we wait for the dependent signal to complete before entering the critical section
+    // Make sure we wait for the dependent signal to complete before holding a channel
     // to avoid potential dead lock
     {
-        std::lock_guard<std::mutex> l(_copyLock);
+        ChannelGuard channel(this);
+        if (started) {
+            *started = std::chrono::steady_clock::now();
+        }
         DBOUTL(DB_COPY2, __func__ << DBPARM(dst) << "," << DBPARM(src) << "," << DBPARM(sizeBytes))
 
         const char *srcp = static_cast<const char *>(src);
@@ -168,7 +295,7 @@ void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src,
 
         for (int i = 0; i < _numBuffers; i++)
         {
-            hsa_signal_store_screlease(_completionSignal[i], 0);
+            hsa_signal_store_screlease(channel->_completionSignal[i], 0);
         }
 
         if (sizeBytes >= UINT64_MAX / 2)
@@ -178,13 +305,13 @@ void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src,
         int bufferIndex = 0;
 
         size_t theseBytes = sizeBytes;
-        //tprintf (DB_COPY2, "H2D: waiting... on completion signal handle=%lu\n", _completionSignal[bufferIndex].handle);
-        //hsa_signal_wait_scacquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+        //tprintf (DB_COPY2, "H2D: waiting... on completion signal handle=%lu\n", channel->_completionSignal[bufferIndex].handle);
+        //hsa_signal_wait_scacquire(channel->_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
-        //void * masked_srcp = (void*) ((uintptr_t)srcp & (uintptr_t)(~0x3f)) ; // TODO
-        void *locked_srcp;
-        //hsa_status_t hsa_status = hsa_amd_memory_lock(masked_srcp, theseBytes, &_hsaAgent, 1, &locked_srcp);
-        hsa_status_t hsa_status = hsa_amd_memory_lock(const_cast<char *>(srcp), theseBytes, &_hsaAgent, 1, &locked_srcp);
+        // The range usually stays locked after the copy, for the next copy from the same buffer.
+        PinnedRangeCache::Pin pin;
+        hsa_status_t hsa_status = PinnedRangeCache::get().acquire(_hsaAgent, srcp, theseBytes, &pin);
+        void *locked_srcp = pin._agentPtr;
         //tprintf (DB_COPY2, "H2D: bytesRemaining=%zu: pin-in-place:%p+%zu bufferIndex[%d]\n", bytesRemaining, srcp, theseBytes, bufferIndex);
         //printf ("status=%x srcp=%p, masked_srcp=%p, locked_srcp=%p\n", hsa_status, srcp, masked_srcp, locked_srcp);
 
@@ -193,18 +320,19 @@ void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src,
             THROW_ERROR(hipErrorRuntimeMemory, hsa_status);
         }
 
-        hsa_signal_store_screlease(_completionSignal[bufferIndex], 1);
+        hsa_signal_store_screlease(channel->_completionSignal[bufferIndex], 1);
 
-        hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, locked_srcp, _hsaAgent, theseBytes, 0, nullptr, _completionSignal[bufferIndex]);
-        //tprintf (DB_COPY2, "H2D: bytesRemaining=%zu: async_copy %zu bytes %p to %p status=%x\n", bytesRemaining, theseBytes, _pinnedStagingBuffer[bufferIndex], dstp, hsa_status);
+        hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, locked_srcp, _hsaAgent, theseBytes, 0, nullptr, channel->_completionSignal[bufferIndex]);
+        //tprintf (DB_COPY2, "H2D: bytesRemaining=%zu: async_copy %zu bytes %p to %p status=%x\n", bytesRemaining, theseBytes, channel->_pinnedStagingBuffer[bufferIndex], dstp, hsa_status);
 
         if (hsa_status != HSA_STATUS_SUCCESS)
         {
+            PinnedRangeCache::get().release(pin);
             THROW_ERROR(hipErrorRuntimeMemory, hsa_status);
         }
-        DBOUTL(DB_COPY2, "H2D: waiting... on completion signal handle=" << _completionSignal[bufferIndex].handle);
-        hsa_signal_wait_scacquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
-        hsa_amd_memory_unlock(const_cast<char *>(srcp));
+        DBOUTL(DB_COPY2, "H2D: waiting... on completion signal handle=" << channel->_completionSignal[bufferIndex].handle);
+        hsa_signal_wait_scacquire(channel->_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+        PinnedRangeCache::get().release(pin);
     }
 }
 
@@ -229,10 +357,16 @@ void UnpinnedCopyEngine::CopyHostToDevice(UnpinnedCopyEngine::CopyMode copyMode,
 {
     bool isLocked = false;
     if((copyMode == ChooseBest) || (copyMode == UsePinInPlace)) {
-        isLocked = IsLockedPointer(src);
+        // Ranges kept locked by the pin cache are for pin-in-place copies to reuse.
+        isLocked = !PinnedRangeCache::get().contains(_hsaAgent, src, sizeBytes) && IsLockedPointer(src);
     }
+    bool tuned = false;
     if (copyMode == ChooseBest) {
-        if (_isLargeBar && (sizeBytes < _hipH2DTransferThresholdDirectOrStaging)) {
+        if (_tuner && !isLocked) {
+            copyMode = _tuner->Choose(CopyTuner::HostToDevice, sizeBytes, _isLargeBar,
+                                      sizeBytes >= TUNER_PININPLACE_MIN_SIZE);
+            tuned = true;
+        } else if (_isLargeBar && (sizeBytes < _hipH2DTransferThresholdDirectOrStaging)) {
             copyMode = UseMemcpy;
         } else if ((sizeBytes > _hipH2DTransferThresholdStagingOrPininplace) && (!isLocked)) {
             copyMode = UsePinInPlace;
@@ -241,19 +375,28 @@ void UnpinnedCopyEngine::CopyHostToDevice(UnpinnedCopyEngine::CopyMode copyMode,
         }
     }
 
+    // A copy waiting for another command says little about its algorithm.  The copies using a channel
+    // are timed from when they got one.
+    bool timed = tuned && (!waitFor || hsa_signal_load_scacquire(*waitFor) == 0);
+    auto start = std::chrono::steady_clock::now();
+
     if (copyMode == UseMemcpy) {
         CopyHostToDeviceMemcpy(dst, src, sizeBytes, waitFor);
 
 	} else if ((copyMode == UsePinInPlace) && (!isLocked)) {
-        CopyHostToDevicePinInPlace(dst, src, sizeBytes, waitFor);
+        CopyHostToDevicePinInPlace(dst, src, sizeBytes, waitFor, &start);
 
 	} else if (copyMode == UseStaging) {
-        CopyHostToDeviceStaging(dst, src, sizeBytes, waitFor);
+        CopyHostToDeviceStaging(dst, src, sizeBytes, waitFor, &start);
 
     } else {
         // Unknown copy mode.
         THROW_ERROR(hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
     }
+
+    if (timed) {
+        _tuner->Record(CopyTuner::HostToDevice, sizeBytes, copyMode, elapsedNs(start));
+    }
 }
 
 
@@ -262,46 +405,53 @@ void UnpinnedCopyEngine::CopyHostToDevice(UnpinnedCopyEngine::CopyMode copyMode,
 //IN: dst - dest pointer - must be accessible from host CPU.
 //IN: src - src pointer for copy.  Must be accessible from agent this buffer is associated with (via _hsaAgent)
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
-void UnpinnedCopyEngine::CopyHostToDeviceStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor)
+void UnpinnedCopyEngine::CopyHostToDeviceStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                                 std::chrono::steady_clock::time_point *started)
 {
     if (waitFor)
         hsa_signal_wait_scacquire(*waitFor, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
   
-    // Make sure we wait for the dependent signal to complete before entering the critical section
+    // Make sure we wait for the dependent signal to complete before holding a channel
     // to avoid potential dead lock
     {
-        std::lock_guard<std::mutex> l (_copyLock);
+        ChannelGuard channel(this);
+        if (started) {
+            *started = std::chrono::steady_clock::now();
+        }
         DBOUTL (DB_COPY2, __func__ << DBPARM(dst) << "," << DBPARM(src) << "," << DBPARM(sizeBytes))
 
         const char *srcp = static_cast<const char*> (src);
         char *dstp = static_cast<char*> (dst);
 
         for (int i=0; i<_numBuffers; i++) {
-            hsa_signal_store_screlease(_completionSignal[i], 0);
+            hsa_signal_store_screlease(channel->_completionSignal[i], 0);
         }
 
         if (sizeBytes >= UINT64_MAX/2) {
             THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
         }
 
+        auto start = std::chrono::steady_clock::now();
         int bufferIndex = 0;
         for (int64_t bytesRemaining=sizeBytes; bytesRemaining>0 ;  bytesRemaining -= _bufferSize) {
 
             size_t theseBytes = (bytesRemaining > _bufferSize) ? _bufferSize : bytesRemaining;
 
-            DBOUTL (DB_COPY2,  "H2D: waiting... on completion signal handle=" << _completionSignal[bufferIndex].handle);
-            hsa_signal_wait_scacquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+            // Start pulling in the chunk while the DMA of the previous chunk out of this buffer runs.
+            prefetchRange(srcp, std::min<size_t>(theseBytes, STAGING_PREFETCH_SIZE));
+
+            DBOUTL (DB_COPY2,  "H2D: waiting... on completion signal handle=" << channel->_completionSignal[bufferIndex].handle);
+            hsa_signal_wait_scacquire(channel->_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
             DBOUTL (DB_COPY2, "H2D: bytesRemaining=" << bytesRemaining << ": copy " << theseBytes << " bytes " 
-                    << static_cast<const void*>(srcp) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(_pinnedStagingBuffer[bufferIndex])); 
-            // TODO - use uncached memcpy, someday.
-            memcpy(_pinnedStagingBuffer[bufferIndex], srcp, theseBytes);
+                    << static_cast<const void*>(srcp) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(channel->_pinnedStagingBuffer[bufferIndex])); 
+            StagingMemcpy(channel->_pinnedStagingBuffer[bufferIndex], srcp, theseBytes);
 
 
-            hsa_signal_store_screlease(_completionSignal[bufferIndex], 1);
-            hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, _pinnedStagingBuffer[bufferIndex], _hsaAgent, theseBytes, 0, nullptr, _completionSignal[bufferIndex]);
+            hsa_signal_store_screlease(channel->_completionSignal[bufferIndex], 1);
+            hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, channel->_pinnedStagingBuffer[bufferIndex], _hsaAgent, theseBytes, 0, nullptr, channel->_completionSignal[bufferIndex]);
             DBOUTL (DB_COPY2, "H2D: bytesRemaining=" << bytesRemaining << ": async_copy " << theseBytes << " bytes " 
-                    << static_cast<void*>(_pinnedStagingBuffer[bufferIndex]) << " to " << static_cast<void*>(dstp) << " status=" << hsa_status);
+                    << static_cast<void*>(channel->_pinnedStagingBuffer[bufferIndex]) << " to " << static_cast<void*>(dstp) << " status=" << hsa_status);
             if (hsa_status != HSA_STATUS_SUCCESS) {
                 THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
             }
@@ -315,28 +465,34 @@ void UnpinnedCopyEngine::CopyHostToDeviceStaging(void* dst, const void* src, siz
 
 
         for (int i=0; i<_numBuffers; i++) {
-            hsa_signal_wait_scacquire(_completionSignal[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+            hsa_signal_wait_scacquire(channel->_completionSignal[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
         }
+        DBOUTL (DB_COPY2, "H2D: staged " << sizeBytes << " bytes at " << copyBandwidth(start, sizeBytes) << " GB/s"
+                << " (threads=" << _stagingThreads << " nonTemporal=" << _nonTemporal << ")");
     }
 }
 
 
-void UnpinnedCopyEngine::CopyDeviceToHostPinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor)
+void UnpinnedCopyEngine::CopyDeviceToHostPinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                                    std::chrono::steady_clock::time_point *started)
 {
     if (waitFor)
         hsa_signal_wait_scacquire(*waitFor, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
         
-    // Make sure we wait for the dependent signal to complete before entering the critical section
+    // Make sure we wait for the dependent signal to complete before holding a channel
     // to avoid potential dead lock
     {
-        std::lock_guard<std::mutex> l(_copyLock);
+        ChannelGuard channel(this);
+        if (started) {
+            *started = std::chrono::steady_clock::now();
+        }
 
         const char *srcp = static_cast<const char *>(src);
         char *dstp = static_cast<char *>(dst);
 
         for (int i = 0; i < _numBuffers; i++)
         {
-            hsa_signal_store_screlease(_completionSignal[i], 0);
+            hsa_signal_store_screlease(channel->_completionSignal[i], 0);
         }
 
         if (sizeBytes >= UINT64_MAX / 2)
@@ -345,27 +501,28 @@ void UnpinnedCopyEngine::CopyDeviceToHostPinInPlace(void* dst, const void* src,
         }
         int bufferIndex = 0;
         size_t theseBytes = sizeBytes;
-        void *locked_destp;
-
-        hsa_status_t hsa_status = hsa_amd_memory_lock(const_cast<char *>(dstp), theseBytes, &_hsaAgent, 1, &locked_destp);
+        PinnedRangeCache::Pin pin;
+        hsa_status_t hsa_status = PinnedRangeCache::get().acquire(_hsaAgent, dstp, theseBytes, &pin);
+        void *locked_destp = pin._agentPtr;
 
         if (hsa_status != HSA_STATUS_SUCCESS)
         {
             THROW_ERROR(hipErrorRuntimeMemory, hsa_status);
         }
 
-        hsa_signal_store_screlease(_completionSignal[bufferIndex], 1);
+        hsa_signal_store_screlease(channel->_completionSignal[bufferIndex], 1);
 
-        hsa_status = hsa_amd_memory_async_copy(locked_destp, _hsaAgent, srcp, _hsaAgent, theseBytes, 0, nullptr, _completionSignal[bufferIndex]);
+        hsa_status = hsa_amd_memory_async_copy(locked_destp, _hsaAgent, srcp, _hsaAgent, theseBytes, 0, nullptr, channel->_completionSignal[bufferIndex]);
 
         if (hsa_status != HSA_STATUS_SUCCESS)
         {
+            PinnedRangeCache::get().release(pin);
             THROW_ERROR(hipErrorRuntimeMemory, hsa_status);
         }
         DBOUTL(DB_COPY2, "D2H: waiting... on completion signal handle=\n"
-                             << _completionSignal[bufferIndex].handle);
-        hsa_signal_wait_scacquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
-        hsa_amd_memory_unlock(const_cast<char *>(dstp));
+                             << channel->_completionSignal[bufferIndex].handle);
+        hsa_signal_wait_scacquire(channel->_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+        PinnedRangeCache::get().release(pin);
     }
 }
 
@@ -374,11 +531,15 @@ void UnpinnedCopyEngine::CopyDeviceToHost(CopyMode copyMode ,void* dst, const vo
 {
     bool isLocked = false;
     if((copyMode == ChooseBest) || (copyMode == UsePinInPlace)) {
-        isLocked = IsLockedPointer(dst);
+        isLocked = !PinnedRangeCache::get().contains(_hsaAgent, dst, sizeBytes) && IsLockedPointer(dst);
     }
 
+    bool tuned = false;
     if (copyMode == ChooseBest) {
-        if (sizeBytes > _hipD2HTransferThreshold && !isLocked) {
+        if (_tuner && !isLocked) {
+            copyMode = _tuner->Choose(CopyTuner::DeviceToHost, sizeBytes, false, sizeBytes >= TUNER_PININPLACE_MIN_SIZE);
+            tuned = true;
+        } else if (sizeBytes > _hipD2HTransferThreshold && !isLocked) {
             copyMode = UsePinInPlace;
         } else {
             copyMode = UseStaging;
@@ -386,14 +547,22 @@ void UnpinnedCopyEngine::CopyDeviceToHost(CopyMode copyMode ,void* dst, const vo
     }
 
 
+    // Timed from when the copy got a channel, as for H2D.
+    bool timed = tuned && (!waitFor || hsa_signal_load_scacquire(*waitFor) == 0);
+    auto start = std::chrono::steady_clock::now();
+
 	  if (copyMode == UsePinInPlace && !isLocked) {
-        CopyDeviceToHostPinInPlace(dst, src, sizeBytes, waitFor);
+        CopyDeviceToHostPinInPlace(dst, src, sizeBytes, waitFor, &start);
     } else if (copyMode == UseStaging) { 
-        CopyDeviceToHostStaging(dst, src, sizeBytes, waitFor);
+        CopyDeviceToHostStaging(dst, src, sizeBytes, waitFor, &start);
     } else {
         // Unknown copy mode.
         THROW_ERROR(hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
     }
+
+    if (timed) {
+        _tuner->Record(CopyTuner::DeviceToHost, sizeBytes, copyMode, elapsedNs(start));
+    }
 }
 
 //---
@@ -401,23 +570,27 @@ void UnpinnedCopyEngine::CopyDeviceToHost(CopyMode copyMode ,void* dst, const vo
 //IN: dst - dest pointer - must be accessible from agent this buffer is associated with (via _hsaAgent).
 //IN: src - src pointer for copy.  Must be accessible from host CPU.
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
-void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor)
+void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                                 std::chrono::steady_clock::time_point *started)
 {
     if (waitFor)
         hsa_signal_wait_scacquire(*waitFor, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
 
-    // Make sure we wait for the dependent signal to complete before entering the critical section
+    // Make sure we wait for the dependent signal to complete before holding a channel
     // to avoid potential dead lock
     {
 
-        std::lock_guard<std::mutex> l(_copyLock);
+        ChannelGuard channel(this);
+        if (started) {
+            *started = std::chrono::steady_clock::now();
+        }
 
         const char *srcp0 = static_cast<const char *>(src);
         char *dstp1 = static_cast<char *>(dst);
 
         for (int i = 0; i < _numBuffers; i++)
         {
-            hsa_signal_store_screlease(_completionSignal[i], 0);
+            hsa_signal_store_screlease(channel->_completionSignal[i], 0);
         }
 
         if (sizeBytes >= UINT64_MAX / 2)
@@ -425,6 +598,7 @@ void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, siz
             THROW_ERROR(hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
         }
 
+        auto start = std::chrono::steady_clock::now();
         int64_t bytesRemaining0 = sizeBytes; // bytes to copy from dest into staging buffer.
         int64_t bytesRemaining1 = sizeBytes; // bytes to copy from staging buffer into final dest
 
@@ -437,9 +611,9 @@ void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, siz
                 size_t theseBytes = (bytesRemaining0 > _bufferSize) ? _bufferSize : bytesRemaining0;
 
                 DBOUTL(DB_COPY2, "D2H: bytesRemaining0=" << bytesRemaining0 << ": copy " << theseBytes << " bytes "
-                                                         << static_cast<const void *>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(_pinnedStagingBuffer[bufferIndex]));
-                hsa_signal_store_screlease(_completionSignal[bufferIndex], 1);
-                hsa_status_t hsa_status = hsa_amd_memory_async_copy(_pinnedStagingBuffer[bufferIndex], _hsaAgent, srcp0, _hsaAgent, theseBytes, 0, nullptr, _completionSignal[bufferIndex]);
+                                                         << static_cast<const void *>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(channel->_pinnedStagingBuffer[bufferIndex]));
+                hsa_signal_store_screlease(channel->_completionSignal[bufferIndex], 1);
+                hsa_status_t hsa_status = hsa_amd_memory_async_copy(channel->_pinnedStagingBuffer[bufferIndex], _hsaAgent, srcp0, _hsaAgent, theseBytes, 0, nullptr, channel->_completionSignal[bufferIndex]);
                 if (hsa_status != HSA_STATUS_SUCCESS)
                 {
                     THROW_ERROR(hipErrorRuntimeMemory, hsa_status);
@@ -455,15 +629,17 @@ void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, siz
                 size_t theseBytes = (bytesRemaining1 > _bufferSize) ? _bufferSize : bytesRemaining1;
 
                 DBOUTL(DB_COPY2, "D2H: wait_completion[" << bufferIndex << "] bytesRemaining=" << bytesRemaining1);
-                hsa_signal_wait_scacquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+                hsa_signal_wait_scacquire(channel->_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
                 DBOUTL(DB_COPY2, "D2H: bytesRemaining1=" << bytesRemaining1 << ": copy " << theseBytes << " bytes "
-                                                         << " stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(_pinnedStagingBuffer[bufferIndex]) << " to dst " << static_cast<void *>(dstp1));
-                memcpy(dstp1, _pinnedStagingBuffer[bufferIndex], theseBytes);
+                                                         << " stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(channel->_pinnedStagingBuffer[bufferIndex]) << " to dst " << static_cast<void *>(dstp1));
+                StagingMemcpy(dstp1, channel->_pinnedStagingBuffer[bufferIndex], theseBytes);
 
                 dstp1 += theseBytes;
             }
         }
+        DBOUTL(DB_COPY2, "D2H: staged " << sizeBytes << " bytes at " << copyBandwidth(start, sizeBytes) << " GB/s"
+               << " (threads=" << _stagingThreads << " nonTemporal=" << _nonTemporal << ")");
     }
 }
 
@@ -477,19 +653,19 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
     if (waitFor)
         hsa_signal_wait_scacquire(*waitFor, HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
 
-    // Make sure we wait for the dependent signal to complete before entering the critical section
+    // Make sure we wait for the dependent signal to complete before holding a channel
     // to avoid potential dead lock
     {
 
-        std::lock_guard<std::mutex> l(_copyLock);
+        ChannelGuard channel(this);
 
         const char *srcp0 = static_cast<const char *>(src);
         char *dstp1 = static_cast<char *>(dst);
 
         for (int i = 0; i < _numBuffers; i++)
         {
-            hsa_signal_store_screlease(_completionSignal[i], 0);
-            hsa_signal_store_screlease(_completionSignal2[i], 0);
+            hsa_signal_store_screlease(channel->_completionSignal[i], 0);
+            hsa_signal_store_screlease(channel->_completionSignal2[i], 0);
         }
 
         if (sizeBytes >= UINT64_MAX / 2)
@@ -511,13 +687,13 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
                 size_t theseBytes = (bytesRemaining0 > _bufferSize) ? _bufferSize : bytesRemaining0;
 
                 // Wait to make sure we are not overwriting a buffer before it has been drained:
-                hsa_signal_wait_scacquire(_completionSignal2[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+                hsa_signal_wait_scacquire(channel->_completionSignal2[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
                 DBOUTL(DB_COPY2, "P2P: bytesRemaining0=" << bytesRemaining0 << ": async_copy " << theseBytes << " bytes "
-                                                         << static_cast<const void *>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(_pinnedStagingBuffer[bufferIndex]));
-                hsa_signal_store_screlease(_completionSignal[bufferIndex], 1);
+                                                         << static_cast<const void *>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(channel->_pinnedStagingBuffer[bufferIndex]));
+                hsa_signal_store_screlease(channel->_completionSignal[bufferIndex], 1);
                 // Select CPU-agent here to ensure Runtime picks the H2D blit kernel.  Makes a 5X-10X difference in performance.
-                hsa_status_t hsa_status = hsa_amd_memory_async_copy(_pinnedStagingBuffer[bufferIndex], _cpuAgent, srcp0, srcAgent, theseBytes, 0, nullptr, _completionSignal[bufferIndex]);
+                hsa_status_t hsa_status = hsa_amd_memory_async_copy(channel->_pinnedStagingBuffer[bufferIndex], _cpuAgent, srcp0, srcAgent, theseBytes, 0, nullptr, channel->_completionSignal[bufferIndex]);
                 if (hsa_status != HSA_STATUS_SUCCESS)
                 {
                     THROW_ERROR(hipErrorRuntimeMemory, hsa_status);
@@ -539,16 +715,16 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
                 if (hostWait)
                 {
                     // Host-side wait, should not be necessary:
-                    hsa_signal_wait_scacquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+                    hsa_signal_wait_scacquire(channel->_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
                 }
 
                 DBOUTL(DB_COPY2, "P2P: bytesRemaining1=" << bytesRemaining1 << ": copy " << theseBytes << " bytes "
-                                                         << " stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(_pinnedStagingBuffer[bufferIndex]) << " to dst " << static_cast<void *>(dstp1));
-                hsa_signal_store_screlease(_completionSignal2[bufferIndex], 1);
+                                                         << " stagingBuf[" << bufferIndex << "]:" << static_cast<void *>(channel->_pinnedStagingBuffer[bufferIndex]) << " to dst " << static_cast<void *>(dstp1));
+                hsa_signal_store_screlease(channel->_completionSignal2[bufferIndex], 1);
                 // Select CPU-agent here to ensure Runtime picks the H2D blit kernel.  Makes a 5X-10X difference in performance.
-                hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp1, dstAgent, _pinnedStagingBuffer[bufferIndex], _cpuAgent, theseBytes,
-                                                                    hostWait ? 0 : 1, hostWait ? NULL : &_completionSignal[bufferIndex],
-                                                                    _completionSignal2[bufferIndex]);
+                hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp1, dstAgent, channel->_pinnedStagingBuffer[bufferIndex], _cpuAgent, theseBytes,
+                                                                    hostWait ? 0 : 1, hostWait ? NULL : &channel->_completionSignal[bufferIndex],
+                                                                    channel->_completionSignal2[bufferIndex]);
 
                 dstp1 += theseBytes;
             }
@@ -557,7 +733,7 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
         // Wait for the staging-buffer to dest copies to complete:
         for (int i = 0; i < _numBuffers; i++)
         {
-            hsa_signal_wait_scacquire(_completionSignal2[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+            hsa_signal_wait_scacquire(channel->_completionSignal2[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
         }
     }
 }
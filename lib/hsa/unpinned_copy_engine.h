@@ -22,7 +22,14 @@ THE SOFTWARE.
 #define STAGING_BUFFER_H
 
 #include "hsa/hsa.h"
+#include "hsa/hsa_ext_amd.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+class CopyTuner;
 
 //-------------------------------------------------------------------------------------------------
 // An optimized "staging buffer" used to implement Host-To-Device and Device-To-Host copies.
@@ -36,14 +43,25 @@ THE SOFTWARE.
 // PinInPlace is another algorithm which pins the host memory "in-place", and copies it with the DMA
 // engine.  This routine is under development.
 //
-// Staging buffer provides thread-safe access via a mutex.
+// The staging buffers come in channels, each a set of numBuffers buffers with their completion
+// signals.  A copy holds a channel for its whole duration, so copies from different host threads
+// proceed in parallel, up to numChannels of them.  Channels past the first one are created the
+// first time all the others are busy.
+//
+// The CPU side of a staging copy, the memcpy of a chunk into or out of a staging buffer, is split
+// across stagingThreads threads and may use non-temporal stores, which keep large transfers from
+// evicting the caches.
+//
+// With a tuner, ChooseBest picks the algorithm the tuner measured fastest for the size of the copy
+// rather than going by the thresholds.
 struct UnpinnedCopyEngine {
 
     enum CopyMode {ChooseBest=0, UsePinInPlace=1, UseStaging=2, UseMemcpy=3} ; 
 
     static const int _max_buffers = 4;
 
-    UnpinnedCopyEngine(hsa_agent_t hsaAgent,hsa_agent_t cpuAgent, size_t bufferSize, int numBuffers, 
+    UnpinnedCopyEngine(hsa_agent_t hsaAgent,hsa_agent_t cpuAgent, size_t bufferSize, int numBuffers, int numChannels,
+                       int stagingThreads, bool nonTemporal, CopyTuner *tuner,
                        bool isLargeBar, int thresholdH2D_directStaging, int thresholdH2D_stagingPinInPlace, int thresholdD2H) ;
     ~UnpinnedCopyEngine();
 
@@ -52,36 +70,79 @@ struct UnpinnedCopyEngine {
     void CopyDeviceToHost(CopyMode copyMode, void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor);
 
 
-    // Specific H2D copy algorithm implementations:
-    void CopyHostToDeviceStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor);
-    void CopyHostToDevicePinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor);
+    // Specific H2D copy algorithm implementations.  If started is not null, the time the copy got hold
+    // of a channel is stored there, so that the wait for a free channel is left out of timing it.
+    void CopyHostToDeviceStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                 std::chrono::steady_clock::time_point *started = nullptr);
+    void CopyHostToDevicePinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                    std::chrono::steady_clock::time_point *started = nullptr);
     void CopyHostToDeviceMemcpy(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor);
 
 
-    // Specific D2H copy algorithm implementations:
-    void CopyDeviceToHostStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor);
-    void CopyDeviceToHostPinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor);
+    // Specific D2H copy algorithm implementations, started as for H2D:
+    void CopyDeviceToHostStaging(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                 std::chrono::steady_clock::time_point *started = nullptr);
+    void CopyDeviceToHostPinInPlace(void* dst, const void* src, size_t sizeBytes, const hsa_signal_t *waitFor,
+                                    std::chrono::steady_clock::time_point *started = nullptr);
 
 
     // P2P Copy implementation:
     void CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const void* src, hsa_agent_t srcAgent, size_t sizeBytes, const hsa_signal_t *waitFor);
 
 private:
+    // Staging buffers and completion signals used by one copy at a time.
+    struct Channel {
+        char            *_pinnedStagingBuffer[_max_buffers];
+        hsa_signal_t     _completionSignal[_max_buffers];
+        hsa_signal_t     _completionSignal2[_max_buffers]; // P2P needs another set of signals.
+    };
+
+    // Holds a channel of the engine until it goes out of scope.
+    class ChannelGuard {
+    public:
+        ChannelGuard(UnpinnedCopyEngine *engine) : _engine(engine), _channel(engine->AcquireChannel()) {}
+        ~ChannelGuard() { _engine->ReleaseChannel(_channel); }
+
+        Channel *operator->() const { return _channel; }
+
+    private:
+        UnpinnedCopyEngine *_engine;
+        Channel            *_channel;
+    };
+
     bool IsLockedPointer(const void *ptr);
 
+    // Copy a chunk into or out of a staging buffer.
+    void StagingMemcpy(void* dst, const void* src, size_t sizeBytes);
+
+    Channel *CreateChannel();
+    void DestroyChannel(Channel *channel);
+
+    // Wait until a channel is free, creating a new one if there are less than _maxChannels.
+    Channel *AcquireChannel();
+    void ReleaseChannel(Channel *channel);
+
 private:
     hsa_agent_t     _hsaAgent;
     hsa_agent_t     _cpuAgent;
     size_t          _bufferSize;  // Size of the buffers.
     int             _numBuffers;
+    int             _maxChannels;
+    int             _stagingThreads;  // threads sharing the memcpy of a staging chunk
+    bool            _nonTemporal;     // use non-temporal stores for staging memcpys
+    CopyTuner      *_tuner;           // picks the ChooseBest algorithm if not null, not owned
 
     // True if system supports large-bar and thus can benefit from CPU directly performing copy operation.
     bool            _isLargeBar;
 
-    char            *_pinnedStagingBuffer[_max_buffers];
-    hsa_signal_t     _completionSignal[_max_buffers];
-    hsa_signal_t     _completionSignal2[_max_buffers]; // P2P needs another set of signals.
-    std::mutex       _copyLock;    // provide thread-safe access
+    // Pool the staging buffers are allocated from, and the agents they are made accessible to.
+    hsa_amd_memory_pool_t    _sysPool;
+    std::vector<hsa_agent_t> _gpuAgents;
+
+    std::vector<Channel*>    _channels;      // every channel created so far
+    std::vector<Channel*>    _freeChannels;  // channels not held by a copy
+    std::mutex               _channelLock;
+    std::condition_variable  _channelFree;
     size_t              _hipH2DTransferThresholdDirectOrStaging;
     size_t              _hipH2DTransferThresholdStagingOrPininplace;
     size_t              _hipD2HTransferThreshold;
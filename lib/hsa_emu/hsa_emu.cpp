@@ -0,0 +1,1498 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Software implementation of the part of the ROCr API used by the HCC
+// runtime (libmcwamp_hsa, libhc_am and hc2), built as a drop-in
+// libhsa-runtime64.so.1. It lets HCC_RUNTIME=HSA run end-to-end on hosts
+// without an AMD GPU so that the dispatch, signal, kernarg and copy paths of
+// the runtime can be exercised and their overheads measured.
+//
+// The system consists of one CPU agent and HCC_HSA_EMU_GPU_COUNT emulated
+// GPU agents. Every AQL queue is drained by a host thread which honors
+// barrier packets and completion signals; kernel dispatch packets do not
+// execute the GCN code of the kernel, they take HCC_HSA_EMU_DISPATCH_NS
+// nanoseconds instead. Asynchronous copies are performed by a copy engine
+// thread with memcpy. Device memory is host memory.
+//
+// Environment variables:
+//   HCC_HSA_EMU_GPU_COUNT     number of GPU agents, 1 by default
+//   HCC_HSA_EMU_AGENT_NAME    name of the GPU agents, gfx900 by default
+//   HCC_HSA_EMU_CU_COUNT      compute units per GPU agent, 64 by default
+//   HCC_HSA_EMU_DEVICE_MEM_MB size of the memory of a GPU agent, 4096 by default
+//   HCC_HSA_EMU_DISPATCH_NS   time spent on every kernel dispatch, 0 by default
+
+#include <hsa/hsa.h>
+#include <hsa/hsa_ext_amd.h>
+#include <hsa/hsa_ven_amd_loader.h>
+#include <hsa/amd_hsa_kernel_code.h>
+
+#include "../../hc2/external/elfio/elfio.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+// number of times a blocked wait polls the signal before it goes to sleep
+#define EMU_SPIN_COUNT (2048)
+
+// sizes of the emulated memory pools
+#define EMU_GROUP_SEGMENT_SIZE (64 * 1024)
+#define EMU_ALLOC_GRANULE (4096)
+
+uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long env_long(const char* name, long dflt) {
+    const char* env = getenv(name);
+    if (env == nullptr)
+        return dflt;
+    long v = strtol(env, nullptr, 0);
+    return v > 0 ? v : dflt;
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+//===----------------------------------------------------------------------===//
+// Signals
+//===----------------------------------------------------------------------===//
+
+struct Signal {
+    std::atomic<hsa_signal_value_t> value;
+
+    // sleeping waiters, a store only takes the lock if there are any
+    std::atomic<uint32_t> waiters;
+    std::mutex lock;
+    std::condition_variable cv;
+
+    // timestamps of the dispatch or copy which last completed the signal
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+
+    explicit Signal(hsa_signal_value_t v) : value(v), waiters(0), lock(), cv(), start(0), end(0) {}
+};
+
+inline Signal* to_signal(hsa_signal_t s) { return reinterpret_cast<Signal*>(s.handle); }
+
+// handlers registered with hsa_amd_signal_async_handler, run by a single
+// event thread as in ROCr
+struct AsyncHandler {
+    Signal* signal;
+    hsa_signal_condition_t cond;
+    hsa_signal_value_t value;
+    hsa_amd_signal_handler handler;
+    void* arg;
+};
+
+struct AsyncEvents {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<AsyncHandler> handlers;
+    // bumped by every signal change while handlers are registered
+    uint64_t changes;
+    bool started;
+};
+
+AsyncEvents& async_events() {
+    static AsyncEvents* events = new AsyncEvents{ {}, {}, {}, 0, false };
+    return *events;
+}
+
+// number of registered handlers, a store only wakes the event thread if
+// there are any
+std::atomic<uint32_t> async_handler_count(0);
+
+inline void notify(Signal* s) {
+    if (s->waiters.load() != 0) {
+        std::lock_guard<std::mutex> l(s->lock);
+        s->cv.notify_all();
+    }
+    if (async_handler_count.load() != 0) {
+        AsyncEvents& events = async_events();
+        std::lock_guard<std::mutex> l(events.lock);
+        ++events.changes;
+        events.cv.notify_one();
+    }
+}
+
+inline void store(Signal* s, hsa_signal_value_t v) {
+    s->value.store(v);
+    notify(s);
+}
+
+inline bool satisfied(hsa_signal_condition_t cond, hsa_signal_value_t v, hsa_signal_value_t cmp) {
+    switch (cond) {
+    case HSA_SIGNAL_CONDITION_EQ:  return v == cmp;
+    case HSA_SIGNAL_CONDITION_NE:  return v != cmp;
+    case HSA_SIGNAL_CONDITION_LT:  return v < cmp;
+    case HSA_SIGNAL_CONDITION_GTE: return v >= cmp;
+    }
+    return true;
+}
+
+hsa_signal_value_t wait(Signal* s, hsa_signal_condition_t cond, hsa_signal_value_t cmp,
+                        uint64_t timeout, hsa_wait_state_t state) {
+    // timestamps are in nanoseconds, which makes the timeout one as well
+    const uint64_t deadline = (timeout > UINT64_MAX - now()) ? UINT64_MAX : now() + timeout;
+    hsa_signal_value_t v;
+    for (int spin = 0; ; ++spin) {
+        v = s->value.load(std::memory_order_acquire);
+        if (satisfied(cond, v, cmp))
+            return v;
+        if ((spin & 63) == 0 && deadline != UINT64_MAX && now() >= deadline)
+            return v;
+        if (spin >= EMU_SPIN_COUNT) {
+            if (state == HSA_WAIT_STATE_BLOCKED)
+                break;
+            std::this_thread::yield();
+        } else {
+            cpu_relax();
+        }
+    }
+
+    std::unique_lock<std::mutex> l(s->lock);
+    s->waiters.fetch_add(1);
+    while (!satisfied(cond, v = s->value.load(), cmp)) {
+        if (deadline == UINT64_MAX) {
+            s->cv.wait(l);
+        } else if (now() >= deadline ||
+                   s->cv.wait_for(l, std::chrono::nanoseconds(deadline - now())) ==
+                       std::cv_status::timeout) {
+            v = s->value.load();
+            break;
+        }
+    }
+    s->waiters.fetch_sub(1);
+    return v;
+}
+
+// complete an operation: record when it ran and decrement its signal
+void complete(hsa_signal_t signal, uint64_t start, uint64_t end) {
+    if (signal.handle == 0)
+        return;
+    Signal* s = to_signal(signal);
+    s->start.store(start, std::memory_order_relaxed);
+    s->end.store(end, std::memory_order_relaxed);
+    s->value.fetch_sub(1);
+    notify(s);
+}
+
+void async_event_loop() {
+    AsyncEvents& events = async_events();
+    uint64_t seen = 0;
+    std::vector<AsyncHandler> ready;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> l(events.lock);
+            events.cv.wait(l, [&] { return events.changes != seen; });
+            seen = events.changes;
+            auto& handlers = events.handlers;
+            for (size_t i = 0; i < handlers.size(); ) {
+                if (satisfied(handlers[i].cond, handlers[i].signal->value.load(), handlers[i].value)) {
+                    ready.push_back(handlers[i]);
+                    handlers[i] = handlers.back();
+                    handlers.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+            async_handler_count.store(static_cast<uint32_t>(handlers.size()));
+        }
+
+        // a handler may register new ones, it runs without the lock
+        for (auto& h : ready) {
+            hsa_signal_value_t v = h.signal->value.load(std::memory_order_acquire);
+            if (h.handler(v, h.arg)) {
+                std::lock_guard<std::mutex> l(events.lock);
+                events.handlers.push_back(h);
+                async_handler_count.store(static_cast<uint32_t>(events.handlers.size()));
+            }
+        }
+        ready.clear();
+    }
+}
+
+void wait_deps(uint32_t count, const hsa_signal_t* deps) {
+    for (uint32_t i = 0; i < count; ++i)
+        if (deps[i].handle != 0)
+            wait(to_signal(deps[i]), HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
+}
+
+//===----------------------------------------------------------------------===//
+// Agents and memory
+//===----------------------------------------------------------------------===//
+
+struct Agent;
+
+struct Pool {
+    Agent* owner;
+    hsa_amd_segment_t segment;
+    uint32_t flags;
+    size_t size;
+    bool alloc_allowed;
+
+    // bytes currently allocated from the pool
+    size_t used;
+};
+
+struct Agent {
+    hsa_device_type_t type;
+    std::string name;
+    uint32_t node;
+    uint32_t cu_count;
+    std::vector<Pool*> pools;
+};
+
+inline Agent* to_agent(hsa_agent_t a) { return reinterpret_cast<Agent*>(a.handle); }
+inline hsa_agent_t to_handle(Agent* a) { hsa_agent_t h; h.handle = reinterpret_cast<uint64_t>(a); return h; }
+inline Pool* to_pool(hsa_amd_memory_pool_t p) { return reinterpret_cast<Pool*>(p.handle); }
+
+/// memory allocated from a pool or locked with hsa_amd_memory_lock
+struct Allocation {
+    size_t size;
+    Agent* owner;
+    Pool* pool;
+    hsa_amd_pointer_type_t type;
+    void* user_data;
+    int lock_count;
+};
+
+class CopyEngine;
+
+struct Runtime {
+    std::mutex lock;
+    int refcount;
+
+    Agent cpu;
+    std::vector<std::unique_ptr<Agent>> gpus;
+    std::vector<std::unique_ptr<Pool>> pools;
+
+    // agent dispatch time of every kernel
+    uint64_t dispatch_ns;
+
+    std::mutex alloc_lock;
+    std::map<uintptr_t, Allocation> allocations;
+
+    // names of the ISAs known to the runtime, hsa_isa_t is the index + 1
+    std::mutex isa_lock;
+    std::vector<std::string> isas;
+
+    std::unique_ptr<CopyEngine> copy_engine;
+
+    Runtime();
+
+    Pool* add_pool(Agent* owner, hsa_amd_segment_t segment, uint32_t flags, size_t size, bool alloc) {
+        pools.emplace_back(new Pool{owner, segment, flags, size, alloc, 0});
+        owner->pools.push_back(pools.back().get());
+        return pools.back().get();
+    }
+
+    hsa_isa_t isa(const std::string& name) {
+        std::lock_guard<std::mutex> l(isa_lock);
+        hsa_isa_t h;
+        auto it = std::find(isas.begin(), isas.end(), name);
+        if (it == isas.end())
+            it = isas.insert(isas.end(), name);
+        h.handle = (it - isas.begin()) + 1;
+        return h;
+    }
+
+    // find the allocation containing ptr, allocations.end() if there is none
+    std::map<uintptr_t, Allocation>::iterator find(const void* ptr) {
+        uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+        auto it = allocations.upper_bound(p);
+        if (it == allocations.begin())
+            return allocations.end();
+        --it;
+        if (p >= it->first + std::max<size_t>(it->second.size, 1))
+            return allocations.end();
+        return it;
+    }
+};
+
+Runtime& runtime();
+
+//===----------------------------------------------------------------------===//
+// Copy engine
+//===----------------------------------------------------------------------===//
+
+/// Performs the asynchronous copies of all agents in submission order, after
+/// their dependencies are satisfied, like a single DMA engine.
+class CopyEngine {
+public:
+    typedef std::function<void()> copy_fn;
+
+    CopyEngine() : lock(), cv(), copies(), worker(&CopyEngine::loop, this) {}
+
+    void submit(uint32_t ndeps, const hsa_signal_t* deps, hsa_signal_t completion, copy_fn fn) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            copies.push_back(Copy{std::vector<hsa_signal_t>(deps, deps + ndeps), completion, std::move(fn)});
+        }
+        cv.notify_one();
+    }
+
+private:
+    struct Copy {
+        std::vector<hsa_signal_t> deps;
+        hsa_signal_t completion;
+        copy_fn fn;
+    };
+
+    void loop() {
+        for (;;) {
+            Copy c;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                cv.wait(l, [this] { return !copies.empty(); });
+                c = std::move(copies.front());
+                copies.pop_front();
+            }
+            wait_deps(c.deps.size(), c.deps.data());
+            uint64_t start = now();
+            c.fn();
+            complete(c.completion, start, now());
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<Copy> copies;
+
+    // runs for the lifetime of the process, copies may be in flight at exit
+    std::thread worker;
+};
+
+Runtime::Runtime() : lock(), refcount(0), cpu(), gpus(), pools(), dispatch_ns(0), alloc_lock(),
+                     allocations(), isa_lock(), isas(), copy_engine() {
+    cpu.type = HSA_DEVICE_TYPE_CPU;
+    cpu.name = "CPU";
+    cpu.node = 0;
+    cpu.cu_count = std::max(std::thread::hardware_concurrency(), 1u);
+
+    const size_t host_mem = size_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    add_pool(&cpu, HSA_AMD_SEGMENT_GLOBAL,
+             HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_KERNARG_INIT | HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_FINE_GRAINED,
+             host_mem, true);
+    add_pool(&cpu, HSA_AMD_SEGMENT_GLOBAL, HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_COARSE_GRAINED, host_mem, true);
+
+    const long count = env_long("HCC_HSA_EMU_GPU_COUNT", 1);
+    const char* name = getenv("HCC_HSA_EMU_AGENT_NAME");
+    const size_t device_mem = size_t(env_long("HCC_HSA_EMU_DEVICE_MEM_MB", 4096)) * 1024 * 1024;
+    for (long i = 0; i < count; ++i) {
+        gpus.emplace_back(new Agent);
+        Agent* gpu = gpus.back().get();
+        gpu->type = HSA_DEVICE_TYPE_GPU;
+        gpu->name = name ? name : "gfx900";
+        gpu->node = i + 1;
+        gpu->cu_count = env_long("HCC_HSA_EMU_CU_COUNT", 64);
+        add_pool(gpu, HSA_AMD_SEGMENT_GLOBAL, HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_COARSE_GRAINED,
+                 device_mem, true);
+        add_pool(gpu, HSA_AMD_SEGMENT_GROUP, 0, EMU_GROUP_SEGMENT_SIZE, false);
+        isa("amdgcn-amd-amdhsa--" + gpu->name);
+    }
+
+    dispatch_ns = env_long("HCC_HSA_EMU_DISPATCH_NS", 0);
+    copy_engine.reset(new CopyEngine);
+}
+
+Runtime& runtime() {
+    // never destroyed: queue and copy threads may still run at exit
+    static Runtime* rt = new Runtime;
+    return *rt;
+}
+
+hsa_status_t allocate(Pool* pool, size_t size, void** ptr) {
+    if (!pool->alloc_allowed)
+        return HSA_STATUS_ERROR_INVALID_ALLOCATION;
+    if (size == 0)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.alloc_lock);
+    size_t bytes = (size + EMU_ALLOC_GRANULE - 1) & ~size_t(EMU_ALLOC_GRANULE - 1);
+    if (pool->used + bytes > pool->size)
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    void* p = nullptr;
+    if (posix_memalign(&p, EMU_ALLOC_GRANULE, bytes) != 0)
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    pool->used += bytes;
+    rt.allocations[reinterpret_cast<uintptr_t>(p)] =
+        Allocation{size, pool->owner, pool, HSA_EXT_POINTER_TYPE_HSA, nullptr, 0};
+    *ptr = p;
+    return HSA_STATUS_SUCCESS;
+}
+
+//===----------------------------------------------------------------------===//
+// Queues
+//===----------------------------------------------------------------------===//
+
+/// An AQL queue, drained in order by a host thread.
+struct Queue {
+    hsa_queue_t queue;
+    Agent* agent;
+    std::atomic<uint64_t> read_index;
+    std::atomic<uint64_t> write_index;
+    Signal* doorbell;
+    void (*callback)(hsa_status_t, hsa_queue_t*, void*);
+    void* data;
+    std::atomic<bool> stopping;
+    std::thread worker;
+
+    void loop();
+    bool process(hsa_kernel_dispatch_packet_t* packet, uint16_t type);
+};
+
+inline Queue* to_queue(const hsa_queue_t* q) { return reinterpret_cast<Queue*>(q->id); }
+
+inline uint16_t packet_type(uint16_t header) {
+    return (header >> HSA_PACKET_HEADER_TYPE) & ((1 << HSA_PACKET_HEADER_WIDTH_TYPE) - 1);
+}
+
+inline uint16_t load_header(hsa_kernel_dispatch_packet_t* p) {
+    return __atomic_load_n(&p->header, __ATOMIC_ACQUIRE);
+}
+
+void Queue::loop() {
+    hsa_kernel_dispatch_packet_t* ring = static_cast<hsa_kernel_dispatch_packet_t*>(queue.base_address);
+    hsa_signal_value_t rung = doorbell->value.load();
+    for (;;) {
+        uint64_t index = read_index.load(std::memory_order_relaxed);
+        hsa_kernel_dispatch_packet_t* packet = &ring[index & (queue.size - 1)];
+
+        // a packet is published by writing its header, and the doorbell is
+        // rung afterwards
+        uint16_t header;
+        while (packet_type(header = load_header(packet)) == HSA_PACKET_TYPE_INVALID) {
+            if (stopping.load())
+                return;
+            rung = wait(doorbell, HSA_SIGNAL_CONDITION_NE, rung, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
+        }
+
+        if (!process(packet, packet_type(header))) {
+            if (callback)
+                callback(HSA_STATUS_ERROR_INVALID_PACKET_FORMAT, &queue, data);
+            return;
+        }
+
+        __atomic_store_n(&packet->header, uint16_t(HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE),
+                         __ATOMIC_RELEASE);
+        read_index.store(index + 1, std::memory_order_release);
+    }
+}
+
+bool Queue::process(hsa_kernel_dispatch_packet_t* packet, uint16_t type) {
+    // packets are processed one at a time, which satisfies the barrier bit
+    // and the acquire and release fences of every packet
+    switch (type) {
+    case HSA_PACKET_TYPE_KERNEL_DISPATCH: {
+        uint64_t start = now();
+        const uint64_t ns = runtime().dispatch_ns;
+        while (ns != 0 && now() - start < ns)
+            cpu_relax();
+        complete(packet->completion_signal, start, now());
+        return true;
+    }
+    case HSA_PACKET_TYPE_BARRIER_AND: {
+        hsa_barrier_and_packet_t* barrier = reinterpret_cast<hsa_barrier_and_packet_t*>(packet);
+        uint64_t start = now();
+        wait_deps(HSA_BARRIER_DEP_SIGNAL_CNT, barrier->dep_signal);
+        complete(barrier->completion_signal, start, now());
+        return true;
+    }
+    case HSA_PACKET_TYPE_BARRIER_OR: {
+        hsa_barrier_or_packet_t* barrier = reinterpret_cast<hsa_barrier_or_packet_t*>(packet);
+        uint64_t start = now();
+        bool any = true;
+        for (int i = 0; i < HSA_BARRIER_DEP_SIGNAL_CNT; ++i)
+            any &= (barrier->dep_signal[i].handle == 0);
+        while (!any) {
+            for (int i = 0; i < HSA_BARRIER_DEP_SIGNAL_CNT && !any; ++i) {
+                if (barrier->dep_signal[i].handle != 0) {
+                    // poll every dependency in turn with a short timeout
+                    any = wait(to_signal(barrier->dep_signal[i]), HSA_SIGNAL_CONDITION_EQ, 0,
+                               100 * 1000, HSA_WAIT_STATE_BLOCKED) == 0;
+                }
+            }
+        }
+        complete(barrier->completion_signal, start, now());
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Code objects and executables
+//===----------------------------------------------------------------------===//
+
+struct CodeObjectReader {
+    std::string data;
+};
+
+struct Symbol {
+    std::string name;
+    hsa_symbol_kind_t kind;
+    Agent* agent;
+
+    // variables: address of the storage, kernels: kernel object
+    uint64_t address;
+    uint32_t size;
+
+    // zeroed kernel descriptor the kernel object of a kernel points at
+    amd_kernel_code_t code;
+};
+
+struct Executable {
+    std::vector<std::unique_ptr<Symbol>> symbols;
+    std::map<std::string, void*> defined;
+    std::vector<void*> storage;
+    bool frozen;
+
+    Symbol* find(const std::string& name) {
+        for (auto& s : symbols)
+            if (s->name == name)
+                return s.get();
+        return nullptr;
+    }
+};
+
+inline Executable* to_executable(hsa_executable_t e) { return reinterpret_cast<Executable*>(e.handle); }
+inline Symbol* to_symbol(hsa_executable_symbol_t s) { return reinterpret_cast<Symbol*>(s.handle); }
+
+// ELF symbol type of kernels in code object v2
+#define EMU_STT_AMDGPU_HSA_KERNEL (10)
+
+hsa_status_t load_symbols(Executable* exe, Agent* agent, const std::string& data) {
+    ELFIO::elfio reader;
+    std::istringstream stream(data);
+    if (!reader.load(stream))
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+
+    for (auto&& section : reader.sections) {
+        if (section->get_type() != SHT_SYMTAB && section->get_type() != SHT_DYNSYM)
+            continue;
+        ELFIO::symbol_section_accessor symbols(reader, section);
+        for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i) {
+            std::string name;
+            ELFIO::Elf64_Addr value;
+            ELFIO::Elf_Xword size;
+            unsigned char bind;
+            unsigned char type;
+            ELFIO::Elf_Half index;
+            unsigned char other;
+            symbols.get_symbol(i, name, value, size, bind, type, index, other);
+            if (name.empty() || type == STT_SECTION || type == STT_FILE || exe->find(name))
+                continue;
+
+            std::unique_ptr<Symbol> sym(new Symbol());
+            sym->name = name;
+            sym->agent = agent;
+            sym->size = size;
+            const bool descriptor = name.size() > 3 && name.compare(name.size() - 3, 3, ".kd") == 0;
+            if (type == STT_FUNC || type == EMU_STT_AMDGPU_HSA_KERNEL || descriptor) {
+                sym->kind = HSA_SYMBOL_KIND_KERNEL;
+                sym->address = reinterpret_cast<uint64_t>(&sym->code);
+            } else if (type == STT_OBJECT) {
+                sym->kind = HSA_SYMBOL_KIND_VARIABLE;
+                if (index == SHN_UNDEF) {
+                    // external variables have to be defined by the program
+                    auto it = exe->defined.find(name);
+                    if (it == exe->defined.end())
+                        continue;
+                    sym->address = reinterpret_cast<uint64_t>(it->second);
+                } else {
+                    void* p = calloc(1, std::max<size_t>(size, 1));
+                    if (p == nullptr)
+                        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+                    exe->storage.push_back(p);
+                    if (index < reader.sections.size()) {
+                        ELFIO::section* s = reader.sections[index];
+                        if (s->get_data() && value >= s->get_address() &&
+                            value - s->get_address() + size <= s->get_size())
+                            memcpy(p, s->get_data() + (value - s->get_address()), size);
+                    }
+                    sym->address = reinterpret_cast<uint64_t>(p);
+                }
+            } else {
+                continue;
+            }
+            exe->symbols.push_back(std::move(sym));
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+// kernel objects the runtime may ask the loader for the host address of
+hsa_status_t query_host_address(const void* device_address, const void** host_address) {
+    if (host_address == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    *host_address = device_address;
+    return HSA_STATUS_SUCCESS;
+}
+
+template <typename T>
+inline hsa_status_t put(void* value, const T& v) {
+    memcpy(value, &v, sizeof(T));
+    return HSA_STATUS_SUCCESS;
+}
+
+inline hsa_status_t put_string(void* value, const std::string& s, size_t capacity) {
+    char* out = static_cast<char*>(value);
+    memset(out, 0, capacity);
+    memcpy(out, s.c_str(), std::min(s.size(), capacity - 1));
+    return HSA_STATUS_SUCCESS;
+}
+
+} // namespace
+
+//===----------------------------------------------------------------------===//
+// Runtime and system
+//===----------------------------------------------------------------------===//
+
+hsa_status_t hsa_init() {
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.lock);
+    ++rt.refcount;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_shut_down() {
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.lock);
+    if (rt.refcount == 0)
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    --rt.refcount;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_status_string(hsa_status_t status, const char** status_string) {
+    if (status_string == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    switch (status) {
+    case HSA_STATUS_SUCCESS:                     *status_string = "HSA_STATUS_SUCCESS"; break;
+    case HSA_STATUS_INFO_BREAK:                  *status_string = "HSA_STATUS_INFO_BREAK"; break;
+    case HSA_STATUS_ERROR_INVALID_ARGUMENT:      *status_string = "HSA_STATUS_ERROR_INVALID_ARGUMENT"; break;
+    case HSA_STATUS_ERROR_INVALID_AGENT:         *status_string = "HSA_STATUS_ERROR_INVALID_AGENT"; break;
+    case HSA_STATUS_ERROR_INVALID_ALLOCATION:    *status_string = "HSA_STATUS_ERROR_INVALID_ALLOCATION"; break;
+    case HSA_STATUS_ERROR_OUT_OF_RESOURCES:      *status_string = "HSA_STATUS_ERROR_OUT_OF_RESOURCES"; break;
+    case HSA_STATUS_ERROR_NOT_INITIALIZED:       *status_string = "HSA_STATUS_ERROR_NOT_INITIALIZED"; break;
+    case HSA_STATUS_ERROR_INVALID_CODE_OBJECT:   *status_string = "HSA_STATUS_ERROR_INVALID_CODE_OBJECT"; break;
+    case HSA_STATUS_ERROR_INVALID_SYMBOL_NAME:   *status_string = "HSA_STATUS_ERROR_INVALID_SYMBOL_NAME"; break;
+    case HSA_STATUS_ERROR_INVALID_PACKET_FORMAT: *status_string = "HSA_STATUS_ERROR_INVALID_PACKET_FORMAT"; break;
+    default:                                     *status_string = "HSA_STATUS_ERROR"; break;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_system_get_info(hsa_system_info_t attribute, void* value) {
+    if (value == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    switch (attribute) {
+    case HSA_SYSTEM_INFO_VERSION_MAJOR:       return put<uint16_t>(value, 1);
+    case HSA_SYSTEM_INFO_VERSION_MINOR:       return put<uint16_t>(value, 1);
+    case HSA_SYSTEM_INFO_TIMESTAMP:           return put<uint64_t>(value, now());
+    case HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY: return put<uint64_t>(value, 1000000000);
+    case HSA_SYSTEM_INFO_SIGNAL_MAX_WAIT:     return put<uint64_t>(value, UINT64_MAX);
+    case HSA_SYSTEM_INFO_ENDIANNESS:          return put(value, HSA_ENDIANNESS_LITTLE);
+    case HSA_SYSTEM_INFO_MACHINE_MODEL:       return put(value, HSA_MACHINE_MODEL_LARGE);
+    case HSA_SYSTEM_INFO_EXTENSIONS: {
+        uint8_t extensions[128] = {0};
+        extensions[HSA_EXTENSION_AMD_LOADER / 8] |= 1 << (HSA_EXTENSION_AMD_LOADER % 8);
+        memcpy(value, extensions, sizeof(extensions));
+        return HSA_STATUS_SUCCESS;
+    }
+    default:
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_system_major_extension_supported(uint16_t extension, uint16_t version_major,
+                                                  uint16_t* version_minor, bool* result) {
+    if (version_minor == nullptr || result == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    *result = (extension == HSA_EXTENSION_AMD_LOADER && version_major == 1);
+    if (*result)
+        *version_minor = 1;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_system_get_major_extension_table(uint16_t extension, uint16_t version_major,
+                                                  size_t table_length, void* table) {
+    if (table == nullptr || extension != HSA_EXTENSION_AMD_LOADER || version_major != 1)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    hsa_ven_amd_loader_1_01_pfn_t loader;
+    memset(&loader, 0, sizeof(loader));
+    loader.hsa_ven_amd_loader_query_host_address = query_host_address;
+    memcpy(table, &loader, std::min(table_length, sizeof(loader)));
+    return HSA_STATUS_SUCCESS;
+}
+
+//===----------------------------------------------------------------------===//
+// Agents
+//===----------------------------------------------------------------------===//
+
+hsa_status_t hsa_iterate_agents(hsa_status_t (*callback)(hsa_agent_t agent, void* data), void* data) {
+    if (callback == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    Runtime& rt = runtime();
+    if (rt.refcount == 0)
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    hsa_status_t status = callback(to_handle(&rt.cpu), data);
+    for (size_t i = 0; i < rt.gpus.size() && status == HSA_STATUS_SUCCESS; ++i)
+        status = callback(to_handle(rt.gpus[i].get()), data);
+    return status;
+}
+
+hsa_status_t hsa_agent_get_info(hsa_agent_t agent, hsa_agent_info_t attribute, void* value) {
+    Agent* a = to_agent(agent);
+    if (a == nullptr)
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    if (value == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    const bool gpu = a->type == HSA_DEVICE_TYPE_GPU;
+    switch (static_cast<int>(attribute)) {
+    case HSA_AGENT_INFO_NAME:          return put_string(value, a->name, 64);
+    case HSA_AGENT_INFO_VENDOR_NAME:   return put_string(value, gpu ? "AMD" : "CPU", 64);
+    case HSA_AGENT_INFO_FEATURE:
+        return put(value, gpu ? HSA_AGENT_FEATURE_KERNEL_DISPATCH : HSA_AGENT_FEATURE_AGENT_DISPATCH);
+    case HSA_AGENT_INFO_MACHINE_MODEL: return put(value, HSA_MACHINE_MODEL_LARGE);
+    case HSA_AGENT_INFO_PROFILE:       return put(value, gpu ? HSA_PROFILE_BASE : HSA_PROFILE_FULL);
+    case HSA_AGENT_INFO_DEFAULT_FLOAT_ROUNDING_MODE:
+        return put(value, HSA_DEFAULT_FLOAT_ROUNDING_MODE_NEAR);
+    case HSA_AGENT_INFO_WAVEFRONT_SIZE:      return put<uint32_t>(value, gpu ? 64 : 0);
+    case HSA_AGENT_INFO_WORKGROUP_MAX_DIM: {
+        uint16_t dim[3] = { 1024, 1024, 1024 };
+        memcpy(value, dim, sizeof(dim));
+        return HSA_STATUS_SUCCESS;
+    }
+    case HSA_AGENT_INFO_WORKGROUP_MAX_SIZE:  return put<uint32_t>(value, gpu ? 1024 : 0);
+    case HSA_AGENT_INFO_GRID_MAX_DIM: {
+        hsa_dim3_t dim = { UINT32_MAX, UINT32_MAX, UINT32_MAX };
+        return put(value, dim);
+    }
+    case HSA_AGENT_INFO_GRID_MAX_SIZE:       return put<uint32_t>(value, UINT32_MAX);
+    case HSA_AGENT_INFO_FBARRIER_MAX_SIZE:   return put<uint32_t>(value, 32);
+    case HSA_AGENT_INFO_QUEUES_MAX:          return put<uint32_t>(value, gpu ? 128 : 0);
+    case HSA_AGENT_INFO_QUEUE_MIN_SIZE:      return put<uint32_t>(value, gpu ? 64 : 0);
+    case HSA_AGENT_INFO_QUEUE_MAX_SIZE:      return put<uint32_t>(value, gpu ? 131072 : 0);
+    case HSA_AGENT_INFO_QUEUE_TYPE:          return put(value, HSA_QUEUE_TYPE_MULTI);
+    case HSA_AGENT_INFO_NODE:                return put<uint32_t>(value, a->node);
+    case HSA_AGENT_INFO_DEVICE:              return put(value, a->type);
+    case HSA_AGENT_INFO_CACHE_SIZE: {
+        uint32_t sizes[4] = { 16 * 1024, 4 * 1024 * 1024, 0, 0 };
+        memcpy(value, sizes, sizeof(sizes));
+        return HSA_STATUS_SUCCESS;
+    }
+    case HSA_AGENT_INFO_ISA: {
+        hsa_isa_t isa = {0};
+        if (gpu)
+            isa = runtime().isa("amdgcn-amd-amdhsa--" + a->name);
+        return put(value, isa);
+    }
+    case HSA_AGENT_INFO_EXTENSIONS: {
+        uint8_t extensions[128] = {0};
+        memcpy(value, extensions, sizeof(extensions));
+        return HSA_STATUS_SUCCESS;
+    }
+    case HSA_AGENT_INFO_VERSION_MAJOR:       return put<uint16_t>(value, 1);
+    case HSA_AGENT_INFO_VERSION_MINOR:       return put<uint16_t>(value, 1);
+    case HSA_AMD_AGENT_INFO_CHIP_ID:         return put<uint32_t>(value, 0);
+    case HSA_AMD_AGENT_INFO_CACHELINE_SIZE:  return put<uint32_t>(value, 64);
+    case HSA_AMD_AGENT_INFO_COMPUTE_UNIT_COUNT: return put<uint32_t>(value, a->cu_count);
+    case HSA_AMD_AGENT_INFO_MAX_CLOCK_FREQUENCY: return put<uint32_t>(value, 1000);
+    case HSA_AMD_AGENT_INFO_DRIVER_NODE_ID:  return put<uint32_t>(value, a->node);
+    case HSA_AMD_AGENT_INFO_BDFID:           return put<uint32_t>(value, a->node);
+    case HSA_AMD_AGENT_INFO_PRODUCT_NAME:
+        return put_string(value, gpu ? "HSA emulated " + a->name : a->name, 64);
+    case HSA_AMD_AGENT_INFO_MAX_WAVES_PER_CU: return put<uint32_t>(value, gpu ? 40 : 0);
+    case HSA_AMD_AGENT_INFO_NUM_SIMDS_PER_CU: return put<uint32_t>(value, gpu ? 4 : 0);
+    default:
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_agent_iterate_isas(hsa_agent_t agent, hsa_status_t (*callback)(hsa_isa_t isa, void* data),
+                                    void* data) {
+    Agent* a = to_agent(agent);
+    if (a == nullptr)
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    if (callback == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    if (a->type != HSA_DEVICE_TYPE_GPU)
+        return HSA_STATUS_SUCCESS;
+
+    // kernels are never executed, so an emulated agent accepts the code
+    // objects of every GCN ISA the runtime asks about
+    Runtime& rt = runtime();
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> l(rt.isa_lock);
+        names = rt.isas;
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+        hsa_isa_t isa;
+        isa.handle = i + 1;
+        hsa_status_t status = callback(isa, data);
+        if (status != HSA_STATUS_SUCCESS)
+            return status;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_isa_from_name(const char* name, hsa_isa_t* isa) {
+    if (name == nullptr || isa == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    static const char prefix[] = "amdgcn-amd-amdhsa--gfx";
+    if (strncmp(name, prefix, sizeof(prefix) - 1) != 0)
+        return HSA_STATUS_ERROR_INVALID_ISA_NAME;
+    *isa = runtime().isa(name);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_isa_get_info_alt(hsa_isa_t isa, hsa_isa_info_t attribute, void* value) {
+    Runtime& rt = runtime();
+    std::string name;
+    {
+        std::lock_guard<std::mutex> l(rt.isa_lock);
+        if (isa.handle == 0 || isa.handle > rt.isas.size())
+            return HSA_STATUS_ERROR_INVALID_ISA;
+        name = rt.isas[isa.handle - 1];
+    }
+    if (value == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    switch (attribute) {
+    case HSA_ISA_INFO_NAME_LENGTH: return put<uint32_t>(value, name.size());
+    case HSA_ISA_INFO_NAME:
+        memcpy(value, name.c_str(), name.size());
+        return HSA_STATUS_SUCCESS;
+    default:
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Signals
+//===----------------------------------------------------------------------===//
+
+hsa_status_t hsa_signal_create(hsa_signal_value_t initial_value, uint32_t num_consumers,
+                               const hsa_agent_t* consumers, hsa_signal_t* signal) {
+    if (signal == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    signal->handle = reinterpret_cast<uint64_t>(new Signal(initial_value));
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_signal_destroy(hsa_signal_t signal) {
+    if (signal.handle == 0)
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    delete to_signal(signal);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_signal_value_t hsa_signal_load_scacquire(hsa_signal_t signal) {
+    return to_signal(signal)->value.load(std::memory_order_acquire);
+}
+
+hsa_signal_value_t hsa_signal_load_relaxed(hsa_signal_t signal) {
+    return to_signal(signal)->value.load(std::memory_order_relaxed);
+}
+
+void hsa_signal_store_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    store(to_signal(signal), value);
+}
+
+void hsa_signal_store_screlease(hsa_signal_t signal, hsa_signal_value_t value) {
+    store(to_signal(signal), value);
+}
+
+hsa_signal_value_t hsa_signal_wait_scacquire(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                             hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                             hsa_wait_state_t wait_state_hint) {
+    return wait(to_signal(signal), condition, compare_value, timeout_hint, wait_state_hint);
+}
+
+hsa_signal_value_t hsa_signal_wait_relaxed(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                           hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                           hsa_wait_state_t wait_state_hint) {
+    return wait(to_signal(signal), condition, compare_value, timeout_hint, wait_state_hint);
+}
+
+hsa_status_t hsa_amd_signal_async_handler(hsa_signal_t signal, hsa_signal_condition_t cond,
+                                          hsa_signal_value_t value, hsa_amd_signal_handler handler,
+                                          void* arg) {
+    if (signal.handle == 0)
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    if (handler == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    AsyncEvents& events = async_events();
+    {
+        std::lock_guard<std::mutex> l(events.lock);
+        events.handlers.push_back(AsyncHandler{ to_signal(signal), cond, value, handler, arg });
+        async_handler_count.store(static_cast<uint32_t>(events.handlers.size()));
+        // the condition may hold already
+        ++events.changes;
+        if (!events.started) {
+            std::thread(async_event_loop).detach();
+            events.started = true;
+        }
+    }
+    events.cv.notify_one();
+    return HSA_STATUS_SUCCESS;
+}
+
+//===----------------------------------------------------------------------===//
+// Queues
+//===----------------------------------------------------------------------===//
+
+hsa_status_t hsa_queue_create(hsa_agent_t agent, uint32_t size, hsa_queue_type32_t type,
+                              void (*callback)(hsa_status_t status, hsa_queue_t* source, void* data),
+                              void* data, uint32_t private_segment_size, uint32_t group_segment_size,
+                              hsa_queue_t** queue) {
+    Agent* a = to_agent(agent);
+    if (a == nullptr)
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    if (queue == nullptr || size < 64 || size > 131072 || (size & (size - 1)) != 0)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    if (a->type != HSA_DEVICE_TYPE_GPU)
+        return HSA_STATUS_ERROR_INVALID_QUEUE_CREATION;
+
+    void* ring = nullptr;
+    if (posix_memalign(&ring, 64, size_t(size) * sizeof(hsa_kernel_dispatch_packet_t)) != 0)
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    hsa_kernel_dispatch_packet_t* packets = static_cast<hsa_kernel_dispatch_packet_t*>(ring);
+    for (uint32_t i = 0; i < size; ++i) {
+        memset(&packets[i], 0, sizeof(packets[i]));
+        packets[i].header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    }
+
+    Queue* q = new Queue();
+    q->queue.type = type;
+    q->queue.features = HSA_QUEUE_FEATURE_KERNEL_DISPATCH;
+    q->queue.base_address = ring;
+    q->queue.size = size;
+    q->queue.id = reinterpret_cast<uint64_t>(q);
+    // the runtime rings the doorbell with the index of the packet, so that
+    // the first ring has to differ from the initial value
+    q->doorbell = new Signal(-1);
+    q->queue.doorbell_signal.handle = reinterpret_cast<uint64_t>(q->doorbell);
+    q->agent = a;
+    q->read_index.store(0);
+    q->write_index.store(0);
+    q->callback = callback;
+    q->data = data;
+    q->stopping.store(false);
+    q->worker = std::thread(&Queue::loop, q);
+    *queue = &q->queue;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_queue_destroy(hsa_queue_t* queue) {
+    if (queue == nullptr)
+        return HSA_STATUS_ERROR_INVALID_QUEUE;
+    Queue* q = to_queue(queue);
+    q->stopping.store(true);
+    store(q->doorbell, INT64_MIN);
+    q->worker.join();
+    delete q->doorbell;
+    free(q->queue.base_address);
+    delete q;
+    return HSA_STATUS_SUCCESS;
+}
+
+uint64_t hsa_queue_load_read_index_scacquire(const hsa_queue_t* queue) {
+    return to_queue(queue)->read_index.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_read_index_relaxed(const hsa_queue_t* queue) {
+    return to_queue(queue)->read_index.load(std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_load_write_index_scacquire(const hsa_queue_t* queue) {
+    return to_queue(queue)->write_index.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_write_index_relaxed(const hsa_queue_t* queue) {
+    return to_queue(queue)->write_index.load(std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    to_queue(queue)->write_index.store(value, std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_screlease(const hsa_queue_t* queue, uint64_t value) {
+    to_queue(queue)->write_index.store(value, std::memory_order_release);
+}
+
+uint64_t hsa_queue_add_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    return to_queue(queue)->write_index.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_add_write_index_scacq_screl(const hsa_queue_t* queue, uint64_t value) {
+    return to_queue(queue)->write_index.fetch_add(value, std::memory_order_acq_rel);
+}
+
+uint64_t hsa_queue_cas_write_index_scacq_screl(const hsa_queue_t* queue, uint64_t expected, uint64_t value) {
+    to_queue(queue)->write_index.compare_exchange_strong(expected, value, std::memory_order_acq_rel);
+    return expected;
+}
+
+hsa_status_t hsa_amd_queue_set_priority(hsa_queue_t* queue, hsa_amd_queue_priority_t priority) {
+    return queue ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_INVALID_QUEUE;
+}
+
+hsa_status_t hsa_amd_queue_cu_set_mask(const hsa_queue_t* queue, uint32_t num_cu_mask_count,
+                                       const uint32_t* cu_mask) {
+    if (queue == nullptr)
+        return HSA_STATUS_ERROR_INVALID_QUEUE;
+    return (num_cu_mask_count != 0 && cu_mask == nullptr) ? HSA_STATUS_ERROR_INVALID_ARGUMENT
+                                                          : HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_set_profiler_enabled(hsa_queue_t* queue, int enable) {
+    // timestamps are always recorded
+    return queue ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_INVALID_QUEUE;
+}
+
+hsa_status_t hsa_amd_profiling_async_copy_enable(bool enable) {
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_get_dispatch_time(hsa_agent_t agent, hsa_signal_t signal,
+                                                 hsa_amd_profiling_dispatch_time_t* time) {
+    if (signal.handle == 0)
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    if (time == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    time->start = to_signal(signal)->start.load(std::memory_order_relaxed);
+    time->end = to_signal(signal)->end.load(std::memory_order_relaxed);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_get_async_copy_time(hsa_signal_t signal,
+                                                   hsa_amd_profiling_async_copy_time_t* time) {
+    if (signal.handle == 0)
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    if (time == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    time->start = to_signal(signal)->start.load(std::memory_order_relaxed);
+    time->end = to_signal(signal)->end.load(std::memory_order_relaxed);
+    return HSA_STATUS_SUCCESS;
+}
+
+//===----------------------------------------------------------------------===//
+// Memory
+//===----------------------------------------------------------------------===//
+
+hsa_status_t hsa_amd_agent_iterate_memory_pools(hsa_agent_t agent,
+                                                hsa_status_t (*callback)(hsa_amd_memory_pool_t pool, void* data),
+                                                void* data) {
+    Agent* a = to_agent(agent);
+    if (a == nullptr)
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    if (callback == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    for (Pool* p : a->pools) {
+        hsa_amd_memory_pool_t pool;
+        pool.handle = reinterpret_cast<uint64_t>(p);
+        hsa_status_t status = callback(pool, data);
+        if (status != HSA_STATUS_SUCCESS)
+            return status;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_pool_get_info(hsa_amd_memory_pool_t memory_pool,
+                                          hsa_amd_memory_pool_info_t attribute, void* value) {
+    Pool* p = to_pool(memory_pool);
+    if (p == nullptr || value == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    switch (attribute) {
+    case HSA_AMD_MEMORY_POOL_INFO_SEGMENT:                 return put(value, p->segment);
+    case HSA_AMD_MEMORY_POOL_INFO_GLOBAL_FLAGS:            return put<uint32_t>(value, p->flags);
+    case HSA_AMD_MEMORY_POOL_INFO_SIZE:                    return put<size_t>(value, p->size);
+    case HSA_AMD_MEMORY_POOL_INFO_RUNTIME_ALLOC_ALLOWED:   return put<bool>(value, p->alloc_allowed);
+    case HSA_AMD_MEMORY_POOL_INFO_RUNTIME_ALLOC_GRANULE:   return put<size_t>(value, EMU_ALLOC_GRANULE);
+    case HSA_AMD_MEMORY_POOL_INFO_RUNTIME_ALLOC_ALIGNMENT: return put<size_t>(value, EMU_ALLOC_GRANULE);
+    case HSA_AMD_MEMORY_POOL_INFO_ACCESSIBLE_BY_ALL:
+        return put<bool>(value, (p->flags & HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_FINE_GRAINED) != 0);
+    default:
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_amd_agent_memory_pool_get_info(hsa_agent_t agent, hsa_amd_memory_pool_t memory_pool,
+                                                hsa_amd_agent_memory_pool_info_t attribute, void* value) {
+    Agent* a = to_agent(agent);
+    Pool* p = to_pool(memory_pool);
+    if (a == nullptr)
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    if (p == nullptr || value == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    switch (attribute) {
+    case HSA_AMD_AGENT_MEMORY_POOL_INFO_ACCESS: {
+        // like a dGPU system: host fine-grained memory is open to every agent,
+        // everything else only to its owner unless access is granted
+        hsa_amd_memory_pool_access_t access = HSA_AMD_MEMORY_POOL_ACCESS_DISALLOWED_BY_DEFAULT;
+        if (p->owner == a || (p->flags & HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_FINE_GRAINED))
+            access = HSA_AMD_MEMORY_POOL_ACCESS_ALLOWED_BY_DEFAULT;
+        else if (p->segment == HSA_AMD_SEGMENT_GROUP)
+            access = HSA_AMD_MEMORY_POOL_ACCESS_NEVER_ALLOWED;
+        return put(value, access);
+    }
+    case HSA_AMD_AGENT_MEMORY_POOL_INFO_NUM_LINK_HOPS:
+        return put<uint32_t>(value, p->owner == a ? 0 : 1);
+    default:
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_amd_memory_pool_allocate(hsa_amd_memory_pool_t memory_pool, size_t size, uint32_t flags,
+                                          void** ptr) {
+    Pool* p = to_pool(memory_pool);
+    if (p == nullptr || ptr == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    return allocate(p, size, ptr);
+}
+
+hsa_status_t hsa_amd_memory_pool_free(void* ptr) {
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.alloc_lock);
+    auto it = rt.allocations.find(reinterpret_cast<uintptr_t>(ptr));
+    if (it == rt.allocations.end() || it->second.type != HSA_EXT_POINTER_TYPE_HSA)
+        return HSA_STATUS_ERROR_INVALID_ALLOCATION;
+    it->second.pool->used -= (it->second.size + EMU_ALLOC_GRANULE - 1) & ~size_t(EMU_ALLOC_GRANULE - 1);
+    rt.allocations.erase(it);
+    free(ptr);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_agents_allow_access(uint32_t num_agents, const hsa_agent_t* agents,
+                                         const uint32_t* flags, const void* ptr) {
+    if (num_agents == 0 || agents == nullptr || ptr == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_lock(void* host_ptr, size_t size, hsa_agent_t* agents, int num_agent,
+                                 void** agent_ptr) {
+    if (host_ptr == nullptr || size == 0 || agent_ptr == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.alloc_lock);
+    auto it = rt.allocations.find(reinterpret_cast<uintptr_t>(host_ptr));
+    if (it != rt.allocations.end()) {
+        if (it->second.type != HSA_EXT_POINTER_TYPE_LOCKED)
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+        ++it->second.lock_count;
+    } else {
+        rt.allocations[reinterpret_cast<uintptr_t>(host_ptr)] =
+            Allocation{size, &rt.cpu, nullptr, HSA_EXT_POINTER_TYPE_LOCKED, nullptr, 1};
+    }
+    // device memory is host memory, the agents see the same address
+    *agent_ptr = host_ptr;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_unlock(void* host_ptr) {
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.alloc_lock);
+    auto it = rt.allocations.find(reinterpret_cast<uintptr_t>(host_ptr));
+    if (it == rt.allocations.end() || it->second.type != HSA_EXT_POINTER_TYPE_LOCKED)
+        return HSA_STATUS_SUCCESS;
+    if (--it->second.lock_count == 0)
+        rt.allocations.erase(it);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_pointer_info(void* ptr, hsa_amd_pointer_info_t* info, void* (*alloc)(size_t),
+                                  uint32_t* num_agents_accessible, hsa_agent_t** accessible) {
+    if (ptr == nullptr || info == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    Runtime& rt = runtime();
+    {
+        std::lock_guard<std::mutex> l(rt.alloc_lock);
+        auto it = rt.find(ptr);
+        if (it == rt.allocations.end()) {
+            info->type = HSA_EXT_POINTER_TYPE_UNKNOWN;
+        } else {
+            info->type = it->second.type;
+            info->agentBaseAddress = reinterpret_cast<void*>(it->first);
+            info->hostBaseAddress = reinterpret_cast<void*>(it->first);
+            info->sizeInBytes = it->second.size;
+            info->userData = it->second.user_data;
+            info->agentOwner = to_handle(it->second.owner);
+        }
+    }
+
+    if (num_agents_accessible != nullptr && accessible != nullptr && alloc != nullptr) {
+        std::vector<hsa_agent_t> agents;
+        if (info->type != HSA_EXT_POINTER_TYPE_UNKNOWN) {
+            agents.push_back(to_handle(&rt.cpu));
+            for (auto& gpu : rt.gpus)
+                agents.push_back(to_handle(gpu.get()));
+        }
+        *num_agents_accessible = agents.size();
+        *accessible = static_cast<hsa_agent_t*>(alloc(std::max<size_t>(agents.size(), 1) * sizeof(hsa_agent_t)));
+        if (*accessible == nullptr)
+            return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+        std::copy(agents.begin(), agents.end(), *accessible);
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_pointer_info_set_userdata(void* ptr, void* userdata) {
+    Runtime& rt = runtime();
+    std::lock_guard<std::mutex> l(rt.alloc_lock);
+    auto it = rt.allocations.find(reinterpret_cast<uintptr_t>(ptr));
+    if (it == rt.allocations.end())
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    it->second.user_data = userdata;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_memory_copy(void* dst, const void* src, size_t size) {
+    if (dst == nullptr || src == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    memmove(dst, src, size);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_async_copy(void* dst, hsa_agent_t dst_agent, const void* src,
+                                       hsa_agent_t src_agent, size_t size, uint32_t num_dep_signals,
+                                       const hsa_signal_t* dep_signals, hsa_signal_t completion_signal) {
+    if (dst == nullptr || src == nullptr || (num_dep_signals != 0 && dep_signals == nullptr))
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    runtime().copy_engine->submit(num_dep_signals, dep_signals, completion_signal,
+                                  [=] { memmove(dst, src, size); });
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_async_copy_rect(const hsa_pitched_ptr_t* dst, const hsa_dim3_t* dst_offset,
+                                            const hsa_pitched_ptr_t* src, const hsa_dim3_t* src_offset,
+                                            const hsa_dim3_t* range, hsa_agent_t copy_agent,
+                                            hsa_amd_copy_direction_t dir, uint32_t num_dep_signals,
+                                            const hsa_signal_t* dep_signals, hsa_signal_t completion_signal) {
+    if (dst == nullptr || dst_offset == nullptr || src == nullptr || src_offset == nullptr ||
+        range == nullptr || (num_dep_signals != 0 && dep_signals == nullptr))
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    const hsa_pitched_ptr_t d = *dst;
+    const hsa_pitched_ptr_t s = *src;
+    const hsa_dim3_t doff = *dst_offset;
+    const hsa_dim3_t soff = *src_offset;
+    const hsa_dim3_t r = *range;
+    runtime().copy_engine->submit(num_dep_signals, dep_signals, completion_signal, [=] {
+        // offset and range are in bytes along x, rows along y, slices along z
+        for (uint32_t z = 0; z < r.z; ++z) {
+            for (uint32_t y = 0; y < r.y; ++y) {
+                char* to = static_cast<char*>(d.base) + (doff.z + z) * d.slice + (doff.y + y) * d.pitch + doff.x;
+                const char* from = static_cast<const char*>(s.base) + (soff.z + z) * s.slice +
+                                   (soff.y + y) * s.pitch + soff.x;
+                memmove(to, from, r.x);
+            }
+        }
+    });
+    return HSA_STATUS_SUCCESS;
+}
+
+//===----------------------------------------------------------------------===//
+// Code objects and executables
+//===----------------------------------------------------------------------===//
+
+hsa_status_t hsa_code_object_reader_create_from_memory(const void* code_object, size_t size,
+                                                       hsa_code_object_reader_t* code_object_reader) {
+    if (code_object == nullptr || size == 0 || code_object_reader == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    CodeObjectReader* r = new CodeObjectReader;
+    r->data.assign(static_cast<const char*>(code_object), size);
+    code_object_reader->handle = reinterpret_cast<uint64_t>(r);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_code_object_reader_destroy(hsa_code_object_reader_t code_object_reader) {
+    if (code_object_reader.handle == 0)
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT_READER;
+    delete reinterpret_cast<CodeObjectReader*>(code_object_reader.handle);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_create_alt(hsa_profile_t profile,
+                                       hsa_default_float_rounding_mode_t default_float_rounding_mode,
+                                       const char* options, hsa_executable_t* executable) {
+    if (executable == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    Executable* e = new Executable;
+    e->frozen = false;
+    executable->handle = reinterpret_cast<uint64_t>(e);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_destroy(hsa_executable_t executable) {
+    Executable* e = to_executable(executable);
+    if (e == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    for (void* p : e->storage)
+        free(p);
+    delete e;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_agent_global_variable_define(hsa_executable_t executable, hsa_agent_t agent,
+                                                         const char* variable_name, void* address) {
+    Executable* e = to_executable(executable);
+    if (e == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    if (variable_name == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    if (e->frozen)
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    if (!e->defined.insert(std::make_pair(std::string(variable_name), address)).second)
+        return HSA_STATUS_ERROR_VARIABLE_ALREADY_DEFINED;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_load_agent_code_object(hsa_executable_t executable, hsa_agent_t agent,
+                                                   hsa_code_object_reader_t code_object_reader,
+                                                   const char* options,
+                                                   hsa_loaded_code_object_t* loaded_code_object) {
+    Executable* e = to_executable(executable);
+    CodeObjectReader* r = reinterpret_cast<CodeObjectReader*>(code_object_reader.handle);
+    if (e == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    if (r == nullptr)
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT_READER;
+    if (to_agent(agent) == nullptr)
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    if (e->frozen)
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    hsa_status_t status = load_symbols(e, to_agent(agent), r->data);
+    if (status == HSA_STATUS_SUCCESS && loaded_code_object != nullptr)
+        loaded_code_object->handle = reinterpret_cast<uint64_t>(r);
+    return status;
+}
+
+hsa_status_t hsa_executable_freeze(hsa_executable_t executable, const char* options) {
+    Executable* e = to_executable(executable);
+    if (e == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    if (e->frozen)
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    e->frozen = true;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_validate_alt(hsa_executable_t executable, const char* options, uint32_t* result) {
+    if (to_executable(executable) == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    if (result == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    *result = 0;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_get_symbol_by_name(hsa_executable_t executable, const char* symbol_name,
+                                               const hsa_agent_t* agent, hsa_executable_symbol_t* symbol) {
+    Executable* e = to_executable(executable);
+    if (e == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    if (symbol_name == nullptr || symbol == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    Symbol* s = e->find(symbol_name);
+    if (s == nullptr)
+        s = e->find(std::string(symbol_name) + ".kd");
+    if (s == nullptr)
+        return HSA_STATUS_ERROR_INVALID_SYMBOL_NAME;
+    symbol->handle = reinterpret_cast<uint64_t>(s);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_iterate_agent_symbols(
+    hsa_executable_t executable, hsa_agent_t agent,
+    hsa_status_t (*callback)(hsa_executable_t exec, hsa_agent_t agent, hsa_executable_symbol_t symbol, void* data),
+    void* data) {
+    Executable* e = to_executable(executable);
+    if (e == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    if (callback == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    for (auto& s : e->symbols) {
+        if (s->agent != to_agent(agent))
+            continue;
+        hsa_executable_symbol_t symbol;
+        symbol.handle = reinterpret_cast<uint64_t>(s.get());
+        hsa_status_t status = callback(executable, agent, symbol, data);
+        if (status != HSA_STATUS_SUCCESS)
+            return status;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_symbol_get_info(hsa_executable_symbol_t executable_symbol,
+                                            hsa_executable_symbol_info_t attribute, void* value) {
+    Symbol* s = to_symbol(executable_symbol);
+    if (s == nullptr)
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE_SYMBOL;
+    if (value == nullptr)
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    const bool kernel = s->kind == HSA_SYMBOL_KIND_KERNEL;
+    switch (attribute) {
+    case HSA_EXECUTABLE_SYMBOL_INFO_TYPE:          return put(value, s->kind);
+    case HSA_EXECUTABLE_SYMBOL_INFO_NAME_LENGTH:   return put<uint32_t>(value, s->name.size());
+    case HSA_EXECUTABLE_SYMBOL_INFO_NAME:
+        memcpy(value, s->name.c_str(), s->name.size());
+        return HSA_STATUS_SUCCESS;
+    case HSA_EXECUTABLE_SYMBOL_INFO_AGENT:         return put(value, to_handle(s->agent));
+    case HSA_EXECUTABLE_SYMBOL_INFO_LINKAGE:       return put(value, HSA_SYMBOL_LINKAGE_PROGRAM);
+    case HSA_EXECUTABLE_SYMBOL_INFO_IS_DEFINITION: return put<bool>(value, true);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_ADDRESS:
+        if (kernel)
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+        return put<uint64_t>(value, s->address);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_SEGMENT:    return put(value, HSA_VARIABLE_SEGMENT_GLOBAL);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_ALLOCATION: return put(value, HSA_VARIABLE_ALLOCATION_AGENT);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_ALIGNMENT:  return put<uint32_t>(value, 16);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_SIZE:       return put<uint32_t>(value, s->size);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_IS_CONST:   return put<bool>(value, false);
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT:
+        if (!kernel)
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+        return put<uint64_t>(value, s->address);
+    // the code of a kernel is never run, it needs no segments
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE:      return put<uint32_t>(value, 0);
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_ALIGNMENT: return put<uint32_t>(value, 16);
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_GROUP_SEGMENT_SIZE:        return put<uint32_t>(value, 0);
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_PRIVATE_SEGMENT_SIZE:      return put<uint32_t>(value, 0);
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_DYNAMIC_CALLSTACK:         return put<bool>(value, false);
+    default:
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
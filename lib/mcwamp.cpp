@@ -209,7 +209,9 @@ bool is_cpu()
     return GetOrInitRuntime()->is_cpu();
 }
 
-static bool in_kernel = false;
+// CPU path kernels run on the threads of the CPU thread pool, only those
+// threads are inside a kernel while it executes
+static thread_local bool in_kernel = false;
 bool in_cpu_kernel() { return in_kernel; }
 void enter_kernel() { in_kernel = true; }
 void leave_kernel() { in_kernel = false; }
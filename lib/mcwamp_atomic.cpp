@@ -1,183 +1,189 @@
-#include <mutex>
-#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
-// FIXME : need to consider how to let hc namespace could also use functions here
-namespace Concurrency {
+// Atomic operations used by kernels on the CPU path. Every work-item of a
+// launch may be running on a different worker thread, so these have to be
+// real atomics; they are built on the __atomic builtins and never take a
+// lock. Operations without a hardware instruction (floating point add/sub,
+// min/max) are compare-and-swap loops.
+//
+// All functions return the value stored at the location before the update.
 
-std::mutex afx_u, afx_i, afx_f;
-unsigned int atomic_exchange_unsigned(unsigned int *x, unsigned int y) {
-    std::lock_guard<std::mutex> guard(afx_u);
-    unsigned int old = *x;
-    *x = y;
-    return old;
-}
-int atomic_exchange_int(int *x, int y) {
-    std::lock_guard<std::mutex> guard(afx_i);
-    int old = *x;
-    *x = y;
-    return old;
-}
-float atomic_exchange_float(float* x, float y) {
-    std::lock_guard<std::mutex> guard(afx_f);
-    int old = *x;
-    *x = y;
-    return old;
-}
+namespace {
 
-std::mutex afcas_u, afcas_i;
-unsigned int atomic_compare_exchange_unsigned(unsigned int *x, unsigned int y, unsigned int z) {
-    std::lock_guard<std::mutex> guard(afcas_u);
-    unsigned int old = *x;
-    if (*x == y) {
-        *x = z;
-    }
-    return old;
-}
-int atomic_compare_exchange_int(int *x, int y, int z) {
-    std::lock_guard<std::mutex> guard(afcas_i);
-    int old = *x;
-    if (*x == y) {
-        *x = z;
-    }
-    return old;
+template <typename T>
+inline T fetch_exchange(T* p, T val) {
+    return __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST);
 }
 
-std::mutex afa_u, afa_i, afa_f;
-unsigned int atomic_add_unsigned(unsigned int *x, unsigned int y) {
-    std::lock_guard<std::mutex> guard(afa_u);
-    unsigned int old = *x;
-    *x += y;
-    return old;
-}
-int atomic_add_int(int *x, int y) {
-    std::lock_guard<std::mutex> guard(afa_i);
-    int old = *x;
-    *x += y;
-    return old;
-}
-float atomic_add_float(float* x, float y) {
-    std::lock_guard<std::mutex> guard(afa_f);
-    float old = *x;
-    *x += y;
-    return old;
+template <typename T>
+inline T fetch_compare_exchange(T* p, T expected, T val) {
+    // on failure expected is overwritten with the current value, on success
+    // it already is the old value
+    __atomic_compare_exchange_n(p, &expected, val, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
 }
 
-std::mutex afs_u, afs_i, afs_f;
-unsigned int atomic_sub_unsigned(unsigned int *x, unsigned int y) {
-    std::lock_guard<std::mutex> guard(afa_u);
-    unsigned int old = *x;
-    *x -= y;
-    return old;
-}
-int atomic_sub_int(int *x, int y) {
-    std::lock_guard<std::mutex> guard(afa_i);
-    int old = *x;
-    *x -= y;
-    return old;
-}
-float atomic_sub_float(float* x, float y) {
-    std::lock_guard<std::mutex> guard(afa_f);
-    float old = *x;
-    *x -= y;
+template <typename T>
+inline T fetch_max(T* p, T val) {
+    T old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (old < val &&
+           !__atomic_compare_exchange_n(p, &old, val, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
     return old;
 }
 
-std::mutex afand_u, afand_i;
-unsigned int atomic_and_unsigned(unsigned int *x, unsigned int y) {
-    std::lock_guard<std::mutex> guard(afand_u);
-    unsigned int old = *x;
-    *x &= y;
-    return old;
-}
-int atomic_and_int(int *x, int y) {
-    std::lock_guard<std::mutex> guard(afand_i);
-    int old = *x;
-    *x &= y;
+template <typename T>
+inline T fetch_min(T* p, T val) {
+    T old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (val < old &&
+           !__atomic_compare_exchange_n(p, &old, val, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
     return old;
 }
 
-std::mutex afor_u, afor_i;
-unsigned int atomic_or_unsigned(unsigned int *x, unsigned int y) {
-    std::lock_guard<std::mutex> guard(afor_u);
-    unsigned int old = *x;
-    *x |= y;
-    return old;
-}
-int atomic_or_int(int *x, int y) {
-    std::lock_guard<std::mutex> guard(afor_i);
-    int old = *x;
-    *x |= y;
-    return old;
+// floats are updated through their bit pattern
+inline uint32_t float_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
 }
 
-std::mutex afxor_u, afxor_i;
-unsigned int atomic_xor_unsigned(unsigned int *x, unsigned int y) {
-    std::lock_guard<std::mutex> guard(afxor_u);
-    unsigned int old = *x;
-    *x ^= y;
-    return old;
-}
-int atomic_xor_int(int *x, int y) {
-    std::lock_guard<std::mutex> guard(afxor_i);
-    int old = *x;
-    *x ^= y;
-    return old;
+inline float bits_float(uint32_t u) {
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
 }
 
-std::mutex afmax_u, afmax_i;
-unsigned int atomic_max_unsigned(unsigned int *p, unsigned int val) {
-    std::lock_guard<std::mutex> guard(afmax_u);
-    unsigned int old = *p;
-    *p = std::max(*p, val);
-    return old;
-}
-int atomic_max_int(int *p, int val) {
-    std::lock_guard<std::mutex> guard(afmax_i);
-    int old = *p;
-    *p = std::max(*p, val);
-    return old;
+template <typename Op>
+inline float fetch_update_float(float* x, Op op) {
+    uint32_t* p = reinterpret_cast<uint32_t*>(x);
+    uint32_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(p, &old, float_bits(op(bits_float(old))), true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+    return bits_float(old);
 }
 
-std::mutex afmin_u, afmin_i;
-unsigned int atomic_min_unsigned(unsigned int *p, unsigned int val) {
-    std::lock_guard<std::mutex> guard(afmin_u);
-    unsigned int old = *p;
-    *p = std::min(*p, val);
-    return old;
-}
-int atomic_min_int(int *p, int val) {
-    std::lock_guard<std::mutex> guard(afmin_i);
-    int old = *p;
-    *p = std::min(*p, val);
-    return old;
-}
+} // namespace
 
-std::mutex afi_u, afi_i;
-unsigned int atomic_inc_unsigned(unsigned int *p) {
-    std::lock_guard<std::mutex> guard(afi_u);
-    unsigned int old = *p;
-    *p += 1;
-    return old;
-}
-int atomic_inc_int(int *p) {
-    std::lock_guard<std::mutex> guard(afi_i);
-    int old = *p;
-    *p += 1;
-    return old;
+// Concurrency keeps the symbols libraries built against the C++AMP headers
+// link to, hc is where hc.hpp declares them for the CPU path
+#define KALMAR_CPU_ATOMICS                                                           \
+unsigned int atomic_exchange_unsigned(unsigned int *x, unsigned int y) {             \
+    return fetch_exchange(x, y);                                                     \
+}                                                                                    \
+int atomic_exchange_int(int *x, int y) {                                             \
+    return fetch_exchange(x, y);                                                     \
+}                                                                                    \
+float atomic_exchange_float(float* x, float y) {                                     \
+    return bits_float(fetch_exchange(reinterpret_cast<uint32_t*>(x), float_bits(y))); \
+}                                                                                    \
+uint64_t atomic_exchange_uint64(uint64_t *x, uint64_t y) {                           \
+    return fetch_exchange(x, y);                                                     \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_compare_exchange_unsigned(unsigned int *x, unsigned int y, unsigned int z) { \
+    return fetch_compare_exchange(x, y, z);                                          \
+}                                                                                    \
+int atomic_compare_exchange_int(int *x, int y, int z) {                              \
+    return fetch_compare_exchange(x, y, z);                                          \
+}                                                                                    \
+uint64_t atomic_compare_exchange_uint64(uint64_t *x, uint64_t y, uint64_t z) {       \
+    return fetch_compare_exchange(x, y, z);                                          \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_add_unsigned(unsigned int *x, unsigned int y) {                  \
+    return __atomic_fetch_add(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+int atomic_add_int(int *x, int y) {                                                  \
+    return __atomic_fetch_add(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+float atomic_add_float(float* x, float y) {                                          \
+    return fetch_update_float(x, [y](float v) { return v + y; });                    \
+}                                                                                    \
+uint64_t atomic_add_uint64(uint64_t *x, uint64_t y) {                                \
+    return __atomic_fetch_add(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_sub_unsigned(unsigned int *x, unsigned int y) {                  \
+    return __atomic_fetch_sub(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+int atomic_sub_int(int *x, int y) {                                                  \
+    return __atomic_fetch_sub(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+float atomic_sub_float(float* x, float y) {                                          \
+    return fetch_update_float(x, [y](float v) { return v - y; });                    \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_and_unsigned(unsigned int *x, unsigned int y) {                  \
+    return __atomic_fetch_and(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+int atomic_and_int(int *x, int y) {                                                  \
+    return __atomic_fetch_and(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+uint64_t atomic_and_uint64(uint64_t *x, uint64_t y) {                                \
+    return __atomic_fetch_and(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_or_unsigned(unsigned int *x, unsigned int y) {                   \
+    return __atomic_fetch_or(x, y, __ATOMIC_SEQ_CST);                                \
+}                                                                                    \
+int atomic_or_int(int *x, int y) {                                                   \
+    return __atomic_fetch_or(x, y, __ATOMIC_SEQ_CST);                                \
+}                                                                                    \
+uint64_t atomic_or_uint64(uint64_t *x, uint64_t y) {                                 \
+    return __atomic_fetch_or(x, y, __ATOMIC_SEQ_CST);                                \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_xor_unsigned(unsigned int *x, unsigned int y) {                  \
+    return __atomic_fetch_xor(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+int atomic_xor_int(int *x, int y) {                                                  \
+    return __atomic_fetch_xor(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+uint64_t atomic_xor_uint64(uint64_t *x, uint64_t y) {                                \
+    return __atomic_fetch_xor(x, y, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_max_unsigned(unsigned int *p, unsigned int val) {                \
+    return fetch_max(p, val);                                                        \
+}                                                                                    \
+int atomic_max_int(int *p, int val) {                                                \
+    return fetch_max(p, val);                                                        \
+}                                                                                    \
+uint64_t atomic_max_uint64(uint64_t *p, uint64_t val) {                              \
+    return fetch_max(p, val);                                                        \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_min_unsigned(unsigned int *p, unsigned int val) {                \
+    return fetch_min(p, val);                                                        \
+}                                                                                    \
+int atomic_min_int(int *p, int val) {                                                \
+    return fetch_min(p, val);                                                        \
+}                                                                                    \
+uint64_t atomic_min_uint64(uint64_t *p, uint64_t val) {                              \
+    return fetch_min(p, val);                                                        \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_inc_unsigned(unsigned int *p) {                                  \
+    return __atomic_fetch_add(p, 1u, __ATOMIC_SEQ_CST);                              \
+}                                                                                    \
+int atomic_inc_int(int *p) {                                                         \
+    return __atomic_fetch_add(p, 1, __ATOMIC_SEQ_CST);                               \
+}                                                                                    \
+                                                                                     \
+unsigned int atomic_dec_unsigned(unsigned int *p) {                                  \
+    return __atomic_fetch_sub(p, 1u, __ATOMIC_SEQ_CST);                              \
+}                                                                                    \
+int atomic_dec_int(int *p) {                                                         \
+    return __atomic_fetch_sub(p, 1, __ATOMIC_SEQ_CST);                               \
 }
 
-std::mutex afd_u, afd_i;
-unsigned int atomic_dec_unsigned(unsigned int *p) {
-    std::lock_guard<std::mutex> guard(afd_u);
-    unsigned int old = *p;
-    *p -= 1;
-    return old;
-}
-int atomic_dec_int(int *p) {
-    std::lock_guard<std::mutex> guard(afd_i);
-    int old = *p;
-    *p -= 1;
-    return old;
-}
+namespace Concurrency {
+KALMAR_CPU_ATOMICS
+} // namespace Concurrency
 
-}
+namespace hc {
+KALMAR_CPU_ATOMICS
+} // namespace hc
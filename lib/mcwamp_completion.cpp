@@ -0,0 +1,141 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <kalmar_runtime.h>
+
+// number of executor threads used when HCC_COMPLETION_THREADS is not set
+#define COMPLETION_THREADS_DEFAULT (2)
+
+// longest time between a watched future becoming ready and the waiter
+// noticing it
+#define COMPLETION_WATCH_INTERVAL_US (200)
+
+namespace Kalmar {
+
+namespace {
+
+/// state of the CompletionService. It is never destroyed: continuations may
+/// still be pending when the process exits, the threads are detached.
+class CompletionState
+{
+public:
+  static CompletionState& get() {
+    static CompletionState* state = new CompletionState();
+    return *state;
+  }
+
+  void post(CompletionService::callback_fn callback) {
+    {
+      std::lock_guard<std::mutex> l(exec_lock);
+      tasks.push_back(std::move(callback));
+      if (executor_count == 0)
+        start_executors();
+    }
+    exec_cv.notify_one();
+  }
+
+  void watch(const std::shared_future<void>& future, CompletionService::callback_fn callback) {
+    {
+      std::lock_guard<std::mutex> l(watch_lock);
+      added.push_back(Watched{future, std::move(callback)});
+      if (!waiter_started) {
+        std::thread(&CompletionState::waiter_loop, this).detach();
+        waiter_started = true;
+      }
+    }
+    watch_cv.notify_one();
+  }
+
+private:
+  struct Watched {
+    std::shared_future<void> future;
+    CompletionService::callback_fn callback;
+  };
+
+  CompletionState() : executor_count(0), waiter_started(false) {}
+
+  void start_executors() {
+    executor_count = COMPLETION_THREADS_DEFAULT;
+    char* env = getenv("HCC_COMPLETION_THREADS");
+    if (env != nullptr && strtol(env, nullptr, 0) > 0)
+      executor_count = static_cast<unsigned int>(strtol(env, nullptr, 0));
+    for (unsigned int i = 0; i < executor_count; ++i)
+      std::thread(&CompletionState::executor_loop, this).detach();
+  }
+
+  void executor_loop() {
+    for (;;) {
+      CompletionService::callback_fn callback;
+      {
+        std::unique_lock<std::mutex> l(exec_lock);
+        exec_cv.wait(l, [&] { return !tasks.empty(); });
+        callback = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      // an exception thrown by a continuation has nowhere to go, as with the
+      // thread completion_future::then used to spawn
+      callback();
+    }
+  }
+
+  // the waiter sleeps on the oldest watched future, which usually completes
+  // first, and sweeps all of them whenever it wakes up
+  void waiter_loop() {
+    std::vector<Watched> watched;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> l(watch_lock);
+        if (watched.empty())
+          watch_cv.wait(l, [&] { return !added.empty(); });
+        for (auto& w : added)
+          watched.push_back(std::move(w));
+        added.clear();
+      }
+
+      size_t kept = 0;
+      for (size_t i = 0; i < watched.size(); ++i) {
+        std::future_status status = watched[i].future.wait_for(std::chrono::seconds(0));
+        if (status == std::future_status::ready) {
+          post(std::move(watched[i].callback));
+        } else if (status == std::future_status::deferred) {
+          // a deferred future only runs when it is waited for
+          std::shared_future<void> future = watched[i].future;
+          CompletionService::callback_fn callback = std::move(watched[i].callback);
+          post([future, callback] { future.wait(); callback(); });
+        } else if (kept++ != i) {
+          watched[kept - 1] = std::move(watched[i]);
+        }
+      }
+      watched.resize(kept);
+
+      if (!watched.empty())
+        watched.front().future.wait_for(std::chrono::microseconds(COMPLETION_WATCH_INTERVAL_US));
+    }
+  }
+
+  std::mutex exec_lock;
+  std::condition_variable exec_cv;
+  std::deque<CompletionService::callback_fn> tasks;
+  unsigned int executor_count;
+
+  std::mutex watch_lock;
+  std::condition_variable watch_cv;
+  std::vector<Watched> added;
+  bool waiter_started;
+};
+
+} // namespace
+
+void CompletionService::post(callback_fn callback) {
+  CompletionState::get().post(std::move(callback));
+}
+
+void CompletionService::watch(const std::shared_future<void>& future, callback_fn callback) {
+  CompletionState::get().watch(future, std::move(callback));
+}
+
+} // namespace Kalmar
@@ -0,0 +1,242 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <kalmar_cpu_fiber.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// User space context switch for the work-item fibers of tiled CPU kernels.
+//
+// __hcc_fiber_switch pushes the callee-saved registers of the calling
+// context on its own stack, publishes the resulting stack pointer and pops
+// the registers of the target context off the target stack. A fresh fiber
+// is given a stack which looks as if it had been switched away from at the
+// entry of __hcc_fiber_start, which then calls fn(arg).
+
+#if defined(__x86_64__)
+
+asm(R"(
+    .pushsection .text
+    .globl  __hcc_fiber_switch
+    .type   __hcc_fiber_switch, @function
+    .p2align 4
+__hcc_fiber_switch:
+    pushq   %rbp
+    pushq   %rbx
+    pushq   %r12
+    pushq   %r13
+    pushq   %r14
+    pushq   %r15
+    subq    $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw  4(%rsp)
+    movq    %rsp, (%rdi)
+    movq    %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw   4(%rsp)
+    addq    $8, %rsp
+    popq    %r15
+    popq    %r14
+    popq    %r13
+    popq    %r12
+    popq    %rbx
+    popq    %rbp
+    ret
+    .size   __hcc_fiber_switch, .-__hcc_fiber_switch
+
+    .type   __hcc_fiber_start, @function
+    .p2align 4
+__hcc_fiber_start:
+    movq    %r12, %rdi
+    callq   *%r13
+    ud2
+    .size   __hcc_fiber_start, .-__hcc_fiber_start
+    .popsection
+)");
+
+extern "C" void __hcc_fiber_start();
+
+extern "C" void* __hcc_fiber_make(char* stack, size_t size, void (*fn)(void*), void* arg) {
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~uintptr_t(15);
+    uint64_t* sp = reinterpret_cast<uint64_t*>(top);
+
+    // return address of __hcc_fiber_switch, popped with the stack 16-byte
+    // aligned as required at the call in __hcc_fiber_start
+    *--sp = reinterpret_cast<uint64_t>(&__hcc_fiber_start);
+    *--sp = 0;                                   // rbp
+    *--sp = 0;                                   // rbx
+    *--sp = reinterpret_cast<uint64_t>(arg);     // r12
+    *--sp = reinterpret_cast<uint64_t>(fn);      // r13
+    *--sp = 0;                                   // r14
+    *--sp = 0;                                   // r15
+
+    // inherit the floating point control state of the creating thread
+    uint32_t mxcsr;
+    uint16_t fpucw;
+    asm volatile("stmxcsr %0" : "=m"(mxcsr));
+    asm volatile("fnstcw %0" : "=m"(fpucw));
+    *--sp = (uint64_t(fpucw) << 32) | mxcsr;
+    return sp;
+}
+
+#elif defined(__aarch64__)
+
+asm(R"(
+    .pushsection .text
+    .globl  __hcc_fiber_switch
+    .type   __hcc_fiber_switch, %function
+    .p2align 4
+__hcc_fiber_switch:
+    sub     sp, sp, #160
+    stp     x19, x20, [sp, #0]
+    stp     x21, x22, [sp, #16]
+    stp     x23, x24, [sp, #32]
+    stp     x25, x26, [sp, #48]
+    stp     x27, x28, [sp, #64]
+    stp     x29, x30, [sp, #80]
+    stp     d8,  d9,  [sp, #96]
+    stp     d10, d11, [sp, #112]
+    stp     d12, d13, [sp, #128]
+    stp     d14, d15, [sp, #144]
+    mov     x9, sp
+    str     x9, [x0]
+    mov     sp, x1
+    ldp     x19, x20, [sp, #0]
+    ldp     x21, x22, [sp, #16]
+    ldp     x23, x24, [sp, #32]
+    ldp     x25, x26, [sp, #48]
+    ldp     x27, x28, [sp, #64]
+    ldp     x29, x30, [sp, #80]
+    ldp     d8,  d9,  [sp, #96]
+    ldp     d10, d11, [sp, #112]
+    ldp     d12, d13, [sp, #128]
+    ldp     d14, d15, [sp, #144]
+    add     sp, sp, #160
+    ret
+    .size   __hcc_fiber_switch, .-__hcc_fiber_switch
+
+    .type   __hcc_fiber_start, %function
+    .p2align 4
+__hcc_fiber_start:
+    mov     x0, x19
+    blr     x20
+    brk     #0
+    .size   __hcc_fiber_start, .-__hcc_fiber_start
+    .popsection
+)");
+
+extern "C" void __hcc_fiber_start();
+
+extern "C" void* __hcc_fiber_make(char* stack, size_t size, void (*fn)(void*), void* arg) {
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~uintptr_t(15);
+    uint64_t* sp = reinterpret_cast<uint64_t*>(top) - 20;
+
+    for (int i = 0; i < 20; ++i)
+        sp[i] = 0;
+    sp[0] = reinterpret_cast<uint64_t>(arg);                 // x19
+    sp[1] = reinterpret_cast<uint64_t>(fn);                  // x20
+    sp[11] = reinterpret_cast<uint64_t>(&__hcc_fiber_start); // x30
+    return sp;
+}
+
+#endif
+
+namespace Kalmar {
+
+// default usable size of a work-item stack
+#define CPU_FIBER_STACK_SIZE (64 * 1024)
+
+static size_t page_size() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+size_t CPUStackArena::stack_size() {
+    static const size_t size = [] {
+        size_t bytes = CPU_FIBER_STACK_SIZE;
+        char* env = getenv("HCC_CPU_STACK_SIZE");
+        if (env != nullptr) {
+            long v = strtol(env, nullptr, 0);
+            if (v > 0)
+                bytes = v;
+        }
+        return (bytes + page_size() - 1) & ~(page_size() - 1);
+    }();
+    return size;
+}
+
+CPUStackArena::CPUStackArena()
+    : base(nullptr), stride(stack_size() + page_size()), guard(page_size()), count(0),
+      scratch_mem(nullptr), scratch_size(0) {}
+
+CPUStackArena::~CPUStackArena() {
+    if (base)
+        munmap(base, count * stride);
+    ::operator delete(scratch_mem);
+}
+
+CPUStackArena& CPUStackArena::get() {
+    static thread_local CPUStackArena arena;
+    return arena;
+}
+
+void CPUStackArena::reserve(size_t n) {
+    if (n <= count)
+        return;
+
+    // the whole range starts out inaccessible and without commit charge,
+    // only the stacks themselves are opened up
+    char* p = static_cast<char*>(mmap(nullptr, n * stride, PROT_NONE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+    for (size_t i = 0; i < n; ++i) {
+        if (mprotect(p + i * stride + guard, stride - guard, PROT_READ | PROT_WRITE) != 0) {
+            // every guard page splits the mapping, which may run into the
+            // limit on the number of mappings of a process. Go without guard
+            // pages rather than fail the launch.
+            if (mprotect(p, n * stride, PROT_READ | PROT_WRITE) != 0) {
+                munmap(p, n * stride);
+                throw std::bad_alloc();
+            }
+            break;
+        }
+    }
+
+    if (base)
+        munmap(base, count * stride);
+    base = p;
+    count = n;
+}
+
+void fiber_barrier_divergence() {
+    // the work-item is on the stack of the thread running the tile, there is
+    // no context to switch to
+    fprintf(stderr, "### HCC CPU path: tile_barrier::wait() reached by a work-item of a tile "
+                    "whose last work-item did not reach it. All work-items of a tile have to "
+                    "reach every barrier.\n");
+    abort();
+}
+
+void* CPUStackArena::scratch(size_t bytes) {
+    if (bytes > scratch_size) {
+        ::operator delete(scratch_mem);
+        scratch_mem = nullptr;
+        scratch_size = 0;
+        scratch_mem = ::operator new(bytes);
+        scratch_size = bytes;
+    }
+    return scratch_mem;
+}
+
+} // namespace Kalmar
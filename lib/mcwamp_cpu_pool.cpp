@@ -0,0 +1,467 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <kalmar_cpu_pool.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Kalmar {
+
+// number of times an idle thread polls for work before it goes to sleep
+#define CPU_POOL_SPIN_COUNT (4096)
+
+// smallest part of a parallel_memcpy handed to a thread
+#define MEMCPY_MIN_PART_SIZE (256 * 1024)
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// pool whose worker is the calling thread
+static thread_local CPUThreadPool* current_pool = nullptr;
+
+struct CPUThreadPool::Job {
+    task_fn fn;
+    void* arg;
+    std::atomic<size_t> remaining;
+
+    // completion callback of a submitted job, nullptr for a blocking run()
+    done_fn on_done;
+
+    // set by the thread completing the last partition, while holding lock
+    std::atomic<bool> done;
+    std::mutex lock;
+    std::condition_variable cv;
+};
+
+CPUThreadPool::CPUThreadPool(unsigned int nworkers)
+    : workers(), cpus(), queued(0), sleepers(0), sleep_lock(), sleep_cv(), stopping(false) {
+    start(nworkers);
+}
+
+CPUThreadPool::CPUThreadPool(const std::vector<int>& cpus)
+    : workers(), cpus(cpus), queued(0), sleepers(0), sleep_lock(), sleep_cv(), stopping(false) {
+    start(cpu_worker_count(cpus.size()));
+}
+
+void CPUThreadPool::start(unsigned int nworkers) {
+    nworkers = std::max(nworkers, 1u);
+    for (unsigned int i = 0; i < nworkers; ++i)
+        workers.emplace_back(new Worker);
+    for (unsigned int i = 0; i < nworkers; ++i)
+        workers[i]->thread = std::thread(&CPUThreadPool::worker_loop, this, i);
+}
+
+CPUThreadPool::~CPUThreadPool() {
+    {
+        std::lock_guard<std::mutex> l(sleep_lock);
+        stopping = true;
+    }
+    sleep_cv.notify_all();
+    for (auto& w : workers)
+        if (w->thread.joinable())
+            w->thread.join();
+}
+
+CPUThreadPool& CPUThreadPool::get_default() {
+    static CPUThreadPool pool(cpu_worker_count(usable_cpus().size()));
+    return pool;
+}
+
+void CPUThreadPool::destroy(CPUThreadPool* pool) {
+    if (pool != nullptr && current_pool == pool)
+        std::thread([pool] { delete pool; }).detach();
+    else
+        delete pool;
+}
+
+void CPUThreadPool::push(unsigned int id, const Task& task) {
+    {
+        std::lock_guard<std::mutex> l(workers[id]->lock);
+        workers[id]->tasks.push_back(task);
+    }
+    queued.fetch_add(1);
+}
+
+void CPUThreadPool::wake() {
+    if (sleepers.load() != 0) {
+        std::lock_guard<std::mutex> l(sleep_lock);
+        sleep_cv.notify_all();
+    }
+}
+
+bool CPUThreadPool::pop(unsigned int id, Task& task) {
+    Worker& w = *workers[id];
+    std::lock_guard<std::mutex> l(w.lock);
+    if (w.tasks.empty())
+        return false;
+    task = w.tasks.back();
+    w.tasks.pop_back();
+    queued.fetch_sub(1);
+    return true;
+}
+
+// Steal the oldest (and thus largest) task of another worker. The index of
+// the victim is returned so that a thief which is not a pool worker (thief
+// == size()) can hand the remainder of the stolen range back to it.
+bool CPUThreadPool::steal(unsigned int thief, Task& task, unsigned int& victim) {
+    const unsigned int n = size();
+    for (unsigned int i = 1; i <= n; ++i) {
+        if (queued.load(std::memory_order_relaxed) == 0)
+            return false;
+        victim = (thief + i) % n;
+        if (victim == thief)
+            continue;
+        Worker& w = *workers[victim];
+        std::lock_guard<std::mutex> l(w.lock);
+        if (w.tasks.empty())
+            continue;
+        task = w.tasks.front();
+        w.tasks.pop_front();
+        queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+// Run a task, splitting it in halves until a single partition is left. The
+// upper halves are pushed onto the deque of worker id where they are either
+// picked up again by that worker or stolen by an idle one.
+void CPUThreadPool::execute(unsigned int id, Task task) {
+    Job* job = task.job;
+    while (task.end - task.begin > 1) {
+        size_t mid = task.begin + (task.end - task.begin) / 2;
+        push(id, Task{job, mid, task.end});
+        task.end = mid;
+    }
+    wake();
+
+    job->fn(job->arg, task.begin);
+
+    // the job object of a blocking run() lives on the stack of the thread in
+    // run(), it must not be touched once the last partition has been
+    // accounted for. A submitted job is owned by the pool.
+    if (job->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (job->on_done) {
+            job->on_done(job->arg);
+            delete job;
+            return;
+        }
+        std::lock_guard<std::mutex> l(job->lock);
+        job->done.store(true, std::memory_order_release);
+        job->cv.notify_all();
+    }
+}
+
+void CPUThreadPool::worker_loop(unsigned int id) {
+    current_pool = this;
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    Task task;
+    unsigned int victim;
+    for (;;) {
+        if (pop(id, task) || steal(id, task, victim)) {
+            execute(id, task);
+            continue;
+        }
+
+        // poll a little while before parking, back-to-back launches are
+        // then picked up without a trip through the kernel
+        int spin = 0;
+        while (spin < CPU_POOL_SPIN_COUNT && queued.load(std::memory_order_relaxed) == 0) {
+            cpu_relax();
+            ++spin;
+        }
+        if (spin < CPU_POOL_SPIN_COUNT)
+            continue;
+
+        std::unique_lock<std::mutex> l(sleep_lock);
+        sleepers.fetch_add(1);
+        sleep_cv.wait(l, [&] { return stopping || queued.load() != 0; });
+        sleepers.fetch_sub(1);
+        if (stopping && queued.load() == 0)
+            return;
+    }
+}
+
+// seed one contiguous range of the partitions of job per worker
+void CPUThreadPool::seed(Job* job, size_t nparts) {
+    const size_t nseed = std::min<size_t>(size(), nparts);
+    for (size_t i = 0; i < nseed; ++i)
+        push(i, Task{job, nparts * i / nseed, nparts * (i + 1) / nseed});
+    wake();
+}
+
+void CPUThreadPool::run(task_fn fn, void* arg, size_t nparts) {
+    if (nparts == 0)
+        return;
+
+    Job job;
+    job.fn = fn;
+    job.arg = arg;
+    job.remaining.store(nparts);
+    job.on_done = nullptr;
+    job.done.store(false);
+    seed(&job, nparts);
+
+    // help out while the launch is in flight
+    const unsigned int n = size();
+    Task task;
+    unsigned int victim;
+    int spin = 0;
+    while (!job.done.load(std::memory_order_acquire)) {
+        if (steal(n, task, victim)) {
+            execute(victim, task);
+            spin = 0;
+            continue;
+        }
+        if (++spin >= CPU_POOL_SPIN_COUNT)
+            break;
+        cpu_relax();
+    }
+
+    std::unique_lock<std::mutex> l(job.lock);
+    job.cv.wait(l, [&] { return job.done.load(std::memory_order_acquire); });
+}
+
+void CPUThreadPool::submit(task_fn fn, void* arg, size_t nparts, done_fn done) {
+    if (nparts == 0) {
+        done(arg);
+        return;
+    }
+
+    Job* job = new Job;
+    job->fn = fn;
+    job->arg = arg;
+    job->remaining.store(nparts);
+    job->on_done = done;
+    job->done.store(false);
+    seed(job, nparts);
+}
+
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    const char* p = list.c_str();
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+        while (*p == ',' || *p == ' ' || *p == '\n')
+            ++p;
+    }
+    return cpus;
+}
+
+std::vector<int> usable_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    }
+    if (cpus.empty()) {
+        for (unsigned int cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// read "<quota> <period>" from a cgroup v2 cpu.max file, quota is "max" if
+// there is no limit
+static double read_cpu_max(const std::string& path) {
+    std::ifstream f(path);
+    std::string quota;
+    double period = 0;
+    if (!(f >> quota >> period) || quota == "max" || period <= 0)
+        return 0;
+    return strtod(quota.c_str(), nullptr) / period;
+}
+
+// read a cgroup v1 quota, cpu.cfs_quota_us is -1 if there is no limit
+static double read_cfs_quota(const std::string& dir) {
+    std::ifstream q(dir + "/cpu.cfs_quota_us");
+    std::ifstream p(dir + "/cpu.cfs_period_us");
+    double quota = 0;
+    double period = 0;
+    if (!(q >> quota) || !(p >> period) || quota <= 0 || period <= 0)
+        return 0;
+    return quota / period;
+}
+
+unsigned int cpu_quota() {
+    static const unsigned int quota = [] {
+        // the cgroup of the process as seen from its cgroup namespace; the
+        // hierarchy may be mounted at its root or at that cgroup, so both
+        // are looked at
+        std::string v2_path;
+        std::string v1_path;
+        std::ifstream cgroup("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(cgroup, line)) {
+            size_t a = line.find(':');
+            size_t b = line.find(':', a + 1);
+            if (a == std::string::npos || b == std::string::npos)
+                continue;
+            std::string controllers = line.substr(a + 1, b - a - 1);
+            std::string path = line.substr(b + 1);
+            if (path == "/")
+                path.clear();
+            if (controllers.empty()) {
+                v2_path = path;
+                continue;
+            }
+            std::stringstream ss(controllers);
+            std::string c;
+            while (std::getline(ss, c, ','))
+                if (c == "cpu")
+                    v1_path = path;
+        }
+
+        double limit = 0;
+        auto apply = [&limit](double l) {
+            if (l > 0 && (limit == 0 || l < limit))
+                limit = l;
+        };
+
+        // a v2 limit may be set on any ancestor of the cgroup
+        const char* v2_mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+        for (const char* mount : v2_mounts) {
+            std::string path = v2_path;
+            for (;;) {
+                apply(read_cpu_max(mount + path + "/cpu.max"));
+                if (path.empty())
+                    break;
+                path.erase(path.rfind('/'));
+            }
+        }
+
+        const char* v1_mounts[] = { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" };
+        for (const char* mount : v1_mounts) {
+            apply(read_cfs_quota(mount + v1_path));
+            apply(read_cfs_quota(mount));
+        }
+
+        return static_cast<unsigned int>(std::ceil(limit));
+    }();
+    return quota;
+}
+
+unsigned int cpu_worker_count(size_t ncpus) {
+    unsigned int n = static_cast<unsigned int>(std::max<size_t>(ncpus, 1));
+    unsigned int quota = cpu_quota();
+    if (quota != 0)
+        n = std::min(n, quota);
+    return n;
+}
+
+void stream_memcpy(void* dst, const void* src, size_t count) {
+#if defined(__SSE2__)
+    char* d = static_cast<char*>(dst);
+    const char* s = static_cast<const char*>(src);
+
+    // streaming stores need an aligned destination
+    size_t head = std::min<size_t>((16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15, count);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    count -= head;
+
+    for (; count >= 64; count -= 64, d += 64, s += 64) {
+        __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+        __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+        __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d), v0);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d + 16), v1);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d + 32), v2);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d + 48), v3);
+    }
+    // order the streaming stores before whatever publishes dst
+    _mm_sfence();
+    memcpy(d, s, count);
+#else
+    memcpy(dst, src, count);
+#endif
+}
+
+namespace {
+
+struct MemcpyParts {
+    char* dst;
+    const char* src;
+    size_t count;
+    size_t part_size;
+    bool nontemporal;
+};
+
+void copy_part(void* arg, size_t part) {
+    MemcpyParts* p = static_cast<MemcpyParts*>(arg);
+    size_t begin = part * p->part_size;
+    size_t n = std::min(p->part_size, p->count - begin);
+    if (p->nontemporal)
+        stream_memcpy(p->dst + begin, p->src + begin, n);
+    else
+        memcpy(p->dst + begin, p->src + begin, n);
+}
+
+} // namespace
+
+void parallel_memcpy(CPUThreadPool& pool, void* dst, const void* src, size_t count, bool nontemporal) {
+    size_t nparts = std::min<size_t>(pool.size() + 1, count / MEMCPY_MIN_PART_SIZE);
+    if (nparts <= 1) {
+        if (nontemporal)
+            stream_memcpy(dst, src, count);
+        else
+            memcpy(dst, src, count);
+        return;
+    }
+
+    // parts are a multiple of the page size
+    size_t part_size = (count + nparts - 1) / nparts;
+    part_size = (part_size + 4095) & ~size_t(4095);
+    nparts = (count + part_size - 1) / part_size;
+
+    MemcpyParts parts { static_cast<char*>(dst), static_cast<const char*>(src), count, part_size, nontemporal };
+    pool.run(copy_part, &parts, nparts);
+}
+
+} // namespace Kalmar
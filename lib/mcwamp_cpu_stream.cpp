@@ -0,0 +1,243 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <kalmar_runtime.h>
+
+#include <unordered_map>
+
+namespace Kalmar {
+namespace CLAMP {
+
+extern bool in_cpu_kernel();
+
+// set on the worker threads of command streams
+static thread_local bool in_stream = false;
+
+// kernel enqueued last on any CPU queue for each buffer; it completes after
+// the kernels enqueued before it on the buffer, which it depends on
+static std::mutex cpu_kernel_lock;
+static std::unordered_map<const rw_info*, std::shared_ptr<KalmarAsyncOp>> cpu_kernels;
+
+std::shared_ptr<CPUAsyncOp> push_cpu_kernel(CPUStreamQueue* queue, const std::vector<rw_info*>& bufs,
+                                            CPUCommandStream::command_fn fn) {
+  std::lock_guard<std::mutex> l(cpu_kernel_lock);
+  for (auto it = cpu_kernels.begin(); it != cpu_kernels.end(); ) {
+    if (it->second->isReady())
+      it = cpu_kernels.erase(it);
+    else
+      ++it;
+  }
+
+  // kernels on other buffers, and on other queues, run side by side
+  std::vector<std::shared_ptr<KalmarAsyncOp>> deps;
+  for (rw_info* rw : bufs) {
+    auto it = cpu_kernels.find(rw);
+    if (it != cpu_kernels.end())
+      deps.push_back(it->second);
+  }
+  std::shared_ptr<CPUAsyncOp> op = queue->enqueue(hcCommandKernel, std::move(fn), std::move(deps));
+  for (rw_info* rw : bufs)
+    cpu_kernels[rw] = op;
+  return op;
+}
+
+void wait_cpu_kernels(const rw_info* buf) {
+  // a command stream only starts a kernel once the kernels before it on its
+  // buffers completed
+  if (in_cpu_kernel() || in_stream)
+    return;
+  std::shared_ptr<KalmarAsyncOp> kernel;
+  {
+    std::lock_guard<std::mutex> l(cpu_kernel_lock);
+    auto it = cpu_kernels.find(buf);
+    if (it != cpu_kernels.end())
+      kernel = it->second;
+  }
+  if (kernel)
+    kernel->getFuture()->wait();
+}
+
+} // namespace CLAMP
+
+struct CPUCommandStream::Command {
+  std::shared_ptr<CPUAsyncOp> op;
+  command_fn fn;
+  std::vector<std::shared_ptr<KalmarAsyncOp>> deps;
+};
+
+struct CPUCommandStream::State {
+  KalmarQueue* queue;
+  execute_order order;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Command> commands;
+
+  // enqueued commands which might not have completed yet
+  std::deque<std::shared_ptr<CPUAsyncOp>> inflight;
+
+  std::thread worker;
+  bool stopping;
+};
+
+CPUCommandStream::CPUCommandStream(KalmarQueue* queue, execute_order order) : state(new State) {
+  state->queue = queue;
+  state->order = order;
+  state->stopping = false;
+}
+
+namespace {
+
+/// worker threads of the streams destroyed by a command on their own worker,
+/// which cannot join itself. The worker only finishes the commands left in
+/// its stream, it is joined by the next stream destroyed on another thread.
+/// Never destroyed, streams may still be released during exit.
+class ExitedWorkers
+{
+public:
+  static ExitedWorkers& get() {
+    static ExitedWorkers* workers = new ExitedWorkers();
+    return *workers;
+  }
+
+  void add(std::thread worker) {
+    std::lock_guard<std::mutex> l(lock);
+    workers.push_back(std::move(worker));
+  }
+
+  /// join the exited workers, other than the calling thread
+  void join() {
+    std::vector<std::thread> joined;
+    {
+      std::lock_guard<std::mutex> l(lock);
+      auto self = std::partition(workers.begin(), workers.end(),
+                                 [](const std::thread& t) { return t.get_id() != std::this_thread::get_id(); });
+      std::move(workers.begin(), self, std::back_inserter(joined));
+      workers.erase(workers.begin(), self);
+    }
+    for (auto& t : joined)
+      t.join();
+  }
+
+private:
+  std::mutex lock;
+  std::vector<std::thread> workers;
+};
+
+} // namespace
+
+CPUCommandStream::~CPUCommandStream() {
+  {
+    std::lock_guard<std::mutex> l(state->lock);
+    state->stopping = true;
+  }
+  state->cv.notify_one();
+  if (state->worker.joinable()) {
+    if (state->worker.get_id() == std::this_thread::get_id()) {
+      ExitedWorkers::get().add(std::move(state->worker));
+      return;
+    }
+    state->worker.join();
+  }
+  ExitedWorkers::get().join();
+}
+
+std::shared_ptr<CPUAsyncOp> CPUCommandStream::enqueue(hcCommandKind kind, command_fn fn,
+                                                      std::vector<std::shared_ptr<KalmarAsyncOp>> deps) {
+  std::shared_ptr<CPUAsyncOp> op = std::make_shared<CPUAsyncOp>(state->queue, kind);
+  {
+    std::lock_guard<std::mutex> l(state->lock);
+    op->setSeqNumFromQueue();
+    auto& inflight = state->inflight;
+    while (!inflight.empty() && inflight.front()->isReady())
+      inflight.pop_front();
+
+    // a marker on an execute_any_order queue waits for everything before it
+    if (state->order == execute_any_order && kind == hcCommandMarker)
+      deps.insert(deps.end(), inflight.begin(), inflight.end());
+
+    state->commands.push_back(Command{op, std::move(fn), std::move(deps)});
+    inflight.push_back(op);
+    if (!state->worker.joinable())
+      state->worker = std::thread(&CPUCommandStream::worker_loop, state);
+  }
+  state->cv.notify_one();
+  return op;
+}
+
+void CPUCommandStream::wait() {
+  std::deque<std::shared_ptr<CPUAsyncOp>> ops;
+  {
+    std::lock_guard<std::mutex> l(state->lock);
+    ops = state->inflight;
+  }
+  for (auto& op : ops)
+    op->getFuture()->wait();
+}
+
+int CPUCommandStream::pending() {
+  std::lock_guard<std::mutex> l(state->lock);
+  int n = 0;
+  for (auto& op : state->inflight)
+    if (!op->isReady())
+      ++n;
+  return n;
+}
+
+void CPUCommandStream::worker_loop(std::shared_ptr<State> state) {
+  CLAMP::in_stream = true;
+  std::shared_ptr<CPUAsyncOp> last;
+  for (;;) {
+    Command c;
+    {
+      std::unique_lock<std::mutex> l(state->lock);
+      state->cv.wait(l, [&] { return state->stopping || !state->commands.empty(); });
+      if (state->commands.empty())
+        return;
+      c = std::move(state->commands.front());
+      state->commands.pop_front();
+    }
+
+    for (auto& dep : c.deps)
+      if (dep && dep->getFuture())
+        dep->getFuture()->wait();
+    if (state->order == execute_in_order && last)
+      last->getFuture()->wait();
+
+    try {
+      c.fn(c.op);
+    } catch (...) {
+      c.op->complete(std::current_exception());
+    }
+    last = std::move(c.op);
+  }
+}
+
+bool CPUStreamQueue::set_cu_mask(const std::vector<bool>& cu_mask) {
+  std::vector<int> cpus = get_device_cpus();
+  std::vector<int> selected;
+  for (size_t i = 0; i < std::min(cu_mask.size(), cpus.size()); ++i)
+    if (cu_mask[i])
+      selected.push_back(cpus[i]);
+  if (selected.empty())
+    return false;
+
+  // the pool is swapped by the stream in between the commands enqueued
+  // before and after this call, the previous one is released once its last
+  // kernel is done
+  std::shared_ptr<CPUThreadPool> pool(new CPUThreadPool(selected), &CPUThreadPool::destroy);
+  std::shared_ptr<CPUAsyncOp> op = stream.enqueue(hcCommandMarker,
+      [this, pool](const std::shared_ptr<CPUAsyncOp>& op) {
+        op->start();
+        cu_pool = pool;
+        op->complete();
+      });
+  op->getFuture()->wait();
+  return true;
+}
+
+} // namespace Kalmar
@@ -0,0 +1,108 @@
+// RUN: %hc %s -lhc_am -o %t.out && env HCC_AM_CACHE_SIZE=64 %t.out
+
+#include <cstdio>
+#include <cstring>
+#include <hc.hpp>
+#include <hc_am.hpp>
+#include <vector>
+
+// number of small blocks, sub-allocated from slabs
+#define SMALL_COUNT (100)
+#define SMALL_SIZE (1000)
+
+#define LARGE_SIZE (4 * 1024 * 1024)
+
+// test am_alloc with the caching allocator enabled
+//
+// Small blocks come out of shared slabs, yet each of them is tracked on its
+// own and usable from kernels.  Freed memory shows as cached in
+// am_memtracker_sizeinfo, is handed out again and is given back by
+// am_alloc_cache_trim.
+int main()
+{
+    hc::accelerator acc;
+    hc::accelerator_view av = acc.get_default_view();
+    bool ret = true;
+
+    size_t device0, host0, user0, cachedDevice0, cachedHost0;
+    hc::am_memtracker_sizeinfo(acc, &device0, &host0, &user0, &cachedDevice0, &cachedHost0);
+
+    std::vector<int*> small;
+    for (int i = 0; i < SMALL_COUNT; i++) {
+        small.push_back(hc::am_alloc(SMALL_SIZE, acc, 0));
+    }
+
+    // every block is a tracker entry of its own
+    for (int i = 0; i < SMALL_COUNT; i++) {
+        hc::AmPointerInfo info(NULL, NULL, NULL, 0, acc, 0, 0);
+        char *last = reinterpret_cast<char*>(small[i]) + SMALL_SIZE - 1;
+        if (hc::am_memtracker_getinfo(&info, last) != AM_SUCCESS ||
+            info._devicePointer != small[i] || info._sizeBytes != SMALL_SIZE ||
+            info._hostPointer != NULL || !info._isInDeviceMem || !info._isAmManaged) {
+            printf("Failed tracker info for small block %d\n", i);
+            ret = false;
+        }
+    }
+
+    // the blocks do not overlap
+    for (int i = 0; i < SMALL_COUNT; i++) {
+        int *p = small[i];
+        hc::parallel_for_each(av, hc::extent<1>(SMALL_SIZE / sizeof(int)), [=](hc::index<1> idx) [[hc]] {
+            p[idx[0]] = i * SMALL_SIZE + idx[0];
+        });
+    }
+    std::vector<int> host(SMALL_SIZE / sizeof(int));
+    for (int i = 0; i < SMALL_COUNT; i++) {
+        av.copy(small[i], host.data(), SMALL_SIZE);
+        for (size_t j = 0; j < host.size(); j++) {
+            if (host[j] != static_cast<int>(i * SMALL_SIZE + j)) {
+                printf("Failed data check for small block %d\n", i);
+                ret = false;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < SMALL_COUNT; i++) {
+        hc::am_free(small[i]);
+    }
+
+    char *large = hc::am_alloc(LARGE_SIZE, acc, 0);
+    hc::am_free(large);
+
+    size_t device1, host1, user1, cachedDevice1, cachedHost1;
+    hc::am_memtracker_sizeinfo(acc, &device1, &host1, &user1, &cachedDevice1, &cachedHost1);
+    if (device1 != device0 || cachedDevice1 < cachedDevice0 + LARGE_SIZE) {
+        printf("Failed size info after free: device %zu cached %zu\n", device1, cachedDevice1);
+        ret = false;
+    }
+
+    // a smaller request reuses the cached large block
+    char *again = hc::am_alloc(LARGE_SIZE - 4096, acc, 0);
+    if (again != large) {
+        printf("Failed to reuse the cached block\n");
+        ret = false;
+    }
+    hc::am_free(again);
+
+    // host memory
+    char *pinned = hc::am_alloc(SMALL_SIZE, acc, amHostPinned);
+    hc::AmPointerInfo info(NULL, NULL, NULL, 0, acc, 0, 0);
+    if (hc::am_memtracker_getinfo(&info, pinned) != AM_SUCCESS ||
+        info._hostPointer != pinned || info._isInDeviceMem) {
+        printf("Failed tracker info for pinned block\n");
+        ret = false;
+    }
+    memset(pinned, 1, SMALL_SIZE);
+    hc::am_free(pinned);
+
+    size_t trimmed = hc::am_alloc_cache_trim(acc);
+    size_t device2, host2, user2, cachedDevice2, cachedHost2;
+    hc::am_memtracker_sizeinfo(acc, &device2, &host2, &user2, &cachedDevice2, &cachedHost2);
+    if (trimmed == 0 || cachedDevice2 != 0 || cachedHost2 != 0) {
+        printf("Failed trim: %zu trimmed, %zu cached\n", trimmed, cachedDevice2 + cachedHost2);
+        ret = false;
+    }
+
+    return !(ret == true);
+}
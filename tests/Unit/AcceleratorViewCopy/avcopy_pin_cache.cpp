@@ -0,0 +1,76 @@
+// RUN: %hc %s -o %t.out && env HCC_UNPINNED_COPY_MODE=1 HCC_PINNED_CACHE_SIZE=1024 %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <iostream>
+#include <vector>
+
+// large enough for several hundred pages
+#define COPY_SIZE (8 * 1024 * 1024)
+
+// round trips made from the same buffers
+#define ROUND_COUNT (16)
+
+#define TEST_DEBUG (0)
+
+/// test pin-in-place copies reusing the host memory they locked
+///
+/// With HCC_PINNED_CACHE_SIZE set, the host buffers stay locked between the
+/// copies from and to them, so every round trip after the first reuses the
+/// locked ranges. Each round trip has to return the data of its own round,
+/// including copies from the middle of a locked range. The buffers are not
+/// freed before the test is done with them.
+bool round_trips(hc::accelerator_view& acc_view, int* dev, std::vector<int>& src, std::vector<int>& dst, int seed) {
+  bool ret = true;
+  size_t count = COPY_SIZE / sizeof(int);
+
+  for (int round = 0; round < ROUND_COUNT; ++round) {
+    for (size_t i = 0; i < count; ++i) {
+      src[i] = static_cast<int>(i) + seed * ROUND_COUNT + round;
+    }
+    acc_view.copy(src.data(), dev, COPY_SIZE);
+    acc_view.copy(dev, dst.data(), COPY_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+      if (dst[i] != src[i]) {
+#if TEST_DEBUG
+        std::cout << "seed " << seed << " round " << round << ": dst[" << i << "] = "
+                  << dst[i] << ", expected " << src[i] << "\n";
+#endif
+        ret = false;
+        break;
+      }
+    }
+
+    // the second half of the device buffer into the first half of dst,
+    // inside the range locked by the copy above
+    acc_view.copy(dev + count / 2, dst.data(), COPY_SIZE / 2);
+    for (size_t i = 0; i < count / 2; ++i) {
+      if (dst[i] != src[count / 2 + i]) {
+        ret = false;
+        break;
+      }
+    }
+  }
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.get_default_view();
+  int* dev = hc::am_alloc(COPY_SIZE, acc, 0);
+
+  // the same buffers for every seed
+  std::vector<int> src(COPY_SIZE / sizeof(int));
+  std::vector<int> dst(COPY_SIZE / sizeof(int));
+
+  for (int seed = 0; seed < 4; ++seed) {
+    ret &= round_trips(acc_view, dev, src, dst, seed);
+  }
+
+  hc::am_free(dev);
+
+  return !(ret == true);
+}
@@ -0,0 +1,77 @@
+// RUN: %hc %s -o %t.out && rm -f %t.profile
+// RUN: env HCC_UNPINNED_COPY_MODE=0 HCC_COPY_PROFILE=%t.profile %t.out
+// RUN: env HCC_UNPINNED_COPY_MODE=0 HCC_COPY_PROFILE=%t.profile %t.out check
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// sizes of the copies, in different buckets of the tuner
+#define MIN_COPY_SIZE (64 * 1024)
+#define MAX_COPY_SIZE (16 * 1024 * 1024)
+
+// round trips per size, enough for the tuner to try every algorithm
+#define ROUND_COUNT (12)
+
+#define TEST_DEBUG (0)
+
+/// test ChooseBest unpinned copies picked by the copy tuner
+///
+/// Round trips of several sizes go through whatever algorithm the tuner
+/// tries, each of them has to return its data. The tuner writes what it
+/// measured to the profile file at exit; a second run starts from the profile
+/// written by the first one and checks it has both directions in it.
+bool profile_has_both_directions(const char* file_name) {
+  std::ifstream in(file_name);
+  std::string line;
+  bool h2d = false;
+  bool d2h = false;
+  while (std::getline(in, line)) {
+#if TEST_DEBUG
+    std::cout << line << "\n";
+#endif
+    h2d |= (line.find(" h2d ") != std::string::npos);
+    d2h |= (line.find(" d2h ") != std::string::npos);
+  }
+  return h2d && d2h;
+}
+
+int main(int argc, char* argv[]) {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.get_default_view();
+
+  if (argc > 1 && strcmp(argv[1], "check") == 0 && acc.is_hsa_accelerator()) {
+    ret &= profile_has_both_directions(getenv("HCC_COPY_PROFILE"));
+  }
+
+  int* dev = hc::am_alloc(MAX_COPY_SIZE, acc, 0);
+  for (size_t size = MIN_COPY_SIZE; size <= MAX_COPY_SIZE; size *= 4) {
+    size_t count = size / sizeof(int);
+    std::vector<int> src(count);
+    std::vector<int> dst(count);
+    for (int round = 0; round < ROUND_COUNT; ++round) {
+      for (size_t i = 0; i < count; ++i) {
+        src[i] = static_cast<int>(i) * 3 + round;
+      }
+      acc_view.copy(src.data(), dev, size);
+      acc_view.copy(dev, dst.data(), size);
+      if (std::memcmp(src.data(), dst.data(), size) != 0) {
+#if TEST_DEBUG
+        std::cout << "size " << size << " round " << round << ": mismatch\n";
+#endif
+        ret = false;
+      }
+    }
+  }
+  hc::am_free(dev);
+
+  return !(ret == true);
+}
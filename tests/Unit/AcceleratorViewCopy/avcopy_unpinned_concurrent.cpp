@@ -0,0 +1,82 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// number of host threads copying at the same time
+#define THREAD_COUNT (8)
+
+// large enough to go through several staging buffers
+#define COPY_SIZE (16 * 1024 * 1024)
+
+// round trips made by every thread
+#define ROUND_COUNT (4)
+
+#define TEST_DEBUG (0)
+
+/// test unpinned copies from several host threads at once
+///
+/// Every thread copies a pageable host buffer of its own to the device and
+/// back, as many unpinned copies run at the same time as there are staging
+/// channels in the copy engines. Each round trip has to return the data of
+/// its own thread.
+bool round_trips(hc::accelerator_view acc_view, int id) {
+  bool ret = true;
+  hc::accelerator acc = acc_view.get_accelerator();
+
+  size_t count = COPY_SIZE / sizeof(int);
+  std::vector<int> src(count);
+  std::vector<int> dst(count);
+  int* dev = hc::am_alloc(COPY_SIZE, acc, 0);
+
+  for (int round = 0; round < ROUND_COUNT; ++round) {
+    for (size_t i = 0; i < count; ++i) {
+      src[i] = static_cast<int>(i) * THREAD_COUNT + id + round;
+    }
+    acc_view.copy(src.data(), dev, COPY_SIZE);
+    acc_view.copy(dev, dst.data(), COPY_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+      if (dst[i] != src[i]) {
+#if TEST_DEBUG
+        std::cout << "thread " << id << " round " << round << ": dst[" << i << "] = "
+                  << dst[i] << ", expected " << src[i] << "\n";
+#endif
+        ret = false;
+        break;
+      }
+    }
+  }
+
+  hc::am_free(dev);
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+
+  std::vector<char> results(THREAD_COUNT, 0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < THREAD_COUNT; ++i) {
+    // each thread on a view of its own, so that only the copy engines are
+    // shared
+    hc::accelerator_view acc_view = acc.create_view();
+    threads.emplace_back([acc_view, i, &results] {
+      results[i] = round_trips(acc_view, i);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (int i = 0; i < THREAD_COUNT; ++i) {
+    ret &= (results[i] != 0);
+  }
+
+  return !(ret == true);
+}
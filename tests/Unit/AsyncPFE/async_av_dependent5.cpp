@@ -87,8 +87,10 @@ bool test1D() {
 
   void* handle2 = fut2.get_native_handle();
   hsa_signal_value_t signal_value2;
-  signal_value1 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle1));
+  // load the signal of the younger kernel first: the older one may complete
+  // in between the two loads, the younger one not before the older one
   signal_value2 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle2));
+  signal_value1 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle1));
 #if TEST_DEBUG
   std::cout << "signal value #1: " << signal_value1 << "\n";
   std::cout << "signal value #2: " << signal_value2 << "\n";
@@ -112,18 +114,18 @@ bool test1D() {
 
   void* handle3 = fut3.get_native_handle();
   hsa_signal_value_t signal_value3;
-  signal_value1 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle1));
-  signal_value2 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle2));
+  // load the signals from the youngest kernel to the oldest, as above
   signal_value3 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle3));
+  signal_value2 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle2));
+  signal_value1 = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(handle1));
 #if TEST_DEBUG
   std::cout << "signal value #1: " << signal_value1 << "\n";
   std::cout << "signal value #2: " << signal_value2 << "\n";
   std::cout << "signal value #3: " << signal_value3 << "\n";
 #endif
-  // signal_value1 MUST be 0 because the new kernel must wait on the previous one be completed
-  ret &= (signal_value1 == 0);
-  // signal_value2 MUST be 0 because the new kernel must wait on the previous one be completed
-  ret &= (signal_value2 == 0);
+  // the new kernel waits for the previous ones on the device, so it can not
+  // have completed before them
+  ret &= (signal_value3 != 0 || (signal_value1 == 0 && signal_value2 == 0));
 
   // wait on the last future object
   fut3.wait();
@@ -0,0 +1,107 @@
+
+// RUN: %hc %s -I%hsa_header_path -L%hsa_library_path -lhsa-runtime64 -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <iostream>
+#include <vector>
+
+#include <hsa/hsa.h>
+
+// loop to deliberately slow down kernel execution
+#define LOOP_COUNT (1 << 16)
+
+// number of back-to-back dependent kernels
+#define KERNEL_COUNT (8)
+
+#define TEST_DEBUG (0)
+
+/// test that dependent kernel dispatches do not block the host
+///
+/// Every kernel reads and writes the same array_view, so each of them has to
+/// wait for the previous one. The dependency is resolved on the device: all
+/// dispatches return right away, while the first kernel is still running,
+/// and the kernels still execute in order.
+///
+/// The test case only works on HSA because it directly uses HSA runtime API
+/// to query the completion signals of the kernels.
+///
+static inline unsigned int step(unsigned int v) [[cpu, hc]] {
+  return v * 1664525u + 1013904223u;
+}
+
+template<size_t grid_size>
+bool test(hc::accelerator_view acc_view) {
+
+  bool ret = true;
+
+  std::vector<unsigned int> table(grid_size);
+  for (int i = 0; i < grid_size; ++i) {
+    table[i] = i;
+  }
+
+  hc::array_view<unsigned int, 1> av(grid_size, table);
+
+  // make sure the data is on the device before timing the launches
+  av.synchronize_to(acc_view);
+
+  std::vector<hc::completion_future> futures;
+  for (int k = 0; k < KERNEL_COUNT; ++k) {
+    futures.push_back(hc::parallel_for_each(acc_view, hc::extent<1>(grid_size), [=](hc::index<1>& idx) [[hc]] {
+      unsigned int v = av(idx);
+      for (int i = 0; i < LOOP_COUNT; ++i)
+        v = step(v);
+      av(idx) = v;
+    }));
+  }
+
+  // the host got here without waiting for any kernel, the first one is
+  // still running
+  hsa_signal_value_t signal_value_first = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(futures.front().get_native_handle()));
+  hsa_signal_value_t signal_value_last = hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(futures.back().get_native_handle()));
+#if TEST_DEBUG
+  std::cout << "signal value first: " << signal_value_first << "\n";
+  std::cout << "signal value last: " << signal_value_last << "\n";
+#endif
+  ret &= (signal_value_first != 0);
+  ret &= (signal_value_last != 0);
+
+  futures.back().wait();
+
+  // kernels complete in order
+  for (int k = 0; k < KERNEL_COUNT; ++k) {
+    ret &= (hsa_signal_load_scacquire(*static_cast<hsa_signal_t*>(futures[k].get_native_handle())) == 0);
+  }
+
+  // spot check the results, every kernel has to have seen the output of the
+  // one before it
+  av.synchronize();
+  for (int i = 0; i < grid_size; i += grid_size / 16) {
+    unsigned int v = i;
+    for (int j = 0; j < KERNEL_COUNT * LOOP_COUNT; ++j)
+      v = step(v);
+    if (table[i] != v) {
+#if TEST_DEBUG
+      std::cout << "table[" << i << "] = " << table[i] << ", expected " << v << "\n";
+#endif
+      ret = false;
+      break;
+    }
+  }
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+
+  ret &= test<4096>(acc.get_default_view());
+  ret &= test<65536>(acc.get_default_view());
+  ret &= test<4096>(acc.create_view(hc::execute_any_order));
+  ret &= test<65536>(acc.create_view(hc::execute_any_order));
+
+  return !(ret == true);
+}
+
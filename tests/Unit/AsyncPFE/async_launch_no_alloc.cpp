@@ -0,0 +1,120 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <new>
+
+// number of launches measured, after the warm-up
+#define LAUNCH_COUNT (1024)
+
+// number of launches in flight at once in the batched measurement
+#define BATCH_SIZE (32)
+
+#define GRID_SIZE (256)
+
+// allocations allowed for each accelerator_view::wait(), which may enqueue a
+// marker to release the results of the kernels to the host
+#define WAIT_ALLOCS (8)
+
+#define TEST_DEBUG (0)
+
+/// test that steady-state kernel launches do not allocate memory
+///
+/// Every allocation of the process is counted. The first launches of a kernel
+/// resolve it and warm up the caches of the runtime. After that a launch may
+/// only allocate the shared state of the std::async call behind its
+/// completion_future.
+///
+/// The kernel only captures a pointer and a scalar: array_views add
+/// allocations to track the dependencies between kernels.
+static std::atomic<long> alloc_count(0);
+
+void* operator new(std::size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+hc::completion_future launch(hc::accelerator_view& acc_view, int* data, int k) {
+  return hc::parallel_for_each(acc_view, hc::extent<1>(GRID_SIZE), [=](hc::index<1>& idx) [[hc]] {
+    data[idx[0]] = k + idx[0];
+  });
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.get_default_view();
+  int* data = hc::am_alloc(GRID_SIZE * sizeof(int), acc, 0);
+
+  // allocations made by the std::async call of a completion_future
+  long before = alloc_count.load();
+  {
+    std::shared_future<void> f = std::async(std::launch::deferred, [] {}).share();
+    f.wait();
+  }
+  long future_allocs = alloc_count.load() - before;
+
+  // warm up
+  for (int i = 0; i < 2 * BATCH_SIZE; ++i) {
+    launch(acc_view, data, i).wait();
+  }
+  for (int i = 0; i < 2 * BATCH_SIZE; ++i) {
+    launch(acc_view, data, i);
+  }
+  acc_view.wait();
+
+  // wait for every launch
+  before = alloc_count.load();
+  for (int i = 0; i < LAUNCH_COUNT; ++i) {
+    launch(acc_view, data, i).wait();
+  }
+  long waited_allocs = alloc_count.load() - before;
+
+  // launch in batches, drop the futures and wait for the view
+  before = alloc_count.load();
+  for (int i = 0; i < LAUNCH_COUNT; i += BATCH_SIZE) {
+    for (int j = 0; j < BATCH_SIZE; ++j) {
+      launch(acc_view, data, i + j);
+    }
+    acc_view.wait();
+  }
+  long batched_allocs = alloc_count.load() - before;
+
+#if TEST_DEBUG
+  std::cout << "future allocations: " << future_allocs << "\n";
+  std::cout << "allocations per waited launch: " << (double)waited_allocs / LAUNCH_COUNT << "\n";
+  std::cout << "allocations per batched launch: " << (double)batched_allocs / LAUNCH_COUNT << "\n";
+#endif
+
+  ret &= (waited_allocs <= LAUNCH_COUNT * future_allocs);
+  ret &= (batched_allocs <= LAUNCH_COUNT * future_allocs + (LAUNCH_COUNT / BATCH_SIZE) * WAIT_ALLOCS);
+
+  // the kernels still ran
+  int* host = static_cast<int*>(std::malloc(GRID_SIZE * sizeof(int)));
+  acc_view.copy(data, host, GRID_SIZE * sizeof(int));
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    ret &= (host[i] == (LAUNCH_COUNT - 1) + i);
+  }
+  std::free(host);
+
+  hc::am_free(data);
+
+  return !(ret == true);
+}
@@ -0,0 +1,101 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// number of kernels, each with a completion callback
+#define KERNEL_COUNT (4096)
+
+#define GRID_SIZE (256)
+
+// threads the runtime may add while the callbacks are pending
+#define THREAD_BUDGET (16)
+
+#define TEST_DEBUG (0)
+
+/// test that completion callbacks do not take a thread each
+///
+/// A callback is registered with then() on the completion_future of every
+/// kernel while the futures are kept alive. The callbacks all run, each of
+/// them once, and the process does not grow a thread per callback.
+
+// number of threads of the process
+int thread_count() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 8, "Threads:") == 0)
+      return std::stoi(line.substr(8));
+  }
+  return 0;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.get_default_view();
+  int* data = hc::am_alloc(GRID_SIZE * sizeof(int), acc, 0);
+
+  // start the threads of the runtime before counting
+  hc::completion_future warm_up = hc::parallel_for_each(acc_view, hc::extent<1>(GRID_SIZE), [=](hc::index<1>& idx) [[hc]] {
+    data[idx[0]] = idx[0];
+  });
+  std::atomic<int> warm_up_done(0);
+  warm_up.then([&warm_up_done] { warm_up_done.store(1); });
+  while (warm_up_done.load() == 0)
+    std::this_thread::yield();
+  int threads_before = thread_count();
+
+  std::atomic<int> done(0);
+  std::vector<std::atomic<int>> calls(KERNEL_COUNT);
+  std::vector<hc::completion_future> futures;
+  int threads_max = threads_before;
+  for (int i = 0; i < KERNEL_COUNT; ++i) {
+    calls[i].store(0);
+    futures.push_back(hc::parallel_for_each(acc_view, hc::extent<1>(GRID_SIZE), [=](hc::index<1>& idx) [[hc]] {
+      data[idx[0]] = i + idx[0];
+    }));
+    futures.back().then([&calls, &done, i] {
+      calls[i].fetch_add(1);
+      done.fetch_add(1);
+    });
+    // only the first callback counts
+    futures.back().then([&calls, i] {
+      calls[i].fetch_add(1);
+    });
+    if ((i & 255) == 0)
+      threads_max = std::max(threads_max, thread_count());
+  }
+
+  while (done.load() != KERNEL_COUNT)
+    std::this_thread::yield();
+  threads_max = std::max(threads_max, thread_count());
+
+#if TEST_DEBUG
+  std::cout << "threads before: " << threads_before << ", max: " << threads_max << "\n";
+#endif
+
+  ret &= (threads_max - threads_before <= THREAD_BUDGET);
+
+  // give a second callback the time to show up
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  for (int i = 0; i < KERNEL_COUNT; ++i) {
+    ret &= (calls[i].load() == 1);
+  }
+
+  futures.clear();
+  acc_view.wait();
+  hc::am_free(data);
+
+  return !(ret == true);
+}
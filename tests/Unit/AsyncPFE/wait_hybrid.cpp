@@ -0,0 +1,75 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <iostream>
+
+// number of kernels waited on with each wait mode
+#define KERNEL_COUNT (256)
+
+#define GRID_SIZE (256)
+
+#define TEST_DEBUG (0)
+
+/// test the hybrid wait mode, the default of completion_future::wait and
+/// accelerator_view::wait
+///
+/// Every hybrid wait on an HSA accelerator_view is counted once, either as
+/// completed while spinning or as blocked. Blocked and active waits are not
+/// counted. The kernels complete whichever mode they are waited with.
+hc::completion_future launch(hc::accelerator_view& acc_view, int* data, int k) {
+  return hc::parallel_for_each(acc_view, hc::extent<1>(GRID_SIZE), [=](hc::index<1>& idx) [[hc]] {
+    data[idx[0]] = k + idx[0];
+  });
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.create_view();
+  int* data = hc::am_alloc(GRID_SIZE * sizeof(int), acc, 0);
+
+  hc::hcWaitStats before = acc_view.get_wait_stats();
+
+  for (int i = 0; i < KERNEL_COUNT; ++i) {
+    launch(acc_view, data, i).wait();
+  }
+  launch(acc_view, data, 0);
+  acc_view.wait();
+
+  hc::hcWaitStats hybrid = acc_view.get_wait_stats();
+
+  for (int i = 0; i < KERNEL_COUNT; ++i) {
+    launch(acc_view, data, i).wait(hc::hcWaitModeBlocked);
+    launch(acc_view, data, i).wait(hc::hcWaitModeActive);
+  }
+  acc_view.wait(hc::hcWaitModeBlocked);
+
+  hc::hcWaitStats after = acc_view.get_wait_stats();
+
+#if TEST_DEBUG
+  std::cout << "spun: " << hybrid.spinCount - before.spinCount
+            << ", blocked: " << hybrid.blockCount - before.blockCount
+            << ", spin budget: " << hybrid.spinBudgetNs << "ns\n";
+#endif
+
+  if (acc.is_hsa_accelerator()) {
+    ret &= ((hybrid.spinCount - before.spinCount) + (hybrid.blockCount - before.blockCount) >= KERNEL_COUNT + 1);
+    ret &= (hybrid.spinBudgetNs > 0);
+  }
+  ret &= (after.spinCount == hybrid.spinCount);
+  ret &= (after.blockCount == hybrid.blockCount);
+
+  int* host = hc::am_alloc(GRID_SIZE * sizeof(int), acc, amHostPinned);
+  acc_view.copy(data, host, GRID_SIZE * sizeof(int));
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    ret &= (host[i] == (KERNEL_COUNT - 1) + i);
+  }
+
+  hc::am_free(host);
+  hc::am_free(data);
+
+  return !(ret == true);
+}
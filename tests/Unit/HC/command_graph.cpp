@@ -0,0 +1,118 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstring>
+#include <iostream>
+
+#define GRID_SIZE (4096)
+
+// number of replays enqueued back to back
+#define REPLAY_COUNT (64)
+
+#define TEST_DEBUG (0)
+
+/// test recording commands of an accelerator_view into a command_graph and
+/// replaying them
+///
+/// The graph copies the input to the device, scales it with a kernel and
+/// copies the result back. Nothing runs while capturing. Every replay reads
+/// the input as it is at the time, and set_kernel_args changes the scale
+/// applied by later replays.
+struct Scale {
+  int* in;
+  int* out;
+  int k;
+
+  void operator()(hc::index<1> idx) [[hc]] {
+    out[idx[0]] = in[idx[0]] * k;
+  }
+};
+
+bool check(const int* in, const int* out, int k) {
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    if (out[i] != in[i] * k) {
+#if TEST_DEBUG
+      std::cout << "out[" << i << "] = " << out[i] << ", expected " << in[i] * k << "\n";
+#endif
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  bool ret = true;
+
+  hc::accelerator acc;
+  hc::accelerator_view acc_view = acc.get_default_view();
+
+  int* host_in = hc::am_alloc(GRID_SIZE * sizeof(int), acc, amHostPinned);
+  int* host_out = hc::am_alloc(GRID_SIZE * sizeof(int), acc, amHostPinned);
+  int* dev_in = hc::am_alloc(GRID_SIZE * sizeof(int), acc, 0);
+  int* dev_out = hc::am_alloc(GRID_SIZE * sizeof(int), acc, 0);
+
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    host_in[i] = i;
+  }
+  std::memset(host_out, 0, GRID_SIZE * sizeof(int));
+
+  acc_view.begin_capture();
+  hc::completion_future copy_in = acc_view.copy_async(host_in, dev_in, GRID_SIZE * sizeof(int));
+  hc::completion_future kernel = hc::parallel_for_each(acc_view, hc::extent<1>(GRID_SIZE), Scale { dev_in, dev_out, 2 });
+  acc_view.create_blocking_marker(kernel);
+  acc_view.copy_async(dev_out, host_out, GRID_SIZE * sizeof(int));
+  hc::command_graph graph = acc_view.end_capture();
+
+  // the commands were only recorded
+  ret &= copy_in.is_ready();
+  ret &= kernel.is_ready();
+  ret &= (graph.get_command_count() == 4);
+  ret &= (graph.get_command_kind(0) == hc::hcMemcpyHostToDevice);
+  ret &= (graph.get_command_kind(1) == hc::hcCommandKernel);
+  ret &= (graph.get_command_kind(2) == hc::hcCommandMarker);
+  ret &= (graph.get_command_kind(3) == hc::hcMemcpyDeviceToHost);
+  ret &= check(host_in, host_out, 0);
+
+  graph.replay().wait();
+  ret &= check(host_in, host_out, 2);
+
+  // replays see the memory as it is when they run
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    host_in[i] = GRID_SIZE - i;
+  }
+  graph.replay().wait();
+  ret &= check(host_in, host_out, 2);
+
+  // new arguments for the kernel
+  graph.set_kernel_args(1, Scale { dev_in, dev_out, 3 });
+  for (int i = 0; i < REPLAY_COUNT; ++i) {
+    graph.replay();
+  }
+  acc_view.wait();
+  ret &= check(host_in, host_out, 3);
+
+  // only kernels have arguments
+  try {
+    graph.set_kernel_args(2, Scale { dev_in, dev_out, 4 });
+    ret = false;
+  } catch (Kalmar::runtime_exception& e) {
+  }
+
+  // commands of an execute_any_order view run in any order, they cannot be
+  // captured
+  hc::accelerator_view any_order_view = acc.create_view(hc::execute_any_order);
+  try {
+    any_order_view.begin_capture();
+    ret = false;
+  } catch (Kalmar::runtime_exception& e) {
+  }
+
+  hc::am_free(dev_out);
+  hc::am_free(dev_in);
+  hc::am_free(host_out);
+  hc::am_free(host_in);
+
+  return !(ret == true);
+}
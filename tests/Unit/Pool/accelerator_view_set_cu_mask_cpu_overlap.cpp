@@ -0,0 +1,80 @@
+// RUN: %hc %s -o %t.out && env HCC_RUNTIME=CPU %t.out
+
+#include <hc.hpp>
+#include <vector>
+
+/**
+ * Test if kernels of CPU accelerator_views with disjoint CU masks run at the
+ * same time. Two views get one half of the cores each, and a long kernel is
+ * launched on both of them before either is waited for. The kernels work on
+ * buffers of their own, so nothing orders one after the other, and we expect
+ * each of them to begin before the other one ends.
+ */
+
+// iterations of the busy loop of every work-item
+#define SPIN_COUNT (1 << 22)
+
+#define ITEM_COUNT (64)
+
+int main()
+{
+    hc::accelerator acc;
+    unsigned int cu_count = acc.get_cu_count();
+
+    // nothing to split on a single core
+    if (cu_count < 2)
+        return 0;
+
+    hc::accelerator_view av1 = acc.create_view();
+    hc::accelerator_view av2 = acc.create_view();
+
+    std::vector<bool> mask1(cu_count, false);
+    std::vector<bool> mask2(cu_count, false);
+    for (unsigned int i = 0; i < cu_count; i++) {
+        if (i < cu_count / 2)
+            mask1[i] = true;
+        else
+            mask2[i] = true;
+    }
+
+    if (!av1.set_cu_mask(mask1) || !av2.set_cu_mask(mask2)) {
+        printf("set_cu_mask returned false (not successful)\n");
+        return -1;
+    }
+
+    hc::array_view<unsigned int, 1> out1(ITEM_COUNT);
+    hc::array_view<unsigned int, 1> out2(ITEM_COUNT);
+
+    hc::extent<1> e(ITEM_COUNT);
+    hc::completion_future fut1 = hc::parallel_for_each(av1, e, [=](hc::index<1> idx) __HC__ {
+        unsigned int x = idx[0];
+        for (int i = 0; i < SPIN_COUNT; i++)
+            x = x * 1664525u + 1013904223u;
+        out1[idx[0]] = x;
+    });
+    hc::completion_future fut2 = hc::parallel_for_each(av2, e, [=](hc::index<1> idx) __HC__ {
+        unsigned int x = idx[0];
+        for (int i = 0; i < SPIN_COUNT; i++)
+            x = x * 1664525u + 1013904223u;
+        out2[idx[0]] = x;
+    });
+
+    fut1.wait();
+    fut2.wait();
+
+    if (fut1.get_begin_tick() >= fut2.get_end_tick() ||
+        fut2.get_begin_tick() >= fut1.get_end_tick()) {
+        printf("Kernels on disjoint masks did not overlap\n");
+        return -1;
+    }
+
+    // both kernels computed the same values
+    for (int i = 0; i < ITEM_COUNT; i++) {
+        if (out1[i] != out2[i]) {
+            printf("Result verification fails\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}